@@ -0,0 +1,23 @@
+// MathCheck.cpp : Fuzzes the simd math against its scalar reference.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include "differential.h"
+
+using namespace tocs;
+
+//MathCheck [iterations [seed]], exits non zero if any kernel is off by more than its tolerance.
+int main(int argc, char **argv)
+{
+	int iterations = argc > 1 ? std::atoi(argv[1]) : 100000;
+	std::uint32_t seed = argc > 2 ? static_cast<std::uint32_t> (std::strtoul(argv[2], nullptr, 0)) : 0x7A3C5E11u;
+
+	math::differential_checker differential(seed);
+	for (const math::differential_result &result : differential.run(iterations))
+	{
+		std::printf("%-36s %s  max error %g, allowed %g\n", result.kernel, result.passed() ? "ok  " : "FAIL", result.max_error, result.tolerance);
+	}
+
+	return differential.all_passed() ? 0 : 1;
+}
@@ -0,0 +1,566 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <core/xorshift.h>
+#include <math/batch.h>
+#include <math/culling.h>
+#include <math/matrix.h>
+#include <math/quaternion.h>
+#include <math/ray.h>
+#include <math/vector.h>
+
+namespace tocs {
+namespace math {
+
+//Worst difference one kernel showed against the scalar reference.
+class differential_result
+{
+public:
+	const char *kernel;
+	double max_error;
+	double tolerance;
+
+	bool passed() const { return max_error <= tolerance; }
+};
+
+//Fuzzes the simd kernels against the simd_disabled path. Inputs are random floats, the reference runs on the same floats in double precision,
+//and the largest difference per kernel is kept. Errors are absolute for unit sized results and relative to the magnitude otherwise.
+//Batched kernels get random counts so the scalar tails are covered too.
+class differential_checker
+{
+	core::xorshift_random random;
+	std::vector<differential_result> results;
+public:
+	explicit differential_checker(std::uint32_t seed = 0x7A3C5E11u)
+		: random(seed)
+	{}
+
+	const std::vector<differential_result> &run(int iterations)
+	{
+		for (int i = 0; i < iterations; ++i)
+		{
+			check_vectors();
+			check_quaternions();
+			check_matrices();
+			check_batches();
+			check_culling();
+			check_rays();
+		}
+		return results;
+	}
+
+	const std::vector<differential_result> &get_results() const { return results; }
+
+	bool all_passed() const
+	{
+		return std::all_of(results.begin(), results.end(), [](const differential_result &result) { return result.passed(); });
+	}
+
+private:
+	//Uniform in [-range, range].
+	float next_float(float range = 1.0f)
+	{
+		return (static_cast<float> (random.next() >> 8) * (1.0f / 16777216.0f) * 2.0f - 1.0f) * range;
+	}
+
+	quaternion random_rotation()
+	{
+		float x, y, z, w, length_sq;
+		do
+		{
+			x = next_float();
+			y = next_float();
+			z = next_float();
+			w = next_float();
+			length_sq = x * x + y * y + z * z + w * w;
+		} while (length_sq < 0.01f || length_sq > 1.0f);
+
+		float scale = 1.0f / std::sqrt(length_sq);
+		return quaternion(x * scale, y * scale, z * scale, w * scale);
+	}
+
+	//Rotation, per axis scale in [0.5, 2] and translation, the kind of matrix transform_inverse is for.
+	matrix4 random_transform()
+	{
+		quaterniond q(random_rotation());
+		double scale[3] = { std::exp2(next_float()), std::exp2(next_float()), std::exp2(next_float()) };
+
+		double xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+		double xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+		double wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+		double rotation[3][3] = {
+			{ 1 - 2 * (yy + zz), 2 * (xy - wz), 2 * (xz + wy) },
+			{ 2 * (xy + wz), 1 - 2 * (xx + zz), 2 * (yz - wx) },
+			{ 2 * (xz - wy), 2 * (yz + wx), 1 - 2 * (xx + yy) } };
+
+		matrix4 result = matrix4::identity();
+		for (int r = 0; r < 3; ++r)
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				result(r, c) = static_cast<float> (rotation[r][c] * scale[c]);
+			}
+			result(r, 3) = next_float(10.0f);
+		}
+		return result;
+	}
+
+	//Diagonally dominant so the condition number stays small and float error in the result is the kernel's, not the input's.
+	matrix4 random_matrix()
+	{
+		matrix4 result;
+		for (int r = 0; r < 4; ++r)
+		{
+			for (int c = 0; c < 4; ++c)
+			{
+				result(r, c) = next_float() + (r == c ? (next_float() < 0 ? -4.0f : 4.0f) : 0.0f);
+			}
+		}
+		return result;
+	}
+
+	void record(const char *kernel, double error, double tolerance)
+	{
+		for (differential_result &result : results)
+		{
+			if (result.kernel == kernel)
+			{
+				result.max_error = std::max(result.max_error, error);
+				return;
+			}
+		}
+		results.push_back(differential_result{ kernel, error, tolerance });
+	}
+
+	//Relative to scale, which is the magnitude the rounding errors come from rather than the result's, since results can cancel down to nothing.
+	static double relative(double value, double reference, double scale)
+	{
+		return std::abs(value - reference) / std::max(1.0, scale);
+	}
+
+	static double relative(double value, double reference)
+	{
+		return relative(value, reference, std::abs(reference));
+	}
+
+	//Where the pair is close to 90 degrees apart float and double can disagree on which way is shorter, and both answers are right.
+	static bool ambiguous_arc(const quaterniond &a, const quaterniond &b)
+	{
+		return std::abs(a.dot(b)) < 1e-5;
+	}
+
+	static bool ambiguous_squad(const quaterniond &a, const quaterniond &b, const quaterniond &c, const quaterniond &d, double t)
+	{
+		return ambiguous_arc(a, d) || ambiguous_arc(b, c) || ambiguous_arc(quaterniond::slerp(a, d, t), quaterniond::slerp(b, c, t));
+	}
+
+	static double difference(const quaternion &value, const quaterniond &reference)
+	{
+		quaterniond v(value);
+		return std::max(std::max(std::abs(v.x - reference.x), std::abs(v.y - reference.y)), std::max(std::abs(v.z - reference.z), std::abs(v.w - reference.w)));
+	}
+
+	static double difference(const matrix4 &value, const matrix4d &reference)
+	{
+		double magnitude = 0;
+		for (int r = 0; r < 4; ++r)
+		{
+			for (int c = 0; c < 4; ++c)
+			{
+				magnitude = std::max(magnitude, std::abs(reference(r, c)));
+			}
+		}
+
+		double error = 0;
+		for (int r = 0; r < 4; ++r)
+		{
+			for (int c = 0; c < 4; ++c)
+			{
+				error = std::max(error, relative(value(r, c), reference(r, c), magnitude));
+			}
+		}
+		return error;
+	}
+
+	void check_vectors()
+	{
+		vector3 a(next_float(10.0f), next_float(10.0f), next_float(10.0f));
+		vector3 b(next_float(10.0f), next_float(10.0f), next_float(10.0f));
+		vector3d ad(a), bd(b);
+
+		double scale = ad.length() * bd.length();
+
+		record("vector3::dot", relative(a.dot(b), ad.dot(bd), scale), 1e-6);
+		record("vector3::length", relative(a.length(), ad.length()), 1e-6);
+
+		vector3d cross(a.cross(b));
+		vector3d cross_reference = ad.cross(bd);
+		for (int i = 0; i < 3; ++i)
+		{
+			record("vector3::cross", relative(cross[i], cross_reference[i], scale), 1e-6);
+		}
+
+		vector4 c(next_float(10.0f), next_float(10.0f), next_float(10.0f), next_float(10.0f));
+		vector4 d(next_float(10.0f), next_float(10.0f), next_float(10.0f), next_float(10.0f));
+		vector4d cd(c), dd(d);
+		record("vector4::dot", relative(c.dot(d), cd.dot(dd), cd.length() * dd.length()), 1e-6);
+	}
+
+	void check_quaternions()
+	{
+		quaternion a = random_rotation();
+		quaternion b = random_rotation();
+		quaternion c = random_rotation();
+		quaternion d = random_rotation();
+		quaterniond ad(a), bd(b), cd(c), dd(d);
+		float t = next_float() * 0.5f + 0.5f;
+
+		record("quaternion::operator*", difference(a * b, ad * bd), 1e-6);
+		record("quaternion::inverse", difference(a.inverse(), ad.inverse()), 1e-6);
+		if (!ambiguous_arc(ad, bd))
+		{
+			record("quaternion::nlerp", difference(quaternion::nlerp(a, b, t), quaterniond::nlerp(ad, bd, t)), 1e-6);
+			record("quaternion::slerp", difference(quaternion::slerp(a, b, t), quaterniond::slerp(ad, bd, t)), 4e-6);
+		}
+		if (!ambiguous_squad(ad, bd, cd, dd, t))
+		{
+			record("quaternion::squad", difference(quaternion::squad(a, b, c, d, t), quaterniond::squad(ad, bd, cd, dd, t)), 5e-6);
+		}
+		if (!ambiguous_arc(ad, bd) && !ambiguous_arc(cd, bd))
+		{
+			record("quaternion::squad_control_point", difference(quaternion::squad_control_point(a, b, c), quaterniond::squad_control_point(ad, bd, cd)), 1e-5);
+		}
+
+		float pitch = next_float(3.14159265f), yaw = next_float(3.14159265f), roll = next_float(3.14159265f);
+		record("quaternion::from_euler", difference(quaternion::from_euler(pitch, yaw, roll), quaterniond::from_euler(pitch, yaw, roll)), 1e-6);
+
+		vector3 v(next_float(10.0f), next_float(10.0f), next_float(10.0f));
+		vector3d rotated(a.rotate(v));
+		vector3d rotated_reference = ad.rotate(vector3d(v));
+		for (int i = 0; i < 3; ++i)
+		{
+			record("quaternion::rotate", relative(rotated[i], rotated_reference[i], rotated_reference.length()), 1e-6);
+		}
+	}
+
+	void check_matrices()
+	{
+		matrix4 a = random_matrix();
+		matrix4 b = random_matrix();
+		matrix4d ad(a), bd(b);
+
+		record("matrix4::operator*", difference(a * b, ad * bd), 1e-6);
+		record("matrix4::transposed", difference(a.transposed(), ad.transposed()), 0);
+		record("matrix4::inverse", difference(a.inverse(), ad.inverse()), 1e-6);
+		record("matrix4::inverse identity", identity_error(a, a.inverse()), 1e-6);
+
+		//Rows shuffled so the large entries leave the diagonal blocks, the block method mustn't depend on them being invertible.
+		matrix4 permuted = permuted_rows(random_matrix());
+		record("matrix4::inverse permuted", difference(permuted.inverse(), matrix4d(permuted).inverse()), 1e-6);
+		record("matrix4::inverse identity", identity_error(permuted, permuted.inverse()), 1e-6);
+
+		matrix4 transform = random_transform();
+		matrix4d transform_reference(transform);
+		record("matrix4::transform_inverse", difference(transform.transform_inverse(), transform_reference.transform_inverse()), 4e-6);
+		record("matrix4::transform_inverse identity", identity_error(transform, transform.transform_inverse()), 4e-6);
+		record("matrix4::inverse transform", difference(transform.inverse(), transform_reference.inverse()), 4e-6);
+
+		//Unprojecting goes through the general inverse of a projection times a view.
+		matrix4 view_projection = matrix4::create_projection(1.0f + next_float() * 0.5f, 1.5f, 0.1f, 50.0f) * transform;
+		record("matrix4::inverse projection", difference(view_projection.inverse(), matrix4d(view_projection).inverse()), 1e-5);
+	}
+
+	matrix4 permuted_rows(const matrix4 &m)
+	{
+		int order[4] = { 0, 1, 2, 3 };
+		for (int i = 3; i > 0; --i)
+		{
+			std::swap(order[i], order[random.next_below(static_cast<std::uint32_t> (i + 1))]);
+		}
+
+		matrix4 result;
+		for (int r = 0; r < 4; ++r)
+		{
+			for (int c = 0; c < 4; ++c)
+			{
+				result(r, c) = m(order[r], c);
+			}
+		}
+		return result;
+	}
+
+	//How far m * inverse is from the identity, checked in double so only the inverse's error shows. Independent of the scalar reference.
+	static double identity_error(const matrix4 &m, const matrix4 &inverse)
+	{
+		double error = 0;
+		for (int r = 0; r < 4; ++r)
+		{
+			for (int c = 0; c < 4; ++c)
+			{
+				double sum = 0, magnitude = 0;
+				for (int k = 0; k < 4; ++k)
+				{
+					sum += double(m(r, k)) * inverse(k, c);
+					magnitude += std::abs(double(m(r, k)) * inverse(k, c));
+				}
+				error = std::max(error, std::abs(sum - (r == c ? 1.0 : 0.0)) / std::max(1.0, magnitude));
+			}
+		}
+		return error;
+	}
+
+	void check_batches()
+	{
+		std::size_t count = random.next_below(40);
+		float t = next_float() * 0.5f + 0.5f;
+
+		std::vector<float> from(count * 4), to(count * 4), result(count * 4);
+		for (std::size_t i = 0; i < count * 4; ++i)
+		{
+			from[i] = next_float(10.0f);
+			to[i] = next_float(10.0f);
+		}
+
+		math::batch_lerp(from.data(), to.data(), t, result.data(), count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			record("batch_lerp", relative(result[i], double(from[i]) * (1 - double(t)) + double(to[i]) * t), 1e-6);
+		}
+
+		//Quaternions as both SoA lanes and an array.
+		std::vector<quaternion> from_quaternions(count), to_quaternions(count), result_quaternions(count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			from_quaternions[i] = random_rotation();
+			to_quaternions[i] = random_rotation();
+
+			quaterniond f(from_quaternions[i]), q(to_quaternions[i]);
+			from[i] = float(f.x); from[count + i] = float(f.y); from[2 * count + i] = float(f.z); from[3 * count + i] = float(f.w);
+			to[i] = float(q.x); to[count + i] = float(q.y); to[2 * count + i] = float(q.z); to[3 * count + i] = float(q.w);
+		}
+
+		quaternion_lanes<const float> from_lanes{ from.data(), from.data() + count, from.data() + 2 * count, from.data() + 3 * count };
+		quaternion_lanes<const float> to_lanes{ to.data(), to.data() + count, to.data() + 2 * count, to.data() + 3 * count };
+		quaternion_lanes<float> result_lanes{ result.data(), result.data() + count, result.data() + 2 * count, result.data() + 3 * count };
+
+		auto lane_quaternion = [&](std::size_t i)
+		{
+			return quaternion(result[i], result[count + i], result[2 * count + i], result[3 * count + i]);
+		};
+
+		math::batch_nlerp(from_lanes, to_lanes, t, result_lanes, count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			if (ambiguous_arc(quaterniond(from_quaternions[i]), quaterniond(to_quaternions[i])))
+			{
+				continue;
+			}
+			record("batch_nlerp", difference(lane_quaternion(i), quaterniond::nlerp(quaterniond(from_quaternions[i]), quaterniond(to_quaternions[i]), t)), 1e-6);
+		}
+
+		math::batch_slerp(from_lanes, to_lanes, t, result_lanes, count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			if (ambiguous_arc(quaterniond(from_quaternions[i]), quaterniond(to_quaternions[i])))
+			{
+				continue;
+			}
+			record("batch_slerp lanes", difference(lane_quaternion(i), quaterniond::slerp(quaterniond(from_quaternions[i]), quaterniond(to_quaternions[i]), t)), 4e-6);
+		}
+
+		math::batch_squad(from_lanes, to_lanes, from_lanes, to_lanes, t, result_lanes, count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			quaterniond f(from_quaternions[i]), q(to_quaternions[i]);
+			if (ambiguous_squad(f, q, f, q, t))
+			{
+				continue;
+			}
+			record("batch_squad", difference(lane_quaternion(i), quaterniond::squad(f, q, f, q, t)), 5e-6);
+		}
+
+		math::batch_slerp(from_quaternions.data(), to_quaternions.data(), t, result_quaternions.data(), count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			if (ambiguous_arc(quaterniond(from_quaternions[i]), quaterniond(to_quaternions[i])))
+			{
+				continue;
+			}
+			record("batch_slerp array", difference(result_quaternions[i], quaterniond::slerp(quaterniond(from_quaternions[i]), quaterniond(to_quaternions[i]), t)), 4e-6);
+		}
+
+		check_transform_propagation(count);
+	}
+
+	void check_transform_propagation(std::size_t count)
+	{
+		std::vector<int> parents(count);
+		std::vector<matrix4> locals(count), worlds(count);
+		std::vector<matrix4d> reference(count);
+
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			parents[i] = i == 0 || random.next_below(4) == 0 ? -1 : static_cast<int> (random.next_below(static_cast<std::uint32_t> (i)));
+			locals[i] = random_transform();
+			reference[i] = parents[i] < 0 ? matrix4d(locals[i]) : reference[parents[i]] * matrix4d(locals[i]);
+		}
+
+		math::batch_propagate_transforms(parents.data(), locals.data(), worlds.data(), 0, count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			//Deep chains of scaled transforms grow in magnitude, so this is relative to the largest entry.
+			double magnitude = 1;
+			for (int r = 0; r < 4; ++r)
+			{
+				for (int c = 0; c < 4; ++c)
+				{
+					magnitude = std::max(magnitude, std::abs(reference[i](r, c)));
+				}
+			}
+
+			double error = 0;
+			for (int r = 0; r < 4; ++r)
+			{
+				for (int c = 0; c < 4; ++c)
+				{
+					error = std::max(error, std::abs(worlds[i](r, c) - reference[i](r, c)) / magnitude);
+				}
+			}
+			record("batch_propagate_transforms", error, 1e-5);
+		}
+	}
+
+	//Batch culling against the plane test redone in double. Spheres right on a plane can go either way, so only ones clearly inside or outside count
+	//and the error is the number of those that came out wrong.
+	void check_culling()
+	{
+		matrix4 view = random_transform().transform_inverse();
+		matrix4 view_projection = matrix4::create_projection(1.0f + next_float() * 0.5f, 1.5f, 0.1f, 50.0f) * view;
+		frustum f = frustum::from_matrix(view_projection);
+		matrix4d planes_source(view_projection);
+
+		std::size_t count = random.next_below(40);
+		std::vector<float> lanes(count * 6);
+		float *values[6];
+		for (int l = 0; l < 6; ++l)
+		{
+			values[l] = lanes.data() + l * count;
+		}
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			values[0][i] = next_float(40.0f);
+			values[1][i] = next_float(40.0f);
+			values[2][i] = next_float(40.0f);
+			values[3][i] = std::abs(next_float(5.0f));
+			values[4][i] = std::abs(next_float(5.0f));
+			values[5][i] = std::abs(next_float(5.0f));
+		}
+
+		std::vector<std::uint32_t> visible(count);
+		std::size_t sphere_count = cull_spheres(f, sphere_lanes<const float>{ values[0], values[1], values[2], values[3] }, 0, count, visible.data());
+		record("cull_spheres", culling_mismatches(planes_source, values, false, visible.data(), sphere_count, count), 0);
+
+		std::size_t box_count = cull_aabbs(f, aabb_lanes<const float>{ values[0], values[1], values[2], values[3], values[4], values[5] }, 0, count, visible.data());
+		record("cull_aabbs", culling_mismatches(planes_source, values, true, visible.data(), box_count, count), 0);
+	}
+
+	static double culling_mismatches(const matrix4d &m, float *const *values, bool boxes, const std::uint32_t *visible, std::size_t visible_count, std::size_t count)
+	{
+		const double margin = 1e-3;
+
+		double mismatches = 0;
+		std::size_t next_visible = 0;
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			bool reported = next_visible < visible_count && visible[next_visible] == i;
+			if (reported)
+			{
+				++next_visible;
+			}
+
+			//Smallest reach over the planes, negative means outside.
+			double closest = std::numeric_limits<double>::max();
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				for (double sign = -1; sign <= 1; sign += 2)
+				{
+					double normal[3], distance = m(3, 3) + sign * m(axis, 3);
+					for (int c = 0; c < 3; ++c)
+					{
+						normal[c] = m(3, c) + sign * m(axis, c);
+					}
+					double length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+
+					double reach = distance;
+					for (int c = 0; c < 3; ++c)
+					{
+						reach += normal[c] * values[c][i];
+						reach += boxes ? std::abs(normal[c]) * values[3 + c][i] : 0;
+					}
+					reach = reach / length + (boxes ? 0 : values[3][i]);
+					closest = std::min(closest, reach);
+				}
+			}
+
+			if (std::abs(closest) > margin && reported != (closest >= 0))
+			{
+				++mismatches;
+			}
+		}
+		return mismatches + (visible_count - next_visible);
+	}
+
+	//The four wide slab test against ray::box_hit, which does the same operations, so hits and entry distances have to match exactly.
+	void check_rays()
+	{
+		ray r(vector3(next_float(20.0f), next_float(20.0f), next_float(20.0f)), vector3(next_float(), next_float(), next_float()));
+		float max_t = std::abs(next_float(100.0f));
+
+		float bounds[6][4];
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				float center = next_float(30.0f), extent = std::abs(next_float(5.0f));
+				bounds[axis][lane] = center - extent;
+				bounds[3 + axis][lane] = center + extent;
+			}
+		}
+
+		typedef detail::simd_pack<float> pack;
+		pack entry;
+		int hits = detail::ray_packs(r).boxes_hit(pack::load(bounds[0]), pack::load(bounds[1]), pack::load(bounds[2]),
+			pack::load(bounds[3]), pack::load(bounds[4]), pack::load(bounds[5]), pack(max_t), entry);
+
+		float entries[4];
+		entry.store(entries);
+
+		double error = 0;
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			float min[3] = { bounds[0][lane], bounds[1][lane], bounds[2][lane] };
+			float max[3] = { bounds[3][lane], bounds[4][lane], bounds[5][lane] };
+			float t;
+			bool hit = r.box_hit(min, max, max_t, t);
+			bool packed_hit = ((hits >> lane) & 1) != 0;
+
+			if (hit != packed_hit)
+			{
+				++error;
+			}
+			else if (hit)
+			{
+				error += std::abs(static_cast<double> (t) - entries[lane]);
+			}
+		}
+		record("ray_boxes_hit", error, 0);
+	}
+};
+
+}
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace tocs {
+namespace core {
+
+//Index of the lowest set bit. Undefined for zero, callers check first.
+inline int count_trailing_zeros(std::uint64_t bits)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return static_cast<int> (index);
+#else
+	return __builtin_ctzll(bits);
+#endif
+}
+
+inline int pop_count(std::uint64_t bits)
+{
+#if defined(_MSC_VER)
+	return static_cast<int> (__popcnt64(bits));
+#else
+	return __builtin_popcountll(bits);
+#endif
+}
+
+//Clears the lowest set bit, used to walk a mask with count_trailing_zeros.
+inline std::uint64_t clear_lowest_bit(std::uint64_t bits)
+{
+	return bits & (bits - 1);
+}
+
+}
+}
@@ -0,0 +1,190 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <new>
+#include "asserts.h"
+
+namespace tocs {
+namespace core {
+
+//Bump allocator over a list of chunks. Nothing is freed individually, reset() rewinds everything at once.
+class linear_arena
+{
+	struct chunk
+	{
+		std::unique_ptr<unsigned char[]> memory;
+		std::size_t size;
+	};
+
+	std::vector<chunk> chunks;
+	std::size_t current_chunk;
+	std::size_t offset;
+	std::size_t default_chunk_size;
+
+	void add_chunk(std::size_t min_size)
+	{
+		std::size_t size = min_size > default_chunk_size ? min_size : default_chunk_size;
+		chunks.push_back(chunk{ std::unique_ptr<unsigned char[]>(new unsigned char[size]), size });
+	}
+
+public:
+	static constexpr std::size_t default_size = 64 * 1024;
+
+	explicit linear_arena(std::size_t chunk_size = default_size)
+		: current_chunk(0)
+		, offset(0)
+		, default_chunk_size(chunk_size)
+	{}
+
+	linear_arena(const linear_arena &) = delete;
+	linear_arena &operator=(const linear_arena &) = delete;
+
+	void *allocate(std::size_t bytes, std::size_t alignment = alignof(std::max_align_t))
+	{
+		check((alignment & (alignment - 1)) == 0);
+
+		while (current_chunk < chunks.size())
+		{
+			chunk &c = chunks[current_chunk];
+			std::uintptr_t base = reinterpret_cast<std::uintptr_t> (c.memory.get());
+			std::uintptr_t aligned = (base + offset + alignment - 1) & ~(std::uintptr_t(alignment) - 1);
+			std::size_t new_offset = (aligned - base) + bytes;
+
+			if (new_offset <= c.size)
+			{
+				offset = new_offset;
+				return reinterpret_cast<void *> (aligned);
+			}
+
+			++current_chunk;
+			offset = 0;
+		}
+
+		//Worst case padding so the aligned block always fits.
+		add_chunk(bytes + alignment);
+		current_chunk = chunks.size() - 1;
+		offset = 0;
+		return allocate(bytes, alignment);
+	}
+
+	//Rewinds the arena. If last use spilled over into several chunks they get merged into one so the steady state is a single block.
+	void reset()
+	{
+		if (chunks.size() > 1)
+		{
+			std::size_t total = 0;
+			for (chunk &c : chunks)
+			{
+				total += c.size;
+			}
+
+			chunks.clear();
+			add_chunk(total);
+		}
+
+		current_chunk = 0;
+		offset = 0;
+	}
+
+	std::size_t capacity() const
+	{
+		std::size_t total = 0;
+		for (const chunk &c : chunks)
+		{
+			total += c.size;
+		}
+		return total;
+	}
+};
+
+//Per thread, double buffered arenas keyed off the frame number.
+//Memory handed out during frame N stays valid through frame N + 1 and is reclaimed when the thread first allocates in frame N + 2.
+//Each thread lazily resets its own arena so no cross thread synchronization is needed beyond publishing the frame number.
+class frame_arena
+{
+	struct thread_arenas
+	{
+		linear_arena arenas[2];
+		int frames[2] = { -1, -1 };
+	};
+
+	static std::atomic<int> &frame_counter()
+	{
+		static std::atomic<int> frame(0);
+		return frame;
+	}
+
+	static thread_arenas &this_thread_arenas()
+	{
+		static thread_local thread_arenas arenas;
+		return arenas;
+	}
+
+public:
+	//Called by world::advance_frame once no jobs from the previous frame are still allocating.
+	static void begin_frame(int frame_number)
+	{
+		frame_counter().store(frame_number, std::memory_order_release);
+	}
+
+	static int current_frame()
+	{
+		return frame_counter().load(std::memory_order_acquire);
+	}
+
+	static linear_arena &current()
+	{
+		thread_arenas &local = this_thread_arenas();
+		int frame = current_frame();
+		int slot = frame & 1;
+
+		if (local.frames[slot] != frame)
+		{
+			local.arenas[slot].reset();
+			local.frames[slot] = frame;
+		}
+
+		return local.arenas[slot];
+	}
+
+	static void *allocate(std::size_t bytes, std::size_t alignment = alignof(std::max_align_t))
+	{
+		return current().allocate(bytes, alignment);
+	}
+};
+
+//STL allocator that draws from the calling thread's frame_arena. Deallocation is a no-op.
+//Only use this for containers that don't outlive the next frame.
+template <class T>
+class frame_allocator
+{
+public:
+	typedef T value_type;
+
+	frame_allocator() noexcept {}
+
+	template <class U>
+	frame_allocator(const frame_allocator<U> &) noexcept {}
+
+	T *allocate(std::size_t n)
+	{
+		return static_cast<T *> (frame_arena::allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T *, std::size_t) noexcept {}
+
+	template <class U>
+	bool operator==(const frame_allocator<U> &) const noexcept { return true; }
+
+	template <class U>
+	bool operator!=(const frame_allocator<U> &) const noexcept { return false; }
+};
+
+template <class T>
+using frame_vector = std::vector<T, frame_allocator<T>>;
+
+}
+}
@@ -1,44 +1,62 @@
 #pragma once
 #include <limits>
-#include <mutex>
-#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <iterator>
+#include "asserts.h"
+#include "bits.h"
+
 namespace tocs {
+namespace core {
 
 
 using free_list_index = unsigned int;
 static constexpr free_list_index free_list_invalid_index = std::numeric_limits<free_list_index>::max();
 
+//Single threaded slot map. Indices stay valid until the item is removed, and removed slots get reused.
+//Iteration uses a per page allocation bitmap so empty runs are skipped a word at a time.
+//If you need to allocate from multiple threads use threading::concurrent_pool instead.
 template <class T>
 class free_list
 {
 	struct list_item
 	{
-		unsigned char data[T]
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type data;
 		free_list_index next;
-		bool allocated;
 
 		list_item()
 			: next(free_list_invalid_index)
-			, allocated(false)
 		{}
 
-		T &item() { return *static_cast<T*> (&data[0]); }
-		const T &item() const { return *static_cast<T*> (&data[0]); }
+		T &item() { return *reinterpret_cast<T*> (&data); }
+		const T &item() const { return *reinterpret_cast<const T*> (&data); }
 	};
 
-	static constexpr int page_num_items = 100;
-	
+	using bitmap_word = std::uint64_t;
+	static constexpr free_list_index bits_per_word = 64;
+	static constexpr free_list_index page_num_words = 4;
+	static constexpr free_list_index page_num_items = page_num_words * bits_per_word;
+
 	struct item_page
 	{
+		bitmap_word allocated[page_num_words];
 		list_item items[page_num_items];
+
+		item_page()
+			: allocated{}
+		{}
 	};
 
 	std::vector<std::unique_ptr<item_page>> pages;
 
 	free_list_index head;
 	free_list_index max_alloced;
+	free_list_index item_count;
 
-	list_item &get_item(free_list_indext index)
+	list_item &get_item(free_list_index index)
 	{
 		return pages[index / page_num_items]->items[index % page_num_items];
 	}
@@ -48,6 +66,21 @@ class free_list
 		return pages[index / page_num_items]->items[index % page_num_items];
 	}
 
+	bitmap_word &get_word(free_list_index index)
+	{
+		return pages[index / page_num_items]->allocated[(index % page_num_items) / bits_per_word];
+	}
+
+	bitmap_word get_word(free_list_index index) const
+	{
+		return pages[index / page_num_items]->allocated[(index % page_num_items) / bits_per_word];
+	}
+
+	static bitmap_word get_bit(free_list_index index)
+	{
+		return bitmap_word(1) << (index % bits_per_word);
+	}
+
 	void ensure_max_alloced()
 	{
 		if (max_alloced >= pages.size() * page_num_items)
@@ -56,20 +89,69 @@ class free_list
 		}
 	}
 
-public:
+	free_list_index take_free_index()
+	{
+		free_list_index index = head;
+
+		if (index == free_list_invalid_index)
+		{
+			//Check if we need to alloc a new page.
+			ensure_max_alloced();
+			index = max_alloced++;
+		}
+		else
+		{
+			head = get_item(index).next;
+		}
+
+		return index;
+	}
 
-	friend class iterator;
-	class iterator
+	//Finds the first allocated index at or after index, or max_alloced if there isn't one.
+	free_list_index next_allocated(free_list_index index) const
 	{
-		free_list<T> *list;
+		while (index < max_alloced)
+		{
+			free_list_index bit = index % bits_per_word;
+			bitmap_word bits = get_word(index) & (~bitmap_word(0) << bit);
+
+			if (bits)
+			{
+				return index - bit + count_trailing_zeros(bits);
+			}
+
+			index += bits_per_word - bit;
+		}
+
+		return max_alloced;
+	}
+
+	void destroy_all()
+	{
+		for (free_list_index index = next_allocated(0); index < max_alloced; index = next_allocated(index + 1))
+		{
+			get_item(index).item().~T();
+		}
+	}
+
+	template <class list_type, class item_type>
+	class basic_iterator
+	{
+		list_type *list;
 		free_list_index index;
 	public:
-		iterator()
+		typedef std::forward_iterator_tag iterator_category;
+		typedef item_type value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef item_type *pointer;
+		typedef item_type &reference;
+
+		basic_iterator()
 			: list(nullptr)
 			, index(free_list_invalid_index)
 		{}
 	private:
-		iterator(free_list<T> *list, free_list_index index)
+		basic_iterator(list_type *list, free_list_index index)
 			: list(list)
 			, index(index)
 		{}
@@ -79,89 +161,118 @@ public:
 
 		free_list_index get_index() const { return index; }
 
-		T *operator->()
+		item_type *operator->() const
 		{
 			return &list->get_item(index).item();
 		}
 
-		T &operator*()
+		item_type &operator*() const
 		{
 			return list->get_item(index).item();
 		}
 
-		iterator &operator++()
+		basic_iterator &operator++()
 		{
-			do
-			{
-				++index;
-				if (index >= max_alloced)
-					return *this;
-			} while (!get_item(index).allocated);
+			index = list->next_allocated(index + 1);
 			return *this;
 		}
 
-		iterator operator++(int)
+		basic_iterator operator++(int)
 		{
-			iterator result = *this;
+			basic_iterator result = *this;
 			++(*this);
 			return result;
 		}
+
+		bool operator==(const basic_iterator &rhs) const { return index == rhs.index; }
+		bool operator!=(const basic_iterator &rhs) const { return index != rhs.index; }
 	};
 
+public:
+
+	typedef basic_iterator<free_list<T>, T> iterator;
+	typedef basic_iterator<const free_list<T>, const T> const_iterator;
+
 	free_list()
 		: head(free_list_invalid_index)
 		, max_alloced(0)
+		, item_count(0)
 	{
-		pages.emplace_back(new item_page());
 	}
 
-	iterator add(const T &value)
+	~free_list()
 	{
-		free_list_index index = head;
+		destroy_all();
+	}
+
+	free_list(const free_list &) = delete;
+	free_list &operator=(const free_list &) = delete;
 
-		if (index == ~0U)
+	free_list(free_list &&moveme) noexcept
+		: pages(std::move(moveme.pages))
+		, head(moveme.head)
+		, max_alloced(moveme.max_alloced)
+		, item_count(moveme.item_count)
+	{
+		moveme.pages.clear();
+		moveme.head = free_list_invalid_index;
+		moveme.max_alloced = 0;
+		moveme.item_count = 0;
+	}
+
+	free_list &operator=(free_list &&moveme) noexcept
+	{
+		if (this != &moveme)
 		{
-			//Check if we need to alloc a new page.
-			ensure_max_alloced();
-			index = max_alloced++;
+			destroy_all();
+			pages = std::move(moveme.pages);
+			head = moveme.head;
+			max_alloced = moveme.max_alloced;
+			item_count = moveme.item_count;
+
+			moveme.pages.clear();
+			moveme.head = free_list_invalid_index;
+			moveme.max_alloced = 0;
+			moveme.item_count = 0;
 		}
+		return *this;
+	}
 
-		list_item &new_item = get_item(index);
-
-		new (new_item.data) T(value);
-		head = new_item.next;
-		new_item.allocated = true;
+	iterator add(const T &value)
+	{
+		return emplace(value);
+	}
 
-		return iterator result(this, index);
+	iterator add(T &&value)
+	{
+		return emplace(std::move(value));
 	}
 
 	template <class ...Args>
-	iterator emplace(Args... &&args)
+	iterator emplace(Args &&...args)
 	{
-		free_list_index index = head;
-
-		if (index == ~0U)
-		{
-			//Check if we need to alloc a new page.
-			ensure_max_alloced();
-			index = max_alloced++;
-		}
+		free_list_index index = take_free_index();
 
 		list_item &new_item = get_item(index);
 
-		new (new_item.data) T(std::forward<Args>(args)...);
-		head = new_item.next;
-		new_item.allocated = true;
+		new (&new_item.data) T(std::forward<Args>(args)...);
+		new_item.next = free_list_invalid_index;
+		get_word(index) |= get_bit(index);
+		++item_count;
 
-		return iterator result(this, index);;
+		return iterator(this, index);
 	}
 
 	void remove(free_list_index index)
 	{
-		get_item(index).item().~T();
-		get_item(index).next = head;
-		get_item(index).allocated = false;
+		check(is_allocated(index));
+
+		list_item &item = get_item(index);
+		item.item().~T();
+		item.next = head;
+		get_word(index) &= ~get_bit(index);
 		head = index;
+		--item_count;
 	}
 
 	void remove(iterator it)
@@ -169,13 +280,49 @@ public:
 		remove(it.index);
 	}
 
-	iterator begin()
+	//Destroys every item but keeps the pages around for reuse. Indices start from 0 again.
+	void clear()
+	{
+		destroy_all();
+
+		for (auto &page : pages)
+		{
+			for (bitmap_word &word : page->allocated)
+			{
+				word = 0;
+			}
+		}
+
+		head = free_list_invalid_index;
+		max_alloced = 0;
+		item_count = 0;
+	}
+
+	//Allocates enough pages up front to hold count items without touching the heap.
+	void reserve(std::size_t count)
 	{
-		iterator result;
-		if (!pages[0]->items[0].allocated)
-			result++;
+		std::size_t page_count = (count + page_num_items - 1) / page_num_items;
+		while (pages.size() < page_count)
+		{
+			pages.emplace_back(new item_page());
+		}
+	}
 
-		return result;
+	bool is_allocated(free_list_index index) const
+	{
+		return index < max_alloced && (get_word(index) & get_bit(index)) != 0;
+	}
+
+	std::size_t size() const { return item_count; }
+	bool empty() const { return item_count == 0; }
+	std::size_t capacity() const { return pages.size() * page_num_items; }
+
+	//One past the highest index ever handed out, useful for sizing parallel arrays keyed by index.
+	free_list_index index_range() const { return max_alloced; }
+
+	iterator begin()
+	{
+		return iterator(this, next_allocated(0));
 	}
 
 	iterator end()
@@ -183,15 +330,31 @@ public:
 		return iterator(this, max_alloced);
 	}
 
+	const_iterator begin() const
+	{
+		return const_iterator(this, next_allocated(0));
+	}
+
+	const_iterator end() const
+	{
+		return const_iterator(this, max_alloced);
+	}
+
 	T &get(free_list_index index)
 	{
+		check(is_allocated(index));
 		return get_item(index).item();
 	}
 
 	const T &get(free_list_index index) const
 	{
+		check(is_allocated(index));
 		return get_item(index).item();
 	}
+
+	T &operator[](free_list_index index) { return get(index); }
+	const T &operator[](free_list_index index) const { return get(index); }
 };
 
 }
+}
@@ -0,0 +1,216 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <emmintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace tocs {
+namespace core {
+
+//Non-cryptographic hashing of bulk memory for checksums, laid out like XXH3's long input path: eight 64 bit lanes take 64 byte stripes two
+//lanes to an SSE2 register, each lane multiplying the low and high halves of its input keyed by a sliding secret, with the accumulators scrambled
+//every block. Stable across runs and platforms of the same endianness, not across versions of this file.
+namespace hash
+{
+	static constexpr std::size_t stripe_size = 64;
+	static constexpr std::size_t stripes_per_block = 8;
+
+	static constexpr std::uint64_t prime32_1 = 0x9E3779B1u;
+	static constexpr std::uint64_t prime64_1 = 0x9E3779B185EBCA87ull;
+	static constexpr std::uint64_t prime64_2 = 0xC2B2AE3D27D4EB4Full;
+	static constexpr std::uint64_t prime64_3 = 0x165667B19E3779F9ull;
+
+	namespace detail
+	{
+		inline std::uint64_t splitmix(std::uint64_t &state)
+		{
+			std::uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			return z ^ (z >> 31);
+		}
+
+		//Stripe s reads the secret at s * 8, the scramble reads the last 64 bytes, so it needs stripe_size + (stripes_per_block - 1) * 8 bytes.
+		//The merges read 64 bytes from offsets 11 and 53.
+		class secret_table
+		{
+		public:
+			alignas(16) unsigned char bytes[128];
+
+			secret_table()
+			{
+				std::uint64_t state = 0x746F6373u; //"tocs"
+				for (std::size_t i = 0; i < sizeof(bytes); i += 8)
+				{
+					std::uint64_t word = splitmix(state);
+					std::memcpy(bytes + i, &word, 8);
+				}
+			}
+		};
+
+		inline const unsigned char *secret()
+		{
+			static const secret_table table;
+			return table.bytes;
+		}
+
+		inline std::uint64_t multiply_fold(std::uint64_t a, std::uint64_t b)
+		{
+#if defined(_MSC_VER)
+			std::uint64_t high;
+			std::uint64_t low = _umul128(a, b, &high);
+			return low ^ high;
+#else
+			unsigned __int128 product = static_cast<unsigned __int128> (a) * b;
+			return static_cast<std::uint64_t> (product) ^ static_cast<std::uint64_t> (product >> 64);
+#endif
+		}
+
+		inline std::uint64_t avalanche(std::uint64_t h)
+		{
+			h ^= h >> 37;
+			h *= 0x165667919E3779F9ull;
+			h ^= h >> 32;
+			return h;
+		}
+
+		inline void accumulate_stripe(__m128i acc[4], const unsigned char *data, const unsigned char *key)
+		{
+			for (int i = 0; i < 4; ++i)
+			{
+				__m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i *> (data + i * 16));
+				__m128i keyed = _mm_xor_si128(value, _mm_loadu_si128(reinterpret_cast<const __m128i *> (key + i * 16)));
+
+				//Low half of each lane times its high half, plus the input with lanes swapped so no input bit is lost to the multiply.
+				__m128i product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+				__m128i swapped = _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+				acc[i] = _mm_add_epi64(acc[i], _mm_add_epi64(product, swapped));
+			}
+		}
+
+		inline void scramble(__m128i acc[4], const unsigned char *key)
+		{
+			const __m128i prime = _mm_set1_epi32(static_cast<int> (prime32_1));
+			for (int i = 0; i < 4; ++i)
+			{
+				__m128i a = acc[i];
+				a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+				a = _mm_xor_si128(a, _mm_loadu_si128(reinterpret_cast<const __m128i *> (key + i * 16)));
+
+				//64 bit multiply by a 32 bit prime from two 32 x 32 multiplies.
+				__m128i low = _mm_mul_epu32(a, prime);
+				__m128i high = _mm_mul_epu32(_mm_shuffle_epi32(a, _MM_SHUFFLE(2, 3, 0, 1)), prime);
+				acc[i] = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+			}
+		}
+
+		inline void accumulate(__m128i acc[4], const unsigned char *data, std::size_t size)
+		{
+			const unsigned char *key = secret();
+			std::size_t stripes = size / stripe_size;
+
+			std::size_t stripe = 0;
+			for (; stripe + stripes_per_block <= stripes; stripe += stripes_per_block)
+			{
+				for (std::size_t s = 0; s < stripes_per_block; ++s)
+				{
+					accumulate_stripe(acc, data + (stripe + s) * stripe_size, key + s * 8);
+				}
+				scramble(acc, key + 64);
+			}
+			for (std::size_t s = 0; stripe < stripes; ++stripe, ++s)
+			{
+				accumulate_stripe(acc, data + stripe * stripe_size, key + s * 8);
+			}
+
+			//The tail goes in zero padded, its length is folded in by the caller.
+			std::size_t tail = size - stripes * stripe_size;
+			if (tail)
+			{
+				alignas(16) unsigned char last[stripe_size] = {};
+				std::memcpy(last, data + stripes * stripe_size, tail);
+				accumulate_stripe(acc, last, key + 56);
+			}
+		}
+
+		inline void init(__m128i acc[4], std::uint64_t seed)
+		{
+			acc[0] = _mm_set_epi64x(static_cast<long long> (prime64_1 - seed), static_cast<long long> (prime32_1 + seed));
+			acc[1] = _mm_set_epi64x(static_cast<long long> (prime64_3 - seed), static_cast<long long> (prime64_2 + seed));
+			acc[2] = _mm_set_epi64x(static_cast<long long> (prime64_2 - seed), static_cast<long long> (prime64_1 + seed));
+			acc[3] = _mm_set_epi64x(static_cast<long long> (prime32_1 - seed), static_cast<long long> (prime64_3 + seed));
+		}
+
+		inline std::uint64_t merge(const __m128i acc[4], const unsigned char *key, std::uint64_t start)
+		{
+			alignas(16) std::uint64_t lanes[8];
+			for (int i = 0; i < 4; ++i)
+			{
+				_mm_store_si128(reinterpret_cast<__m128i *> (lanes + i * 2), acc[i]);
+			}
+
+			std::uint64_t result = start;
+			for (int i = 0; i < 4; ++i)
+			{
+				std::uint64_t key_a;
+				std::uint64_t key_b;
+				std::memcpy(&key_a, key + i * 16, 8);
+				std::memcpy(&key_b, key + i * 16 + 8, 8);
+				result += multiply_fold(lanes[i * 2] ^ key_a, lanes[i * 2 + 1] ^ key_b);
+			}
+			return avalanche(result);
+		}
+	}
+
+	inline std::uint64_t hash64(const void *data, std::size_t size, std::uint64_t seed = 0)
+	{
+		__m128i acc[4];
+		detail::init(acc, seed);
+		detail::accumulate(acc, static_cast<const unsigned char *> (data), size);
+		return detail::merge(acc, detail::secret() + 11, size * prime64_1);
+	}
+
+	//Order dependent, combine(combine(s, a), b) differs from combine(combine(s, b), a).
+	inline std::uint64_t combine(std::uint64_t seed, std::uint64_t value)
+	{
+		return detail::avalanche(detail::multiply_fold(seed ^ prime64_2, value ^ prime64_3) + seed);
+	}
+
+	class digest128
+	{
+	public:
+		std::uint64_t low;
+		std::uint64_t high;
+
+		bool operator==(const digest128 &rhs) const { return low == rhs.low && high == rhs.high; }
+		bool operator!=(const digest128 &rhs) const { return !(*this == rhs); }
+	};
+
+	//The same accumulators as hash64 merged twice under different parts of the secret, so the extra 64 bits cost one more merge.
+	inline digest128 hash128(const void *data, std::size_t size, std::uint64_t seed = 0)
+	{
+		__m128i acc[4];
+		detail::init(acc, seed);
+		detail::accumulate(acc, static_cast<const unsigned char *> (data), size);
+
+		digest128 result;
+		result.low = detail::merge(acc, detail::secret() + 11, size * prime64_1);
+		result.high = detail::merge(acc, detail::secret() + 53, ~(size * prime64_2));
+		return result;
+	}
+
+	inline digest128 combine(const digest128 &seed, const digest128 &value)
+	{
+		digest128 result;
+		result.low = combine(seed.low, value.low);
+		result.high = combine(seed.high, value.high);
+		return result;
+	}
+}
+
+}
+}
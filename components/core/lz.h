@@ -0,0 +1,183 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace tocs {
+namespace core {
+
+//Byte oriented LZ77 block compression in the LZ4 sequence layout: a token byte with literal and match length nibbles, extra length bytes
+//past 15, the literals, then a 16 bit match offset. Fast on both ends and good enough for state that mostly repeats frame to frame.
+namespace lz
+{
+	static constexpr std::size_t min_match = 4;
+	static constexpr std::size_t hash_bits = 12;
+	static constexpr std::size_t max_offset = 0xFFFF;
+
+	namespace detail
+	{
+		inline std::uint32_t read32(const unsigned char *p)
+		{
+			std::uint32_t value;
+			std::memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		inline std::uint32_t hash(std::uint32_t value)
+		{
+			return (value * 2654435761u) >> (32 - hash_bits);
+		}
+
+		inline void write_length(std::vector<unsigned char> &out, std::size_t length)
+		{
+			for (; length >= 255; length -= 255)
+			{
+				out.push_back(255);
+			}
+			out.push_back(static_cast<unsigned char> (length));
+		}
+
+		inline bool read_length(const unsigned char *&in, const unsigned char *end, std::size_t &length)
+		{
+			unsigned char byte;
+			do
+			{
+				if (in == end)
+				{
+					return false;
+				}
+				byte = *in++;
+				length += byte;
+			} while (byte == 255);
+			return true;
+		}
+
+		inline void write_sequence(std::vector<unsigned char> &out, const unsigned char *literals, std::size_t literal_count, std::size_t offset, std::size_t match_length)
+		{
+			std::size_t match_code = match_length ? match_length - min_match : 0;
+			out.push_back(static_cast<unsigned char> ((literal_count < 15 ? literal_count : 15) << 4 | (match_code < 15 ? match_code : 15)));
+			if (literal_count >= 15)
+			{
+				write_length(out, literal_count - 15);
+			}
+			out.insert(out.end(), literals, literals + literal_count);
+
+			if (match_length)
+			{
+				out.push_back(static_cast<unsigned char> (offset));
+				out.push_back(static_cast<unsigned char> (offset >> 8));
+				if (match_code >= 15)
+				{
+					write_length(out, match_code - 15);
+				}
+			}
+		}
+	}
+
+	//Appends the compressed form of source to out.
+	inline void compress(const unsigned char *source, std::size_t size, std::vector<unsigned char> &out)
+	{
+		std::uint32_t table[1 << hash_bits];
+		std::memset(table, 0, sizeof(table));
+
+		std::size_t anchor = 0;
+		std::size_t i = 0;
+
+		//Table entries are position + 1 so zero means empty.
+		while (size >= min_match && i <= size - min_match)
+		{
+			std::uint32_t value = detail::read32(source + i);
+			std::uint32_t &slot = table[detail::hash(value)];
+			std::size_t candidate = slot;
+			slot = static_cast<std::uint32_t> (i + 1);
+
+			if (candidate == 0 || i - (candidate - 1) > max_offset || detail::read32(source + candidate - 1) != value)
+			{
+				++i;
+				continue;
+			}
+
+			std::size_t match = candidate - 1;
+			std::size_t length = min_match;
+			while (i + length < size && source[match + length] == source[i + length])
+			{
+				++length;
+			}
+
+			detail::write_sequence(out, source + anchor, i - anchor, i - match, length);
+			i += length;
+			anchor = i;
+		}
+
+		//Trailing literals end the block, the decoder stops when it runs out of input after them.
+		detail::write_sequence(out, source + anchor, size - anchor, 0, 0);
+	}
+
+	//Decompresses into dest, which has to be exactly the original size. Returns false for corrupt input rather than reading or writing out of bounds.
+	inline bool decompress(const unsigned char *source, std::size_t size, unsigned char *dest, std::size_t dest_size)
+	{
+		const unsigned char *in = source;
+		const unsigned char *end = source + size;
+		std::size_t written = 0;
+
+		while (in < end)
+		{
+			unsigned char token = *in++;
+
+			std::size_t literal_count = token >> 4;
+			if (literal_count == 15 && !detail::read_length(in, end, literal_count))
+			{
+				return false;
+			}
+			if (literal_count > static_cast<std::size_t> (end - in) || literal_count > dest_size - written)
+			{
+				return false;
+			}
+			if (literal_count)
+			{
+				std::memcpy(dest + written, in, literal_count);
+			}
+			in += literal_count;
+			written += literal_count;
+
+			if (in == end)
+			{
+				break;
+			}
+
+			if (end - in < 2)
+			{
+				return false;
+			}
+			std::size_t offset = in[0] | (in[1] << 8);
+			in += 2;
+
+			std::size_t match_length = token & 0xF;
+			if (match_length == 15 && !detail::read_length(in, end, match_length))
+			{
+				return false;
+			}
+			match_length += min_match;
+
+			if (offset == 0 || offset > written || match_length > dest_size - written)
+			{
+				return false;
+			}
+
+			//Matches can overlap what they produce, so copy forwards a byte at a time.
+			const unsigned char *from = dest + written - offset;
+			unsigned char *to = dest + written;
+			for (std::size_t b = 0; b < match_length; ++b)
+			{
+				to[b] = from[b];
+			}
+			written += match_length;
+		}
+
+		return written == dest_size;
+	}
+}
+
+}
+}
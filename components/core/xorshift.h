@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdint>
+
+namespace tocs {
+namespace core {
+
+//Tiny non-cryptographic rng, cheap enough to call in spin loops. One per thread, it isn't thread safe.
+class xorshift_random
+{
+	std::uint32_t state;
+public:
+	explicit xorshift_random(std::uint32_t seed = 0x9E3779B9u)
+		: state(seed ? seed : 0x9E3779B9u)
+	{}
+
+	std::uint32_t next()
+	{
+		std::uint32_t x = state;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		state = x;
+		return x;
+	}
+
+	//Uniform in [0, range) without a divide.
+	std::uint32_t next_below(std::uint32_t range)
+	{
+		return static_cast<std::uint32_t> ((std::uint64_t(next()) * range) >> 32);
+	}
+};
+
+}
+}
@@ -0,0 +1,937 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <core/asserts.h>
+#include <core/bits.h>
+#include <core/frame_arena.h>
+#include <math/culling.h>
+#include <math/ray.h>
+#include <math/simd.h>
+#include <math/vector.h>
+#include <threading/trace.h>
+#include <threading/worker.h>
+
+namespace tocs {
+namespace engine {
+
+//Four wide bounding volume hierarchy over boxes. Each node stores its children's boxes as SoA so one ray or overlap test covers all four, leaves
+//hold up to four primitives whose boxes are laid out the same way. Built top down with binned SAH, subtrees below primitives_per_job are built as
+//jobs. Primitives are identified by their index in the boxes given to build.
+class bvh
+{
+	typedef math::detail::simd_pack<float> pack;
+public:
+	static constexpr int width = 4;
+	static constexpr int max_leaf_size = 4;
+	static constexpr std::uint32_t none = 0xFFFFFFFFu;
+
+	class node
+	{
+	public:
+		float min_x[width], min_y[width], min_z[width];
+		float max_x[width], max_y[width], max_z[width];
+
+		//Child node index, or the first primitive slot when primitive_counts is non zero.
+		std::uint32_t children[width];
+		std::uint8_t primitive_counts[width];
+		std::uint8_t child_count;
+
+		node()
+			: child_count(0)
+		{
+			for (int c = 0; c < width; ++c)
+			{
+				min_x[c] = min_y[c] = min_z[c] = 0;
+				max_x[c] = max_y[c] = max_z[c] = 0;
+				children[c] = none;
+				primitive_counts[c] = 0;
+			}
+		}
+	};
+
+	class hit
+	{
+	public:
+		std::uint32_t primitive;
+		float t;
+	};
+
+	bvh()
+		: top_node_count(0)
+	{
+	}
+
+	std::size_t size() const { return primitives.size(); }
+	const std::vector<node> &get_nodes() const { return nodes; }
+
+	//Has to be called from a job_system worker.
+	void build(math::aabb_lanes<const float> boxes, std::size_t count, std::size_t primitives_per_job = 4096)
+	{
+		TOCS_TRACE_SCOPE("bvh::build");
+
+		nodes.clear();
+		subtrees.clear();
+		top_node_count = 0;
+		primitives.resize(count);
+		slots.resize(count);
+		leaves.resize(count);
+		records.resize(count);
+		for (int bound = 0; bound < 6; ++bound)
+		{
+			//Padded so a leaf's primitives always load as a whole pack.
+			primitive_bounds[bound].assign(count + max_leaf_size - 1, 0.0f);
+		}
+
+		if (count == 0)
+		{
+			return;
+		}
+
+		threading::job_system::parallel_for(count, primitives_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; ++i)
+			{
+				build_primitive &record = records[i];
+				primitive_box(boxes, static_cast<std::uint32_t> (i), record.bounds);
+				record.center[0] = boxes.center_x[i];
+				record.center[1] = boxes.center_y[i];
+				record.center[2] = boxes.center_z[i];
+				record.index = static_cast<std::uint32_t> (i);
+			}
+		});
+
+		//The top of the tree is split here, with big ranges binned in parallel. Ranges that fit in a job are left as subtree tasks.
+		std::vector<subtree_task> tasks;
+		nodes.push_back(node());
+		build_context top{ nodes, &tasks, primitives_per_job };
+		split_node(top, 0, 0, count, 0);
+		top_node_count = nodes.size();
+
+		threading::job_system::parallel_for(tasks.size(), 1, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t t = begin; t < end; ++t)
+			{
+				subtree_task &task = tasks[t];
+				task.nodes.push_back(node());
+				build_context context{ task.nodes, nullptr, primitives_per_job };
+				split_node(context, 0, task.begin, task.end, task.depth);
+			}
+		});
+
+		//Subtrees go after the top nodes in task order, every one contiguous so refit can walk them as separate jobs.
+		std::uint32_t offset = static_cast<std::uint32_t> (nodes.size());
+		for (subtree_task &task : tasks)
+		{
+			std::uint32_t subtree_size = static_cast<std::uint32_t> (task.nodes.size());
+			subtrees.push_back(subtree_range{ offset, offset + subtree_size });
+			nodes[task.parent].children[task.child] = offset;
+			offset += subtree_size;
+		}
+		nodes.resize(offset);
+
+		threading::job_system::parallel_for(tasks.size(), 1, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t t = begin; t < end; ++t)
+			{
+				std::uint32_t offset = subtrees[t].begin;
+				for (std::size_t n = 0; n < tasks[t].nodes.size(); ++n)
+				{
+					node &moved = nodes[offset + n];
+					moved = tasks[t].nodes[n];
+					for (int c = 0; c < moved.child_count; ++c)
+					{
+						if (!moved.primitive_counts[c])
+						{
+							moved.children[c] += offset;
+						}
+					}
+				}
+			}
+		});
+
+		//Primitives in leaf order, and the links incremental refit walks back up.
+		parents.assign(nodes.size(), none);
+		threading::job_system::parallel_for(nodes.size(), nodes_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t n = begin; n < end; ++n)
+			{
+				const node &current = nodes[n];
+				for (int c = 0; c < current.child_count; ++c)
+				{
+					std::uint32_t link = static_cast<std::uint32_t> (n * width + c);
+					if (!current.primitive_counts[c])
+					{
+						parents[current.children[c]] = link;
+						continue;
+					}
+
+					for (std::uint32_t slot = current.children[c]; slot < current.children[c] + current.primitive_counts[c]; ++slot)
+					{
+						leaves[slot] = link;
+					}
+				}
+			}
+		});
+
+		threading::job_system::parallel_for(count, primitives_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t slot = begin; slot < end; ++slot)
+			{
+				const build_primitive &record = records[slot];
+				primitives[slot] = record.index;
+				slots[record.index] = static_cast<std::uint32_t> (slot);
+				for (int bound = 0; bound < 6; ++bound)
+				{
+					primitive_bounds[bound][slot] = record.bounds[bound];
+				}
+			}
+		});
+	}
+
+	//Refits every node to moved boxes without changing the tree, for when the same primitives moved. The tree gets looser as things move
+	//away from where they were built, rebuild now and again. Has to be called from a job_system worker.
+	void refit(math::aabb_lanes<const float> boxes, std::size_t count, std::size_t primitives_per_job = 4096)
+	{
+		TOCS_TRACE_SCOPE("bvh::refit");
+		check(count == size());
+
+		threading::job_system::parallel_for(count, primitives_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t slot = begin; slot < end; ++slot)
+			{
+				copy_primitive(boxes, primitives[slot], slot);
+			}
+		});
+
+		//Children always come after their parent, so walking each range backwards finishes every child before its parent.
+		threading::job_system::parallel_for(subtrees.size(), 1, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t t = begin; t < end; ++t)
+			{
+				for (std::uint32_t n = subtrees[t].end; n-- > subtrees[t].begin; )
+				{
+					refit_node(n);
+				}
+			}
+		});
+
+		for (std::size_t n = top_node_count; n-- > 0; )
+		{
+			refit_node(static_cast<std::uint32_t> (n));
+		}
+	}
+
+	//Refits only the leaves holding changed primitives and walks up from each, stopping where a box stops growing or shrinking.
+	//Falls back to a full refit when a large share moved.
+	void refit(math::aabb_lanes<const float> boxes, const std::vector<std::uint32_t> &changed, std::size_t primitives_per_job = 4096)
+	{
+		if (changed.size() * 8 > size())
+		{
+			refit(boxes, size(), primitives_per_job);
+			return;
+		}
+
+		TOCS_TRACE_SCOPE("bvh::refit_changed");
+
+		for (std::uint32_t primitive : changed)
+		{
+			std::uint32_t slot = slots[primitive];
+			copy_primitive(boxes, primitive, slot);
+
+			for (std::uint32_t link = leaves[slot]; link != none; )
+			{
+				node &parent = nodes[link / width];
+				int c = link % width;
+
+				float bounds[6];
+				if (parent.primitive_counts[c])
+				{
+					leaf_bounds(parent.children[c], parent.primitive_counts[c], bounds);
+				}
+				else
+				{
+					node_bounds(nodes[parent.children[c]], bounds);
+				}
+
+				if (!set_child_bounds(parent, c, bounds))
+				{
+					break;
+				}
+				link = parents[link / width];
+			}
+		}
+	}
+
+	//Nearest primitive the ray hits within max_t that filter(primitive) accepts. Safe to run from several threads between builds.
+	template <class filter_type>
+	bool closest_hit(const math::ray &r, float max_t, hit &result, filter_type &&filter) const
+	{
+		result.primitive = none;
+		result.t = max_t;
+		if (nodes.empty())
+		{
+			return false;
+		}
+
+		const math::detail::ray_packs ray_pack(r);
+
+		stack_entry stack[max_stack];
+		int stack_size = 0;
+		stack[stack_size++] = stack_entry{ 0, 0.0f };
+
+		while (stack_size)
+		{
+			stack_entry entry = stack[--stack_size];
+			if (entry.t > result.t)
+			{
+				continue;
+			}
+
+			const node &current = nodes[entry.index];
+			pack entry_t;
+			std::uint64_t hits = test_children(ray_pack, current, result.t, entry_t);
+			if (!hits)
+			{
+				continue;
+			}
+
+			float child_t[width];
+			entry_t.store(child_t);
+
+			//Nearest children get popped first, leaves are tested straight away so they can shrink the ray before any node is walked.
+			int order[width];
+			int order_count = 0;
+			for (; hits; hits = core::clear_lowest_bit(hits))
+			{
+				int c = core::count_trailing_zeros(hits);
+				int at = order_count++;
+				for (; at > 0 && child_t[order[at - 1]] > child_t[c]; --at)
+				{
+					order[at] = order[at - 1];
+				}
+				order[at] = c;
+			}
+
+			for (int o = 0; o < order_count; ++o)
+			{
+				int c = order[o];
+				if (current.primitive_counts[c] && child_t[c] <= result.t)
+				{
+					test_leaf(ray_pack, current.children[c], current.primitive_counts[c], result, filter, false);
+				}
+			}
+
+			for (int o = order_count; o-- > 0; )
+			{
+				int c = order[o];
+				if (!current.primitive_counts[c])
+				{
+					check(stack_size < max_stack);
+					stack[stack_size++] = stack_entry{ current.children[c], child_t[c] };
+				}
+			}
+		}
+
+		return result.primitive != none;
+	}
+
+	bool closest_hit(const math::ray &r, float max_t, hit &result) const
+	{
+		return closest_hit(r, max_t, result, accept_all());
+	}
+
+	//Whether anything filter accepts is hit within max_t, stopping at the first. Line of sight is any_hit on ray::between with max_t 1.
+	template <class filter_type>
+	bool any_hit(const math::ray &r, float max_t, filter_type &&filter) const
+	{
+		if (nodes.empty())
+		{
+			return false;
+		}
+
+		const math::detail::ray_packs ray_pack(r);
+		hit result{ none, max_t };
+
+		std::uint32_t stack[max_stack];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size)
+		{
+			const node &current = nodes[stack[--stack_size]];
+			pack entry_t;
+			for (std::uint64_t hits = test_children(ray_pack, current, max_t, entry_t); hits; hits = core::clear_lowest_bit(hits))
+			{
+				int c = core::count_trailing_zeros(hits);
+				if (current.primitive_counts[c])
+				{
+					if (test_leaf(ray_pack, current.children[c], current.primitive_counts[c], result, filter, true))
+					{
+						return true;
+					}
+				}
+				else
+				{
+					check(stack_size < max_stack);
+					stack[stack_size++] = current.children[c];
+				}
+			}
+		}
+		return false;
+	}
+
+	bool any_hit(const math::ray &r, float max_t) const
+	{
+		return any_hit(r, max_t, accept_all());
+	}
+
+	//closest_hit for a batch of rays as parallel jobs, misses come back with primitive set to none. Has to be called from a job_system worker.
+	void closest_hits(const math::ray *rays, const float *max_t, std::size_t count, hit *results, std::size_t rays_per_job = 256) const
+	{
+		TOCS_TRACE_SCOPE("bvh::closest_hits");
+
+		threading::job_system::parallel_for(count, rays_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; ++i)
+			{
+				closest_hit(rays[i], max_t[i], results[i]);
+			}
+		});
+	}
+
+	//any_hit for a batch, blocked[i] is 1 where ray i hit something.
+	void any_hits(const math::ray *rays, const float *max_t, std::size_t count, std::uint8_t *blocked, std::size_t rays_per_job = 256) const
+	{
+		TOCS_TRACE_SCOPE("bvh::any_hits");
+
+		threading::job_system::parallel_for(count, rays_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; ++i)
+			{
+				blocked[i] = any_hit(rays[i], max_t[i]) ? 1 : 0;
+			}
+		});
+	}
+
+	//Appends every primitive whose box overlaps the query box.
+	void query_aabb(const math::vector3 &min, const math::vector3 &max, std::vector<std::uint32_t> &out) const
+	{
+		const pack low_x(min.x), low_y(min.y), low_z(min.z);
+		const pack high_x(max.x), high_y(max.y), high_z(max.z);
+
+		walk_overlaps([&](const float *min_x, const float *min_y, const float *min_z, const float *max_x, const float *max_y, const float *max_z)
+		{
+			auto outside = pack::load(max_x).c_less(low_x).bit_or(high_x.c_less(pack::load(min_x)))
+				.bit_or(pack::load(max_y).c_less(low_y)).bit_or(high_y.c_less(pack::load(min_y)))
+				.bit_or(pack::load(max_z).c_less(low_z)).bit_or(high_z.c_less(pack::load(min_z)));
+			return ~outside.sign_mask() & 0xF;
+		}, out);
+	}
+
+	//Appends every primitive whose box touches the sphere.
+	void query_sphere(const math::vector3 &center, float radius, std::vector<std::uint32_t> &out) const
+	{
+		const pack cx(center.x), cy(center.y), cz(center.z), radius_sq(radius * radius), zero;
+
+		walk_overlaps([&](const float *min_x, const float *min_y, const float *min_z, const float *max_x, const float *max_y, const float *max_z)
+		{
+			auto ex = pack::load(min_x).sub(cx).c_max(cx.sub(pack::load(max_x))).c_max(zero);
+			auto ey = pack::load(min_y).sub(cy).c_max(cy.sub(pack::load(max_y))).c_max(zero);
+			auto ez = pack::load(min_z).sub(cz).c_max(cz.sub(pack::load(max_z))).c_max(zero);
+			auto distance_sq = ex.c_mul(ex).add(ey.c_mul(ey)).add(ez.c_mul(ez));
+			return ~radius_sq.c_less(distance_sq).sign_mask() & 0xF;
+		}, out);
+	}
+
+private:
+	static constexpr int bin_count = 16;
+	static constexpr std::size_t nodes_per_job = 1024;
+
+	//Past this depth splits go to the median so a bad SAH run can't make the tree deep, which keeps the traversal stacks fixed size.
+	static constexpr int max_sah_depth = 32;
+	static constexpr int max_stack = 256;
+
+	class accept_all
+	{
+	public:
+		bool operator()(std::uint32_t) const { return true; }
+	};
+
+	class stack_entry
+	{
+	public:
+		std::uint32_t index;
+		float t;
+	};
+
+	class subtree_task
+	{
+	public:
+		std::uint32_t parent;
+		int child;
+		std::size_t begin, end;
+		int depth;
+		std::vector<node> nodes;
+	};
+
+	class subtree_range
+	{
+	public:
+		std::uint32_t begin, end;
+	};
+
+	//Partitioned in place while building so every pass reads through memory in order.
+	class build_primitive
+	{
+	public:
+		float bounds[6];
+		float center[3];
+		std::uint32_t index;
+	};
+
+	class build_context
+	{
+	public:
+		std::vector<node> &nodes;
+
+		//Null inside a subtree job.
+		std::vector<subtree_task> *tasks;
+		std::size_t primitives_per_job;
+	};
+
+	class box
+	{
+	public:
+		float bounds[6];
+
+		box()
+		{
+			empty_bounds(bounds);
+		}
+	};
+
+	//Box and primitive count while binning.
+	class bin
+	{
+	public:
+		float bounds[6];
+		std::size_t count;
+
+		bin()
+			: count(0)
+		{
+			empty_bounds(bounds);
+		}
+	};
+
+	std::vector<node> nodes;
+	std::size_t top_node_count;
+	std::vector<subtree_range> subtrees;
+
+	//Per slot, in leaf order.
+	std::vector<std::uint32_t> primitives;
+	std::vector<std::uint32_t> leaves;
+	std::vector<float> primitive_bounds[6];
+
+	//Per node, the parent's node * width + child.
+	std::vector<std::uint32_t> parents;
+
+	//Per primitive.
+	std::vector<std::uint32_t> slots;
+
+	std::vector<build_primitive> records;
+
+	static void empty_bounds(float *bounds)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			bounds[axis] = std::numeric_limits<float>::max();
+			bounds[3 + axis] = -std::numeric_limits<float>::max();
+		}
+	}
+
+	static void grow_bounds(float *bounds, const float *other)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			bounds[axis] = std::min(bounds[axis], other[axis]);
+			bounds[3 + axis] = std::max(bounds[3 + axis], other[3 + axis]);
+		}
+	}
+
+	static void merge_boxes(box &result, const box &other)
+	{
+		grow_bounds(result.bounds, other.bounds);
+	}
+
+	//Half the surface area, which is all SAH needs.
+	static float half_area(const float *bounds)
+	{
+		float dx = bounds[3] - bounds[0], dy = bounds[4] - bounds[1], dz = bounds[5] - bounds[2];
+		return dx < 0 ? 0 : dx * dy + dy * dz + dz * dx;
+	}
+
+	static void primitive_box(const math::aabb_lanes<const float> &boxes, std::uint32_t i, float *bounds)
+	{
+		bounds[0] = boxes.center_x[i] - boxes.extent_x[i];
+		bounds[1] = boxes.center_y[i] - boxes.extent_y[i];
+		bounds[2] = boxes.center_z[i] - boxes.extent_z[i];
+		bounds[3] = boxes.center_x[i] + boxes.extent_x[i];
+		bounds[4] = boxes.center_y[i] + boxes.extent_y[i];
+		bounds[5] = boxes.center_z[i] + boxes.extent_z[i];
+	}
+
+	void copy_primitive(const math::aabb_lanes<const float> &boxes, std::uint32_t primitive, std::size_t slot)
+	{
+		float bounds[6];
+		primitive_box(boxes, primitive, bounds);
+		for (int bound = 0; bound < 6; ++bound)
+		{
+			primitive_bounds[bound][slot] = bounds[bound];
+		}
+	}
+
+	//Runs func(begin, end, bounds) over [begin, end) of the primitive order and merges the partial results in order, in parallel jobs when the range
+	//is big and this is the top of the build.
+	template <class result_type, class func_type, class merge_type>
+	result_type reduce_range(const build_context &context, std::size_t begin, std::size_t end, func_type &&func, merge_type &&merge) const
+	{
+		std::size_t count = end - begin;
+		if (!context.tasks || count <= context.primitives_per_job * 2)
+		{
+			result_type result;
+			func(begin, end, result);
+			return result;
+		}
+
+		std::size_t chunk_count = (count + context.primitives_per_job - 1) / context.primitives_per_job;
+		std::vector<result_type> partial(chunk_count);
+		threading::job_system::parallel_for(count, context.primitives_per_job, [&](std::size_t chunk_begin, std::size_t chunk_end)
+		{
+			func(begin + chunk_begin, begin + chunk_end, partial[chunk_begin / context.primitives_per_job]);
+		});
+
+		result_type result = partial[0];
+		for (std::size_t chunk = 1; chunk < chunk_count; ++chunk)
+		{
+			merge(result, partial[chunk]);
+		}
+		return result;
+	}
+
+	//Splits [begin, end) in two and returns where the second half starts. Binned SAH along the axis the centers spread furthest on.
+	std::size_t split_range(const build_context &context, std::size_t begin, std::size_t end, int depth)
+	{
+		box spread = reduce_range<box>(context, begin, end, [this](std::size_t first, std::size_t last, box &result)
+		{
+			for (std::size_t i = first; i < last; ++i)
+			{
+				const float *center = records[i].center;
+				float point[6] = { center[0], center[1], center[2], center[0], center[1], center[2] };
+				grow_bounds(result.bounds, point);
+			}
+		}, merge_boxes);
+
+		int axis = 0;
+		for (int a = 1; a < 3; ++a)
+		{
+			if (spread.bounds[3 + a] - spread.bounds[a] > spread.bounds[3 + axis] - spread.bounds[axis])
+			{
+				axis = a;
+			}
+		}
+
+		float extent = spread.bounds[3 + axis] - spread.bounds[axis];
+		std::size_t middle = begin + (end - begin) / 2;
+		if (!(extent > 0))
+		{
+			//Every center in the same place, any split is as good as another.
+			return middle;
+		}
+
+		if (depth > max_sah_depth)
+		{
+			std::nth_element(records.begin() + begin, records.begin() + middle, records.begin() + end, [axis](const build_primitive &a, const build_primitive &b)
+			{
+				return a.center[axis] < b.center[axis];
+			});
+			return middle;
+		}
+
+		//Small ranges get a bin per primitive at most, the sweep costs more than the binning otherwise.
+		int used_bins = static_cast<int> (std::min<std::size_t> (end - begin, bin_count));
+		float origin = spread.bounds[axis];
+		float scale = used_bins / extent * 0.99999f;
+		auto bin_of = [axis, origin, scale, used_bins](const build_primitive &record)
+		{
+			return std::min(static_cast<int> ((record.center[axis] - origin) * scale), used_bins - 1);
+		};
+
+		class bin_set
+		{
+		public:
+			bin bins[bin_count];
+		};
+
+		bin_set binned = reduce_range<bin_set>(context, begin, end, [&](std::size_t first, std::size_t last, bin_set &result)
+		{
+			for (std::size_t i = first; i < last; ++i)
+			{
+				bin &b = result.bins[bin_of(records[i])];
+				grow_bounds(b.bounds, records[i].bounds);
+				++b.count;
+			}
+		}, [used_bins](bin_set &result, const bin_set &other)
+		{
+			for (int b = 0; b < used_bins; ++b)
+			{
+				grow_bounds(result.bins[b].bounds, other.bins[b].bounds);
+				result.bins[b].count += other.bins[b].count;
+			}
+		});
+
+		//Cost of splitting after bin b is left count * left area + right count * right area.
+		float right_cost[bin_count];
+		bin right;
+		for (int b = used_bins - 1; b > 0; --b)
+		{
+			grow_bounds(right.bounds, binned.bins[b].bounds);
+			right.count += binned.bins[b].count;
+			right_cost[b] = right.count * half_area(right.bounds);
+		}
+
+		int best_split = 1;
+		float best_cost = std::numeric_limits<float>::max();
+		bin left;
+		for (int b = 1; b < used_bins; ++b)
+		{
+			grow_bounds(left.bounds, binned.bins[b - 1].bounds);
+			left.count += binned.bins[b - 1].count;
+
+			float cost = left.count * half_area(left.bounds) + right_cost[b];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_split = b;
+			}
+		}
+
+		auto split = std::partition(records.begin() + begin, records.begin() + end, [&](const build_primitive &record)
+		{
+			return bin_of(record) < best_split;
+		});
+
+		std::size_t result = split - records.begin();
+		return result == begin || result == end ? middle : result;
+	}
+
+	//Fills node index with up to four children for [begin, end), splitting the biggest range until there are four or all fit in leaves.
+	void split_node(build_context &context, std::uint32_t index, std::size_t begin, std::size_t end, int depth)
+	{
+		std::size_t starts[width + 1] = { begin, end };
+		int range_count = 1;
+
+		while (range_count < width)
+		{
+			int biggest = 0;
+			for (int r = 1; r < range_count; ++r)
+			{
+				if (starts[r + 1] - starts[r] > starts[biggest + 1] - starts[biggest])
+				{
+					biggest = r;
+				}
+			}
+			if (starts[biggest + 1] - starts[biggest] <= static_cast<std::size_t> (max_leaf_size))
+			{
+				break;
+			}
+
+			std::size_t split = split_range(context, starts[biggest], starts[biggest + 1], depth);
+			for (int r = range_count + 1; r > biggest + 1; --r)
+			{
+				starts[r] = starts[r - 1];
+			}
+			starts[biggest + 1] = split;
+			++range_count;
+		}
+
+		for (int c = 0; c < range_count; ++c)
+		{
+			std::size_t first = starts[c], last = starts[c + 1];
+
+			box bounds = reduce_range<box>(context, first, last, [&](std::size_t from, std::size_t to, box &result)
+			{
+				for (std::size_t i = from; i < to; ++i)
+				{
+					grow_bounds(result.bounds, records[i].bounds);
+				}
+			}, merge_boxes);
+
+			node &current = context.nodes[index];
+			set_child_bounds(current, c, bounds.bounds);
+			current.child_count = static_cast<std::uint8_t> (range_count);
+
+			if (last - first <= static_cast<std::size_t> (max_leaf_size))
+			{
+				current.children[c] = static_cast<std::uint32_t> (first);
+				current.primitive_counts[c] = static_cast<std::uint8_t> (last - first);
+			}
+			else if (context.tasks && last - first <= context.primitives_per_job)
+			{
+				context.tasks->push_back(subtree_task{ index, c, first, last, depth + 1, std::vector<node>() });
+			}
+			else
+			{
+				std::uint32_t child = static_cast<std::uint32_t> (context.nodes.size());
+				context.nodes[index].children[c] = child;
+				context.nodes.push_back(node());
+				split_node(context, child, first, last, depth + 1);
+			}
+		}
+	}
+
+	void leaf_bounds(std::uint32_t first, int count, float *bounds) const
+	{
+		empty_bounds(bounds);
+		for (std::uint32_t slot = first; slot < first + count; ++slot)
+		{
+			float primitive[6];
+			for (int bound = 0; bound < 6; ++bound)
+			{
+				primitive[bound] = primitive_bounds[bound][slot];
+			}
+			grow_bounds(bounds, primitive);
+		}
+	}
+
+	static void node_bounds(const node &n, float *bounds)
+	{
+		empty_bounds(bounds);
+		for (int c = 0; c < n.child_count; ++c)
+		{
+			float child[6] = { n.min_x[c], n.min_y[c], n.min_z[c], n.max_x[c], n.max_y[c], n.max_z[c] };
+			grow_bounds(bounds, child);
+		}
+	}
+
+	//Returns whether the box changed.
+	static bool set_child_bounds(node &n, int c, const float *bounds)
+	{
+		bool changed = n.min_x[c] != bounds[0] || n.min_y[c] != bounds[1] || n.min_z[c] != bounds[2]
+			|| n.max_x[c] != bounds[3] || n.max_y[c] != bounds[4] || n.max_z[c] != bounds[5];
+
+		n.min_x[c] = bounds[0];
+		n.min_y[c] = bounds[1];
+		n.min_z[c] = bounds[2];
+		n.max_x[c] = bounds[3];
+		n.max_y[c] = bounds[4];
+		n.max_z[c] = bounds[5];
+		return changed;
+	}
+
+	void refit_node(std::uint32_t index)
+	{
+		node &current = nodes[index];
+		for (int c = 0; c < current.child_count; ++c)
+		{
+			float bounds[6];
+			if (current.primitive_counts[c])
+			{
+				leaf_bounds(current.children[c], current.primitive_counts[c], bounds);
+			}
+			else
+			{
+				node_bounds(nodes[current.children[c]], bounds);
+			}
+			set_child_bounds(current, c, bounds);
+		}
+	}
+
+	static std::uint64_t test_children(const math::detail::ray_packs &ray_pack, const node &n, float max_t, pack &entry_t)
+	{
+		int hits = ray_pack.boxes_hit(
+			pack::load(n.min_x), pack::load(n.min_y), pack::load(n.min_z),
+			pack::load(n.max_x), pack::load(n.max_y), pack::load(n.max_z), pack(max_t), entry_t);
+		return static_cast<std::uint64_t> (hits) & ((1u << n.child_count) - 1);
+	}
+
+	//Tests a leaf's primitives, keeping the nearest accepted hit in result. With stop_at_first it returns as soon as one is accepted.
+	template <class filter_type>
+	bool test_leaf(const math::detail::ray_packs &ray_pack, std::uint32_t first, int count, hit &result, filter_type &filter, bool stop_at_first) const
+	{
+		pack entry_t;
+		int hits = ray_pack.boxes_hit(
+			pack::load(&primitive_bounds[0][first]), pack::load(&primitive_bounds[1][first]), pack::load(&primitive_bounds[2][first]),
+			pack::load(&primitive_bounds[3][first]), pack::load(&primitive_bounds[4][first]), pack::load(&primitive_bounds[5][first]),
+			pack(result.t), entry_t);
+
+		float t[width];
+		entry_t.store(t);
+
+		bool found = false;
+		for (std::uint64_t lanes = static_cast<std::uint64_t> (hits) & ((1u << count) - 1); lanes; lanes = core::clear_lowest_bit(lanes))
+		{
+			int lane = core::count_trailing_zeros(lanes);
+			std::uint32_t primitive = primitives[first + lane];
+			if (t[lane] <= result.t && filter(primitive))
+			{
+				result.primitive = primitive;
+				result.t = t[lane];
+				found = true;
+				if (stop_at_first)
+				{
+					break;
+				}
+			}
+		}
+		return found;
+	}
+
+	//Walks every node whose box overlaps(...) accepts, appending the primitives it accepts. overlaps gets pointers to four boxes as SoA and returns
+	//their lane bits.
+	template <class overlap_func>
+	void walk_overlaps(overlap_func &&overlaps, std::vector<std::uint32_t> &out) const
+	{
+		if (nodes.empty())
+		{
+			return;
+		}
+
+		std::uint32_t stack[max_stack];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size)
+		{
+			const node &current = nodes[stack[--stack_size]];
+			std::uint64_t hits = static_cast<std::uint64_t> (overlaps(current.min_x, current.min_y, current.min_z, current.max_x, current.max_y, current.max_z));
+
+			for (hits &= (1u << current.child_count) - 1; hits; hits = core::clear_lowest_bit(hits))
+			{
+				int c = core::count_trailing_zeros(hits);
+				if (!current.primitive_counts[c])
+				{
+					check(stack_size < max_stack);
+					stack[stack_size++] = current.children[c];
+					continue;
+				}
+
+				std::uint32_t first = current.children[c];
+				std::uint64_t lanes = static_cast<std::uint64_t> (overlaps(
+					&primitive_bounds[0][first], &primitive_bounds[1][first], &primitive_bounds[2][first],
+					&primitive_bounds[3][first], &primitive_bounds[4][first], &primitive_bounds[5][first]));
+
+				for (lanes &= (1u << current.primitive_counts[c]) - 1; lanes; lanes = core::clear_lowest_bit(lanes))
+				{
+					out.push_back(primitives[first + core::count_trailing_zeros(lanes)]);
+				}
+			}
+		}
+	}
+};
+
+}
+}
@@ -0,0 +1,220 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <core/asserts.h>
+#include <math/ray.h>
+#include <math/vector.h>
+#include <threading/trace.h>
+#include <threading/worker.h>
+#include "bvh.h"
+#include "component.h"
+
+namespace tocs {
+namespace engine {
+
+//Two points that should be able to see each other, the objects at either end don't block it.
+class sight_line
+{
+public:
+	math::vector3 from;
+	math::vector3 to;
+	game_object_id viewer;
+	game_object_id target;
+};
+
+//A bvh over the objects that have one component type, keyed by game object. world::update_bvh_index refreshes it from the current game_state,
+//rebuilding when objects come or go and otherwise refitting only the boxes that differ from the last update's. Boxes are compared rather than
+//trusting state_value changed flags, which stay set once written. Refits loosen the tree so it is rebuilt anyway every rebuild_interval updates.
+class bvh_index
+{
+	std::function<void(const all_component_storage &)> gather;
+
+	bvh tree;
+	int rebuild_interval;
+	int updates_since_build;
+
+	//Sorted by id so the same set of objects always lands in the same order and can be refit.
+	std::vector<game_object_id> objects;
+	std::vector<float> center_x, center_y, center_z, extent_x, extent_y, extent_z;
+	std::vector<std::uint32_t> changed;
+
+	std::vector<game_object_id> gathered_objects;
+	std::vector<std::uint32_t> order;
+	std::vector<float> gathered;
+public:
+	explicit bvh_index(int rebuild_interval = 120)
+		: rebuild_interval(rebuild_interval)
+		, updates_since_build(0)
+	{
+	}
+
+	//Indexes comp_type as boxes, bounds(const comp_type &, math::vector3 &center, math::vector3 &extent) fills in the box.
+	template <class comp_type, class bounds_func>
+	void track(bounds_func bounds)
+	{
+		gather = [this, bounds](const all_component_storage &storage)
+		{
+			gathered_objects.clear();
+			gathered.clear();
+
+			const component_storage<comp_type> *comps = storage.template find_storage<comp_type>();
+			if (!comps)
+			{
+				return;
+			}
+
+			comps->for_each([&](game_object_id id, const comp_type &comp)
+			{
+				math::vector3 center, extent;
+				bounds(comp, center, extent);
+
+				gathered_objects.push_back(id);
+				gathered.push_back(center.x);
+				gathered.push_back(center.y);
+				gathered.push_back(center.z);
+				gathered.push_back(extent.x);
+				gathered.push_back(extent.y);
+				gathered.push_back(extent.z);
+			});
+		};
+		updates_since_build = 0;
+		objects.clear();
+	}
+
+	bool is_tracking() const { return static_cast<bool> (gather); }
+
+	std::size_t size() const { return objects.size(); }
+	const std::vector<game_object_id> &get_objects() const { return objects; }
+	const bvh &get_tree() const { return tree; }
+
+	//Has to be called from a job_system worker.
+	void update(const all_component_storage &storage)
+	{
+		TOCS_TRACE_SCOPE("update_bvh_index");
+		check(is_tracking());
+
+		gather(storage);
+
+		std::size_t count = gathered_objects.size();
+		order.resize(count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			order[i] = static_cast<std::uint32_t> (i);
+		}
+		std::sort(order.begin(), order.end(), [this](std::uint32_t a, std::uint32_t b)
+		{
+			return gathered_objects[a] < gathered_objects[b];
+		});
+
+		bool same_objects = count == objects.size() && updates_since_build > 0;
+		objects.resize(count);
+		center_x.resize(count);
+		center_y.resize(count);
+		center_z.resize(count);
+		extent_x.resize(count);
+		extent_y.resize(count);
+		extent_z.resize(count);
+		changed.clear();
+
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			std::uint32_t from = order[i];
+			same_objects = same_objects && objects[i] == gathered_objects[from];
+			objects[i] = gathered_objects[from];
+
+			const float *box = &gathered[from * 6];
+			if (center_x[i] != box[0] || center_y[i] != box[1] || center_z[i] != box[2] || extent_x[i] != box[3] || extent_y[i] != box[4] || extent_z[i] != box[5])
+			{
+				changed.push_back(static_cast<std::uint32_t> (i));
+			}
+
+			center_x[i] = box[0];
+			center_y[i] = box[1];
+			center_z[i] = box[2];
+			extent_x[i] = box[3];
+			extent_y[i] = box[4];
+			extent_z[i] = box[5];
+		}
+
+		math::aabb_lanes<const float> boxes{ center_x.data(), center_y.data(), center_z.data(), extent_x.data(), extent_y.data(), extent_z.data() };
+
+		if (!same_objects || updates_since_build >= rebuild_interval)
+		{
+			tree.build(boxes, count);
+			updates_since_build = 1;
+		}
+		else
+		{
+			if (!changed.empty())
+			{
+				tree.refit(boxes, changed);
+			}
+			++updates_since_build;
+		}
+	}
+
+	//The nearest object the ray hits within max_t. Safe to run from several threads between updates.
+	bool raycast(const math::ray &r, float max_t, game_object_id &object, float &t) const
+	{
+		bvh::hit result;
+		if (!tree.closest_hit(r, max_t, result))
+		{
+			return false;
+		}
+
+		object = objects[result.primitive];
+		t = result.t;
+		return true;
+	}
+
+	bool line_of_sight(const sight_line &line) const
+	{
+		return !tree.any_hit(math::ray::between(line.from, line.to), 1.0f, [this, &line](std::uint32_t primitive)
+		{
+			return objects[primitive] != line.viewer && objects[primitive] != line.target;
+		});
+	}
+
+	//line_of_sight for a batch as parallel jobs, clear[i] is 1 where line i is unobstructed. Has to be called from a job_system worker.
+	void line_of_sight(const sight_line *lines, std::size_t count, std::uint8_t *clear, std::size_t lines_per_job = 256) const
+	{
+		TOCS_TRACE_SCOPE("line_of_sight");
+
+		threading::job_system::parallel_for(count, lines_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; ++i)
+			{
+				clear[i] = line_of_sight(lines[i]) ? 1 : 0;
+			}
+		});
+	}
+
+	//Overlap queries append the ids of matching objects to out.
+	void query_aabb(const math::vector3 &min, const math::vector3 &max, std::vector<game_object_id> &out) const
+	{
+		std::vector<std::uint32_t> indices;
+		tree.query_aabb(min, max, indices);
+		append_objects(indices, out);
+	}
+
+	void query_sphere(const math::vector3 &center, float radius, std::vector<game_object_id> &out) const
+	{
+		std::vector<std::uint32_t> indices;
+		tree.query_sphere(center, radius, indices);
+		append_objects(indices, out);
+	}
+
+private:
+	void append_objects(const std::vector<std::uint32_t> &indices, std::vector<game_object_id> &out) const
+	{
+		for (std::uint32_t i : indices)
+		{
+			out.push_back(objects[i]);
+		}
+	}
+};
+
+}
+}
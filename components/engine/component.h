@@ -2,9 +2,19 @@
 #include <type_traits>
 #include "state.h"
 #include "gametime.h"
+#include "snapshot.h"
+#include "diff_stream.h"
 #include <threading/pool.h>
+#include <threading/counters.h>
+#include <threading/worker.h>
 #include <core/asserts.h>
+#include <core/hash.h>
 #include <core/static_storage.h>
+#include <core/frame_arena.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
 #include <mutex>
 #include <shared_mutex>
 #include <unordered_map>
@@ -16,91 +26,1229 @@ namespace engine {
 class game_object;
 using game_object_id = std::size_t;
 
+//A diff addressed to one object's component, what apply_diffs takes in bulk.
+class object_diff
+{
+public:
+	game_object_id object;
+	state_object_diff diff;
+};
+
 template <class comp_type>
 class component_mapping
 {
 	//Todo, can we do map access lockelessly?
-	std::shared_mutex map_mutex;
+	mutable std::shared_mutex map_mutex;
 	std::unordered_map<game_object_id, threading::concurrent_pool_handle<comp_type>> obj_to_comp;
+
+	//The same components sorted by id, rebuilt by the first ordered walk after components are added or removed. The hash map's order depends
+	//on the history of inserts, this doesn't.
+	mutable std::mutex ordered_mutex;
+	mutable std::atomic<bool> ordered_valid{ false };
+	mutable std::vector<std::pair<game_object_id, comp_type *>> ordered;
+
+	std::unique_lock<std::shared_mutex> lock_map()
+	{
+		std::unique_lock<std::shared_mutex> lock(map_mutex, std::defer_lock);
+		if (!lock.try_lock())
+		{
+			TOCS_COUNT(component_lock_waits, 1);
+			lock.lock();
+		}
+		return lock;
+	}
+
+	//These are called with map_mutex held exclusively, after inserting or erasing. Ids past the end of a valid index are appended and erased
+	//ids compacted out. New objects get the newest ids, so frames that spawn and delete objects don't sort every component again.
+	void invalidate_ordered()
+	{
+		ordered_valid.store(false, std::memory_order_relaxed);
+	}
+
+	void add_ordered(game_object_id id, comp_type *comp)
+	{
+		if (!ordered.empty() && ordered.back().first > id)
+		{
+			invalidate_ordered();
+		}
+		else if (ordered_valid.load(std::memory_order_relaxed))
+		{
+			ordered.emplace_back(id, comp);
+		}
+	}
+
+	//ids has to be sorted.
+	void remove_ordered(const game_object_id *ids, std::size_t count)
+	{
+		if (count == 0 || !ordered_valid.load(std::memory_order_relaxed))
+		{
+			return;
+		}
+
+		auto out = std::lower_bound(ordered.begin(), ordered.end(), ids[0], [](const std::pair<game_object_id, comp_type *> &comp, game_object_id id)
+		{
+			return comp.first < id;
+		});
+		std::size_t next = 0;
+		for (auto i = out; i != ordered.end(); ++i)
+		{
+			while (next < count && ids[next] < i->first)
+			{
+				++next;
+			}
+			if (next == count || ids[next] != i->first)
+			{
+				*out++ = *i;
+			}
+		}
+		ordered.erase(out, ordered.end());
+	}
+
+	//Callers hold map_mutex shared, so the map can't change under the rebuild and nothing rebuilds under a walk.
+	const std::vector<std::pair<game_object_id, comp_type *>> &ordered_components() const
+	{
+		if (!ordered_valid.load(std::memory_order_acquire))
+		{
+			std::lock_guard<std::mutex> lock(ordered_mutex);
+			if (!ordered_valid.load(std::memory_order_relaxed))
+			{
+				ordered.clear();
+				ordered.reserve(obj_to_comp.size());
+				for (auto &m : obj_to_comp)
+				{
+					ordered.emplace_back(m.first, &*m.second);
+				}
+				std::sort(ordered.begin(), ordered.end(), [](const std::pair<game_object_id, comp_type *> &a, const std::pair<game_object_id, comp_type *> &b)
+				{
+					return a.first < b.first;
+				});
+				ordered_valid.store(true, std::memory_order_release);
+			}
+		}
+		return ordered;
+	}
 public:
 
-	void match_allocations(const component_mapping<comp_type> &other_mapping, threading::concurrent_pool<comp_type> &component_pool)
+	//Allocates and frees components until this holds the same objects as other_mapping, calling changed(id) for each object added or removed.
+	template <class changed_func>
+	void match_allocations(const component_mapping<comp_type> &other_mapping, threading::concurrent_pool<comp_type> &component_pool, changed_func &&changed)
+	{
+		auto lock = lock_map();
+
+		core::frame_vector<std::pair<game_object_id, comp_type *>> created_objects;
+
+		for (auto &m : other_mapping.obj_to_comp)
+		{
+			auto i = obj_to_comp.find(m.first);
+
+			if (i == obj_to_comp.end())
+			{
+				//An object got created, match it
+				auto comp = component_pool.get_item(m.first);
+				obj_to_comp.insert(std::make_pair(m.first, comp));
+				created_objects.emplace_back(m.first, &*comp);
+			}
+		}
+
+		std::sort(created_objects.begin(), created_objects.end(), [](const std::pair<game_object_id, comp_type *> &a, const std::pair<game_object_id, comp_type *> &b)
+		{
+			return a.first < b.first;
+		});
+		for (auto &created : created_objects)
+		{
+			add_ordered(created.first, created.second);
+			changed(created.first);
+		}
+
+		//Collect deletions first, erasing while iterating the map would invalidate the loop.
+		core::frame_vector<game_object_id> deleted_objects;
+
+		for (auto &m : obj_to_comp)
+		{
+			auto i = other_mapping.obj_to_comp.find(m.first);
+
+			if (i == other_mapping.obj_to_comp.end())
+			{
+				//An object got deleted, match it
+				component_pool.return_item(m.second);
+				deleted_objects.push_back(m.first);
+			}
+		}
+
+		for (game_object_id id : deleted_objects)
+		{
+			obj_to_comp.erase(id);
+		}
+
+		std::sort(deleted_objects.begin(), deleted_objects.end());
+		remove_ordered(deleted_objects.data(), deleted_objects.size());
+		for (game_object_id id : deleted_objects)
+		{
+			changed(id);
+		}
+	}
+
+	//Returns every component to component_pool, used when the whole storage is replaced by a snapshot.
+	void clear(threading::concurrent_pool<comp_type> &component_pool)
+	{
+		auto lock = lock_map();
+
+		for (auto &m : obj_to_comp)
+		{
+			component_pool.return_item(m.second);
+		}
+		obj_to_comp.clear();
+		invalidate_ordered();
+	}
+
+	void assign(game_object_id id, threading::concurrent_pool_handle<comp_type> comp)
+	{
+		auto lock = lock_map();
+
+		check(obj_to_comp.find(id) == obj_to_comp.end());
+
+		obj_to_comp.emplace(std::make_pair(id, comp));
+		add_ordered(id, &*comp);
+	}
+
+	const comp_type *find(game_object_id id) const
+	{
+		std::shared_lock<std::shared_mutex> lock(map_mutex);
+
+		auto i = obj_to_comp.find(id);
+		return i == obj_to_comp.end() ? nullptr : &*i->second;
+	}
+
+	comp_type *find(game_object_id id)
+	{
+		std::shared_lock<std::shared_mutex> lock(map_mutex);
+
+		auto i = obj_to_comp.find(id);
+		return i == obj_to_comp.end() ? nullptr : &*i->second;
+	}
+
+	//Fills out[i] with the component of the object id_at(i) returns, allocating from component_pool for objects without one. The map is locked
+	//once for the whole batch rather than once per object, and grown up front for count more objects.
+	template <class id_func>
+	void find_or_assign(std::size_t count, id_func &&id_at, threading::concurrent_pool<comp_type> &component_pool, comp_type **out)
+	{
+		auto lock = lock_map();
+		obj_to_comp.reserve(obj_to_comp.size() + count);
+
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			game_object_id id = id_at(i);
+			auto found = obj_to_comp.find(id);
+			if (found == obj_to_comp.end())
+			{
+				found = obj_to_comp.emplace(id, component_pool.get_item(id)).first;
+				add_ordered(id, &*found->second);
+			}
+			out[i] = &*found->second;
+		}
+	}
+
+	//Returns id's component to component_pool, if it has one.
+	void remove(game_object_id id, threading::concurrent_pool<comp_type> &component_pool)
+	{
+		auto lock = lock_map();
+
+		auto i = obj_to_comp.find(id);
+		if (i != obj_to_comp.end())
+		{
+			component_pool.return_item(i->second);
+			obj_to_comp.erase(i);
+			remove_ordered(&id, 1);
+		}
+	}
+
+	//Calls func(id, component) for every component with the map locked for reading.
+	template <class func_type>
+	void for_each(func_type &&func) const
+	{
+		std::shared_lock<std::shared_mutex> lock(map_mutex);
+
+		for (auto &m : obj_to_comp)
+		{
+			func(m.first, *m.second);
+		}
+	}
+
+	//Calls func(id, component, other) for every component, other is other_mapping's component for the same object or nullptr.
+	//Both maps stay locked for the whole walk rather than once per lookup.
+	template <class func_type>
+	void for_each_matched(const component_mapping<comp_type> &other_mapping, func_type &&func) const
+	{
+		std::shared_lock<std::shared_mutex> lock(map_mutex);
+		std::shared_lock<std::shared_mutex> other_lock(other_mapping.map_mutex);
+
+		for (auto &m : obj_to_comp)
+		{
+			auto i = other_mapping.obj_to_comp.find(m.first);
+			func(m.first, *m.second, i == other_mapping.obj_to_comp.end() ? nullptr : &*i->second);
+		}
+	}
+
+	//for_each in id order.
+	template <class func_type>
+	void for_each_ordered(func_type &&func) const
+	{
+		std::shared_lock<std::shared_mutex> lock(map_mutex);
+
+		for (auto &m : ordered_components())
+		{
+			func(m.first, *m.second);
+		}
+	}
+
+	template <class func_type>
+	void for_each_matched_ordered(const component_mapping<comp_type> &other_mapping, func_type &&func) const
+	{
+		std::shared_lock<std::shared_mutex> lock(map_mutex);
+		std::shared_lock<std::shared_mutex> other_lock(other_mapping.map_mutex);
+
+		for (auto &m : ordered_components())
+		{
+			auto i = other_mapping.obj_to_comp.find(m.first);
+			func(m.first, *m.second, i == other_mapping.obj_to_comp.end() ? nullptr : &*i->second);
+		}
+	}
+
+	//Runs func(id, component) over the components in id order, split into ranges of grain as parallel jobs. Which components share a job is
+	//fixed by their ids, not by scheduling. The map is locked for reading throughout, func can write components but not add or remove them.
+	template <class func_type>
+	void parallel_for_each(std::size_t grain, func_type &&func) const
+	{
+		std::shared_lock<std::shared_mutex> lock(map_mutex);
+
+		const std::vector<std::pair<game_object_id, comp_type *>> &comps = ordered_components();
+		threading::job_system::parallel_for(comps.size(), grain, [&comps, &func](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; ++i)
+			{
+				func(comps[i].first, *comps[i].second);
+			}
+		});
+	}
+
+	//Calls func(pairs, count) once with every (id, component) pair in id order, the map locked for reading throughout.
+	template <class func_type>
+	void with_ordered(func_type &&func) const
+	{
+		std::shared_lock<std::shared_mutex> lock(map_mutex);
+
+		const std::vector<std::pair<game_object_id, comp_type *>> &comps = ordered_components();
+		func(comps.data(), comps.size());
+	}
+
+	//parallel_reduce over the components in id order, map(pairs, count) gets one range of (id, component) pairs at a time.
+	template <class T, class map_func, class combine_func>
+	T parallel_reduce(std::size_t grain, T identity, map_func &&map, combine_func &&combine) const
+	{
+		std::shared_lock<std::shared_mutex> lock(map_mutex);
+
+		const std::vector<std::pair<game_object_id, comp_type *>> &comps = ordered_components();
+		return threading::job_system::parallel_reduce(comps.size(), grain, identity, [&comps, &map](std::size_t begin, std::size_t end)
+		{
+			return map(comps.data() + begin, end - begin);
+		}, std::forward<combine_func>(combine));
+	}
+};
+
+namespace detail
+{
+
+//Snapshot columns come from a component's state_object metadata, components that aren't state_objects only save which objects have them.
+template <class comp_type, class = void>
+class has_state_metadata : public std::false_type {};
+
+template <class comp_type>
+class has_state_metadata<comp_type, decltype((void)comp_type::meta_data.values)> : public std::true_type {};
+
+template <class comp_type, class = void>
+class has_component_name : public std::false_type {};
+
+template <class comp_type>
+class has_component_name<comp_type, decltype((void)comp_type::component_name)> : public std::true_type {};
+
+template <class comp_type, bool = has_state_metadata<comp_type>::value>
+class component_snapshot
+{
+public:
+	static std::uint64_t schema_hash() { return empty_schema_hash; }
+	static std::uint32_t field_count() { return 0; }
+	static void write(snapshot_writer &, const comp_type *const *, std::size_t) {}
+	static state_schema_remap read(const snapshot_block_view &, comp_type *const *, std::size_t) { return state_schema_remap(); }
+
+	static bool write_diff(diff_stream_writer &, game_object_id, const unsigned char *, const unsigned char *) { return false; }
+	static bool apply_diff(comp_type &, std::uint64_t, const unsigned char *, std::size_t, const state_schema_remap &) { return false; }
+
+	static std::size_t packed_size() { return 0; }
+	static void pack(const comp_type &, unsigned char *) {}
+};
+
+template <class comp_type>
+class component_snapshot<comp_type, true>
+{
+public:
+	static std::uint64_t schema_hash() { return comp_type::meta_data.schema_hash; }
+	static std::uint32_t field_count() { return static_cast<std::uint32_t> (comp_type::meta_data.values.size()); }
+
+	//One column per registered value, a value at a time so each column is written front to back.
+	static void write(snapshot_writer &writer, const comp_type *const *comps, std::size_t count)
+	{
+		for (auto &value : comp_type::meta_data.values)
+		{
+			std::size_t size = value->data_size();
+			unsigned char *column = writer.add_column(value->value_name.c_str(), value->field_id, static_cast<std::uint32_t> (size));
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				value->serialize(comps[i], column + i * size);
+			}
+		}
+	}
+
+	//Columns are matched to values by field id through a remap built once per block, values the snapshot doesn't have keep their defaults.
+	//Returns the remap so diffs recorded against the same schema can use it.
+	static state_schema_remap read(const snapshot_block_view &block, comp_type *const *comps, std::size_t count)
+	{
+		std::uint32_t field_count = block.field_count();
+		core::frame_vector<std::uint32_t> field_ids(field_count);
+		core::frame_vector<std::uint32_t> sizes(field_count);
+		for (std::uint32_t f = 0; f < field_count; ++f)
+		{
+			field_ids[f] = block.field(f).field_id;
+			sizes[f] = block.field(f).value_size;
+		}
+
+		state_schema_remap remap = comp_type::meta_data.make_remap(block.schema_hash(), field_ids.data(), sizes.data(), field_count);
+
+		for (std::uint32_t f = 0; f < field_count; ++f)
+		{
+			int target = remap.identity ? static_cast<int> (f) : remap.entries[f].target;
+			if (target < 0)
+			{
+				continue;
+			}
+
+			const unsigned char *column = static_cast<const unsigned char *> (block.column(f));
+			const state_value_layout &layout = comp_type::meta_data.layouts[target];
+			if (layout.raw_copy)
+			{
+				copy_column(comps, count, layout.offset, column, layout.size);
+				continue;
+			}
+
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				comp_type::meta_data.apply_value(reinterpret_cast<unsigned char *> (comps[i]), target, column + i * sizes[f]);
+			}
+		}
+		return remap;
+	}
+
+	//Writes id, a bit for each value whose packed bytes differ from previous_packed, the byte count and those values in index order, the
+	//layout apply_diff reads. Every value goes in when previous_packed is null. Changed flags aren't used, they stay set once written and say
+	//nothing about what differs from the previous frame. Returns false without writing anything if nothing differs.
+	static bool write_diff(diff_stream_writer &out, game_object_id id, const unsigned char *packed, const unsigned char *previous_packed)
+	{
+		const std::vector<state_value_layout> &layouts = comp_type::meta_data.layouts;
+
+		std::uint64_t changed_values = 0;
+		std::uint32_t diff_size = 0;
+		std::size_t offset = 0;
+		for (std::size_t i = 0; i < layouts.size(); ++i)
+		{
+			if (!previous_packed || std::memcmp(packed + offset, previous_packed + offset, layouts[i].size) != 0)
+			{
+				changed_values |= std::uint64_t(1) << i;
+				diff_size += layouts[i].size;
+			}
+			offset += layouts[i].size;
+		}
+
+		if (changed_values == 0)
+		{
+			return false;
+		}
+
+		out.write(static_cast<std::uint64_t> (id));
+		out.write(changed_values);
+		out.write(diff_size);
+
+		offset = 0;
+		for (std::size_t i = 0; i < layouts.size(); ++i)
+		{
+			if (changed_values & (std::uint64_t(1) << i))
+			{
+				out.write_bytes(packed + offset, layouts[i].size);
+			}
+			offset += layouts[i].size;
+		}
+		return true;
+	}
+
+	static bool apply_diff(comp_type &comp, std::uint64_t changed_values, const unsigned char *data, std::size_t size, const state_schema_remap &remap)
+	{
+		return comp_type::meta_data.apply_diff(comp, changed_values, data, size, remap);
+	}
+
+	//Every value serialized back to back. Unlike the component's memory this has no padding or changed flags, so equal state packs equal.
+	static std::size_t packed_size()
+	{
+		std::size_t size = 0;
+		for (const state_value_layout &layout : comp_type::meta_data.layouts)
+		{
+			size += layout.size;
+		}
+		return size;
+	}
+
+	static void pack(const comp_type &comp, unsigned char *data)
+	{
+		comp_type::meta_data.serialize_values(comp, data);
+	}
+
+private:
+	//A plain copy column straight into its value in every component, the size fixed for the whole loop so each copy is a single move.
+	template <std::size_t size>
+	static void copy_column(comp_type *const *comps, std::size_t count, std::uint32_t offset, const unsigned char *column)
+	{
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			std::memcpy(reinterpret_cast<unsigned char *> (comps[i]) + offset, column + i * size, size);
+		}
+	}
+
+	static void copy_column(comp_type *const *comps, std::size_t count, std::uint32_t offset, const unsigned char *column, std::uint32_t size)
+	{
+		switch (size)
+		{
+		case 4:
+			copy_column<4>(comps, count, offset, column);
+			break;
+		case 8:
+			copy_column<8>(comps, count, offset, column);
+			break;
+		case 12:
+			copy_column<12>(comps, count, offset, column);
+			break;
+		case 16:
+			copy_column<16>(comps, count, offset, column);
+			break;
+		default:
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				std::memcpy(reinterpret_cast<unsigned char *> (comps[i]) + offset, column + i * size, size);
+			}
+			break;
+		}
+	}
+};
+
+}
+
+class base_component_storage
+{
+public:
+	virtual ~base_component_storage() {}
+
+	virtual void prepare_frame(const base_component_storage &prev_storage) = 0;
+
+	//The component's registered name, see component_storage::block_name.
+	virtual const char *type_name() const = 0;
+
+	//Saves every component as one block, objects in id order.
+	virtual void write_snapshot(snapshot_writer &writer) const = 0;
+
+	//Replaces every component with the ones in block.
+	virtual void read_snapshot(const snapshot_block_view &block) = 0;
+
+	//Drops every component, for snapshots that have no block for this storage.
+	virtual void clear() = 0;
+
+	//Records what changed since previous, the same storage a frame earlier: objects that lost or gained the component, then a diff of the values
+	//that differ from previous for every component, all values for gained ones. Everything is in id order so the same frame always encodes the same way.
+	virtual void write_frame_diffs(const base_component_storage &previous, diff_stream_writer &out) const = 0;
+
+	//Replays write_frame_diffs output on top of this storage, reading diffs with the schema of the last snapshot read. Returns false if the data is corrupt.
+	virtual bool read_frame_diffs(diff_stream_reader &in) = 0;
+
+	//Hash of every object id and its packed values in id order, see all_component_storage::checksum. Has to be called from a job_system worker.
+	virtual std::uint64_t checksum() const = 0;
+
+	//128 bit hash of the same data, updated incrementally, see all_component_storage::state_hash. Has to be called from a job_system worker.
+	virtual core::hash::digest128 state_hash() const = 0;
+
+	//Makes for_each and for_each_matched walk components in id order instead of hash map order.
+	void set_ordered_iteration(bool ordered) { ordered_iteration = ordered; }
+	bool is_ordered_iteration() const { return ordered_iteration; }
+
+protected:
+	bool ordered_iteration = false;
+};
+
+template <class comp_type>
+class component_storage : public base_component_storage
+{
+	threading::concurrent_pool<comp_type> storage;
+	component_mapping<comp_type> mapping;
+
+	//Schema of the last snapshot read, frame diffs that follow it were packed the same way.
+	state_schema_remap saved_schema;
+
+	//state_hash splits objects into pages by id, 2^hash_page_bits ids to a page, and keeps each page's hash from the last call, hash_pages[i]
+	//holding page hash_page_base + i. Every call that can write components or add and remove them marks the pages it touched in dirty_pages,
+	//state_hash only reads the components of marked pages.
+	static constexpr std::size_t hash_page_bits = 8;
+
+	//Past this many separate dirty ranges every page is rehashed, so storages nobody hashes don't grow the list forever.
+	static constexpr std::size_t max_dirty_ranges = 1024;
+
+	class hash_page
+	{
+	public:
+		core::hash::digest128 hash;
+		bool has_objects = false;
+		bool stale = true;
+	};
+
+	mutable std::mutex hash_mutex;
+	mutable std::vector<hash_page> hash_pages;
+	mutable std::size_t hash_page_base = 0;
+
+	//Inclusive ranges of page numbers, guarded by dirty_mutex since parallel_for_each jobs mark them concurrently.
+	mutable std::mutex dirty_mutex;
+	mutable std::vector<std::pair<std::size_t, std::size_t>> dirty_pages;
+	mutable bool all_pages_dirty = true;
+
+	friend class all_component_storage;
+public:
+	component_storage()
+	{
+	}
+
+	void prepare_frame(const base_component_storage &prev_component_storage_untyped) override
+	{
+		const component_storage<comp_type> *prev_storage = dynamic_cast<const component_storage<comp_type> *> (&prev_component_storage_untyped);
+
+		check(prev_storage != nullptr);
+		//Setup the next frame by matching any existing components to the prev frame, avoiding new allocations if we don't need it.
+		core::frame_vector<game_object_id> changed;
+		mapping.match_allocations(prev_storage->mapping, storage, [&changed](game_object_id id)
+		{
+			changed.push_back(id);
+		});
+		mark_hash_dirty(changed.data(), changed.size());
+	}
+
+	const char *type_name() const override
+	{
+		return block_name();
+	}
+
+	//Every component type declares a component_name, e.g. static constexpr const char *component_name = "body";. It keys the type's snapshot
+	//block and replay section and orders storages in checksums, so it has to stay the same across builds and compilers, unlike typeid names.
+	static const char *block_name()
+	{
+		static_assert(detail::has_component_name<comp_type>::value, "components need a static component_name");
+		return comp_type::component_name;
+	}
+
+	void write_snapshot(snapshot_writer &writer) const override
+	{
+		core::frame_vector<std::pair<game_object_id, const comp_type *>> comps;
+		mapping.for_each([&comps](game_object_id id, const comp_type &comp)
+		{
+			comps.emplace_back(id, &comp);
+		});
+		std::sort(comps.begin(), comps.end(), [](const std::pair<game_object_id, const comp_type *> &a, const std::pair<game_object_id, const comp_type *> &b)
+		{
+			return a.first < b.first;
+		});
+
+		core::frame_vector<std::uint64_t> ids(comps.size());
+		core::frame_vector<const comp_type *> ordered(comps.size());
+		for (std::size_t i = 0; i < comps.size(); ++i)
+		{
+			ids[i] = comps[i].first;
+			ordered[i] = comps[i].second;
+		}
+
+		writer.begin_block(type_name(), detail::component_snapshot<comp_type>::schema_hash(), ids.size(), detail::component_snapshot<comp_type>::field_count(), ids.data());
+		detail::component_snapshot<comp_type>::write(writer, ordered.data(), ordered.size());
+	}
+
+	void read_snapshot(const snapshot_block_view &block) override
+	{
+		clear();
+
+		std::size_t count = static_cast<std::size_t> (block.object_count());
+		const std::uint64_t *ids = block.objects();
+
+		//Every component is allocated in one batch under one lock, then filled a column at a time.
+		core::frame_vector<comp_type *> comps(count);
+		mapping.find_or_assign(count, [ids](std::size_t i) { return static_cast<game_object_id> (ids[i]); }, storage, comps.data());
+
+		saved_schema = detail::component_snapshot<comp_type>::read(block, comps.data(), count);
+	}
+
+	void clear() override
+	{
+		mapping.clear(storage);
+		mark_all_hash_dirty();
+	}
+
+	void write_frame_diffs(const base_component_storage &previous_untyped, diff_stream_writer &out) const override
+	{
+		const component_storage<comp_type> *previous = dynamic_cast<const component_storage<comp_type> *> (&previous_untyped);
+		check(previous != nullptr);
+
+		core::frame_vector<std::pair<game_object_id, const comp_type *>> comps;
+		core::frame_vector<const comp_type *> previous_comps;
+		core::frame_vector<game_object_id> added;
+		core::frame_vector<game_object_id> removed;
+
+		mapping.for_each_matched(previous->mapping, [&](game_object_id id, const comp_type &comp, const comp_type *previous_comp)
+		{
+			comps.emplace_back(id, &comp);
+			previous_comps.push_back(previous_comp);
+			if (!previous_comp)
+			{
+				added.push_back(id);
+			}
+		});
+		previous->mapping.for_each_matched(mapping, [&](game_object_id id, const comp_type &, const comp_type *current_comp)
+		{
+			if (!current_comp)
+			{
+				removed.push_back(id);
+			}
+		});
+
+		core::frame_vector<std::uint32_t> order(comps.size());
+		for (std::size_t i = 0; i < order.size(); ++i)
+		{
+			order[i] = static_cast<std::uint32_t> (i);
+		}
+		std::sort(order.begin(), order.end(), [&comps](std::uint32_t a, std::uint32_t b)
+		{
+			return comps[a].first < comps[b].first;
+		});
+		std::sort(added.begin(), added.end());
+		std::sort(removed.begin(), removed.end());
+
+		write_ids(out, removed);
+		write_ids(out, added);
+
+		//Values are compared packed, against the same object's component a frame earlier.
+		std::size_t value_size = detail::component_snapshot<comp_type>::packed_size();
+		core::frame_vector<unsigned char> packed(value_size);
+		core::frame_vector<unsigned char> previous_packed(value_size);
+
+		std::size_t count_at = out.reserve(sizeof(std::uint32_t));
+		std::uint32_t diff_count = 0;
+		for (std::uint32_t i : order)
+		{
+			const comp_type *previous_comp = previous_comps[i];
+			detail::component_snapshot<comp_type>::pack(*comps[i].second, packed.data());
+			if (previous_comp)
+			{
+				detail::component_snapshot<comp_type>::pack(*previous_comp, previous_packed.data());
+			}
+			diff_count += detail::component_snapshot<comp_type>::write_diff(out, comps[i].first, packed.data(), previous_comp ? previous_packed.data() : nullptr) ? 1 : 0;
+		}
+		out.patch(count_at, diff_count);
+	}
+
+	bool read_frame_diffs(diff_stream_reader &in) override
+	{
+		std::uint32_t removed_count = in.read<std::uint32_t>();
+		for (std::uint32_t i = 0; i < removed_count && !in.failed(); ++i)
+		{
+			remove(static_cast<game_object_id> (in.read<std::uint64_t>()));
+		}
+
+		std::uint32_t added_count = in.read<std::uint32_t>();
+		for (std::uint32_t i = 0; i < added_count && !in.failed(); ++i)
+		{
+			find_or_alloc(static_cast<game_object_id> (in.read<std::uint64_t>()));
+		}
+
+		std::uint32_t diff_count = in.read<std::uint32_t>();
+		for (std::uint32_t i = 0; i < diff_count && !in.failed(); ++i)
+		{
+			game_object_id id = static_cast<game_object_id> (in.read<std::uint64_t>());
+			std::uint64_t changed_values = in.read<std::uint64_t>();
+			std::uint32_t size = in.read<std::uint32_t>();
+			const unsigned char *data = in.read_bytes(size);
+			if (!data || !detail::component_snapshot<comp_type>::apply_diff(find_or_alloc(id), changed_values, data, size, saved_schema))
+			{
+				return false;
+			}
+		}
+		return !in.failed();
+	}
+
+	const comp_type *find(game_object_id id) const
+	{
+		return mapping.find(id);
+	}
+
+	//Component to write, or nullptr if id has none. Marks its page for state_hash, so writes through the pointer are seen up to the next
+	//state_hash call, look it up again after that.
+	comp_type *find_for_write(game_object_id id)
+	{
+		comp_type *comp = mapping.find(id);
+		if (comp)
+		{
+			mark_hash_dirty(id, id);
+		}
+		return comp;
+	}
+
+	template <class func_type>
+	void for_each(func_type &&func) const
+	{
+		if (ordered_iteration)
+		{
+			mapping.for_each_ordered(std::forward<func_type>(func));
+		}
+		else
+		{
+			mapping.for_each(std::forward<func_type>(func));
+		}
+	}
+
+	template <class func_type>
+	void for_each_matched(const component_storage<comp_type> &other_storage, func_type &&func) const
+	{
+		if (ordered_iteration)
+		{
+			mapping.for_each_matched_ordered(other_storage.mapping, std::forward<func_type>(func));
+		}
+		else
+		{
+			mapping.for_each_matched(other_storage.mapping, std::forward<func_type>(func));
+		}
+	}
+
+	//Updates components as parallel jobs of grain components each, always in id order and split the same way whatever the worker count.
+	//func(id, component) can write its component, every page it visits is marked for state_hash. Has to be called from a job_system worker.
+	template <class func_type>
+	void parallel_for_each(std::size_t grain, func_type &&func)
+	{
+		mapping.with_ordered([this, grain, &func](const std::pair<game_object_id, comp_type *> *comps, std::size_t count)
+		{
+			threading::job_system::parallel_for(count, grain, [this, comps, &func](std::size_t begin, std::size_t end)
+			{
+				for (std::size_t i = begin; i < end; ++i)
+				{
+					func(comps[i].first, *comps[i].second);
+				}
+				mark_hash_dirty(comps[begin].first, comps[end - 1].first);
+			});
+		});
+	}
+
+	template <class func_type>
+	void parallel_for_each(std::size_t grain, func_type &&func) const
+	{
+		mapping.parallel_for_each(grain, [&func](game_object_id id, const comp_type &comp)
+		{
+			func(id, comp);
+		});
+	}
+
+	//Deterministic parallel reduction over the components, see job_system::parallel_reduce. map(pairs, count) gets one range of
+	//(id, component pointer) pairs in id order.
+	template <class T, class map_func, class combine_func>
+	T parallel_reduce(std::size_t grain, T identity, map_func &&map, combine_func &&combine) const
+	{
+		return mapping.parallel_reduce(grain, identity, std::forward<map_func>(map), std::forward<combine_func>(combine));
+	}
+
+	//Calls func(pairs, count) once with every (id, component pointer) pair in id order, the storage locked for reading throughout. func
+	//mustn't add or remove components.
+	template <class func_type>
+	void with_ordered(func_type &&func) const
 	{
-		std::unique_lock lock(map_mutex);
+		mapping.with_ordered(std::forward<func_type>(func));
+	}
 
-		for (auto &m : other_mapping.obj_to_comp)
+	std::uint64_t checksum() const override
+	{
+		//Ranges are hashed as parallel jobs and their hashes combined in order, so the result doesn't depend on how the jobs ran.
+		static constexpr std::size_t comps_per_job = 1024;
+		std::size_t value_size = detail::component_snapshot<comp_type>::packed_size();
+		std::size_t stride = sizeof(std::uint64_t) + value_size;
+
+		return mapping.parallel_reduce(comps_per_job, core::hash::hash64(nullptr, 0), [stride](const std::pair<game_object_id, comp_type *> *comps, std::size_t count)
 		{
-			auto i = obj_to_comp.find(m.first);
+			core::frame_vector<unsigned char> packed(count * stride);
+			unsigned char *out = packed.data();
+			for (std::size_t i = 0; i < count; ++i, out += stride)
+			{
+				std::uint64_t id = static_cast<std::uint64_t> (comps[i].first);
+				std::memcpy(out, &id, sizeof(id));
+				detail::component_snapshot<comp_type>::pack(*comps[i].second, out + sizeof(id));
+			}
+			return core::hash::hash64(packed.data(), packed.size());
+		}, [](std::uint64_t a, std::uint64_t b)
+		{
+			return core::hash::combine(a, b);
+		});
+	}
 
-			if (i == obj_to_comp.end())
+	//Pages nothing marked since the last call keep their hash without their components being read, the rest are packed and hashed again, a job
+	//to every few pages. Writes through a component reference held from before the last call aren't seen, get one from find_for_write instead.
+	//As long as they are, the result depends only on the components, not on what was cached, and debug builds check that against a full rehash.
+	core::hash::digest128 state_hash() const override
+	{
+		static constexpr std::size_t pages_per_job = 8;
+		std::lock_guard<std::mutex> lock(hash_mutex);
+
+		std::vector<std::pair<std::size_t, std::size_t>> dirty;
+		bool all_dirty;
+		{
+			std::lock_guard<std::mutex> dirty_lock(dirty_mutex);
+			dirty.swap(dirty_pages);
+			all_dirty = all_pages_dirty;
+			all_pages_dirty = false;
+		}
+
+		core::hash::digest128 result = core::hash::hash128(nullptr, 0);
+		mapping.with_ordered([this, &result, &dirty, all_dirty](const std::pair<game_object_id, comp_type *> *comps, std::size_t count)
+		{
+			if (count == 0)
 			{
-				//An object got created, match it
-				obj_to_comp.insert(std::make_pair(m.first, component_pool.get_item(m.first)));
+				hash_pages.clear();
+				return;
+			}
+
+			std::size_t first_page = comps[0].first >> hash_page_bits;
+			std::size_t page_count = (comps[count - 1].first >> hash_page_bits) - first_page + 1;
+
+			//Line the cache up with this call's pages, pages that shift keep their hashes and new ones start stale.
+			if (first_page > hash_page_base)
+			{
+				hash_pages.erase(hash_pages.begin(), hash_pages.begin() + std::min(first_page - hash_page_base, hash_pages.size()));
+			}
+			else if (first_page < hash_page_base)
+			{
+				hash_pages.insert(hash_pages.begin(), std::min(hash_page_base - first_page, page_count), hash_page());
+			}
+			hash_page_base = first_page;
+			hash_pages.resize(page_count);
+
+			for (const std::pair<std::size_t, std::size_t> &range : dirty)
+			{
+				std::size_t last_page = first_page + page_count - 1;
+				for (std::size_t p = std::max(range.first, first_page); p <= std::min(range.second, last_page); ++p)
+				{
+					hash_pages[p - first_page].stale = true;
+				}
+			}
+
+			core::frame_vector<std::size_t> stale;
+			for (std::size_t p = 0; p < page_count; ++p)
+			{
+				if (all_dirty || hash_pages[p].stale)
+				{
+					stale.push_back(p);
+				}
+			}
+
+			const std::pair<game_object_id, comp_type *> *comps_end = comps + count;
+			threading::job_system::parallel_for(stale.size(), pages_per_job, [this, &stale, comps, comps_end, first_page](std::size_t begin, std::size_t end)
+			{
+				auto id_less = [](const std::pair<game_object_id, comp_type *> &comp, game_object_id id)
+				{
+					return comp.first < id;
+				};
+
+				for (std::size_t i = begin; i < end; ++i)
+				{
+					std::size_t p = stale[i];
+					const std::pair<game_object_id, comp_type *> *page_begin = std::lower_bound(comps, comps_end, (first_page + p) << hash_page_bits, id_less);
+					const std::pair<game_object_id, comp_type *> *page_end = std::lower_bound(page_begin, comps_end, (first_page + p + 1) << hash_page_bits, id_less);
+					update_hash_page(hash_pages[p], page_begin, static_cast<std::size_t> (page_end - page_begin));
+				}
+			});
+
+			for (const hash_page &page : hash_pages)
+			{
+				if (page.has_objects)
+				{
+					result = core::hash::combine(result, page.hash);
+				}
 			}
+
+#ifndef NDEBUG
+			//A write that bypassed the dirty pages fails here instead of showing up as a desync against another machine.
+			check(result == hash_all_pages(comps, count));
+#endif
+		});
+		return result;
+	}
+
+	//Applies every diff to its object's component, adding the component where the object has none. Components are all looked up first so
+	//the apply loop only touches component memory. Returns false if any diff is malformed, the ones before it stay applied.
+	bool apply_diffs(const object_diff *diffs, std::size_t count)
+	{
+		core::frame_vector<comp_type *> comps(count);
+		mapping.find_or_assign(count, [diffs](std::size_t i) { return diffs[i].object; }, storage, comps.data());
+
+		core::frame_vector<game_object_id> ids(count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			ids[i] = diffs[i].object;
 		}
+		mark_hash_dirty(ids.data(), ids.size());
 
-		for (auto &m : obj_to_comp)
+		bool valid = true;
+		for (std::size_t i = 0; i < count; ++i)
 		{
-			auto i = other_mapping.obj_to_comp.find(m.first);
+			const state_object_diff &diff = diffs[i].diff;
+			valid = comp_type::meta_data.apply_diff(*comps[i], diff.changed_values.to_ullong(), diff.value_memory.data(), diff.value_memory.size()) && valid;
+		}
+		return valid;
+	}
 
-			if (i == other_mapping.obj_to_comp.end())
+	//A single packed diff, for diffs that arrive one at a time off the network. Adds the component if id has none.
+	bool apply_diff(game_object_id id, std::uint64_t changed_values, const unsigned char *data, std::size_t size)
+	{
+		return comp_type::meta_data.apply_diff(find_or_alloc(id), changed_values, data, size);
+	}
+
+	void remove(game_object_id id)
+	{
+		mapping.remove(id, storage);
+		mark_hash_dirty(id, id);
+	}
+
+private:
+
+	threading::concurrent_pool_handle<comp_type> alloc_component(game_object_id id)
+	{
+		auto comp = storage.get_item(id);
+		mapping.assign(id, comp);
+		mark_hash_dirty(id, id);
+		return comp;
+	}
+
+	comp_type &find_or_alloc(game_object_id id)
+	{
+		comp_type *comp = mapping.find(id);
+		if (!comp)
+		{
+			return *alloc_component(id);
+		}
+		mark_hash_dirty(id, id);
+		return *comp;
+	}
+
+	//Marks the pages holding ids first to last as changed for state_hash.
+	void mark_hash_dirty(game_object_id first, game_object_id last)
+	{
+		std::lock_guard<std::mutex> lock(dirty_mutex);
+		add_dirty_pages(first >> hash_page_bits, last >> hash_page_bits);
+	}
+
+	void mark_hash_dirty(const game_object_id *ids, std::size_t count)
+	{
+		if (count == 0)
+		{
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(dirty_mutex);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			add_dirty_pages(ids[i] >> hash_page_bits, ids[i] >> hash_page_bits);
+		}
+	}
+
+	void mark_all_hash_dirty()
+	{
+		std::lock_guard<std::mutex> lock(dirty_mutex);
+		all_pages_dirty = true;
+		dirty_pages.clear();
+	}
+
+	//Called with dirty_mutex held. Ranges that touch the last one extend it, objects are mostly written in id order.
+	void add_dirty_pages(std::size_t first, std::size_t last)
+	{
+		if (all_pages_dirty)
+		{
+			return;
+		}
+
+		if (!dirty_pages.empty() && first <= dirty_pages.back().second + 1 && last + 1 >= dirty_pages.back().first)
+		{
+			dirty_pages.back().first = std::min(dirty_pages.back().first, first);
+			dirty_pages.back().second = std::max(dirty_pages.back().second, last);
+		}
+		else if (dirty_pages.size() < max_dirty_ranges)
+		{
+			dirty_pages.emplace_back(first, last);
+		}
+		else
+		{
+			all_pages_dirty = true;
+			dirty_pages.clear();
+		}
+	}
+
+	static void update_hash_page(hash_page &page, const std::pair<game_object_id, comp_type *> *comps, std::size_t count)
+	{
+		page.stale = false;
+		page.has_objects = count > 0;
+		if (count == 0)
+		{
+			return;
+		}
+
+		TOCS_COUNT(state_hash_pages, 1);
+		page.hash = hash_page_comps(comps, count);
+	}
+
+	//What state_hash returns for these components with nothing cached, comps being all of them in id order.
+	static core::hash::digest128 hash_all_pages(const std::pair<game_object_id, comp_type *> *comps, std::size_t count)
+	{
+		core::hash::digest128 result = core::hash::hash128(nullptr, 0);
+		for (std::size_t begin = 0; begin < count;)
+		{
+			std::size_t page = comps[begin].first >> hash_page_bits;
+			std::size_t end = begin + 1;
+			while (end < count && (comps[end].first >> hash_page_bits) == page)
 			{
-				//An object got deleted, match it
-				component_pool.return_item(m.second);
-				obj_to_comp.erase(m.first);
+				++end;
 			}
+
+			result = core::hash::combine(result, hash_page_comps(comps + begin, end - begin));
+			begin = end;
 		}
+		return result;
 	}
 
-	void assign(game_object_id id, threading::concurrent_pool_handle<comp_type> comp)
+	static core::hash::digest128 hash_page_comps(const std::pair<game_object_id, comp_type *> *comps, std::size_t count)
 	{
-		std::unique_lock lock(map_mutex);
+		static const std::size_t value_size = detail::component_snapshot<comp_type>::packed_size();
 
-		check(obj_to_comp.find(id) == obj_to_comp.end());
+		std::size_t stride = sizeof(std::uint64_t) + value_size;
+		core::frame_vector<unsigned char> packed(count * stride);
 
-		obj_to_comp.emplace(std::make_pair(id, comp));
+		unsigned char *out = packed.data();
+		for (std::size_t i = 0; i < count; ++i, out += stride)
+		{
+			std::uint64_t id = static_cast<std::uint64_t> (comps[i].first);
+			std::memcpy(out, &id, sizeof(id));
+			detail::component_snapshot<comp_type>::pack(*comps[i].second, out + sizeof(id));
+		}
+		return core::hash::hash128(packed.data(), packed.size());
 	}
-};
 
-class base_component_storage
-{
-public:
-	virtual ~base_component_storage() {}
+	static void write_ids(diff_stream_writer &out, const core::frame_vector<game_object_id> &ids)
+	{
+		out.write(static_cast<std::uint32_t> (ids.size()));
+		for (game_object_id id : ids)
+		{
+			out.write(static_cast<std::uint64_t> (id));
+		}
+	}
 
-	virtual void prepare_frame(const base_component_storage &prev_storage) = 0;
+	static base_component_storage *factory_func()
+	{
+		return new component_storage<comp_type>{};
+	}
 };
 
+//Read only access to one state type's values in a snapshot, in place, for readers and tools that don't load it into a world. Columns are
+//matched to the type's registered values by field id like read_snapshot, values the snapshot doesn't have come back as nullptr columns.
+//Valid as long as the snapshot_view's memory is.
 template <class comp_type>
-class component_storage : public base_component_storage
+class snapshot_component_view
 {
-	threading::concurrent_pool<comp_type> storage;
-	component_mapping<comp_type> mapping;
+	static_assert(detail::has_state_metadata<comp_type>::value, "snapshot_component_view reads state_object values");
+
+	snapshot_block_view block;
+	bool found;
+
+	//The block column holding each registered value, -1 where there is none.
+	std::vector<int> value_columns;
 public:
-	component_storage()
+	explicit snapshot_component_view(const snapshot_view &snapshot)
+		: found(snapshot.find_block(component_storage<comp_type>::block_name(), block))
+		, value_columns(comp_type::meta_data.values.size(), -1)
 	{
+		if (!found)
+		{
+			return;
+		}
+
+		std::uint32_t field_count = block.field_count();
+		core::frame_vector<std::uint32_t> field_ids(field_count);
+		core::frame_vector<std::uint32_t> sizes(field_count);
+		for (std::uint32_t f = 0; f < field_count; ++f)
+		{
+			field_ids[f] = block.field(f).field_id;
+			sizes[f] = block.field(f).value_size;
+		}
+
+		state_schema_remap remap = comp_type::meta_data.make_remap(block.schema_hash(), field_ids.data(), sizes.data(), field_count);
+		for (std::uint32_t f = 0; f < field_count; ++f)
+		{
+			int target = remap.identity ? static_cast<int> (f) : remap.entries[f].target;
+			if (target >= 0)
+			{
+				value_columns[target] = static_cast<int> (f);
+			}
+		}
 	}
 
-	void prepare_frame(const base_component_storage &prev_component_storage_untyped) override
-	{
-		const component_storage<comp_type> *prev_storage = dynamic_cast<const component_storage<comp_type> *> (&prev_component_storage_untyped);
+	//False if the snapshot has no block for comp_type.
+	bool valid() const { return found; }
 
-		check(prev_storage != nullptr);
-		//Setup the next frame by matching any existing components to the prev frame, avoiding new allocations if we don't need it.
-		mapping.match_allocations(prev_storage->mapping, storage);
+	std::size_t size() const { return found ? static_cast<std::size_t> (block.object_count()) : 0; }
+	const std::uint64_t *objects() const { return block.objects(); }
+
+	//Index of id in objects(), or -1 if it has no comp_type. Blocks are written in id order.
+	std::ptrdiff_t find(game_object_id id) const
+	{
+		const std::uint64_t *begin = objects();
+		const std::uint64_t *end = begin + size();
+		const std::uint64_t *i = std::lower_bound(begin, end, static_cast<std::uint64_t> (id));
+		return i != end && *i == id ? i - begin : -1;
 	}
 
-private:
+	//A registered value's serialized column, value_index in registration order, one value of the serialized size per object in objects() order.
+	const void *column(std::size_t value_index) const
+	{
+		int f = found ? value_columns[value_index] : -1;
+		return f >= 0 ? block.column(static_cast<std::uint32_t> (f)) : nullptr;
+	}
 
-	threading::concurrent_pool_handle<comp_type> alloc_component(game_object_id id)
+	//Typed, only for values whose serializer is a plain copy of a T, nullptr otherwise.
+	template <class T>
+	const T *column(std::size_t value_index) const
 	{
-		auto comp = storage.get_item(id);
-		mapping.assign(id, comp);
-		return comp;
+		const state_value_layout &layout = comp_type::meta_data.layouts[value_index];
+		return layout.raw_copy && layout.size == sizeof(T) ? static_cast<const T *> (column(value_index)) : nullptr;
 	}
 
-	static base_component_storage *factory_func()
+	//Copies the values of the object at index into comp, values the snapshot doesn't have are left alone.
+	void read(std::size_t index, comp_type &comp) const
 	{
-		return new component_storage<comp_type>{};
+		check(index < size());
+		for (std::size_t v = 0; v < value_columns.size(); ++v)
+		{
+			if (const unsigned char *values = static_cast<const unsigned char *> (column(v)))
+			{
+				std::size_t value_size = block.field(static_cast<std::uint32_t> (value_columns[v])).value_size;
+				comp_type::meta_data.apply_value(reinterpret_cast<unsigned char *> (&comp), static_cast<int> (v), values + index * value_size);
+			}
+		}
 	}
 };
 
@@ -109,6 +1257,9 @@ class all_component_storage
 	std::unordered_map<std::type_index, std::unique_ptr<base_component_storage>> component_storages;
 	static core::static_storage<std::vector<std::pair<std::type_index, std::function<base_component_storage *()>>>> storage_factories;
 
+	template <class comp_type>
+	friend class storage_factory_initializer;
+
 	template <class comp_type>
 	static void init_factory()
 	{
@@ -122,15 +1273,207 @@ public:
 		{
 			component_storages.emplace(fp.first, fp.second());
 		}
+
+#ifndef NDEBUG
+		//Two types under one name would read each other's snapshot blocks.
+		std::vector<std::string> names;
+		for (auto &pair : component_storages)
+		{
+			names.emplace_back(pair.second->type_name());
+		}
+		std::sort(names.begin(), names.end());
+		check(std::adjacent_find(names.begin(), names.end()) == names.end());
+#endif
 	}
 
 	template <class comp_type>
-	void alloc_component(game_object *obj)
+	comp_type &alloc_component(game_object_id id)
 	{
-		base_component_storage *base_storage = component_storages[std::type_index(typeid(comp_type))];
+		base_component_storage *base_storage = component_storages[std::type_index(typeid(comp_type))].get();
+		check(base_storage != nullptr);
 		component_storage<comp_type> *storage = static_cast<component_storage<comp_type> *> (base_storage);
 
-		storage->alloc_component(obj);
+		return *storage->alloc_component(id);
+	}
+
+	template <class comp_type>
+	bool apply_diffs(const object_diff *diffs, std::size_t count)
+	{
+		base_component_storage *base_storage = component_storages[std::type_index(typeid(comp_type))].get();
+		check(base_storage != nullptr);
+		return static_cast<component_storage<comp_type> *> (base_storage)->apply_diffs(diffs, count);
+	}
+
+	template <class comp_type>
+	const component_storage<comp_type> *find_storage() const
+	{
+		auto i = component_storages.find(std::type_index(typeid(comp_type)));
+		if (i == component_storages.end())
+		{
+			return nullptr;
+		}
+
+		return static_cast<const component_storage<comp_type> *> (i->second.get());
+	}
+
+	template <class comp_type>
+	component_storage<comp_type> *find_storage()
+	{
+		auto i = component_storages.find(std::type_index(typeid(comp_type)));
+		if (i == component_storages.end())
+		{
+			return nullptr;
+		}
+
+		return static_cast<component_storage<comp_type> *> (i->second.get());
+	}
+
+	//Component of type comp_type owned by the object in this state, or nullptr if it has none.
+	template <class comp_type>
+	const comp_type *find(game_object_id id) const
+	{
+		const component_storage<comp_type> *storage = find_storage<comp_type>();
+		return storage ? storage->find(id) : nullptr;
+	}
+
+	//The same for writing, see component_storage::find_for_write.
+	template <class comp_type>
+	comp_type *find_for_write(game_object_id id)
+	{
+		component_storage<comp_type> *storage = find_storage<comp_type>();
+		return storage ? storage->find_for_write(id) : nullptr;
+	}
+
+	void set_ordered_iteration(bool ordered)
+	{
+		for (auto &pair : component_storages)
+		{
+			pair.second->set_ordered_iteration(ordered);
+		}
+	}
+
+	//Hash of every component's state values, for lockstep peers and replays to compare frames by. Storages are folded in by type name rather than
+	//hash map order so equal states hash equal run to run. Has to be called from a job_system worker.
+	std::uint64_t checksum() const
+	{
+		core::frame_vector<const base_component_storage *> storages;
+		for (auto &pair : component_storages)
+		{
+			storages.push_back(pair.second.get());
+		}
+		std::sort(storages.begin(), storages.end(), [](const base_component_storage *a, const base_component_storage *b)
+		{
+			return std::strcmp(a->type_name(), b->type_name()) < 0;
+		});
+
+		std::uint64_t result = core::hash::hash64(nullptr, 0);
+		for (const base_component_storage *storage : storages)
+		{
+			result = core::hash::combine(result, core::hash::hash64(storage->type_name(), std::strlen(storage->type_name())));
+			result = core::hash::combine(result, storage->checksum());
+		}
+		return result;
+	}
+
+	//128 bit hash of every component's state values for desync detection. Storages hash as parallel jobs, each rehashing only the pages of
+	//objects whose components were written, added or removed since it was last hashed, so the cost follows how much of the state changed.
+	//Folded in by type name, unrelated to checksum's value. Has to be called from a job_system worker.
+	core::hash::digest128 state_hash() const
+	{
+		core::frame_vector<const base_component_storage *> storages;
+		for (auto &pair : component_storages)
+		{
+			storages.push_back(pair.second.get());
+		}
+		std::sort(storages.begin(), storages.end(), [](const base_component_storage *a, const base_component_storage *b)
+		{
+			return std::strcmp(a->type_name(), b->type_name()) < 0;
+		});
+
+		core::frame_vector<core::hash::digest128> hashes(storages.size());
+		threading::job_system::parallel_for(storages.size(), 1, [&storages, &hashes](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; ++i)
+			{
+				hashes[i] = storages[i]->state_hash();
+			}
+		});
+
+		core::hash::digest128 result = core::hash::hash128(nullptr, 0);
+		for (std::size_t i = 0; i < storages.size(); ++i)
+		{
+			result = core::hash::combine(result, core::hash::hash128(storages[i]->type_name(), std::strlen(storages[i]->type_name())));
+			result = core::hash::combine(result, hashes[i]);
+		}
+		return result;
+	}
+
+	//One block per storage.
+	void write_snapshot(snapshot_writer &writer) const
+	{
+		for (auto &pair : component_storages)
+		{
+			pair.second->write_snapshot(writer);
+		}
+	}
+
+	//Storages are matched to blocks by type name, a storage the snapshot has no block for ends up empty.
+	void read_snapshot(const snapshot_view &snapshot)
+	{
+		for (auto &pair : component_storages)
+		{
+			snapshot_block_view block;
+			if (snapshot.find_block(pair.second->type_name(), block))
+			{
+				pair.second->read_snapshot(block);
+			}
+			else
+			{
+				pair.second->clear();
+			}
+		}
+	}
+
+	//Every storage's write_frame_diffs output, each under its type name and byte count so readers can skip types they don't have.
+	void write_frame_diffs(const all_component_storage &previous, diff_stream_writer &out) const
+	{
+		out.write(static_cast<std::uint32_t> (component_storages.size()));
+		for (auto &pair : component_storages)
+		{
+			out.write_string(pair.second->type_name());
+			std::size_t size_at = out.reserve(sizeof(std::uint32_t));
+			pair.second->write_frame_diffs(*previous.component_storages.find(pair.first)->second, out);
+			out.patch(size_at, static_cast<std::uint32_t> (out.size() - size_at - sizeof(std::uint32_t)));
+		}
+	}
+
+	bool read_frame_diffs(diff_stream_reader &in)
+	{
+		std::uint32_t storage_count = in.read<std::uint32_t>();
+		for (std::uint32_t s = 0; s < storage_count && !in.failed(); ++s)
+		{
+			std::string name = in.read_string();
+			std::uint32_t size = in.read<std::uint32_t>();
+			const unsigned char *data = in.read_bytes(size);
+			if (!data)
+			{
+				return false;
+			}
+
+			for (auto &pair : component_storages)
+			{
+				if (name == pair.second->type_name())
+				{
+					diff_stream_reader block(data, size);
+					if (!pair.second->read_frame_diffs(block) || !block.at_end())
+					{
+						return false;
+					}
+					break;
+				}
+			}
+		}
+		return !in.failed();
 	}
 
 	void prepare_frame(const all_component_storage &previous)
@@ -162,7 +1505,10 @@ public:
 
 	component(game_object &object)
 		: object(&object)
-	{}
+	{
+		//Static members of templates only get instantiated when used, without this no storage is ever registered for comp_type.
+		(void)&factory_initer;
+	}
 
 	game_object &get_game_object() const { return *object; }
 };
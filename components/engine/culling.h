@@ -0,0 +1,92 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <core/asserts.h>
+#include <core/frame_arena.h>
+#include <math/culling.h>
+#include <threading/trace.h>
+#include <threading/worker.h>
+#include "presentation.h"
+
+namespace tocs {
+namespace engine {
+
+namespace detail
+{
+
+//Runs cull(begin, end, out) over ranges as jobs. Each job writes at its own range's offset in visible, then the ranges slide down into one ascending list.
+template <class cull_func>
+void cull_parallel(std::size_t count, std::vector<std::uint32_t> &visible, std::size_t objects_per_job, cull_func &&cull)
+{
+	visible.resize(count);
+
+	std::size_t chunk_count = (count + objects_per_job - 1) / objects_per_job;
+	core::frame_vector<std::size_t> chunk_visible(chunk_count);
+
+	threading::job_system::parallel_for(count, objects_per_job, [&](std::size_t begin, std::size_t end)
+	{
+		chunk_visible[begin / objects_per_job] = cull(begin, end, visible.data() + begin);
+	});
+
+	std::size_t total = 0;
+	for (std::size_t chunk = 0; chunk < chunk_count; ++chunk)
+	{
+		if (total != chunk * objects_per_job)
+		{
+			std::memmove(visible.data() + total, visible.data() + chunk * objects_per_job, chunk_visible[chunk] * sizeof(std::uint32_t));
+		}
+		total += chunk_visible[chunk];
+	}
+
+	visible.resize(total);
+}
+
+}
+
+//Indices of the spheres touching the frustum, ascending, culled as parallel jobs. Has to be called from a job_system worker.
+inline void cull_spheres(const math::frustum &f, math::sphere_lanes<const float> spheres, std::size_t count, std::vector<std::uint32_t> &visible, std::size_t objects_per_job = 16384)
+{
+	TOCS_TRACE_SCOPE("cull_spheres");
+
+	detail::cull_parallel(count, visible, objects_per_job, [&](std::size_t begin, std::size_t end, std::uint32_t *out)
+	{
+		return math::cull_spheres(f, spheres, begin, end, out);
+	});
+}
+
+inline void cull_aabbs(const math::frustum &f, math::aabb_lanes<const float> boxes, std::size_t count, std::vector<std::uint32_t> &visible, std::size_t objects_per_job = 16384)
+{
+	TOCS_TRACE_SCOPE("cull_aabbs");
+
+	detail::cull_parallel(count, visible, objects_per_job, [&](std::size_t begin, std::size_t end, std::uint32_t *out)
+	{
+		return math::cull_aabbs(f, boxes, begin, end, out);
+	});
+}
+
+//Culls a component type straight from its presentation buffer, which already holds it as SoA lanes. position_value is a vector3 and radius_value a float,
+//both registered with an interpolation so they're batched. visible indexes buffer.objects.
+template <class comp_type>
+void cull_spheres(const math::frustum &f, const presentation_buffer<comp_type> &buffer, int position_value, int radius_value, std::vector<std::uint32_t> &visible, std::size_t objects_per_job = 16384)
+{
+	math::sphere_lanes<const float> spheres{ buffer.lane(position_value, 0), buffer.lane(position_value, 1), buffer.lane(position_value, 2), buffer.lane(radius_value, 0) };
+	check(spheres.x && spheres.y && spheres.z && spheres.radius);
+
+	cull_spheres(f, spheres, buffer.size(), visible, objects_per_job);
+}
+
+//The same with center_value and extent_value as vector3 half extents.
+template <class comp_type>
+void cull_aabbs(const math::frustum &f, const presentation_buffer<comp_type> &buffer, int center_value, int extent_value, std::vector<std::uint32_t> &visible, std::size_t objects_per_job = 16384)
+{
+	math::aabb_lanes<const float> boxes{
+		buffer.lane(center_value, 0), buffer.lane(center_value, 1), buffer.lane(center_value, 2),
+		buffer.lane(extent_value, 0), buffer.lane(extent_value, 1), buffer.lane(extent_value, 2) };
+	check(boxes.center_x && boxes.center_y && boxes.center_z && boxes.extent_x && boxes.extent_y && boxes.extent_z);
+
+	cull_aabbs(f, boxes, buffer.size(), visible, objects_per_job);
+}
+
+}
+}
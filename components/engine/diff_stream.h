@@ -0,0 +1,114 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace tocs {
+namespace engine {
+
+//Little endian byte stream replay frames are encoded in. Writes append to a caller owned buffer so it can be reused frame to frame.
+class diff_stream_writer
+{
+	std::vector<unsigned char> *out;
+public:
+	explicit diff_stream_writer(std::vector<unsigned char> &out)
+		: out(&out)
+	{}
+
+	std::size_t size() const { return out->size(); }
+
+	void write_bytes(const void *data, std::size_t size)
+	{
+		const unsigned char *bytes = static_cast<const unsigned char *> (data);
+		out->insert(out->end(), bytes, bytes + size);
+	}
+
+	template <class T>
+	void write(const T &value)
+	{
+		write_bytes(&value, sizeof(T));
+	}
+
+	void write_string(const char *text)
+	{
+		std::uint32_t length = static_cast<std::uint32_t> (std::strlen(text));
+		write(length);
+		write_bytes(text, length);
+	}
+
+	//Space for a value whose size isn't known until later, filled in with patch.
+	std::size_t reserve(std::size_t size)
+	{
+		std::size_t at = out->size();
+		out->resize(at + size, 0);
+		return at;
+	}
+
+	template <class T>
+	void patch(std::size_t at, const T &value)
+	{
+		std::memcpy(out->data() + at, &value, sizeof(T));
+	}
+};
+
+//Reads a diff_stream_writer's output. Running off the end sets failed and reads zeroes from then on instead of touching anything past it.
+class diff_stream_reader
+{
+	const unsigned char *data;
+	std::size_t size;
+	std::size_t position;
+	bool failed_;
+public:
+	diff_stream_reader(const unsigned char *data, std::size_t size)
+		: data(data)
+		, size(size)
+		, position(0)
+		, failed_(false)
+	{}
+
+	bool failed() const { return failed_; }
+	bool at_end() const { return position == size; }
+	std::size_t remaining() const { return size - position; }
+
+	//Pointer to the next size bytes, or nullptr if there aren't that many left.
+	const unsigned char *read_bytes(std::size_t count)
+	{
+		if (failed_ || count > size - position)
+		{
+			failed_ = true;
+			return nullptr;
+		}
+
+		const unsigned char *result = data + position;
+		position += count;
+		return result;
+	}
+
+	template <class T>
+	T read()
+	{
+		T value;
+		const unsigned char *bytes = read_bytes(sizeof(T));
+		if (bytes)
+		{
+			std::memcpy(&value, bytes, sizeof(T));
+		}
+		else
+		{
+			std::memset(&value, 0, sizeof(T));
+		}
+		return value;
+	}
+
+	std::string read_string()
+	{
+		std::uint32_t length = read<std::uint32_t>();
+		const unsigned char *text = read_bytes(length);
+		return text ? std::string(reinterpret_cast<const char *> (text), length) : std::string();
+	}
+};
+
+}
+}
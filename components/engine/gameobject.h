@@ -6,6 +6,8 @@
 #include <mutex>
 #include <unordered_map>
 #include <thread>
+#include <cstdint>
+#include <vector>
 
 namespace tocs {
 namespace engine {
@@ -64,6 +66,8 @@ public:
 
 	void prepare_frame(const live_game_objects &previous)
 	{
+		//This slot's purgatory is from num_state_histories frames ago and was promoted long since, keeping it would promote it again.
+		object_purgatory.clear();
 		live_objects.clear();
 		live_objects.reserve(previous.live_objects.size() + previous.object_purgatory.size());
 
@@ -116,6 +120,27 @@ private:
 		return objects.get_item(id);
 	}
 
+	//Replaces every object with ones carrying the saved ids, handing their handles back through restored. Assumes no one else will be using any object stuff.
+	void restore(const std::uint64_t *ids, std::size_t count, game_object_id next_id, std::vector<threading::concurrent_pool_handle<game_object>> &restored)
+	{
+		for (auto &pair : id_to_object)
+		{
+			objects.return_item(pair.second);
+		}
+		id_to_object.clear();
+
+		restored.clear();
+		restored.reserve(count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			auto handle = objects.get_item(static_cast<game_object_id> (ids[i]));
+			id_to_object.emplace(std::make_pair(handle->get_id(), handle));
+			restored.push_back(handle);
+		}
+
+		last_id = next_id;
+	}
+
 	//Assumes no one else will be using any object stuff
 	void move_from_pergatory(std::vector<threading::concurrent_pool_handle<game_object>> &objects)
 	{
@@ -29,8 +29,17 @@ class game_timer
 {
 	std::chrono::high_resolution_clock::time_point start_time;
 	std::chrono::high_resolution_clock::time_point last_time_chrono;
+	std::chrono::high_resolution_clock::time_point last_real_time;
 	game_time last_time;
+	long long fixed_ticks;
 public:
+	game_timer()
+		: start_time(std::chrono::high_resolution_clock::now())
+		, last_time_chrono(start_time)
+		, last_real_time(start_time)
+		, fixed_ticks(0)
+	{}
+
 	game_time time() const { return last_time; }
 
 
@@ -46,6 +55,26 @@ public:
 		last_time.dt = std::chrono::duration_cast<std::chrono::duration<float>>(dt).count();
 		++last_time.frame_number_;
 	}
+
+	//Steps game time by exactly tick_length. Time is derived from the tick count rather than summed so every machine sees identical values.
+	void advance_fixed_frame(float tick_length)
+	{
+		++fixed_ticks;
+
+		last_time.time = static_cast<float> (static_cast<double> (tick_length) * fixed_ticks);
+		last_time.dt = tick_length;
+		++last_time.frame_number_;
+	}
+
+	//Real seconds passed since the last call, used to feed a fixed step accumulator.
+	float consume_real_time()
+	{
+		auto now = std::chrono::high_resolution_clock::now();
+		auto elapsed = now - last_real_time;
+		last_real_time = now;
+
+		return std::chrono::duration_cast<std::chrono::duration<float>>(elapsed).count();
+	}
 };
 
 }}
\ No newline at end of file
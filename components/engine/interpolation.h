@@ -1,12 +1,25 @@
 #pragma once
+#include <math/vector.h>
+#include <math/quaternion.h>
 
 namespace tocs {
 namespace engine {
 
+//Which kernel the batched presentation pass uses for a value.
+enum class interpolation_kind
+{
+	none,
+	linear,
+	nlerp,
+	slerp,
+};
+
 template <class ValType>
 class linear_interp
 {
 public:
+	static constexpr interpolation_kind kind = interpolation_kind::linear;
+
 	static ValType interpolate(const ValType &a, const ValType &b, float t)
 	{
 		return a * (1.0f - t) + b * t;
@@ -17,13 +30,70 @@ template <class ValType>
 class no_interp
 {
 public:
+	static constexpr interpolation_kind kind = interpolation_kind::none;
+
 	static ValType interpolate(const ValType &a, const ValType &b, float t)
 	{
 		return a;
 	}
 };
 
-}
-}
+//Shortest arc normalized lerp for rotations.
+template <class ValType>
+class nlerp_interp
+{
+public:
+	static constexpr interpolation_kind kind = interpolation_kind::nlerp;
+
+	static ValType interpolate(const ValType &a, const ValType &b, float t)
+	{
+		return ValType::nlerp(a, b, t);
+	}
+};
+
+//Constant angular velocity blend for rotations, costs a little more than nlerp.
+template <class ValType>
+class slerp_interp
+{
+public:
+	static constexpr interpolation_kind kind = interpolation_kind::slerp;
+
+	static ValType interpolate(const ValType &a, const ValType &b, float t)
+	{
+		return ValType::slerp(a, b, t);
+	}
+};
 
+//How many floats a value is laid out as, so the presentation pass can blend it lane by lane in SoA arrays.
+//0 means the value isn't made of floats and can only be blended one object at a time through its interpolation_type.
+template <class ValType>
+class float_lanes
+{
+public:
+	static constexpr int count = 0;
+};
+
+template <>
+class float_lanes<float>
+{
+public:
+	static constexpr int count = 1;
+};
 
+//Simd vectors are padded out to a full pack, the padding lanes blend harmlessly.
+template <int dim>
+class float_lanes<math::vector_base<float, dim, math::simd_enabled>>
+{
+public:
+	static constexpr int count = 4;
+};
+
+template <>
+class float_lanes<math::quaternion_base<float, math::simd_enabled>>
+{
+public:
+	static constexpr int count = 4;
+};
+
+}
+}
@@ -0,0 +1,256 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
+#include <xmmintrin.h>
+#include <core/asserts.h>
+#include <core/frame_arena.h>
+#include <math/batch.h>
+#include <threading/trace.h>
+#include <threading/worker.h>
+#include "component.h"
+#include "state.h"
+
+namespace tocs {
+namespace engine {
+
+class base_presentation_buffer
+{
+public:
+	virtual ~base_presentation_buffer() {}
+
+	virtual void build(const all_component_storage &from, const all_component_storage &to, float t) = 0;
+};
+
+//Every interpolated value of one component type blended between two game_states, laid out as SoA float arrays for rendering.
+//Only values whose metadata has a batch_kind are stored, anything else can still be blended per object with world::interpolate_component.
+template <class comp_type>
+class presentation_buffer : public base_presentation_buffer
+{
+public:
+	static constexpr int max_lanes = 4;
+
+	class field
+	{
+	public:
+		const base_state_value_metadata<comp_type> *value;
+		std::array<std::vector<float>, max_lanes> lanes;
+	};
+
+	//Element i of every lane belongs to objects[i], objects are in id order.
+	std::vector<game_object_id> objects;
+	std::vector<field> fields;
+
+	presentation_buffer()
+	{
+		for (auto &value : comp_type::meta_data.values)
+		{
+			if (value->batch_kind != interpolation_kind::none)
+			{
+				fields.push_back(field{ value.get(), {} });
+			}
+		}
+	}
+
+	std::size_t size() const { return objects.size(); }
+
+	//Lane of the value registered at value_index, nullptr if that value isn't batched.
+	const float *lane(int value_index, int lane_index) const
+	{
+		for (const field &f : fields)
+		{
+			if (f.value->value_index == value_index)
+			{
+				check(lane_index < f.value->lane_count);
+				return f.lanes[lane_index].data();
+			}
+		}
+		return nullptr;
+	}
+
+	void build(const all_component_storage &from, const all_component_storage &to, float t) override
+	{
+		TOCS_TRACE_SCOPE("presentation_buffer::build");
+
+		const component_storage<comp_type> *from_storage = from.find_storage<comp_type>();
+		const component_storage<comp_type> *to_storage = to.find_storage<comp_type>();
+		check(from_storage != nullptr && to_storage != nullptr);
+
+		//Both storages walk their id ordered index, so matching is a merge rather than a lookup per object. Each job finds where its range
+		//starts in the previous state, then matches, gathers and blends its objects. Objects with no previous component blend against themselves.
+		to_storage->with_ordered([&](const std::pair<game_object_id, comp_type *> *to_comps, std::size_t count)
+		{
+			from_storage->with_ordered([&](const std::pair<game_object_id, comp_type *> *from_comps, std::size_t from_count)
+			{
+				objects.resize(count);
+
+				//Every batched lane of every field in one SoA scratch array per state, filled in a single walk over the objects since touching them is the expensive part.
+				core::frame_vector<std::ptrdiff_t> lane_offsets;
+				for (field &f : fields)
+				{
+					std::ptrdiff_t offset = count > 0 ? f.value->lane_offset(*to_comps[0].second) : 0;
+					for (int l = 0; l < f.value->lane_count; ++l)
+					{
+						lane_offsets.push_back(offset + l * static_cast<std::ptrdiff_t> (sizeof(float)));
+						f.lanes[l].resize(count);
+					}
+				}
+
+				std::size_t lane_total = lane_offsets.size();
+				core::frame_vector<float> from_lanes(count * lane_total);
+				core::frame_vector<float> to_lanes(count * lane_total);
+
+				//Ranges of objects are gathered and blended as separate jobs, the gather is bound by memory latency so it scales with threads.
+				threading::job_system::parallel_for(count, objects_per_job, [&](std::size_t begin, std::size_t end)
+				{
+					gather(to_comps, from_comps, from_count, lane_offsets.data(), lane_total, from_lanes.data(), to_lanes.data(), count, begin, end);
+					blend(from_lanes.data(), to_lanes.data(), count, begin, end, t);
+				});
+			});
+		});
+	}
+
+private:
+	static constexpr std::size_t objects_per_job = 8192;
+	static constexpr std::size_t prefetch_distance = 16;
+
+	//Objects are touched once each, copying every batched lane into lane-major SoA arrays with a stride of count. from_comps is walked
+	//alongside to_comps, both being in id order.
+	void gather(const std::pair<game_object_id, comp_type *> *to_comps, const std::pair<game_object_id, comp_type *> *from_comps, std::size_t from_count,
+		const std::ptrdiff_t *lane_offsets, std::size_t lane_total, float *from_lanes, float *to_lanes, std::size_t count, std::size_t begin, std::size_t end)
+	{
+		const std::pair<game_object_id, comp_type *> *from_end = from_comps + from_count;
+		const std::pair<game_object_id, comp_type *> *previous = std::lower_bound(from_comps, from_end, to_comps[begin].first,
+			[](const std::pair<game_object_id, comp_type *> &comp, game_object_id id)
+		{
+			return comp.first < id;
+		});
+
+		for (std::size_t i = begin; i < end; ++i)
+		{
+			game_object_id id = to_comps[i].first;
+			while (previous != from_end && previous->first < id)
+			{
+				++previous;
+			}
+
+			//The components are scattered through the pools, so fetch ones a few objects ahead while this one is copied.
+			if (i + prefetch_distance < end)
+			{
+				_mm_prefetch(reinterpret_cast<const char *> (to_comps[i + prefetch_distance].second), _MM_HINT_T0);
+				if (previous + prefetch_distance < from_end)
+				{
+					_mm_prefetch(reinterpret_cast<const char *> (previous[prefetch_distance].second), _MM_HINT_T0);
+				}
+			}
+
+			objects[i] = id;
+			const char *to_bytes = reinterpret_cast<const char *> (to_comps[i].second);
+			const char *from_bytes = previous != from_end && previous->first == id ? reinterpret_cast<const char *> (previous->second) : to_bytes;
+
+			for (std::size_t l = 0; l < lane_total; ++l)
+			{
+				std::memcpy(&from_lanes[l * count + i], from_bytes + lane_offsets[l], sizeof(float));
+				std::memcpy(&to_lanes[l * count + i], to_bytes + lane_offsets[l], sizeof(float));
+			}
+		}
+	}
+
+	void blend(const float *from_lanes, const float *to_lanes, std::size_t count, std::size_t begin, std::size_t end, float t)
+	{
+		std::size_t span = end - begin;
+		std::size_t first_lane = 0;
+
+		for (field &f : fields)
+		{
+			const float *from_field = from_lanes + first_lane * count + begin;
+			const float *to_field = to_lanes + first_lane * count + begin;
+			int lane_count = f.value->lane_count;
+
+			switch (f.value->batch_kind)
+			{
+			case interpolation_kind::linear:
+				for (int l = 0; l < lane_count; ++l)
+				{
+					math::batch_lerp(from_field + l * count, to_field + l * count, t, f.lanes[l].data() + begin, span);
+				}
+				break;
+			case interpolation_kind::nlerp:
+				math::batch_nlerp(
+					math::quaternion_lanes<const float>{ from_field, from_field + count, from_field + 2 * count, from_field + 3 * count },
+					math::quaternion_lanes<const float>{ to_field, to_field + count, to_field + 2 * count, to_field + 3 * count },
+					t,
+					math::quaternion_lanes<float>{ f.lanes[0].data() + begin, f.lanes[1].data() + begin, f.lanes[2].data() + begin, f.lanes[3].data() + begin },
+					span);
+				break;
+			case interpolation_kind::slerp:
+				math::batch_slerp(
+					math::quaternion_lanes<const float>{ from_field, from_field + count, from_field + 2 * count, from_field + 3 * count },
+					math::quaternion_lanes<const float>{ to_field, to_field + count, to_field + 2 * count, to_field + 3 * count },
+					t,
+					math::quaternion_lanes<float>{ f.lanes[0].data() + begin, f.lanes[1].data() + begin, f.lanes[2].data() + begin, f.lanes[3].data() + begin },
+					span);
+				break;
+			case interpolation_kind::none:
+				break;
+			}
+
+			first_lane += lane_count;
+		}
+	}
+};
+
+//Presentation buffers for the component types a renderer asked for. world::build_presentation refills them after each update.
+class presentation
+{
+	std::unordered_map<std::type_index, std::unique_ptr<base_presentation_buffer>> buffers;
+public:
+	template <class comp_type>
+	presentation_buffer<comp_type> &track()
+	{
+		auto &buffer = buffers[std::type_index(typeid(comp_type))];
+		if (!buffer)
+		{
+			buffer.reset(new presentation_buffer<comp_type>());
+		}
+		return static_cast<presentation_buffer<comp_type> &> (*buffer);
+	}
+
+	template <class comp_type>
+	const presentation_buffer<comp_type> *get() const
+	{
+		auto i = buffers.find(std::type_index(typeid(comp_type)));
+		return i == buffers.end() ? nullptr : static_cast<const presentation_buffer<comp_type> *> (i->second.get());
+	}
+
+	//Builds every tracked buffer as its own job. Has to be called from a job_system worker.
+	void build(const all_component_storage &from, const all_component_storage &to, float t)
+	{
+		TOCS_TRACE_SCOPE("build_presentation");
+
+		std::atomic<int> remaining(static_cast<int> (buffers.size()));
+
+		for (auto &pair : buffers)
+		{
+			base_presentation_buffer *buffer = pair.second.get();
+			threading::job_system::queue_job([buffer, &from, &to, t, &remaining]()
+			{
+				buffer->build(from, to, t);
+				remaining.fetch_sub(1, std::memory_order_release);
+			}, threading::job_priority::critical);
+		}
+
+		threading::job_system::wait_until([&remaining]()
+		{
+			return remaining.load(std::memory_order_acquire) == 0;
+		});
+	}
+};
+
+}
+}
@@ -0,0 +1,191 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <core/asserts.h>
+#include <threading/cacheline.h>
+#include <threading/counters.h>
+
+namespace tocs {
+namespace engine {
+
+//Hands completed frames from a ring of slot_count states to reader threads without locks. Each slot carries the frame it holds and a count of
+//readers pinning it. A reader bumps the count and then checks the slot still holds its frame, the writer marks a slot retired and then waits
+//for its count to drain before reusing it. With both sides sequentially consistent one of them always sees the other, so a pinned state is
+//never written under a reader.
+template <class state_type, int slot_count>
+class state_publisher
+{
+	class slot
+	{
+	public:
+		std::atomic<int> frame;
+		std::atomic<int> readers;
+		const state_type *state;
+		threading::cache_line_padding padding;
+	};
+
+	slot slots[slot_count];
+	std::atomic<int> latest;
+public:
+	//A published state held open for reading. Releasing it, or letting it go out of scope, lets the writer reuse the slot. Holding one for
+	//longer than slot_count - 1 frames stalls the writer.
+	class pinned_state
+	{
+		state_publisher *owner;
+		const state_type *state;
+		int slot_index;
+		int frame;
+
+		friend class state_publisher;
+
+		pinned_state(state_publisher *owner, const state_type *state, int slot_index, int frame)
+			: owner(owner)
+			, state(state)
+			, slot_index(slot_index)
+			, frame(frame)
+		{}
+	public:
+		pinned_state()
+			: owner(nullptr)
+			, state(nullptr)
+			, slot_index(0)
+			, frame(-1)
+		{}
+
+		pinned_state(pinned_state &&other)
+			: owner(other.owner)
+			, state(other.state)
+			, slot_index(other.slot_index)
+			, frame(other.frame)
+		{
+			other.owner = nullptr;
+			other.state = nullptr;
+		}
+
+		pinned_state &operator=(pinned_state &&other)
+		{
+			if (this != &other)
+			{
+				release();
+				owner = other.owner;
+				state = other.state;
+				slot_index = other.slot_index;
+				frame = other.frame;
+				other.owner = nullptr;
+				other.state = nullptr;
+			}
+			return *this;
+		}
+
+		pinned_state(const pinned_state &) = delete;
+		pinned_state &operator=(const pinned_state &) = delete;
+
+		~pinned_state() { release(); }
+
+		void release()
+		{
+			if (owner)
+			{
+				owner->slots[slot_index].readers.fetch_sub(1, std::memory_order_release);
+				owner = nullptr;
+				state = nullptr;
+			}
+		}
+
+		explicit operator bool() const { return state != nullptr; }
+		int frame_number() const { return frame; }
+
+		const state_type &operator*() const { return *state; }
+		const state_type *operator->() const { return state; }
+	};
+
+	state_publisher()
+		: latest(-1)
+	{
+		for (slot &s : slots)
+		{
+			s.frame.store(-1, std::memory_order_relaxed);
+			s.readers.store(0, std::memory_order_relaxed);
+			s.state = nullptr;
+		}
+	}
+
+	int latest_frame() const { return latest.load(std::memory_order_acquire); }
+
+	//Pins the newest published frame, empty if nothing has been published. Safe from any thread.
+	pinned_state pin_latest()
+	{
+		for (;;)
+		{
+			int frame = latest.load(std::memory_order_acquire);
+			if (frame < 0)
+			{
+				return pinned_state();
+			}
+
+			pinned_state result = pin(frame);
+			if (result)
+			{
+				return result;
+			}
+		}
+	}
+
+	//Pins a specific frame, empty if it was never published or its slot has been retired since.
+	pinned_state pin(int frame)
+	{
+		if (frame < 0)
+		{
+			return pinned_state();
+		}
+
+		int slot_index = frame % slot_count;
+		slot &s = slots[slot_index];
+		s.readers.fetch_add(1, std::memory_order_seq_cst);
+		if (s.frame.load(std::memory_order_seq_cst) != frame)
+		{
+			s.readers.fetch_sub(1, std::memory_order_release);
+			return pinned_state();
+		}
+		return pinned_state(this, s.state, slot_index, frame);
+	}
+
+	//Writer side. frame's state is complete and won't be written again until its slot is retired.
+	void publish(int frame, const state_type &state)
+	{
+		slot &s = slots[frame % slot_count];
+		s.state = &state;
+		s.frame.store(frame, std::memory_order_release);
+		latest.store(frame, std::memory_order_release);
+	}
+
+	//Takes back the slot frame is about to be written into, waiting out any reader still pinning what it held.
+	void retire(int frame)
+	{
+		slot &s = slots[frame % slot_count];
+
+		//Retiring the newest published frame would leave readers spinning in pin_latest.
+		int newest = latest.load(std::memory_order_relaxed);
+		check(newest < 0 || newest % slot_count != frame % slot_count);
+
+		s.frame.store(-1, std::memory_order_seq_cst);
+		while (s.readers.load(std::memory_order_seq_cst) != 0)
+		{
+			TOCS_COUNT(published_state_waits, 1);
+			std::this_thread::yield();
+		}
+	}
+
+	//Retires every slot, for when the whole ring is about to be rewritten.
+	void retire_all()
+	{
+		latest.store(-1, std::memory_order_seq_cst);
+		for (int i = 0; i < slot_count; ++i)
+		{
+			retire(i);
+		}
+	}
+};
+
+}
+}
@@ -0,0 +1,509 @@
+#include "replay.h"
+#include <algorithm>
+#include <iterator>
+#include <core/lz.h>
+
+namespace tocs {
+namespace engine {
+
+namespace {
+
+//Replays of long matches run past 2GB, plain fseek only takes a long.
+int seek_file(std::FILE *file, long long offset, int origin)
+{
+#if defined(_WIN32)
+	return _fseeki64(file, offset, origin);
+#else
+	return fseeko(file, static_cast<off_t> (offset), origin);
+#endif
+}
+
+long long tell_file(std::FILE *file)
+{
+#if defined(_WIN32)
+	return _ftelli64(file);
+#else
+	return static_cast<long long> (ftello(file));
+#endif
+}
+
+void write_ids(diff_stream_writer &out, const std::vector<std::uint64_t> &ids, std::size_t begin, std::size_t end)
+{
+	out.write(static_cast<std::uint32_t> (end - begin));
+	out.write_bytes(ids.data() + begin, (end - begin) * sizeof(std::uint64_t));
+}
+
+bool read_ids(diff_stream_reader &in, std::vector<std::uint64_t> &ids)
+{
+	std::uint32_t count = in.read<std::uint32_t>();
+	const unsigned char *data = in.read_bytes(count * sizeof(std::uint64_t));
+	if (!data)
+	{
+		return false;
+	}
+
+	ids.resize(count);
+	std::memcpy(ids.data(), data, count * sizeof(std::uint64_t));
+	return true;
+}
+
+}
+
+replay_recorder::replay_recorder(int keyframe_interval, std::size_t chunk_size)
+	: keyframe_interval(keyframe_interval)
+	, chunk_size(chunk_size)
+	, file(nullptr)
+	, stopping(false)
+	, write_failed(false)
+	, last_frame(-1)
+	, last_keyframe(-1)
+{
+	frames.kind = replay_format::chunk_kind::frames;
+	frames.first_frame = 0;
+	frames.frame_count = 0;
+}
+
+replay_recorder::~replay_recorder()
+{
+	close();
+}
+
+bool replay_recorder::open(const std::string &path)
+{
+	close();
+
+	file = std::fopen(path.c_str(), "wb");
+	if (!file)
+	{
+		return false;
+	}
+
+	replay_file_header header;
+	header.magic = replay_format::magic;
+	header.version = replay_format::version;
+	if (std::fwrite(&header, sizeof(header), 1, file) != 1)
+	{
+		std::fclose(file);
+		file = nullptr;
+		return false;
+	}
+
+	stopping = false;
+	write_failed = false;
+	last_frame = -1;
+	last_keyframe = -1;
+	writer = std::thread([this] { write_chunks(); });
+	return true;
+}
+
+void replay_recorder::close()
+{
+	if (!file)
+	{
+		return;
+	}
+
+	flush_frames();
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		stopping = true;
+	}
+	queue_ready.notify_one();
+	writer.join();
+
+	std::fclose(file);
+	file = nullptr;
+	last_frame = -1;
+}
+
+void replay_recorder::record_keyframe(std::int64_t frame_number, const std::vector<unsigned char> &snapshot, const std::uint64_t *frame_objects, std::size_t object_count)
+{
+	check(is_open());
+
+	//Frames before the keyframe go out first so chunks stay in frame order.
+	flush_frames();
+
+	pending_chunk chunk;
+	chunk.kind = replay_format::chunk_kind::keyframe;
+	chunk.first_frame = frame_number;
+	chunk.frame_count = 1;
+	chunk.data = take_buffer();
+	chunk.data.assign(snapshot.begin(), snapshot.end());
+	submit(std::move(chunk));
+
+	objects.assign(frame_objects, frame_objects + object_count);
+	last_frame = frame_number;
+	last_keyframe = frame_number;
+}
+
+void replay_recorder::record_frame(std::int64_t frame_number, double total_time, std::uint64_t checksum, const all_component_storage &current, const all_component_storage &previous,
+	const std::uint64_t *frame_objects, std::size_t object_count)
+{
+	check(is_open());
+	check(!needs_keyframe(frame_number));
+
+	if (frames.frame_count == 0)
+	{
+		frames.first_frame = frame_number;
+		frames.data = take_buffer();
+	}
+
+	diff_stream_writer out(frames.data);
+	out.write(static_cast<std::int64_t> (frame_number));
+	out.write(total_time);
+	out.write(checksum);
+
+	//Both id lists are sorted, so spawned and destroyed objects fall out of two set differences.
+	object_changes.clear();
+	std::set_difference(frame_objects, frame_objects + object_count, objects.begin(), objects.end(), std::back_inserter(object_changes));
+	std::size_t spawned = object_changes.size();
+	std::set_difference(objects.begin(), objects.end(), frame_objects, frame_objects + object_count, std::back_inserter(object_changes));
+
+	write_ids(out, object_changes, 0, spawned);
+	write_ids(out, object_changes, spawned, object_changes.size());
+	current.write_frame_diffs(previous, out);
+
+	++frames.frame_count;
+	objects.assign(frame_objects, frame_objects + object_count);
+	last_frame = frame_number;
+
+	if (frames.data.size() >= chunk_size)
+	{
+		flush_frames();
+	}
+}
+
+void replay_recorder::flush_frames()
+{
+	if (frames.frame_count == 0)
+	{
+		return;
+	}
+
+	submit(std::move(frames));
+	frames.kind = replay_format::chunk_kind::frames;
+	frames.first_frame = 0;
+	frames.frame_count = 0;
+	frames.data = std::vector<unsigned char>();
+}
+
+void replay_recorder::submit(pending_chunk &&chunk)
+{
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		queue.push_back(std::move(chunk));
+	}
+	queue_ready.notify_one();
+}
+
+std::vector<unsigned char> replay_recorder::take_buffer()
+{
+	//Buffers come back from the writer thread so steady state recording doesn't allocate.
+	std::lock_guard<std::mutex> lock(queue_mutex);
+	if (spare_buffers.empty())
+	{
+		return std::vector<unsigned char>();
+	}
+
+	std::vector<unsigned char> buffer = std::move(spare_buffers.back());
+	spare_buffers.pop_back();
+	return buffer;
+}
+
+void replay_recorder::write_chunks()
+{
+	static constexpr std::size_t max_spare_buffers = 4;
+	std::vector<unsigned char> packed;
+
+	for (;;)
+	{
+		pending_chunk chunk;
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			queue_ready.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (queue.empty())
+			{
+				return;
+			}
+
+			chunk = std::move(queue.front());
+			queue.pop_front();
+		}
+
+		packed.clear();
+		core::lz::compress(chunk.data.data(), chunk.data.size(), packed);
+
+		replay_chunk_header header;
+		header.magic = replay_format::chunk_magic;
+		header.kind = chunk.kind;
+		header.first_frame = chunk.first_frame;
+		header.frame_count = chunk.frame_count;
+		header.raw_size = static_cast<std::uint32_t> (chunk.data.size());
+		header.compressed_size = static_cast<std::uint32_t> (packed.size());
+		header.reserved = 0;
+
+		//Flushed per chunk so a crash loses at most what was still queued, the case a desync report needs most.
+		bool written = chunk.data.size() <= UINT32_MAX && packed.size() <= UINT32_MAX
+			&& std::fwrite(&header, sizeof(header), 1, file) == 1
+			&& std::fwrite(packed.data(), 1, packed.size(), file) == packed.size()
+			&& std::fflush(file) == 0;
+		if (!written)
+		{
+			write_failed = true;
+		}
+
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		if (spare_buffers.size() < max_spare_buffers)
+		{
+			chunk.data.clear();
+			spare_buffers.push_back(std::move(chunk.data));
+		}
+	}
+}
+
+replay_player::replay_player()
+	: file(nullptr)
+	, next_object_id(0)
+	, frame(-1)
+	, time(0)
+	, checksum(0)
+	, next_chunk(none)
+	, read_position(0)
+{
+}
+
+replay_player::~replay_player()
+{
+	close();
+}
+
+bool replay_player::open(const std::string &path)
+{
+	close();
+
+	file = std::fopen(path.c_str(), "rb");
+	if (!file)
+	{
+		return false;
+	}
+
+	replay_file_header header;
+	if (std::fread(&header, sizeof(header), 1, file) != 1 || header.magic != replay_format::magic || header.version != replay_format::version
+		|| seek_file(file, 0, SEEK_END) != 0)
+	{
+		close();
+		return false;
+	}
+
+	long long file_size = tell_file(file);
+	long long offset = sizeof(header);
+
+	//Anything after the last complete chunk is a write cut short and is left out.
+	for (;;)
+	{
+		replay_chunk_header chunk;
+		if (seek_file(file, offset, SEEK_SET) != 0 || std::fread(&chunk, sizeof(chunk), 1, file) != 1 || chunk.magic != replay_format::chunk_magic
+			|| offset + static_cast<long long> (sizeof(chunk)) + chunk.compressed_size > file_size)
+		{
+			break;
+		}
+
+		chunk_entry entry;
+		entry.kind = chunk.kind;
+		entry.first_frame = chunk.first_frame;
+		entry.frame_count = chunk.frame_count;
+		entry.raw_size = chunk.raw_size;
+		entry.compressed_size = chunk.compressed_size;
+		entry.offset = offset + sizeof(chunk);
+
+		if (entry.kind == replay_format::chunk_kind::keyframe)
+		{
+			keyframes.push_back(chunks.size());
+		}
+		chunks.push_back(entry);
+		offset = entry.offset + entry.compressed_size;
+	}
+
+	return true;
+}
+
+void replay_player::close()
+{
+	if (file)
+	{
+		std::fclose(file);
+		file = nullptr;
+	}
+
+	chunks.clear();
+	keyframes.clear();
+	frame = -1;
+	next_chunk = none;
+	raw.clear();
+	read_position = 0;
+}
+
+std::int64_t replay_player::first_frame() const
+{
+	return keyframes.empty() ? -1 : chunks[keyframes.front()].first_frame;
+}
+
+std::int64_t replay_player::last_frame() const
+{
+	return keyframes.empty() ? -1 : chunks.back().first_frame + chunks.back().frame_count - 1;
+}
+
+bool replay_player::seek(std::int64_t target)
+{
+	if (keyframes.empty() || target < first_frame() || target > last_frame())
+	{
+		return false;
+	}
+
+	//Last keyframe at or before target.
+	auto k = std::upper_bound(keyframes.begin(), keyframes.end(), target, [this](std::int64_t frame_number, std::size_t chunk)
+	{
+		return frame_number < chunks[chunk].first_frame;
+	}) - 1;
+
+	if (frame < 0 || frame > target || frame < chunks[*k].first_frame)
+	{
+		if (!load_chunk(*k))
+		{
+			frame = -1;
+			return false;
+		}
+	}
+
+	while (frame < target)
+	{
+		if (!step())
+		{
+			frame = -1;
+			return false;
+		}
+	}
+	return frame == target;
+}
+
+bool replay_player::step()
+{
+	if (frame < 0)
+	{
+		return false;
+	}
+
+	if (read_position == raw.size())
+	{
+		if (next_chunk >= chunks.size() || !load_chunk(next_chunk))
+		{
+			return false;
+		}
+
+		//A keyframe is a whole frame on its own.
+		if (chunks[next_chunk - 1].kind == replay_format::chunk_kind::keyframe)
+		{
+			return true;
+		}
+	}
+
+	return read_frame();
+}
+
+bool replay_player::load_chunk(std::size_t index)
+{
+	const chunk_entry &chunk = chunks[index];
+
+	compressed.resize(chunk.compressed_size);
+	raw.resize(chunk.raw_size);
+	if (seek_file(file, chunk.offset, SEEK_SET) != 0 || std::fread(compressed.data(), 1, compressed.size(), file) != compressed.size()
+		|| !core::lz::decompress(compressed.data(), compressed.size(), raw.data(), raw.size()))
+	{
+		raw.clear();
+		return false;
+	}
+
+	next_chunk = index + 1;
+	read_position = 0;
+
+	if (chunk.kind == replay_format::chunk_kind::keyframe)
+	{
+		snapshot_view view(raw.data(), raw.size());
+		if (!view.valid())
+		{
+			raw.clear();
+			return false;
+		}
+
+		storage.read_snapshot(view);
+		objects.assign(view.objects(), view.objects() + view.object_count());
+		next_object_id = view.next_object_id();
+		frame = chunk.first_frame;
+		time = view.total_time();
+		checksum = 0;
+		read_position = raw.size();
+	}
+	return true;
+}
+
+bool replay_player::read_frame()
+{
+	diff_stream_reader in(raw.data() + read_position, raw.size() - read_position);
+
+	std::int64_t frame_number = in.read<std::int64_t>();
+	double total_time = in.read<double>();
+	std::uint64_t frame_checksum = in.read<std::uint64_t>();
+	if (in.failed() || frame_number != frame + 1)
+	{
+		return false;
+	}
+
+	if (!read_ids(in, object_changes))
+	{
+		return false;
+	}
+	if (!object_changes.empty())
+	{
+		next_object_id = std::max(next_object_id, object_changes.back() + 1);
+	}
+	apply_changes(objects, object_changes, true, scratch);
+
+	if (!read_ids(in, object_changes))
+	{
+		return false;
+	}
+	apply_changes(objects, object_changes, false, scratch);
+
+	if (!storage.read_frame_diffs(in))
+	{
+		return false;
+	}
+
+	read_position = raw.size() - in.remaining();
+	frame = frame_number;
+	time = total_time;
+	checksum = frame_checksum;
+	return true;
+}
+
+void replay_player::apply_changes(std::vector<std::uint64_t> &set, const std::vector<std::uint64_t> &changes, bool insert, std::vector<std::uint64_t> &scratch)
+{
+	if (changes.empty())
+	{
+		return;
+	}
+
+	scratch.clear();
+	if (insert)
+	{
+		std::set_union(set.begin(), set.end(), changes.begin(), changes.end(), std::back_inserter(scratch));
+	}
+	else
+	{
+		std::set_difference(set.begin(), set.end(), changes.begin(), changes.end(), std::back_inserter(scratch));
+	}
+	set.swap(scratch);
+}
+
+}
+}
@@ -0,0 +1,211 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "component.h"
+#include "diff_stream.h"
+#include "snapshot.h"
+
+namespace tocs {
+namespace engine {
+
+//Replay logs are a file header followed by chunks, each a replay_chunk_header and its payload compressed with core::lz. A keyframe chunk holds one
+//snapshot, a frames chunk holds consecutive frame records:
+//  frame number, game time, state checksum, spawned object ids, destroyed object ids, then all_component_storage::write_frame_diffs
+//Chunks are self describing so a log cut short by a crash still plays up to its last complete chunk.
+namespace replay_format
+{
+	static constexpr std::uint32_t magic = 0x4C524354u; //"TCRL"
+	static constexpr std::uint32_t chunk_magic = 0x4B484354u; //"TCHK"
+	//3 names storage sections and keyframe blocks by registered component name instead of typeid name.
+	static constexpr std::uint32_t version = 3;
+
+	enum class chunk_kind : std::uint32_t
+	{
+		keyframe = 1,
+		frames = 2
+	};
+}
+
+class replay_file_header
+{
+public:
+	std::uint32_t magic;
+	std::uint32_t version;
+};
+
+class replay_chunk_header
+{
+public:
+	std::uint32_t magic;
+	replay_format::chunk_kind kind;
+	std::int64_t first_frame;
+	std::uint32_t frame_count;
+	std::uint32_t raw_size;
+	std::uint32_t compressed_size;
+	std::uint32_t reserved;
+};
+
+//Streams a world's frames to a replay log, fed by world::record_replay_frame once per tick. Encoding the diffs happens on the calling thread,
+//compression and file writes on a background thread so the simulation never waits on the disk. The queue to it is unbounded, a disk that
+//can't keep up costs memory rather than frame time.
+class replay_recorder
+{
+	class pending_chunk
+	{
+	public:
+		replay_format::chunk_kind kind;
+		std::int64_t first_frame;
+		std::uint32_t frame_count;
+		std::vector<unsigned char> data;
+	};
+
+	int keyframe_interval;
+	std::size_t chunk_size;
+
+	std::FILE *file;
+	std::thread writer;
+	std::mutex queue_mutex;
+	std::condition_variable queue_ready;
+	std::deque<pending_chunk> queue;
+	std::vector<std::vector<unsigned char>> spare_buffers;
+	bool stopping;
+	std::atomic<bool> write_failed;
+
+	//Only touched by the recording thread.
+	pending_chunk frames;
+	std::int64_t last_frame;
+	std::int64_t last_keyframe;
+	std::vector<std::uint64_t> objects;
+	std::vector<std::uint64_t> object_changes;
+public:
+	//A keyframe every keyframe_interval frames bounds how far a seek has to replay. Frame records are gathered into chunks of about chunk_size bytes
+	//before compression.
+	explicit replay_recorder(int keyframe_interval = 300, std::size_t chunk_size = 256 * 1024);
+	~replay_recorder();
+
+	replay_recorder(const replay_recorder &) = delete;
+	replay_recorder &operator=(const replay_recorder &) = delete;
+
+	//Starts a new log at path and the thread that writes it.
+	bool open(const std::string &path);
+
+	//Writes everything still queued and closes the file.
+	void close();
+
+	bool is_open() const { return file != nullptr; }
+
+	//True once a background write has failed, the log is incomplete from that point on.
+	bool failed() const { return write_failed.load(std::memory_order_relaxed); }
+
+	//Frames that don't directly follow the last one recorded can't be diffed, so they get a keyframe too.
+	bool needs_keyframe(std::int64_t frame_number) const
+	{
+		return last_frame < 0 || frame_number != last_frame + 1 || frame_number - last_keyframe >= keyframe_interval;
+	}
+
+	//objects is the frame's sorted live object ids, the same table the snapshot holds.
+	void record_keyframe(std::int64_t frame_number, const std::vector<unsigned char> &snapshot, const std::uint64_t *objects, std::size_t object_count);
+
+	//Records current as diffs against previous, the frame before it. checksum is current's all_component_storage::checksum, or 0 if not taken.
+	void record_frame(std::int64_t frame_number, double total_time, std::uint64_t checksum, const all_component_storage &current, const all_component_storage &previous, const std::uint64_t *objects, std::size_t object_count);
+
+private:
+	void flush_frames();
+	void submit(pending_chunk &&chunk);
+	std::vector<unsigned char> take_buffer();
+	void write_chunks();
+};
+
+//Plays a replay log back into its own component storage. Seeking jumps to the nearest keyframe at or before the target and replays frame diffs
+//from there, stepping forward from the current frame instead when no keyframe is closer.
+class replay_player
+{
+	class chunk_entry
+	{
+	public:
+		replay_format::chunk_kind kind;
+		std::int64_t first_frame;
+		std::uint32_t frame_count;
+		std::uint32_t raw_size;
+		std::uint32_t compressed_size;
+		long long offset;
+	};
+
+	static constexpr std::size_t none = static_cast<std::size_t> (-1);
+
+	std::FILE *file;
+	std::vector<chunk_entry> chunks;
+	std::vector<std::size_t> keyframes;
+
+	all_component_storage storage;
+	std::vector<std::uint64_t> objects;
+	std::uint64_t next_object_id;
+	std::int64_t frame;
+	double time;
+	std::uint64_t checksum;
+
+	//The chunk frames are being read from and how far into it.
+	std::size_t next_chunk;
+	std::vector<unsigned char> raw;
+	std::vector<unsigned char> compressed;
+	std::size_t read_position;
+	std::vector<std::uint64_t> object_changes;
+	std::vector<std::uint64_t> scratch;
+public:
+	replay_player();
+	~replay_player();
+
+	replay_player(const replay_player &) = delete;
+	replay_player &operator=(const replay_player &) = delete;
+
+	//Indexes the log's chunks, reading only their headers.
+	bool open(const std::string &path);
+	void close();
+
+	bool is_open() const { return file != nullptr; }
+
+	//Range of frames the log can seek to, empty until it has a keyframe.
+	std::int64_t first_frame() const;
+	std::int64_t last_frame() const;
+
+	//Frame the player's state is at, or -1 before the first seek.
+	std::int64_t frame_number() const { return frame; }
+	double total_time() const { return time; }
+
+	//The checksum recorded with the current frame, 0 for keyframes and frames recorded without one. A playback whose get_storage().checksum()
+	//differs has diverged from the recording.
+	std::uint64_t recorded_checksum() const { return checksum; }
+
+	//Returns false if the frame isn't in the log or the data on the way is corrupt, the state is unspecified after a failure until the next seek.
+	bool seek(std::int64_t target);
+
+	//Moves on one frame. Returns false at the end of the log.
+	bool step();
+
+	const all_component_storage &get_storage() const { return storage; }
+	const std::vector<std::uint64_t> &get_objects() const { return objects; }
+
+	//The current frame as a snapshot, for world::load_snapshot.
+	snapshot_writer write_snapshot() const
+	{
+		snapshot_writer writer(frame, time, next_object_id);
+		storage.write_snapshot(writer);
+		writer.finish(objects.data(), objects.size());
+		return writer;
+	}
+
+private:
+	bool load_chunk(std::size_t index);
+	bool read_frame();
+	static void apply_changes(std::vector<std::uint64_t> &set, const std::vector<std::uint64_t> &changes, bool insert, std::vector<std::uint64_t> &scratch);
+};
+
+}
+}
@@ -0,0 +1,541 @@
+#include "replication.h"
+#include <cstring>
+#include <core/bits.h>
+#include <threading/trace.h>
+#include <threading/worker.h>
+
+namespace tocs {
+namespace engine {
+
+replication_server::replication_server(const replication_settings &settings)
+	: settings(settings)
+	, interest(nullptr)
+	, frame(-1)
+{
+}
+
+replication_server::client_id replication_server::add_client(replication_transport &transport)
+{
+	std::unique_ptr<client> c(new client());
+	c->transport = &transport;
+	c->view_position = math::vector3(0.0f, 0.0f, 0.0f);
+	c->view_radius = 0.0f;
+	c->next_sequence = 1;
+	for (sent_packet &packet : c->sent)
+	{
+		packet.sequence = 0;
+		packet.in_flight = false;
+	}
+
+	for (std::size_t i = 0; i < clients.size(); ++i)
+	{
+		if (!clients[i])
+		{
+			clients[i] = std::move(c);
+			return static_cast<client_id> (i);
+		}
+	}
+
+	clients.push_back(std::move(c));
+	return static_cast<client_id> (clients.size() - 1);
+}
+
+void replication_server::remove_client(client_id id)
+{
+	check(id >= 0 && static_cast<std::size_t> (id) < clients.size() && clients[id]);
+	clients[id].reset();
+}
+
+void replication_server::set_view(client_id id, const math::vector3 &position, float radius)
+{
+	check(id >= 0 && static_cast<std::size_t> (id) < clients.size() && clients[id]);
+	clients[id]->view_position = position;
+	clients[id]->view_radius = radius;
+}
+
+const replication_server::client_stats &replication_server::get_stats(client_id id) const
+{
+	check(id >= 0 && static_cast<std::size_t> (id) < clients.size() && clients[id]);
+	return clients[id]->stats;
+}
+
+void replication_server::update(const all_component_storage &storage, std::int64_t new_frame)
+{
+	TOCS_TRACE_SCOPE("replication_update");
+	frame = new_frame;
+
+	threading::job_system::parallel_for(channels.size(), 1, [this, &storage](std::size_t begin, std::size_t end)
+	{
+		TOCS_TRACE_SCOPE("replication_gather");
+		for (std::size_t i = begin; i < end; ++i)
+		{
+			channel &c = channels[i];
+			c.previous_objects.swap(c.objects);
+			c.previous_values.swap(c.values);
+			c.gather(storage, c);
+			find_changes(c);
+		}
+	});
+
+	threading::job_system::parallel_for(clients.size(), settings.clients_per_job, [this](std::size_t begin, std::size_t end)
+	{
+		for (std::size_t i = begin; i < end; ++i)
+		{
+			if (clients[i])
+			{
+				update_client(*clients[i]);
+			}
+		}
+	});
+}
+
+void replication_server::find_changes(channel &c)
+{
+	//Ids are handed out in order, so a table straight from id to row is usually small enough to build. Sparse channels fall back to
+	//binary searches.
+	c.rows.clear();
+	if (!c.objects.empty() && c.objects.back() < c.objects.size() * 4 + 1024)
+	{
+		c.rows.assign(static_cast<std::size_t> (c.objects.back()) + 1, -1);
+		for (std::size_t i = 0; i < c.objects.size(); ++i)
+		{
+			c.rows[static_cast<std::size_t> (c.objects[i])] = static_cast<std::int32_t> (i);
+		}
+	}
+
+	//Every value of an object that was already there is a candidate, kept only if its bytes differ from the last update's. Changed flags
+	//can't narrow this, they stay set once written and a history slot that wasn't rewritten can differ with its flags clear.
+	std::size_t previous = 0;
+	for (std::size_t i = 0; i < c.objects.size(); ++i)
+	{
+		while (previous < c.previous_objects.size() && c.previous_objects[previous] < c.objects[i])
+		{
+			++previous;
+		}
+
+		if (previous == c.previous_objects.size() || c.previous_objects[previous] != c.objects[i])
+		{
+			c.changed[i] = c.all_values;
+			continue;
+		}
+
+		const unsigned char *now = c.values.data() + i * c.stride;
+		const unsigned char *before = c.previous_values.data() + previous * c.stride;
+		for (std::uint64_t bits = c.changed[i]; bits; bits = core::clear_lowest_bit(bits))
+		{
+			int value = core::count_trailing_zeros(bits);
+			if (std::memcmp(now + c.value_offsets[value], before + c.value_offsets[value], c.value_sizes[value]) == 0)
+			{
+				c.changed[i] &= ~(std::uint64_t(1) << value);
+			}
+		}
+	}
+}
+
+void replication_server::update_client(client &c)
+{
+	read_acks(c);
+	find_relevant(c);
+	merge_scope(c);
+	pack(c);
+}
+
+void replication_server::read_acks(client &c)
+{
+	std::vector<unsigned char> &ack = c.packet;
+	while (c.transport->receive(ack))
+	{
+		diff_stream_reader in(ack.data(), ack.size());
+		std::uint32_t latest = in.read<std::uint32_t>();
+		std::uint32_t bits = in.read<std::uint32_t>();
+		if (in.failed() || !in.at_end() || latest >= c.next_sequence)
+		{
+			continue;
+		}
+
+		for (sent_packet &packet : c.sent)
+		{
+			if (!packet.in_flight || packet.sequence > latest)
+			{
+				continue;
+			}
+
+			std::uint32_t age = latest - packet.sequence;
+			if (age == 0 || (age <= replication_format::ack_bits && (bits >> (age - 1)) & 1))
+			{
+				resolve(c, packet, true);
+			}
+			else
+			{
+				resolve(c, packet, false);
+			}
+		}
+	}
+}
+
+void replication_server::resolve(client &c, sent_packet &packet, bool acked)
+{
+	packet.in_flight = false;
+	++(acked ? c.stats.packets_acked : c.stats.packets_lost);
+
+	for (const sent_record &record : packet.records)
+	{
+		tracked_object *tracked = find_tracked(c, record.channel, record.object);
+		if (!tracked)
+		{
+			continue;
+		}
+
+		if (record.removal)
+		{
+			//An object back in scope since has had its full state queued already.
+			if (tracked->state == scope_state::removing)
+			{
+				tracked->state = acked ? scope_state::gone : scope_state::leaving;
+			}
+		}
+		else if (!acked && tracked->state == scope_state::in_scope)
+		{
+			tracked->pending |= record.values;
+		}
+	}
+	packet.records.clear();
+}
+
+bool replication_server::awaiting_ack(const client &c)
+{
+	for (const sent_packet &packet : c.sent)
+	{
+		if (packet.in_flight && !packet.records.empty())
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+replication_server::tracked_object *replication_server::find_tracked(client &c, std::uint16_t channel, game_object_id object)
+{
+	auto i = std::lower_bound(c.tracked.begin(), c.tracked.end(), std::make_pair(channel, object), [](const tracked_object &t, const std::pair<std::uint16_t, game_object_id> &key)
+	{
+		return t.channel < key.first || (t.channel == key.first && t.object < key.second);
+	});
+	return i != c.tracked.end() && i->channel == channel && i->object == object ? &*i : nullptr;
+}
+
+void replication_server::find_relevant(client &c)
+{
+	c.relevant.clear();
+	if (interest)
+	{
+		interest->query_radius(c.view_position, c.view_radius, c.relevant);
+		std::sort(c.relevant.begin(), c.relevant.end());
+		c.relevant.erase(std::unique(c.relevant.begin(), c.relevant.end()), c.relevant.end());
+	}
+}
+
+void replication_server::merge_scope(client &c)
+{
+	//Walks each channel's sorted objects against the client's tracked list in one pass. With an interest index only the client's relevant
+	//objects are looked up in the channel, so the cost follows what the client sees rather than the size of the world.
+	c.merged.clear();
+	c.merged_rows.clear();
+	std::size_t t = 0;
+	for (std::size_t ch = 0; ch < channels.size(); ++ch)
+	{
+		const channel &source = channels[ch];
+		std::uint16_t channel_index = static_cast<std::uint16_t> (ch);
+		std::size_t start = 0;
+		std::size_t r = 0;
+
+		for (;;)
+		{
+			std::size_t row = start;
+			if (interest)
+			{
+				row = source.objects.size();
+				for (; r < c.relevant.size(); ++r)
+				{
+					std::size_t found = source.find_row(c.relevant[r], start);
+					if (found < source.objects.size())
+					{
+						row = found;
+						break;
+					}
+				}
+			}
+
+			bool have_tracked = t < c.tracked.size() && c.tracked[t].channel == channel_index;
+			bool have_object = row < source.objects.size();
+			if (!have_tracked && !have_object)
+			{
+				break;
+			}
+
+			if (have_tracked && (!have_object || c.tracked[t].object < source.objects[row]))
+			{
+				tracked_object entry = c.tracked[t++];
+				if (entry.state == scope_state::gone)
+				{
+					continue;
+				}
+				if (entry.state == scope_state::in_scope)
+				{
+					entry.state = scope_state::leaving;
+					entry.pending = 0;
+					entry.waited = 0.0f;
+				}
+				c.merged.push_back(entry);
+				c.merged_rows.push_back(-1);
+				continue;
+			}
+
+			if (have_tracked && c.tracked[t].object == source.objects[row])
+			{
+				tracked_object entry = c.tracked[t++];
+				if (entry.state == scope_state::in_scope)
+				{
+					entry.pending |= source.changed[row];
+				}
+				else
+				{
+					//Whatever the client had was removed or is about to be, so it needs everything again.
+					entry.state = scope_state::in_scope;
+					entry.pending = source.all_values;
+				}
+				c.merged.push_back(entry);
+			}
+			else
+			{
+				tracked_object entry;
+				entry.object = source.objects[row];
+				entry.channel = channel_index;
+				entry.state = scope_state::in_scope;
+				entry.pending = source.all_values;
+				entry.waited = 0.0f;
+				c.merged.push_back(entry);
+			}
+			c.merged_rows.push_back(static_cast<std::int32_t> (row));
+			start = row + 1;
+			++r;
+		}
+	}
+
+	c.tracked.swap(c.merged);
+
+	std::size_t in_scope = 0;
+	for (std::size_t i = 0; i < c.tracked.size(); ++i)
+	{
+		tracked_object &entry = c.tracked[i];
+		if (entry.state != scope_state::in_scope)
+		{
+			continue;
+		}
+
+		++in_scope;
+		if (entry.pending)
+		{
+			int priority = channels[entry.channel].priorities[c.merged_rows[i]];
+			entry.waited += 1.0f + static_cast<float> (priority > 0 ? priority : 0);
+		}
+	}
+	c.stats.objects_in_scope = in_scope;
+}
+
+void replication_server::pack(client &c)
+{
+	std::uint32_t sequence = c.next_sequence;
+	sent_packet &slot = c.sent[sequence % sent_window];
+	if (slot.in_flight)
+	{
+		resolve(c, slot, false);
+	}
+
+	c.packet.clear();
+	diff_stream_writer out(c.packet);
+	out.write(sequence);
+	out.write(frame);
+
+	std::size_t budget = settings.packet_budget;
+
+	//Removals are small and free up the client, they go ahead of everything else.
+	for (tracked_object &entry : c.tracked)
+	{
+		if (entry.state != scope_state::leaving || out.size() + replication_format::remove_size > budget)
+		{
+			continue;
+		}
+
+		out.write(replication_format::record_kind::remove);
+		out.write(entry.channel);
+		out.write(static_cast<std::uint64_t> (entry.object));
+		entry.state = scope_state::removing;
+		slot.records.push_back(sent_record{ entry.object, entry.channel, true, 0 });
+	}
+
+	c.ranked.clear();
+	for (std::size_t i = 0; i < c.tracked.size(); ++i)
+	{
+		const tracked_object &entry = c.tracked[i];
+		if (entry.state == scope_state::in_scope && entry.pending)
+		{
+			c.ranked.emplace_back(entry.waited, static_cast<std::uint32_t> (i));
+		}
+	}
+
+	//A few records that don't fit are skipped in case smaller ones behind them do, past that the packet is as full as it'll get. Only as many
+	//as could be looked at need ordering.
+	const int max_misses = 8;
+	std::size_t most = budget / replication_format::update_size + max_misses + 1;
+	auto ranked_end = c.ranked.size() > most ? c.ranked.begin() + most : c.ranked.end();
+	std::partial_sort(c.ranked.begin(), ranked_end, c.ranked.end(), [](const std::pair<float, std::uint32_t> &a, const std::pair<float, std::uint32_t> &b)
+	{
+		return a.first > b.first || (a.first == b.first && a.second < b.second);
+	});
+
+	int misses = 0;
+	for (auto rank = c.ranked.begin(); rank != ranked_end; ++rank)
+	{
+		tracked_object &entry = c.tracked[rank->second];
+		const channel &source = channels[entry.channel];
+
+		std::uint32_t size = 0;
+		for (std::uint64_t bits = entry.pending; bits; bits = core::clear_lowest_bit(bits))
+		{
+			size += source.value_sizes[core::count_trailing_zeros(bits)];
+		}
+
+		if (out.size() + replication_format::update_size + size > budget && !slot.records.empty())
+		{
+			if (++misses > max_misses)
+			{
+				break;
+			}
+			continue;
+		}
+
+		const unsigned char *values = source.values.data() + c.merged_rows[rank->second] * static_cast<std::size_t> (source.stride);
+		out.write(replication_format::record_kind::update);
+		out.write(entry.channel);
+		out.write(static_cast<std::uint64_t> (entry.object));
+		out.write(entry.pending);
+		out.write(static_cast<std::uint16_t> (size));
+		for (std::uint64_t bits = entry.pending; bits; bits = core::clear_lowest_bit(bits))
+		{
+			int value = core::count_trailing_zeros(bits);
+			out.write_bytes(values + source.value_offsets[value], source.value_sizes[value]);
+		}
+
+		slot.records.push_back(sent_record{ entry.object, entry.channel, false, entry.pending });
+		entry.pending = 0;
+		entry.waited = 0.0f;
+	}
+
+	//With nothing new to say a packet still goes out while data is unacked, otherwise losing the last one would never show up in an ack.
+	if (slot.records.empty() && !awaiting_ack(c))
+	{
+		return;
+	}
+
+	slot.sequence = sequence;
+	slot.in_flight = true;
+	++c.next_sequence;
+	++c.stats.packets_sent;
+	c.stats.bytes_sent += c.packet.size();
+	c.transport->send(c.packet.data(), c.packet.size());
+}
+
+replication_client::replication_client()
+	: latest_sequence(0)
+	, received_bits(0)
+	, frame(-1)
+{
+}
+
+bool replication_client::receive(replication_transport &transport)
+{
+	bool valid = true;
+	bool received = false;
+	while (transport.receive(packet))
+	{
+		diff_stream_reader in(packet.data(), packet.size());
+		std::uint32_t sequence = in.read<std::uint32_t>();
+		std::int64_t packet_frame = in.read<std::int64_t>();
+		if (in.failed() || sequence <= latest_sequence)
+		{
+			valid = valid && !in.failed();
+			continue;
+		}
+
+		//Checked whole, every record's size against its changed_values included, before anything is applied so a bad packet doesn't leave
+		//half its records behind. A packet that still fails to apply isn't taken, it stays unacked and the server resends what it carried.
+		diff_stream_reader check_in = in;
+		if (!read_packet(check_in, false) || !read_packet(in, true))
+		{
+			valid = false;
+			continue;
+		}
+
+		//Bit i of received_bits is sequence latest_sequence - 1 - i.
+		std::uint32_t skipped = sequence - latest_sequence;
+		std::uint32_t shifted = skipped < replication_format::ack_bits ? received_bits << skipped : 0;
+		received_bits = latest_sequence != 0 && skipped <= replication_format::ack_bits ? shifted | (std::uint32_t(1) << (skipped - 1)) : 0;
+		latest_sequence = sequence;
+		frame = packet_frame;
+		received = true;
+	}
+
+	if (received)
+	{
+		ack.clear();
+		diff_stream_writer out(ack);
+		out.write(latest_sequence);
+		out.write(received_bits);
+		transport.send(ack.data(), ack.size());
+	}
+	return valid;
+}
+
+bool replication_client::read_packet(diff_stream_reader &in, bool apply)
+{
+	while (!in.at_end())
+	{
+		replication_format::record_kind kind = in.read<replication_format::record_kind>();
+		std::uint16_t channel = in.read<std::uint16_t>();
+		game_object_id object = static_cast<game_object_id> (in.read<std::uint64_t>());
+		if (in.failed() || channel >= channels.size())
+		{
+			return false;
+		}
+
+		if (kind == replication_format::record_kind::remove)
+		{
+			if (apply)
+			{
+				channels[channel].remove(storage, object);
+			}
+		}
+		else if (kind == replication_format::record_kind::update)
+		{
+			std::uint64_t changed_values = in.read<std::uint64_t>();
+			std::uint16_t size = in.read<std::uint16_t>();
+			const unsigned char *data = in.read_bytes(size);
+			if (!data || !channels[channel].valid_update(changed_values, size))
+			{
+				return false;
+			}
+			if (apply && !channels[channel].apply(storage, object, changed_values, data, size))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+}
+}
@@ -0,0 +1,416 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <core/asserts.h>
+#include <math/vector.h>
+#include "component.h"
+#include "diff_stream.h"
+#include "spatial_index.h"
+
+namespace tocs {
+namespace engine {
+
+//Server to client packets are a header followed by records until the end of the packet:
+//  update: kind, channel, object id, changed_values, value byte count, the values packed as state_object_diff packs them
+//  remove: kind, channel, object id
+//Clients answer with an ack naming the newest sequence they've taken and a bit for each of the 32 before it. A client only ever takes packets
+//newer than the last one it took, so anything older that isn't acked by then was lost. Packets with no records only carry the sequence along
+//for acks.
+namespace replication_format
+{
+	static constexpr int ack_bits = 32;
+
+	enum class record_kind : std::uint8_t
+	{
+		update = 1,
+		remove = 2
+	};
+
+	static constexpr std::size_t update_size = sizeof(record_kind) + sizeof(std::uint16_t) + sizeof(std::uint64_t) + sizeof(std::uint64_t) + sizeof(std::uint16_t);
+	static constexpr std::size_t remove_size = sizeof(record_kind) + sizeof(std::uint16_t) + sizeof(std::uint64_t);
+}
+
+//One end of an unreliable, message oriented link. Packets may be dropped but arrive whole.
+class replication_transport
+{
+public:
+	virtual ~replication_transport() {}
+
+	virtual void send(const unsigned char *data, std::size_t size) = 0;
+
+	//Moves the oldest waiting packet into packet, false if there isn't one.
+	virtual bool receive(std::vector<unsigned char> &packet) = 0;
+};
+
+//An in process link for tests and local play. Either end can be driven from its own thread. Every loss_interval'th packet the server sends is
+//dropped, 0 keeps them all.
+class loopback_link
+{
+	class queue
+	{
+	public:
+		std::mutex mutex;
+		std::deque<std::vector<unsigned char>> packets;
+	};
+
+	class end : public replication_transport
+	{
+		queue *outgoing;
+		queue *incoming;
+		int loss_interval;
+		int sent;
+	public:
+		end(queue *outgoing, queue *incoming, int loss_interval)
+			: outgoing(outgoing)
+			, incoming(incoming)
+			, loss_interval(loss_interval)
+			, sent(0)
+		{}
+
+		void send(const unsigned char *data, std::size_t size) override
+		{
+			if (loss_interval > 0 && ++sent % loss_interval == 0)
+			{
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(outgoing->mutex);
+			outgoing->packets.emplace_back(data, data + size);
+		}
+
+		bool receive(std::vector<unsigned char> &packet) override
+		{
+			std::lock_guard<std::mutex> lock(incoming->mutex);
+			if (incoming->packets.empty())
+			{
+				return false;
+			}
+
+			packet.swap(incoming->packets.front());
+			incoming->packets.pop_front();
+			return true;
+		}
+	};
+
+	queue to_client;
+	queue to_server;
+	end server;
+	end client;
+public:
+	explicit loopback_link(int loss_interval = 0)
+		: server(&to_client, &to_server, loss_interval)
+		, client(&to_server, &to_client, 0)
+	{}
+
+	loopback_link(const loopback_link &) = delete;
+	loopback_link &operator=(const loopback_link &) = delete;
+
+	replication_transport &server_end() { return server; }
+	replication_transport &client_end() { return client; }
+};
+
+class replication_settings
+{
+public:
+	//Bytes per packet, records that don't fit wait for a later update. A record bigger than the whole budget goes out alone.
+	std::size_t packet_budget = 1200;
+
+	//Clients handed to each job.
+	std::size_t clients_per_job = 4;
+};
+
+//Sends each client the state of the objects near it, as diffs against what it already has. Every update serializes the registered component
+//types once into per type tables, then clients are handled in parallel, each picking its relevant objects, ranking them and packing what fits
+//in one packet. A value changed since a client last had it stays pending until sent, and goes pending again if the packet carrying it is lost,
+//so clients converge on the latest state without the server keeping per client copies of it.
+//
+//Objects are ranked by how long they've waited, weighted by their component's state_object::priority. Objects leaving a client's interest are
+//removed on it, with the removal resent until acked.
+class replication_server
+{
+public:
+	typedef int client_id;
+
+	class client_stats
+	{
+	public:
+		std::uint64_t packets_sent = 0;
+		std::uint64_t bytes_sent = 0;
+		std::uint64_t packets_acked = 0;
+		std::uint64_t packets_lost = 0;
+		std::size_t objects_in_scope = 0;
+	};
+
+private:
+	class channel
+	{
+	public:
+		std::function<void(const all_component_storage &, channel &)> gather;
+
+		//Values of one object serialized back to back, at value_offsets within a stride.
+		std::vector<std::uint32_t> value_offsets;
+		std::vector<std::uint32_t> value_sizes;
+		std::uint32_t stride;
+		std::uint64_t all_values;
+
+		//This update's components sorted by object, with the values that changed since the last update.
+		std::vector<game_object_id> objects;
+		std::vector<int> priorities;
+		std::vector<std::uint64_t> changed;
+		std::vector<unsigned char> values;
+
+		//Row of each object id when ids are dense enough, otherwise empty.
+		std::vector<std::int32_t> rows;
+
+		std::vector<game_object_id> previous_objects;
+		std::vector<unsigned char> previous_values;
+
+		//Row of object, searching from start on, or objects.size() if it has none.
+		std::size_t find_row(game_object_id object, std::size_t start) const
+		{
+			if (!rows.empty() || objects.empty())
+			{
+				std::int32_t row = object < rows.size() ? rows[static_cast<std::size_t> (object)] : -1;
+				return row >= 0 && static_cast<std::size_t> (row) >= start ? static_cast<std::size_t> (row) : objects.size();
+			}
+
+			auto found = std::lower_bound(objects.begin() + start, objects.end(), object);
+			return found != objects.end() && *found == object ? static_cast<std::size_t> (found - objects.begin()) : objects.size();
+		}
+	};
+
+	enum class scope_state : std::uint8_t
+	{
+		in_scope,
+		leaving,	//Needs a removal sent.
+		removing,	//Removal in flight.
+		gone		//Removal acked, dropped at the next update.
+	};
+
+	//What one client has of one component, sorted by channel then object.
+	class tracked_object
+	{
+	public:
+		game_object_id object;
+		std::uint16_t channel;
+		scope_state state;
+		std::uint64_t pending;
+		float waited;
+	};
+
+	class sent_record
+	{
+	public:
+		game_object_id object;
+		std::uint16_t channel;
+		bool removal;
+		std::uint64_t values;
+	};
+
+	class sent_packet
+	{
+	public:
+		std::uint32_t sequence;
+		bool in_flight;
+		std::vector<sent_record> records;
+	};
+
+	//Unacked packets kept per client. Has to cover the ack window, a packet still unresolved when its slot comes round again counts as lost.
+	static constexpr int sent_window = 64;
+
+	class client
+	{
+	public:
+		replication_transport *transport;
+		math::vector3 view_position;
+		float view_radius;
+
+		std::vector<tracked_object> tracked;
+		sent_packet sent[sent_window];
+		std::uint32_t next_sequence;
+		client_stats stats;
+
+		//Reused every update.
+		std::vector<game_object_id> relevant;
+		std::vector<tracked_object> merged;
+		std::vector<std::int32_t> merged_rows;
+		std::vector<std::pair<float, std::uint32_t>> ranked;
+		std::vector<unsigned char> packet;
+	};
+
+	replication_settings settings;
+	const spatial_index *interest;
+	std::vector<channel> channels;
+	std::vector<std::unique_ptr<client>> clients;
+	std::int64_t frame;
+public:
+	explicit replication_server(const replication_settings &settings = replication_settings());
+
+	replication_server(const replication_server &) = delete;
+	replication_server &operator=(const replication_server &) = delete;
+
+	//Replicates comp_type's state values. Clients have to register the same types in the same order.
+	template <class comp_type>
+	void replicate()
+	{
+		check(channels.size() < 0xFFFF);
+		const state_object_metadata<comp_type> &meta = comp_type::meta_data;
+
+		channels.emplace_back();
+		channel &c = channels.back();
+		c.stride = 0;
+		for (const state_value_layout &layout : meta.layouts)
+		{
+			c.value_offsets.push_back(c.stride);
+			c.value_sizes.push_back(layout.size);
+			c.stride += layout.size;
+		}
+		check(c.stride < 0xFFFF);
+		c.all_values = meta.layouts.size() >= 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << meta.layouts.size()) - 1;
+
+		c.gather = [](const all_component_storage &storage, channel &c)
+		{
+			c.objects.clear();
+			const component_storage<comp_type> *comps = storage.template find_storage<comp_type>();
+			if (!comps)
+			{
+				c.priorities.clear();
+				c.changed.clear();
+				c.values.clear();
+				return;
+			}
+
+			std::vector<std::pair<game_object_id, const comp_type *>> ordered;
+			comps->for_each([&ordered](game_object_id id, const comp_type &comp)
+			{
+				ordered.emplace_back(id, &comp);
+			});
+			std::sort(ordered.begin(), ordered.end(), [](const std::pair<game_object_id, const comp_type *> &a, const std::pair<game_object_id, const comp_type *> &b)
+			{
+				return a.first < b.first;
+			});
+
+			std::size_t count = ordered.size();
+			c.objects.resize(count);
+			c.priorities.resize(count);
+			c.changed.resize(count);
+			c.values.resize(count * c.stride);
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				const comp_type &comp = *ordered[i].second;
+				c.objects[i] = ordered[i].first;
+				c.priorities[i] = comp.priority;
+				c.changed[i] = c.all_values;
+				comp_type::meta_data.serialize_values(comp, c.values.data() + i * c.stride);
+			}
+		};
+	}
+
+	//Limits each client to the objects index finds within its view radius. Without one every object is relevant to every client. The index
+	//has to be kept up to date with the state passed to update.
+	void set_interest(const spatial_index *index) { interest = index; }
+
+	client_id add_client(replication_transport &transport);
+	void remove_client(client_id id);
+
+	void set_view(client_id id, const math::vector3 &position, float radius);
+
+	const client_stats &get_stats(client_id id) const;
+
+	//Sends every client a packet for frame. Component types are gathered in parallel, then clients. Has to be called from a job_system worker.
+	void update(const all_component_storage &storage, std::int64_t frame);
+
+private:
+	void find_changes(channel &c);
+	void update_client(client &c);
+	void read_acks(client &c);
+	void resolve(client &c, sent_packet &packet, bool acked);
+	void find_relevant(client &c);
+	void merge_scope(client &c);
+	void pack(client &c);
+	static bool awaiting_ack(const client &c);
+	tracked_object *find_tracked(client &c, std::uint16_t channel, game_object_id object);
+};
+
+//The receiving end of a replication_server, holding the replicated components in its own storage.
+class replication_client
+{
+	class channel
+	{
+	public:
+		std::function<bool(all_component_storage &, game_object_id, std::uint64_t, const unsigned char *, std::size_t)> apply;
+		std::function<void(all_component_storage &, game_object_id)> remove;
+
+		//Packed size of each value, so updates can be checked against their changed_values before anything is applied.
+		std::vector<std::uint32_t> value_sizes;
+
+		//True if size is exactly the values changed_values names, and it names only registered values.
+		bool valid_update(std::uint64_t changed_values, std::size_t size) const
+		{
+			std::size_t expected = 0;
+			for (std::size_t i = 0; i < value_sizes.size(); ++i)
+			{
+				if (changed_values & (std::uint64_t(1) << i))
+				{
+					expected += value_sizes[i];
+				}
+			}
+			std::uint64_t registered = value_sizes.size() >= 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << value_sizes.size()) - 1;
+			return (changed_values & ~registered) == 0 && expected == size;
+		}
+	};
+
+	all_component_storage storage;
+	std::vector<channel> channels;
+	std::uint32_t latest_sequence;
+	std::uint32_t received_bits;
+	std::int64_t frame;
+
+	std::vector<unsigned char> packet;
+	std::vector<unsigned char> ack;
+public:
+	replication_client();
+
+	replication_client(const replication_client &) = delete;
+	replication_client &operator=(const replication_client &) = delete;
+
+	template <class comp_type>
+	void replicate()
+	{
+		channel c;
+		c.apply = [](all_component_storage &storage, game_object_id id, std::uint64_t changed_values, const unsigned char *data, std::size_t size)
+		{
+			return storage.template find_storage<comp_type>()->apply_diff(id, changed_values, data, size);
+		};
+		c.remove = [](all_component_storage &storage, game_object_id id)
+		{
+			storage.template find_storage<comp_type>()->remove(id);
+		};
+		for (const state_value_layout &layout : comp_type::meta_data.layouts)
+		{
+			c.value_sizes.push_back(layout.size);
+		}
+		channels.push_back(std::move(c));
+	}
+
+	//Applies every packet waiting on transport and acks them. Packets older than the newest one taken are dropped, the server resends what they
+	//carried. Returns false if a packet was malformed, it's dropped unapplied and unacked.
+	bool receive(replication_transport &transport);
+
+	//Frame of the newest packet taken, -1 before the first.
+	std::int64_t frame_number() const { return frame; }
+
+	const all_component_storage &get_storage() const { return storage; }
+
+private:
+	bool read_packet(diff_stream_reader &in, bool apply);
+};
+
+}
+}
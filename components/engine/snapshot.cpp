@@ -0,0 +1,136 @@
+#include "snapshot.h"
+#include <cstdio>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace tocs {
+namespace engine {
+
+bool snapshot_writer::save(const std::string &path) const
+{
+	//finish() fills in the size, an unfinished snapshot would never load.
+	check(data.size() >= sizeof(snapshot_header) && reinterpret_cast<const snapshot_header *> (data.data())->file_size == data.size());
+
+	std::FILE *file = std::fopen(path.c_str(), "wb");
+	if (!file)
+	{
+		return false;
+	}
+
+	bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+	return std::fclose(file) == 0 && written;
+}
+
+#if defined(_WIN32)
+
+bool snapshot_file::open(const std::string &path)
+{
+	close();
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	const void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	file_handle = file;
+	mapping_handle = mapping;
+	mapped = view;
+	length = static_cast<std::size_t> (size.QuadPart);
+	return true;
+}
+
+void snapshot_file::close()
+{
+	if (mapped)
+	{
+		UnmapViewOfFile(mapped);
+		CloseHandle(static_cast<HANDLE> (mapping_handle));
+		CloseHandle(static_cast<HANDLE> (file_handle));
+	}
+
+	file_handle = nullptr;
+	mapping_handle = nullptr;
+	mapped = nullptr;
+	length = 0;
+}
+
+#else
+
+bool snapshot_file::open(const std::string &path)
+{
+	close();
+
+	int file = ::open(path.c_str(), O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(file, &info) != 0 || info.st_size == 0)
+	{
+		::close(file);
+		return false;
+	}
+
+	void *view = mmap(nullptr, static_cast<std::size_t> (info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+
+	//The mapping keeps the file alive on its own.
+	::close(file);
+	if (view == MAP_FAILED)
+	{
+		return false;
+	}
+
+	mapped = view;
+	length = static_cast<std::size_t> (info.st_size);
+	return true;
+}
+
+void snapshot_file::close()
+{
+	if (mapped)
+	{
+		munmap(const_cast<void *> (mapped), length);
+	}
+
+	file_handle = nullptr;
+	mapping_handle = nullptr;
+	mapped = nullptr;
+	length = 0;
+}
+
+#endif
+
+}
+}
@@ -0,0 +1,394 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <core/asserts.h>
+
+namespace tocs {
+namespace engine {
+
+//Versioned binary snapshot of a game_state. Each component storage is one block of SoA columns, one per registered state value, holding the
+//values as their serializer writes them. Blocks and columns are aligned so a mapped file can be read in place, snapshot_view hands out pointers
+//straight into it. Layout, all offsets from the start of the file and little endian:
+//  snapshot_header
+//  blocks, each a snapshot_block_header, its snapshot_field_entry table, the object id column then the value columns
+//  live object table
+//  snapshot_block_entry table
+namespace snapshot_format
+{
+	static constexpr std::uint32_t magic = 0x50534354u; //"TCSP"
+	//2 added field ids and schema hashes, 3 names blocks by registered component name instead of typeid name.
+	static constexpr std::uint32_t version = 3;
+	static constexpr std::size_t alignment = 64;
+	static constexpr std::size_t max_name_length = 96;
+}
+
+class snapshot_header
+{
+public:
+	std::uint32_t magic;
+	std::uint32_t version;
+	std::uint64_t file_size;
+	std::int64_t frame_number;
+	double total_time;
+
+	//Id the next spawned object gets, so objects spawned after loading don't reuse saved ids.
+	std::uint64_t next_object_id;
+	std::uint64_t object_table_offset;
+	std::uint64_t object_count;
+	std::uint64_t block_table_offset;
+	std::uint64_t block_count;
+};
+
+class snapshot_block_entry
+{
+public:
+	char type_name[snapshot_format::max_name_length];
+	std::uint64_t offset;
+	std::uint64_t size;
+};
+
+class snapshot_block_header
+{
+public:
+	std::uint64_t object_count;
+	std::uint64_t ids_offset;
+	std::uint64_t schema_hash;
+	std::uint32_t field_count;
+	std::uint32_t reserved;
+};
+
+class snapshot_field_entry
+{
+public:
+	char name[snapshot_format::max_name_length];
+	std::uint32_t value_size;
+	std::uint32_t field_id;
+
+	//From the start of the block.
+	std::uint64_t column_offset;
+};
+
+//Builds a snapshot in memory. Blocks are written one at a time: begin_block, then add_column once per field, in the field_count given.
+class snapshot_writer
+{
+	std::vector<unsigned char> data;
+	std::vector<snapshot_block_entry> blocks;
+	std::size_t block_start;
+	std::uint32_t fields_written;
+public:
+	snapshot_writer(std::int64_t frame_number, double total_time, std::uint64_t next_object_id)
+		: block_start(0)
+		, fields_written(0)
+	{
+		snapshot_header header;
+		std::memset(&header, 0, sizeof(header));
+		header.magic = snapshot_format::magic;
+		header.version = snapshot_format::version;
+		header.frame_number = frame_number;
+		header.total_time = total_time;
+		header.next_object_id = next_object_id;
+		append(&header, sizeof(header));
+	}
+
+	void begin_block(const char *type_name, std::uint64_t schema_hash, std::uint64_t object_count, std::uint32_t field_count, const std::uint64_t *ids)
+	{
+		align();
+		block_start = data.size();
+		fields_written = 0;
+
+		snapshot_block_entry entry;
+		std::memset(&entry, 0, sizeof(entry));
+		copy_name(entry.type_name, type_name);
+		entry.offset = block_start;
+		blocks.push_back(entry);
+
+		snapshot_block_header header;
+		std::memset(&header, 0, sizeof(header));
+		header.object_count = object_count;
+		header.schema_hash = schema_hash;
+		header.field_count = field_count;
+		append(&header, sizeof(header));
+		data.resize(data.size() + field_count * sizeof(snapshot_field_entry), 0);
+
+		align();
+		block_header().ids_offset = data.size() - block_start;
+		append(ids, object_count * sizeof(std::uint64_t));
+		blocks.back().size = data.size() - block_start;
+	}
+
+	//Space for the block's objects' values of one field, filled by the caller. Only valid until the next call.
+	unsigned char *add_column(const char *name, std::uint32_t field_id, std::uint32_t value_size)
+	{
+		check(fields_written < block_header().field_count);
+
+		align();
+		std::size_t column_start = data.size();
+		data.resize(column_start + block_header().object_count * value_size, 0);
+
+		snapshot_field_entry &field = field_entries()[fields_written++];
+		copy_name(field.name, name);
+		field.value_size = value_size;
+		field.field_id = field_id;
+		field.column_offset = column_start - block_start;
+
+		blocks.back().size = data.size() - block_start;
+		return data.data() + column_start;
+	}
+
+	//Appends the live object table and block table and returns the finished snapshot.
+	const std::vector<unsigned char> &finish(const std::uint64_t *objects, std::size_t object_count)
+	{
+		align();
+		std::size_t object_table = data.size();
+		append(objects, object_count * sizeof(std::uint64_t));
+
+		align();
+		std::size_t block_table = data.size();
+		append(blocks.data(), blocks.size() * sizeof(snapshot_block_entry));
+
+		snapshot_header &header = *reinterpret_cast<snapshot_header *> (data.data());
+		header.file_size = data.size();
+		header.object_table_offset = object_table;
+		header.object_count = object_count;
+		header.block_table_offset = block_table;
+		header.block_count = blocks.size();
+		return data;
+	}
+
+	const std::vector<unsigned char> &get_data() const { return data; }
+
+	//Writes the finished snapshot to path.
+	bool save(const std::string &path) const;
+
+private:
+	void append(const void *source, std::size_t size)
+	{
+		const unsigned char *bytes = static_cast<const unsigned char *> (source);
+		data.insert(data.end(), bytes, bytes + size);
+	}
+
+	void align()
+	{
+		data.resize((data.size() + snapshot_format::alignment - 1) & ~(snapshot_format::alignment - 1), 0);
+	}
+
+	static void copy_name(char *dest, const char *name)
+	{
+		std::size_t length = std::strlen(name);
+		check(length < snapshot_format::max_name_length);
+		std::memcpy(dest, name, length);
+	}
+
+	snapshot_block_header &block_header()
+	{
+		return *reinterpret_cast<snapshot_block_header *> (data.data() + block_start);
+	}
+
+	snapshot_field_entry *field_entries()
+	{
+		return reinterpret_cast<snapshot_field_entry *> (data.data() + block_start + sizeof(snapshot_block_header));
+	}
+};
+
+//One component type's block inside a snapshot.
+class snapshot_block_view
+{
+	const unsigned char *block;
+public:
+	snapshot_block_view()
+		: block(nullptr)
+	{}
+
+	explicit snapshot_block_view(const unsigned char *block)
+		: block(block)
+	{}
+
+	std::uint64_t object_count() const { return header().object_count; }
+	std::uint64_t schema_hash() const { return header().schema_hash; }
+	const std::uint64_t *objects() const { return reinterpret_cast<const std::uint64_t *> (block + header().ids_offset); }
+
+	std::uint32_t field_count() const { return header().field_count; }
+	const snapshot_field_entry &field(std::uint32_t index) const
+	{
+		return reinterpret_cast<const snapshot_field_entry *> (block + sizeof(snapshot_block_header))[index];
+	}
+
+	//A field's values for every object in objects() order.
+	const void *column(std::uint32_t index) const
+	{
+		return block + field(index).column_offset;
+	}
+
+	//Looked up by name and size, nullptr if the block has no such field. For tools reading a snapshot in place, loading goes by field id.
+	const void *column(const char *name, std::uint32_t value_size) const
+	{
+		for (std::uint32_t f = 0; f < field_count(); ++f)
+		{
+			const snapshot_field_entry &entry = field(f);
+			if (entry.value_size == value_size && std::strncmp(entry.name, name, snapshot_format::max_name_length) == 0)
+			{
+				return block + entry.column_offset;
+			}
+		}
+		return nullptr;
+	}
+
+	//Typed for values the default serializer wrote, which are the raw type.
+	template <class T>
+	const T *column(const char *name) const
+	{
+		return static_cast<const T *> (column(name, sizeof(T)));
+	}
+
+private:
+	const snapshot_block_header &header() const { return *reinterpret_cast<const snapshot_block_header *> (block); }
+};
+
+//Reads a snapshot in place, from a mapped file or a writer's buffer. Every table and column is bounds checked once when the view is made,
+//a view that isn't valid() reads as empty. Columns are only 64 byte aligned in memory when the source is, mapped files always are.
+class snapshot_view
+{
+	const unsigned char *data;
+	std::size_t size;
+public:
+	snapshot_view()
+		: data(nullptr)
+		, size(0)
+	{}
+
+	snapshot_view(const void *source, std::size_t source_size)
+		: data(static_cast<const unsigned char *> (source))
+		, size(source_size)
+	{
+		if (!validate())
+		{
+			data = nullptr;
+			size = 0;
+		}
+	}
+
+	bool valid() const { return data != nullptr; }
+
+	std::int64_t frame_number() const { return valid() ? header().frame_number : 0; }
+	double total_time() const { return valid() ? header().total_time : 0; }
+	std::uint64_t next_object_id() const { return valid() ? header().next_object_id : 0; }
+
+	//The live object table.
+	std::size_t object_count() const { return valid() ? static_cast<std::size_t> (header().object_count) : 0; }
+	const std::uint64_t *objects() const { return reinterpret_cast<const std::uint64_t *> (data + header().object_table_offset); }
+
+	std::size_t block_count() const { return valid() ? static_cast<std::size_t> (header().block_count) : 0; }
+	const snapshot_block_entry &block_entry(std::size_t index) const { return block_table()[index]; }
+	snapshot_block_view block(std::size_t index) const { return snapshot_block_view(data + block_table()[index].offset); }
+
+	bool find_block(const char *type_name, snapshot_block_view &result) const
+	{
+		for (std::size_t b = 0; b < block_count(); ++b)
+		{
+			if (std::strncmp(block_table()[b].type_name, type_name, snapshot_format::max_name_length) == 0)
+			{
+				result = block(b);
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	const snapshot_header &header() const { return *reinterpret_cast<const snapshot_header *> (data); }
+	const snapshot_block_entry *block_table() const { return reinterpret_cast<const snapshot_block_entry *> (data + header().block_table_offset); }
+
+	bool in_bounds(std::uint64_t offset, std::uint64_t count, std::uint64_t element_size) const
+	{
+		return offset <= size && (element_size == 0 || count <= (size - offset) / element_size);
+	}
+
+	static bool aligned(std::uint64_t offset)
+	{
+		return offset % snapshot_format::alignment == 0;
+	}
+
+	bool validate() const
+	{
+		if (!data || size < sizeof(snapshot_header) || reinterpret_cast<std::uintptr_t> (data) % alignof(std::uint64_t) != 0)
+		{
+			return false;
+		}
+
+		const snapshot_header &h = header();
+		if (h.magic != snapshot_format::magic || h.version != snapshot_format::version || h.file_size != size
+			|| !aligned(h.object_table_offset) || !in_bounds(h.object_table_offset, h.object_count, sizeof(std::uint64_t))
+			|| !aligned(h.block_table_offset) || !in_bounds(h.block_table_offset, h.block_count, sizeof(snapshot_block_entry)))
+		{
+			return false;
+		}
+
+		for (std::uint64_t b = 0; b < h.block_count; ++b)
+		{
+			const snapshot_block_entry &entry = block_table()[b];
+			if (entry.type_name[snapshot_format::max_name_length - 1] != 0 || !aligned(entry.offset) || !in_bounds(entry.offset, 1, entry.size)
+				|| entry.size < sizeof(snapshot_block_header))
+			{
+				return false;
+			}
+
+			//Everything in the block has to sit inside the block.
+			const unsigned char *start = data + entry.offset;
+			const snapshot_block_header &block_header = *reinterpret_cast<const snapshot_block_header *> (start);
+			std::uint64_t block_size = entry.size;
+			auto in_block = [block_size](std::uint64_t offset, std::uint64_t count, std::uint64_t element_size)
+			{
+				return offset <= block_size && (element_size == 0 || count <= (block_size - offset) / element_size);
+			};
+
+			if (!in_block(sizeof(snapshot_block_header), block_header.field_count, sizeof(snapshot_field_entry))
+				|| !aligned(block_header.ids_offset) || !in_block(block_header.ids_offset, block_header.object_count, sizeof(std::uint64_t)))
+			{
+				return false;
+			}
+
+			const snapshot_field_entry *fields = reinterpret_cast<const snapshot_field_entry *> (start + sizeof(snapshot_block_header));
+			for (std::uint32_t f = 0; f < block_header.field_count; ++f)
+			{
+				if (fields[f].name[snapshot_format::max_name_length - 1] != 0 || !aligned(fields[f].column_offset)
+					|| !in_block(fields[f].column_offset, block_header.object_count, fields[f].value_size))
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+};
+
+//A snapshot file mapped read only. Views into it stay valid until the file is closed or destroyed.
+class snapshot_file
+{
+	void *file_handle;
+	void *mapping_handle;
+	const void *mapped;
+	std::size_t length;
+public:
+	snapshot_file()
+		: file_handle(nullptr)
+		, mapping_handle(nullptr)
+		, mapped(nullptr)
+		, length(0)
+	{}
+
+	~snapshot_file() { close(); }
+
+	snapshot_file(const snapshot_file &) = delete;
+	snapshot_file &operator=(const snapshot_file &) = delete;
+
+	bool open(const std::string &path);
+	void close();
+
+	snapshot_view view() const { return snapshot_view(mapped, length); }
+};
+
+}
+}
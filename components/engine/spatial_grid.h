@@ -0,0 +1,511 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <core/asserts.h>
+#include <core/bits.h>
+#include <core/frame_arena.h>
+#include <math/simd.h>
+#include <math/vector.h>
+#include <threading/trace.h>
+#include <threading/worker.h>
+
+namespace tocs {
+namespace engine {
+
+//Loose grid over hashed cells. A point goes in the cell holding its center and can drift up to looseness * cell_size outside it before the grid needs a
+//rebuild, so small moves only need a refit. Cells hash into a power of two number of buckets and each bucket's points are stored contiguously as SoA,
+//queries test them four at a time. Points are identified by their index in the arrays given to build.
+class spatial_grid
+{
+	typedef math::detail::simd_pack<float> pack;
+public:
+	explicit spatial_grid(float cell_size = 8.0f, float looseness = 0.5f)
+		: cell_size(cell_size)
+		, inverse_cell_size(1.0f / cell_size)
+		, looseness(looseness)
+		, bucket_mask(0)
+		, cursor_capacity(0)
+		, max_radius(0)
+	{
+		check(cell_size > 0 && looseness >= 0);
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			min_bound[axis] = 0;
+			max_bound[axis] = 0;
+		}
+	}
+
+	std::size_t size() const { return sources.size(); }
+	float get_cell_size() const { return cell_size; }
+
+	//Sorts count points into buckets as a parallel counting sort. radius may be nullptr for points. Has to be called from a job_system worker.
+	void build(const float *x, const float *y, const float *z, const float *radius, std::size_t count, std::size_t objects_per_job = 16384)
+	{
+		TOCS_TRACE_SCOPE("spatial_grid::build");
+
+		std::size_t bucket_count = 1024;
+		while (bucket_count * 4 < count)
+		{
+			bucket_count *= 2;
+		}
+		bucket_mask = static_cast<std::uint32_t> (bucket_count - 1);
+
+		if (cursor_capacity < bucket_count)
+		{
+			bucket_cursors.reset(new std::atomic<std::uint32_t>[bucket_count]);
+			cursor_capacity = bucket_count;
+		}
+
+		bucket_starts.resize(bucket_count + 1);
+		keys.resize(count);
+		sources.resize(count);
+		xs.resize(count);
+		ys.resize(count);
+		zs.resize(count);
+		radii.resize(count);
+		cells.resize(count * 3);
+
+		threading::job_system::parallel_for(bucket_count, buckets_per_job, [this](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t b = begin; b < end; ++b)
+			{
+				bucket_cursors[b].store(0, std::memory_order_relaxed);
+			}
+		});
+
+		//Count, every point's bucket is kept for the scatter.
+		threading::job_system::parallel_for(count, objects_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; ++i)
+			{
+				std::uint32_t key = bucket_of(cell_of(x[i]), cell_of(y[i]), cell_of(z[i]));
+				keys[i] = key;
+				bucket_cursors[key].fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+
+		//Exclusive scan of the counts into bucket_starts, each cursor starts at its bucket's first slot.
+		std::size_t scan_chunks = (bucket_count + buckets_per_job - 1) / buckets_per_job;
+		core::frame_vector<std::uint32_t> chunk_offsets(scan_chunks);
+
+		threading::job_system::parallel_for(bucket_count, buckets_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			std::uint32_t sum = 0;
+			for (std::size_t b = begin; b < end; ++b)
+			{
+				sum += bucket_cursors[b].load(std::memory_order_relaxed);
+			}
+			chunk_offsets[begin / buckets_per_job] = sum;
+		});
+
+		std::uint32_t running = 0;
+		for (std::uint32_t &offset : chunk_offsets)
+		{
+			std::uint32_t sum = offset;
+			offset = running;
+			running += sum;
+		}
+
+		threading::job_system::parallel_for(bucket_count, buckets_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			std::uint32_t start = chunk_offsets[begin / buckets_per_job];
+			for (std::size_t b = begin; b < end; ++b)
+			{
+				std::uint32_t bucket_size = bucket_cursors[b].load(std::memory_order_relaxed);
+				bucket_starts[b] = start;
+				bucket_cursors[b].store(start, std::memory_order_relaxed);
+				start += bucket_size;
+			}
+		});
+		bucket_starts[bucket_count] = static_cast<std::uint32_t> (count);
+
+		threading::job_system::parallel_for(count, objects_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t i = begin; i < end; ++i)
+			{
+				sources[bucket_cursors[keys[i]].fetch_add(1, std::memory_order_relaxed)] = static_cast<std::uint32_t> (i);
+			}
+		});
+
+		//The scatter leaves each bucket in whatever order threads got there, sorting by index makes the layout the same every run.
+		threading::job_system::parallel_for(bucket_count, buckets_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			for (std::size_t b = begin; b < end; ++b)
+			{
+				std::sort(sources.begin() + bucket_starts[b], sources.begin() + bucket_starts[b + 1]);
+			}
+		});
+
+		copy_positions(x, y, z, radius, objects_per_job, false);
+	}
+
+	//Moves the points without re-sorting, for when the same points are passed in the same order. Returns false if any left its loose cell,
+	//the grid is then out of date and needs a build. Has to be called from a job_system worker.
+	bool refit(const float *x, const float *y, const float *z, const float *radius, std::size_t count, std::size_t objects_per_job = 16384)
+	{
+		TOCS_TRACE_SCOPE("spatial_grid::refit");
+
+		if (count != size() || bucket_starts.empty())
+		{
+			return false;
+		}
+
+		return copy_positions(x, y, z, radius, objects_per_job, true);
+	}
+
+	//Appends the index of every point whose sphere touches the query sphere.
+	void query_radius(const math::vector3 &center, float radius, std::vector<std::uint32_t> &out) const
+	{
+		float c[3] = { center.x, center.y, center.z };
+		float low[3] = { c[0] - radius, c[1] - radius, c[2] - radius };
+		float high[3] = { c[0] + radius, c[1] + radius, c[2] + radius };
+
+		visit_buckets(low, high, [&](std::uint32_t begin, std::uint32_t end)
+		{
+			test_spheres(c, radius, true, begin, end, [&](std::uint32_t slot, float)
+			{
+				out.push_back(sources[slot]);
+			});
+		});
+	}
+
+	//Appends the index of every point whose sphere touches the box.
+	void query_aabb(const math::vector3 &min, const math::vector3 &max, std::vector<std::uint32_t> &out) const
+	{
+		float low[3] = { min.x, min.y, min.z };
+		float high[3] = { max.x, max.y, max.z };
+
+		visit_buckets(low, high, [&](std::uint32_t begin, std::uint32_t end)
+		{
+			test_box(low, high, begin, end, out);
+		});
+	}
+
+	//Appends the k points with centers closest to point, nearest first. The search radius grows from a density estimate until it holds k points.
+	void query_nearest(const math::vector3 &point, std::size_t k, std::vector<std::uint32_t> &out) const
+	{
+		if (k == 0 || size() == 0)
+		{
+			return;
+		}
+
+		float c[3] = { point.x, point.y, point.z };
+
+		//Past this every point is in range.
+		float farthest_sq = 0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float reach = std::max(std::abs(c[axis] - min_bound[axis]), std::abs(c[axis] - max_bound[axis]));
+			farthest_sq += reach * reach;
+		}
+
+		//Start where a uniform spread over the bounds would put about k points in range.
+		float volume = 1;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			volume *= std::max(max_bound[axis] - min_bound[axis], cell_size);
+		}
+		float search = std::max(std::cbrt(volume * k / (4.2f * size())), cell_size * 0.5f);
+
+		std::vector<std::pair<float, std::uint32_t>> candidates;
+		for (; ; search *= 1.5f)
+		{
+			candidates.clear();
+
+			float low[3] = { c[0] - search, c[1] - search, c[2] - search };
+			float high[3] = { c[0] + search, c[1] + search, c[2] + search };
+
+			visit_buckets(low, high, [&](std::uint32_t begin, std::uint32_t end)
+			{
+				test_spheres(c, search, false, begin, end, [&](std::uint32_t slot, float distance_sq)
+				{
+					candidates.push_back(std::make_pair(distance_sq, sources[slot]));
+				});
+			});
+
+			if (candidates.size() >= k || search * search >= farthest_sq)
+			{
+				break;
+			}
+		}
+
+		std::size_t found = std::min(k, candidates.size());
+		std::partial_sort(candidates.begin(), candidates.begin() + found, candidates.end());
+
+		for (std::size_t i = 0; i < found; ++i)
+		{
+			out.push_back(candidates[i].second);
+		}
+	}
+
+private:
+	static constexpr std::size_t buckets_per_job = 16384;
+
+	float cell_size;
+	float inverse_cell_size;
+	float looseness;
+
+	std::uint32_t bucket_mask;
+	std::vector<std::uint32_t> bucket_starts;
+	std::unique_ptr<std::atomic<std::uint32_t>[]> bucket_cursors;
+	std::size_t cursor_capacity;
+
+	//Per slot, in bucket order.
+	std::vector<float> xs, ys, zs, radii;
+	std::vector<std::int32_t> cells;
+	std::vector<std::uint32_t> sources;
+
+	//Per point, only used while building.
+	std::vector<std::uint32_t> keys;
+
+	float max_radius;
+	float min_bound[3];
+	float max_bound[3];
+
+	std::int32_t cell_of(float v) const
+	{
+		return static_cast<std::int32_t> (std::floor(v * inverse_cell_size));
+	}
+
+	//Teschner et al. spatial hash.
+	std::uint32_t bucket_of(std::int32_t x, std::int32_t y, std::int32_t z) const
+	{
+		return ((static_cast<std::uint32_t> (x) * 73856093u) ^ (static_cast<std::uint32_t> (y) * 19349663u) ^ (static_cast<std::uint32_t> (z) * 83492791u)) & bucket_mask;
+	}
+
+	bool outside_cell(float v, std::int32_t cell, float slack) const
+	{
+		return v < cell * cell_size - slack || v > (cell + 1) * cell_size + slack;
+	}
+
+	//Walks the slots in order pulling in each one's position and refreshes the bounds queries widen by. Without check_cells it records each slot's
+	//cell, with it it stops and returns false if a point left its loose cell, leaving the grid half updated.
+	bool copy_positions(const float *x, const float *y, const float *z, const float *radius, std::size_t objects_per_job, bool check_cells)
+	{
+		std::size_t count = size();
+		std::size_t chunk_count = (count + objects_per_job - 1) / objects_per_job;
+		core::frame_vector<float> chunk_bounds(chunk_count * 7);
+
+		std::atomic<bool> moved(false);
+		float slack = looseness * cell_size;
+
+		threading::job_system::parallel_for(count, objects_per_job, [&](std::size_t begin, std::size_t end)
+		{
+			float largest = 0;
+			float low[3] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+			float high[3] = { -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+
+			for (std::size_t slot = begin; slot < end; ++slot)
+			{
+				std::uint32_t i = sources[slot];
+				std::int32_t *cell = &cells[slot * 3];
+				if (!check_cells)
+				{
+					cell[0] = cell_of(x[i]);
+					cell[1] = cell_of(y[i]);
+					cell[2] = cell_of(z[i]);
+				}
+				else if (outside_cell(x[i], cell[0], slack) || outside_cell(y[i], cell[1], slack) || outside_cell(z[i], cell[2], slack))
+				{
+					moved.store(true, std::memory_order_relaxed);
+					return;
+				}
+
+				float r = radius ? radius[i] : 0.0f;
+				xs[slot] = x[i];
+				ys[slot] = y[i];
+				zs[slot] = z[i];
+				radii[slot] = r;
+
+				largest = std::max(largest, r);
+				low[0] = std::min(low[0], x[i]);
+				low[1] = std::min(low[1], y[i]);
+				low[2] = std::min(low[2], z[i]);
+				high[0] = std::max(high[0], x[i]);
+				high[1] = std::max(high[1], y[i]);
+				high[2] = std::max(high[2], z[i]);
+			}
+
+			float *bounds = &chunk_bounds[begin / objects_per_job * 7];
+			bounds[0] = largest;
+			std::copy(low, low + 3, bounds + 1);
+			std::copy(high, high + 3, bounds + 4);
+		});
+
+		if (moved.load(std::memory_order_relaxed))
+		{
+			return false;
+		}
+
+		max_radius = 0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			min_bound[axis] = std::numeric_limits<float>::max();
+			max_bound[axis] = -std::numeric_limits<float>::max();
+		}
+		for (std::size_t chunk = 0; chunk < chunk_count; ++chunk)
+		{
+			const float *bounds = &chunk_bounds[chunk * 7];
+			max_radius = std::max(max_radius, bounds[0]);
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				min_bound[axis] = std::min(min_bound[axis], bounds[1 + axis]);
+				max_bound[axis] = std::max(max_bound[axis], bounds[4 + axis]);
+			}
+		}
+		return true;
+	}
+
+	//Calls func(begin, end) with the slot range of every bucket a query box can find points in, each bucket once. The box is widened by how far a sphere
+	//can reach out of its cell. A box covering more cells than there are buckets just walks every bucket.
+	template <class func_type>
+	void visit_buckets(const float *low, const float *high, func_type &&func) const
+	{
+		if (size() == 0)
+		{
+			return;
+		}
+
+		float reach = max_radius + looseness * cell_size;
+		std::int32_t first[3], last[3];
+		std::uint64_t cell_count = 1;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			first[axis] = cell_of(std::max(low[axis], min_bound[axis]) - reach);
+			last[axis] = cell_of(std::min(high[axis], max_bound[axis]) + reach);
+			if (last[axis] < first[axis])
+			{
+				return;
+			}
+			cell_count *= static_cast<std::uint64_t> (last[axis] - first[axis] + 1);
+		}
+
+		std::size_t bucket_count = bucket_starts.size() - 1;
+		if (cell_count >= bucket_count)
+		{
+			for (std::size_t b = 0; b < bucket_count; ++b)
+			{
+				if (bucket_starts[b] != bucket_starts[b + 1])
+				{
+					func(bucket_starts[b], bucket_starts[b + 1]);
+				}
+			}
+			return;
+		}
+
+		//Different cells can share a bucket, visiting it twice would report its points twice.
+		std::vector<std::uint32_t> buckets;
+		buckets.reserve(static_cast<std::size_t> (cell_count));
+		for (std::int32_t cz = first[2]; cz <= last[2]; ++cz)
+		{
+			for (std::int32_t cy = first[1]; cy <= last[1]; ++cy)
+			{
+				for (std::int32_t cx = first[0]; cx <= last[0]; ++cx)
+				{
+					buckets.push_back(bucket_of(cx, cy, cz));
+				}
+			}
+		}
+		std::sort(buckets.begin(), buckets.end());
+		buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+
+		for (std::uint32_t b : buckets)
+		{
+			if (bucket_starts[b] != bucket_starts[b + 1])
+			{
+				func(bucket_starts[b], bucket_starts[b + 1]);
+			}
+		}
+	}
+
+	//func(slot, distance_sq) for every slot in [begin, end) within radius of center, plus the point's own radius when use_radii is set.
+	template <class func_type>
+	void test_spheres(const float *center, float radius, bool use_radii, std::uint32_t begin, std::uint32_t end, func_type &&func) const
+	{
+		const pack cx(center[0]), cy(center[1]), cz(center[2]), query_radius(radius);
+
+		std::uint32_t slot = begin;
+		for (; slot + pack::element_count <= end; slot += pack::element_count)
+		{
+			auto dx = pack::load(&xs[slot]).sub(cx);
+			auto dy = pack::load(&ys[slot]).sub(cy);
+			auto dz = pack::load(&zs[slot]).sub(cz);
+			auto distance_sq = dx.c_mul(dx).add(dy.c_mul(dy)).add(dz.c_mul(dz));
+
+			auto reach = use_radii ? query_radius.add(pack::load(&radii[slot])) : query_radius;
+			std::uint64_t hits = ~reach.c_mul(reach).c_less(distance_sq).sign_mask() & 0xF;
+
+			if (hits)
+			{
+				float distances[pack::element_count];
+				distance_sq.store(distances);
+				for (; hits; hits = core::clear_lowest_bit(hits))
+				{
+					int lane = core::count_trailing_zeros(hits);
+					func(slot + lane, distances[lane]);
+				}
+			}
+		}
+
+		for (; slot < end; ++slot)
+		{
+			float dx = xs[slot] - center[0], dy = ys[slot] - center[1], dz = zs[slot] - center[2];
+			float distance_sq = dx * dx + dy * dy + dz * dz;
+			float reach = use_radii ? radius + radii[slot] : radius;
+			if (!(reach * reach < distance_sq))
+			{
+				func(slot, distance_sq);
+			}
+		}
+	}
+
+	//Distance from each center to the box, zero inside it, against the point's radius.
+	void test_box(const float *low, const float *high, std::uint32_t begin, std::uint32_t end, std::vector<std::uint32_t> &out) const
+	{
+		const pack low_x(low[0]), low_y(low[1]), low_z(low[2]);
+		const pack high_x(high[0]), high_y(high[1]), high_z(high[2]);
+		const pack zero;
+
+		std::uint32_t slot = begin;
+		for (; slot + pack::element_count <= end; slot += pack::element_count)
+		{
+			auto x = pack::load(&xs[slot]);
+			auto y = pack::load(&ys[slot]);
+			auto z = pack::load(&zs[slot]);
+			auto r = pack::load(&radii[slot]);
+
+			auto ex = low_x.sub(x).c_max(x.sub(high_x)).c_max(zero);
+			auto ey = low_y.sub(y).c_max(y.sub(high_y)).c_max(zero);
+			auto ez = low_z.sub(z).c_max(z.sub(high_z)).c_max(zero);
+			auto distance_sq = ex.c_mul(ex).add(ey.c_mul(ey)).add(ez.c_mul(ez));
+
+			std::uint64_t hits = ~r.c_mul(r).c_less(distance_sq).sign_mask() & 0xF;
+			for (; hits; hits = core::clear_lowest_bit(hits))
+			{
+				out.push_back(sources[slot + core::count_trailing_zeros(hits)]);
+			}
+		}
+
+		for (; slot < end; ++slot)
+		{
+			float ex = std::max(std::max(low[0] - xs[slot], xs[slot] - high[0]), 0.0f);
+			float ey = std::max(std::max(low[1] - ys[slot], ys[slot] - high[1]), 0.0f);
+			float ez = std::max(std::max(low[2] - zs[slot], zs[slot] - high[2]), 0.0f);
+			float distance_sq = ex * ex + ey * ey + ez * ez;
+			if (!(radii[slot] * radii[slot] < distance_sq))
+			{
+				out.push_back(sources[slot]);
+			}
+		}
+	}
+};
+
+}
+}
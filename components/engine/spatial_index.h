@@ -0,0 +1,152 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <core/asserts.h>
+#include <math/vector.h>
+#include <threading/trace.h>
+#include "component.h"
+#include "spatial_grid.h"
+
+namespace tocs {
+namespace engine {
+
+//A spatial_grid over the objects that have one component type, keyed by game object. world::update_spatial_index refreshes it from the current
+//game_state, refitting while the same objects stay near their cells and rebuilding otherwise.
+class spatial_index
+{
+	std::function<void(const all_component_storage &)> gather;
+
+	spatial_grid grid;
+
+	//Sorted by id so the same set of objects always lands in the same order and can be refit.
+	std::vector<game_object_id> objects;
+	std::vector<float> x, y, z, radius;
+
+	std::vector<game_object_id> gathered_objects;
+	std::vector<std::uint32_t> order;
+	std::vector<float> gathered;
+public:
+	explicit spatial_index(float cell_size = 8.0f, float looseness = 0.5f)
+		: grid(cell_size, looseness)
+	{
+	}
+
+	//Indexes comp_type at position(const comp_type &), which returns a math::vector3, as spheres of radius(const comp_type &).
+	template <class comp_type, class position_func, class radius_func>
+	void track(position_func position, radius_func radius)
+	{
+		gather = [this, position, radius](const all_component_storage &storage)
+		{
+			gathered_objects.clear();
+			gathered.clear();
+
+			const component_storage<comp_type> *comps = storage.template find_storage<comp_type>();
+			if (!comps)
+			{
+				return;
+			}
+
+			comps->for_each([&](game_object_id id, const comp_type &comp)
+			{
+				math::vector3 p = position(comp);
+				gathered_objects.push_back(id);
+				gathered.push_back(p.x);
+				gathered.push_back(p.y);
+				gathered.push_back(p.z);
+				gathered.push_back(radius(comp));
+			});
+		};
+	}
+
+	//The same with every object the same size.
+	template <class comp_type, class position_func>
+	void track(position_func position, float radius = 0.0f)
+	{
+		track<comp_type>(position, [radius](const comp_type &) { return radius; });
+	}
+
+	bool is_tracking() const { return static_cast<bool> (gather); }
+
+	std::size_t size() const { return objects.size(); }
+	const std::vector<game_object_id> &get_objects() const { return objects; }
+
+	//Has to be called from a job_system worker.
+	void update(const all_component_storage &storage)
+	{
+		TOCS_TRACE_SCOPE("update_spatial_index");
+		check(is_tracking());
+
+		gather(storage);
+
+		std::size_t count = gathered_objects.size();
+		order.resize(count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			order[i] = static_cast<std::uint32_t> (i);
+		}
+		std::sort(order.begin(), order.end(), [this](std::uint32_t a, std::uint32_t b)
+		{
+			return gathered_objects[a] < gathered_objects[b];
+		});
+
+		bool same_objects = count == objects.size();
+		objects.resize(count);
+		x.resize(count);
+		y.resize(count);
+		z.resize(count);
+		radius.resize(count);
+
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			std::uint32_t from = order[i];
+			same_objects = same_objects && objects[i] == gathered_objects[from];
+			objects[i] = gathered_objects[from];
+			x[i] = gathered[from * 4];
+			y[i] = gathered[from * 4 + 1];
+			z[i] = gathered[from * 4 + 2];
+			radius[i] = gathered[from * 4 + 3];
+		}
+
+		if (!same_objects || !grid.refit(x.data(), y.data(), z.data(), radius.data(), count))
+		{
+			grid.build(x.data(), y.data(), z.data(), radius.data(), count);
+		}
+	}
+
+	//Queries append the ids of matching objects to out. Safe to run from several threads between updates.
+	void query_radius(const math::vector3 &center, float distance, std::vector<game_object_id> &out) const
+	{
+		std::vector<std::uint32_t> indices;
+		grid.query_radius(center, distance, indices);
+		append_objects(indices, out);
+	}
+
+	void query_aabb(const math::vector3 &min, const math::vector3 &max, std::vector<game_object_id> &out) const
+	{
+		std::vector<std::uint32_t> indices;
+		grid.query_aabb(min, max, indices);
+		append_objects(indices, out);
+	}
+
+	//The k objects nearest to point, closest first.
+	void query_nearest(const math::vector3 &point, std::size_t k, std::vector<game_object_id> &out) const
+	{
+		std::vector<std::uint32_t> indices;
+		grid.query_nearest(point, k, indices);
+		append_objects(indices, out);
+	}
+
+private:
+	void append_objects(const std::vector<std::uint32_t> &indices, std::vector<game_object_id> &out) const
+	{
+		for (std::uint32_t i : indices)
+		{
+			out.push_back(objects[i]);
+		}
+	}
+};
+
+}
+}
@@ -2,6 +2,13 @@
 #include <vector>
 #include <memory>
 #include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <core/asserts.h>
+#include <core/bits.h>
+#include <core/frame_arena.h>
 
 #include "Serializer.h"
 #include "Interpolation.h"
@@ -9,11 +16,18 @@
 namespace tocs {
 namespace engine {
 
+template <class type, class outer_type, class interpolation, class type_serializer>
+class state_value_metadata;
+
 template<class ValType>
 class state_value
 {
 	bool changed;
 	ValType value;
+
+	//Metadata writes interpolated values straight into presentation copies without marking them changed.
+	template <class type, class outer_type, class interpolation, class type_serializer>
+	friend class state_value_metadata;
 public:
 
 	state_value() : value(), changed(false) {}
@@ -33,6 +47,7 @@ public:
 	{
 		changed = true;
 		value = new_value;
+		return *this;
 	}
 
 	bool has_changed() const { return changed; }
@@ -44,7 +59,63 @@ class state_object_diff
 {
 public:
 	std::bitset<64> changed_values;
-	std::vector<unsigned char> value_memory;
+	//Diffs are transient, they live in the frame arena and are only valid until the end of the next frame.
+	core::frame_vector<unsigned char> value_memory;
+};
+
+//FNV-1a, evaluated at compile time for registration name literals. A value's field id is the hash of its name unless registered with one,
+//so saved data refers to fields by something that doesn't move when fields are added or reordered.
+constexpr std::uint32_t hash_field_name(const char *name)
+{
+	std::uint32_t hash = 2166136261u;
+	for (; *name; ++name)
+	{
+		hash = (hash ^ static_cast<unsigned char> (*name)) * 16777619u;
+	}
+	return hash;
+}
+
+//Folds one field into a type's schema hash, FNV-1a 64 over its id and serialized size.
+constexpr std::uint64_t hash_schema_field(std::uint64_t hash, std::uint32_t field_id, std::uint32_t size)
+{
+	for (int b = 0; b < 4; ++b)
+	{
+		hash = (hash ^ ((field_id >> (b * 8)) & 0xFF)) * 1099511628211ull;
+	}
+	for (int b = 0; b < 4; ++b)
+	{
+		hash = (hash ^ ((size >> (b * 8)) & 0xFF)) * 1099511628211ull;
+	}
+	return hash;
+}
+
+static constexpr std::uint64_t empty_schema_hash = 14695981039346656037ull;
+
+//How values saved under some version of a type's schema line up with the current one, by field id. Built once per saved schema so applying
+//old diffs and snapshot columns is a table lookup per value rather than matching fields by name. Identity when the schemas hash the same.
+class state_schema_remap
+{
+public:
+	class entry
+	{
+	public:
+		//Current value index, -1 for fields that no longer exist or changed size.
+		int target;
+		std::uint32_t size;
+	};
+
+	bool identity = true;
+	std::vector<entry> entries;
+};
+
+//Where a value lives inside its object and how many bytes its serializer writes. Values whose serializer is a plain copy are applied with
+//memcpy straight into the object, the rest go through their metadata's deserialize.
+class state_value_layout
+{
+public:
+	std::uint32_t offset;
+	std::uint32_t size;
+	bool raw_copy;
 };
 
 template <class outer_type>
@@ -53,20 +124,37 @@ class base_state_value_metadata
 public:
 	int value_index;
 	std::string value_name;
+	std::uint32_t field_id;
+
+	//Kernel and float count the batched presentation pass uses for this value, none if it can't be batched.
+	interpolation_kind batch_kind;
+	int lane_count;
 
-	base_state_value_metadata(int value_index, const std::string &value_name)
+	base_state_value_metadata(int value_index, const std::string &value_name, std::uint32_t field_id, interpolation_kind batch_kind, int lane_count)
 		: value_index(value_index)
 		, value_name(value_name)
+		, field_id(field_id)
+		, batch_kind(batch_kind)
+		, lane_count(lane_count)
 	{}
 
 	virtual ~base_state_value_metadata() {}
 
 	virtual size_t data_size() const = 0;
 
-	virtual void serialize(outer_type *obj, void *data) = 0;
+	virtual void serialize(const outer_type *obj, void *data) const = 0;
+
+	//Reads a value serialize wrote back into obj without marking it changed.
+	virtual void deserialize(outer_type *obj, const void *data) const = 0;
 
 	//We might be able to avoid a virtual call here if we know the dirty flag is always the first thing in the state_value<>
-	virtual bool is_dirty(outer_type *obj) const = 0;
+	virtual bool is_dirty(const outer_type *obj) const = 0;
+
+	//Blends this value between two copies of the object using its interpolation_type, t = 0 is from.
+	virtual void interpolate(const outer_type &from, const outer_type &to, float t, outer_type &result) const = 0;
+
+	//Byte offset of the value's floats inside obj. Only meaningful when batch_kind isn't none.
+	virtual std::ptrdiff_t lane_offset(const outer_type &obj) const = 0;
 };
 
 
@@ -76,15 +164,33 @@ class state_value_meta_data_constructor
 public:
 	const char *name;
 	state_value<type> outer_type::*value_ptr;
+	std::uint32_t id;
 
 	template<int n>
 	constexpr state_value_meta_data_constructor(state_value<type> outer_type::* value_ptr, const char(&name)[n])
 		: name(&name[0])
 		, value_ptr(value_ptr)
+		, id(hash_field_name(name))
 	{}
 
 	constexpr state_value_meta_data_constructor(const state_value_meta_data_constructor &copyme) = default;
 
+	//Changing the interpolation or serialization produces a new constructor type carrying the same value.
+	template <class other_interp, class other_serialization>
+	constexpr state_value_meta_data_constructor(const state_value_meta_data_constructor<outer_type, type, other_interp, other_serialization> &copyme)
+		: name(copyme.name)
+		, value_ptr(copyme.value_ptr)
+		, id(copyme.id)
+	{}
+
+	//Pins the field id, so a renamed value keeps reading data saved under its old name.
+	constexpr state_value_meta_data_constructor field_id(std::uint32_t new_id) const
+	{
+		state_value_meta_data_constructor result(*this);
+		result.id = new_id;
+		return result;
+	}
+
 	template <class new_interp>
 	constexpr auto interpolation() const
 	{
@@ -104,14 +210,21 @@ decltype(state)::meta_data_type::obj_type, \
 decltype(NAME)::underlying_type> \
 (&decltype(state)::meta_data_type::obj_type::NAME, #NAME)
 
-template <class type, class outer_type, class interpolation = no_interp, class type_serializer = serializer<type>>
+template <class type, class outer_type, class interpolation = no_interp<type>, class type_serializer = serializer<type>>
 class state_value_metadata : public base_state_value_metadata<outer_type>
 {
 public:
 	state_value<type> outer_type::*value_ptr;
 
-	state_value_metadata(state_value<type> outer_type::* value_ptr, int index, const std::string &value_name)
-		: base_state_value_metadata<outer_type>(index, value_name)
+	static constexpr interpolation_kind batch_kind_for_type()
+	{
+		return float_lanes<type>::count == 0 ? interpolation_kind::none
+			: (interpolation::kind == interpolation_kind::nlerp || interpolation::kind == interpolation_kind::slerp) && float_lanes<type>::count != 4 ? interpolation_kind::none
+			: interpolation::kind;
+	}
+
+	state_value_metadata(state_value<type> outer_type::* value_ptr, int index, const std::string &value_name, std::uint32_t field_id)
+		: base_state_value_metadata<outer_type>(index, value_name, field_id, batch_kind_for_type(), float_lanes<type>::count)
 		, value_ptr(value_ptr)
 	{}
 
@@ -120,15 +233,43 @@ public:
 		return type_serializer::size_in_bytes();
 	}
 
-	void serialize(outer_type *obj, void *data) final override
+	void serialize(const outer_type *obj, void *data) const final override
 	{
 		type_serializer::write((obj->*value_ptr).get_value(), data);
 	}
 
-	bool is_dirty(outer_type *obj) const final override
+	void deserialize(outer_type *obj, const void *data) const final override
+	{
+		type_serializer::read(const_cast<void *> (data), (obj->*value_ptr).value);
+	}
+
+	bool is_dirty(const outer_type *obj) const final override
 	{
 		return (obj->*value_ptr).has_changed();
 	}
+
+	void interpolate(const outer_type &from, const outer_type &to, float t, outer_type &result) const final override
+	{
+		(result.*value_ptr).value = interpolation::interpolate((from.*value_ptr).value, (to.*value_ptr).value, t);
+	}
+
+	std::ptrdiff_t lane_offset(const outer_type &obj) const final override
+	{
+		return reinterpret_cast<const char *> (&(obj.*value_ptr).value) - reinterpret_cast<const char *> (&obj);
+	}
+
+	//Worked out on uninitialized storage, components aren't default constructible.
+	state_value_layout layout() const
+	{
+		alignas(outer_type) unsigned char storage[sizeof(outer_type)];
+		const outer_type *obj = reinterpret_cast<const outer_type *> (storage);
+
+		state_value_layout result;
+		result.offset = static_cast<std::uint32_t> (reinterpret_cast<const unsigned char *> (&(obj->*value_ptr).value) - storage);
+		result.size = static_cast<std::uint32_t> (type_serializer::size_in_bytes());
+		result.raw_copy = std::is_same<type_serializer, serializer<type>>::value && std::is_trivially_copyable<type>::value;
+		return result;
+	}
 };
 
 template <class outer_type>
@@ -137,6 +278,12 @@ class state_object_metadata
 public:
 	std::vector<std::unique_ptr<base_state_value_metadata<outer_type>>> values;
 
+	//Indexed like values, kept apart so applying diffs walks one small array.
+	std::vector<state_value_layout> layouts;
+
+	//Changes whenever a field is added, removed, resized or gets a different id. Saved data with the same hash needs no remapping.
+	std::uint64_t schema_hash = empty_schema_hash;
+
 	typedef outer_type obj_type;
 
 	state_object_metadata()
@@ -145,12 +292,50 @@ public:
 	}
 
 	template <class type, class interpolation, class serializer>
-	void register_value(state_value_meta_data_constructor<outer_type, type, interpolation, serializer> & value_data)
+	void register_value(const state_value_meta_data_constructor<outer_type, type, interpolation, serializer> &value_data)
 	{
-		values.emplace_back(new state_value_metadata<type, outer_type, interpolation, serializer>(value_data.value_ptr, values.size(), value_data.name));
+		check(find_value(value_data.id) < 0);
+
+		auto value = new state_value_metadata<type, outer_type, interpolation, serializer>(value_data.value_ptr, values.size(), value_data.name, value_data.id);
+		values.emplace_back(value);
+		layouts.push_back(value->layout());
+		schema_hash = hash_schema_field(schema_hash, value_data.id, layouts.back().size);
 	}
 
-	state_object_diff create_diff(outer_type &obj)
+	//Index of the value with field_id, or -1.
+	int find_value(std::uint32_t field_id) const
+	{
+		for (std::size_t i = 0; i < values.size(); ++i)
+		{
+			if (values[i]->field_id == field_id)
+			{
+				return static_cast<int> (i);
+			}
+		}
+		return -1;
+	}
+
+	//Remap for data saved with source_hash, whose fields were field_ids with serialized sizes, in their old index order.
+	state_schema_remap make_remap(std::uint64_t source_hash, const std::uint32_t *field_ids, const std::uint32_t *sizes, std::size_t count) const
+	{
+		state_schema_remap result;
+		result.identity = source_hash == schema_hash && count == values.size();
+		if (result.identity)
+		{
+			return result;
+		}
+
+		result.entries.resize(count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			int target = find_value(field_ids[i]);
+			result.entries[i].target = target >= 0 && layouts[target].size == sizes[i] ? target : -1;
+			result.entries[i].size = sizes[i];
+		}
+		return result;
+	}
+
+	state_object_diff create_diff(const outer_type &obj) const
 	{
 		state_object_diff result;
 		size_t result_binary_size = 0;
@@ -164,7 +349,6 @@ public:
 			}
 		}
 
-		//TODO: Some sort of allocation pool?
 		result.value_memory.resize(result_binary_size, 0);
 		unsigned char *data_ptr = &result.value_memory[0];
 
@@ -176,6 +360,131 @@ public:
 				data_ptr += value->data_size();
 			}
 		}
+
+		return result;
+	}
+
+	//Serializes every value back to back in index order, the layout a diff with all bits set packs them in.
+	void serialize_values(const outer_type &obj, unsigned char *data) const
+	{
+		const unsigned char *base = reinterpret_cast<const unsigned char *> (&obj);
+		for (std::size_t i = 0; i < layouts.size(); ++i)
+		{
+			const state_value_layout &layout = layouts[i];
+			if (layout.raw_copy)
+			{
+				copy_value(data, base + layout.offset, layout.size);
+			}
+			else
+			{
+				values[i]->serialize(&obj, data);
+			}
+			data += layout.size;
+		}
+	}
+
+	//Writes a diff's values back into obj without marking them changed, the reverse of create_diff. changed_values bits past the registered values
+	//are ignored. Returns false if data is too short for the values it says are there.
+	bool apply_diff(outer_type &obj, std::uint64_t changed_values, const unsigned char *data, std::size_t size) const
+	{
+		std::uint64_t registered = layouts.size() >= 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << layouts.size()) - 1;
+		unsigned char *base = reinterpret_cast<unsigned char *> (&obj);
+
+		//Set bits come out lowest first, the order create_diff packed them in.
+		for (std::uint64_t bits = changed_values & registered; bits; bits = core::clear_lowest_bit(bits))
+		{
+			int index = core::count_trailing_zeros(bits);
+			const state_value_layout &layout = layouts[index];
+			if (layout.size > size)
+			{
+				return false;
+			}
+
+			apply_value(base, index, data);
+			data += layout.size;
+			size -= layout.size;
+		}
+		return true;
+	}
+
+	//The same for a diff packed under another schema, changed_values holds the old value indices.
+	bool apply_diff(outer_type &obj, std::uint64_t changed_values, const unsigned char *data, std::size_t size, const state_schema_remap &remap) const
+	{
+		if (remap.identity)
+		{
+			return apply_diff(obj, changed_values, data, size);
+		}
+
+		unsigned char *base = reinterpret_cast<unsigned char *> (&obj);
+		for (std::uint64_t bits = changed_values; bits; bits = core::clear_lowest_bit(bits))
+		{
+			std::size_t index = static_cast<std::size_t> (core::count_trailing_zeros(bits));
+			if (index >= remap.entries.size() || remap.entries[index].size > size)
+			{
+				return false;
+			}
+
+			const state_schema_remap::entry &entry = remap.entries[index];
+			if (entry.target >= 0)
+			{
+				apply_value(base, entry.target, data);
+			}
+			data += entry.size;
+			size -= entry.size;
+		}
+		return true;
+	}
+
+	//Writes one serialized value into the object at base without marking it changed.
+	void apply_value(unsigned char *base, int index, const unsigned char *data) const
+	{
+		const state_value_layout &layout = layouts[index];
+		if (layout.raw_copy)
+		{
+			copy_value(base + layout.offset, data, layout.size);
+		}
+		else
+		{
+			values[index]->deserialize(reinterpret_cast<outer_type *> (base), data);
+		}
+	}
+
+	bool apply_diff(outer_type &obj, const state_object_diff &diff) const
+	{
+		return apply_diff(obj, diff.changed_values.to_ullong(), diff.value_memory.data(), diff.value_memory.size());
+	}
+
+	//Fills result with every registered value blended between from and to. Values registered with no_interp hold from's value.
+	void interpolate(const outer_type &from, const outer_type &to, float t, outer_type &result) const
+	{
+		for (auto &value : values)
+		{
+			value->interpolate(from, to, t, result);
+		}
+	}
+
+private:
+	//Fixed size copies for the common value sizes compile to a single move instead of a call to memcpy.
+	static void copy_value(unsigned char *dest, const unsigned char *source, std::uint32_t size)
+	{
+		switch (size)
+		{
+		case 4:
+			std::memcpy(dest, source, 4);
+			break;
+		case 8:
+			std::memcpy(dest, source, 8);
+			break;
+		case 12:
+			std::memcpy(dest, source, 12);
+			break;
+		case 16:
+			std::memcpy(dest, source, 16);
+			break;
+		default:
+			std::memcpy(dest, source, size);
+			break;
+		}
 	}
 };
 
@@ -187,7 +496,8 @@ public:
 	typedef state_object_metadata<outer_type> meta_data_type;
 	static meta_data_type meta_data;
 
-	int priority;
+	//Relative importance for replication, higher values are sent to clients sooner when bandwidth is short.
+	int priority = 0;
 
 };
 
@@ -0,0 +1,159 @@
+#include "system.h"
+#include <algorithm>
+#include <chrono>
+#include <core/frame_arena.h>
+
+namespace tocs {
+namespace engine {
+
+static bool contains_any(const std::vector<std::type_index> &a, const std::vector<std::type_index> &b)
+{
+	for (const std::type_index &type : a)
+	{
+		if (std::find(b.begin(), b.end(), type) != b.end())
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool system_access::conflicts_with(const system_access &other) const
+{
+	return (spawns && other.spawns)
+		|| contains_any(writes, other.writes)
+		|| contains_any(writes, other.reads)
+		|| contains_any(reads, other.writes);
+}
+
+void system_scheduler::build_graph()
+{
+	const auto &systems = registry->get_systems();
+	std::size_t count = systems.size();
+
+	dependents.assign(count, std::vector<int>());
+	dependency_counts.assign(count, 0);
+	remaining_dependencies.reset(new std::atomic<int>[count]);
+	average_costs.resize(count, 1.0f);
+	critical_paths.assign(count, 0.0f);
+
+	//Edges always point from earlier to later registrations, so the graph can't have cycles and index order is a valid topological order.
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		for (std::size_t j = i + 1; j < count; ++j)
+		{
+			if (systems[i].access.conflicts_with(systems[j].access))
+			{
+				dependents[i].push_back(static_cast<int> (j));
+				++dependency_counts[j];
+			}
+		}
+	}
+
+	built_version = registry->get_version();
+}
+
+void system_scheduler::compute_critical_paths()
+{
+	for (std::size_t i = dependents.size(); i-- > 0;)
+	{
+		float longest_tail = 0.0f;
+		for (int dependent : dependents[i])
+		{
+			longest_tail = std::max(longest_tail, critical_paths[dependent]);
+		}
+		critical_paths[i] = average_costs[i] + longest_tail;
+	}
+}
+
+void system_scheduler::queue_systems(int *indices, std::size_t count)
+{
+	//The owning worker pops the most recently queued job first, so queue the longest critical path last.
+	std::sort(indices, indices + count, [this](int a, int b)
+	{
+		return critical_paths[a] < critical_paths[b];
+	});
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		int index = indices[i];
+		threading::job_system::queue_job([this, index]()
+		{
+			run_system(index);
+		}, threading::job_priority::critical);
+	}
+}
+
+void system_scheduler::run_system(int index)
+{
+	const system_registry::entry &system = registry->get_systems()[index];
+
+	auto start = std::chrono::high_resolution_clock::now();
+	{
+		TOCS_TRACE_SCOPE(system.trace_name);
+		system.update(*current_world);
+	}
+	auto elapsed = std::chrono::high_resolution_clock::now() - start;
+
+	//Only this system writes its own cost during the frame, the scheduler reads it after the frame is done.
+	float cost = std::chrono::duration_cast<std::chrono::duration<float, std::micro>>(elapsed).count();
+	average_costs[index] = average_costs[index] * 0.9f + cost * 0.1f;
+
+	core::frame_vector<int> ready;
+	for (int dependent : dependents[index])
+	{
+		if (remaining_dependencies[dependent].fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			ready.push_back(dependent);
+		}
+	}
+
+	if (!ready.empty())
+	{
+		queue_systems(ready.data(), ready.size());
+	}
+
+	remaining_systems.fetch_sub(1, std::memory_order_release);
+}
+
+void system_scheduler::run_frame(world &w, const system_registry &systems)
+{
+	if (registry != &systems || built_version != systems.get_version())
+	{
+		registry = &systems;
+		build_graph();
+	}
+
+	std::size_t count = dependents.size();
+	if (count == 0)
+	{
+		return;
+	}
+
+	current_world = &w;
+	compute_critical_paths();
+
+	core::frame_vector<int> roots;
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		remaining_dependencies[i].store(dependency_counts[i], std::memory_order_relaxed);
+		if (dependency_counts[i] == 0)
+		{
+			roots.push_back(static_cast<int> (i));
+		}
+	}
+
+	remaining_systems.store(static_cast<int> (count), std::memory_order_release);
+
+	queue_systems(roots.data(), roots.size());
+
+	threading::job_system::wait_until([this]()
+	{
+		return remaining_systems.load(std::memory_order_acquire) == 0;
+	});
+
+	current_world = nullptr;
+}
+
+}
+}
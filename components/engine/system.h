@@ -0,0 +1,150 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <typeindex>
+#include <threading/worker.h>
+
+namespace tocs {
+namespace engine {
+
+class world;
+
+//The component types a system touches. Anything that writes a type can't run alongside anything else touching that type.
+class system_access
+{
+public:
+	std::vector<std::type_index> reads;
+	std::vector<std::type_index> writes;
+
+	//Spawning systems are ordered against each other so object ids come out the same every run, as long as each spawns from one job.
+	bool spawns = false;
+
+	bool conflicts_with(const system_access &other) const;
+};
+
+class system_registry;
+
+//Returned from system_registry::add_system so access can be declared in a chain.
+//registry.add_system("movement", func).reads<velocity>().writes<position>();
+class system_registration
+{
+	system_registry *registry;
+	std::size_t index;
+public:
+	system_registration(system_registry &registry, std::size_t index)
+		: registry(&registry)
+		, index(index)
+	{}
+
+	template <class comp_type>
+	system_registration &reads();
+
+	template <class comp_type>
+	system_registration &writes();
+
+	system_registration &spawns();
+};
+
+class system_registry
+{
+public:
+	class entry
+	{
+	public:
+		std::string name;
+		//name interned for trace events, which keep the pointer until they're exported.
+		const char *trace_name;
+		std::function<void(world &)> update;
+		system_access access;
+	};
+private:
+	std::vector<entry> systems;
+	int version;
+public:
+	friend class system_registration;
+
+	system_registry()
+		: version(0)
+	{}
+
+	//Systems that conflict run in the order they were added.
+	system_registration add_system(const std::string &name, std::function<void(world &)> update)
+	{
+		systems.push_back(entry{ name, threading::tracer::intern(name), std::move(update), system_access{} });
+		++version;
+		return system_registration(*this, systems.size() - 1);
+	}
+
+	const std::vector<entry> &get_systems() const { return systems; }
+
+	//Bumped whenever systems or their access change so the scheduler knows to rebuild its graph.
+	int get_version() const { return version; }
+};
+
+template <class comp_type>
+system_registration &system_registration::reads()
+{
+	registry->systems[index].access.reads.emplace_back(typeid(comp_type));
+	++registry->version;
+	return *this;
+}
+
+template <class comp_type>
+system_registration &system_registration::writes()
+{
+	registry->systems[index].access.writes.emplace_back(typeid(comp_type));
+	++registry->version;
+	return *this;
+}
+
+inline system_registration &system_registration::spawns()
+{
+	registry->systems[index].access.spawns = true;
+	++registry->version;
+	return *this;
+}
+
+//Runs every registered system once per frame on the job system.
+//Systems with conflicting access get an edge in a dependency graph and everything else runs in parallel.
+//When several systems become ready at once the one with the longest remaining critical path goes first,
+//using each system's measured run time from previous frames.
+class system_scheduler
+{
+	const system_registry *registry;
+	world *current_world;
+	int built_version;
+
+	std::vector<std::vector<int>> dependents;
+	std::vector<int> dependency_counts;
+	std::unique_ptr<std::atomic<int>[]> remaining_dependencies;
+	std::vector<float> average_costs;
+	std::vector<float> critical_paths;
+
+	std::atomic<int> remaining_systems;
+
+	void build_graph();
+	void compute_critical_paths();
+	void queue_systems(int *indices, std::size_t count);
+	void run_system(int index);
+public:
+	system_scheduler()
+		: registry(nullptr)
+		, current_world(nullptr)
+		, built_version(-1)
+		, remaining_systems(0)
+	{}
+
+	system_scheduler(const system_scheduler &) = delete;
+	system_scheduler &operator=(const system_scheduler &) = delete;
+
+	//Must be called from a job_system worker, the calling thread helps run systems until the frame is done.
+	void run_frame(world &w, const system_registry &systems);
+
+	float get_average_cost(int index) const { return average_costs[index]; }
+};
+
+}
+}
@@ -0,0 +1,147 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include <core/asserts.h>
+#include <math/batch.h>
+#include <math/matrix.h>
+#include <threading/trace.h>
+#include <threading/worker.h>
+
+namespace tocs {
+namespace engine {
+
+//Scene graph flattened into arrays. After sort_by_depth() nodes are ordered breadth first, so every parent comes before its children,
+//siblings are next to each other and each depth is one contiguous range that can be split across jobs.
+class transform_hierarchy
+{
+public:
+	//Negative for roots.
+	std::vector<int> parents;
+	std::vector<math::matrix4> locals;
+	std::vector<math::matrix4> worlds;
+
+	transform_hierarchy()
+		: depth_starts(1, 0)
+		, sorted(true)
+	{}
+
+	std::size_t size() const { return parents.size(); }
+
+	//The parent has to be added first. Adding nodes leaves the depth ranges stale until the next sort_by_depth().
+	int add_node(int parent, const math::matrix4 &local)
+	{
+		check(parent < static_cast<int> (parents.size()));
+
+		parents.push_back(parent);
+		locals.push_back(local);
+		worlds.push_back(local);
+		sorted = false;
+
+		return static_cast<int> (parents.size()) - 1;
+	}
+
+	//Stable reorder by depth, keeping children of the same parent together. Returns the new index of every old index so callers can fix up their handles.
+	std::vector<int> sort_by_depth()
+	{
+		std::size_t count = size();
+
+		//Parents come first so one forward pass finds every depth.
+		std::vector<int> depths(count);
+		int max_depth = -1;
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			depths[i] = parents[i] < 0 ? 0 : depths[parents[i]] + 1;
+			max_depth = std::max(max_depth, depths[i]);
+		}
+
+		//Bucket by depth, then order each depth by its parents' new positions so siblings stay together. Roots keep their old order.
+		depth_starts.assign(max_depth + 2, 0);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			++depth_starts[depths[i] + 1];
+		}
+		for (int depth = 0; depth <= max_depth; ++depth)
+		{
+			depth_starts[depth + 1] += depth_starts[depth];
+		}
+
+		std::vector<int> order(count);
+		std::vector<std::size_t> next(depth_starts.begin(), depth_starts.end() - 1);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			order[next[depths[i]]++] = static_cast<int> (i);
+		}
+
+		std::vector<int> remap(count);
+		for (int depth = 0; depth <= max_depth; ++depth)
+		{
+			auto first = order.begin() + depth_starts[depth];
+			auto last = order.begin() + depth_starts[depth + 1];
+
+			if (depth > 0)
+			{
+				std::stable_sort(first, last, [&](int a, int b)
+				{
+					return remap[parents[a]] < remap[parents[b]];
+				});
+			}
+
+			for (auto i = first; i != last; ++i)
+			{
+				remap[*i] = static_cast<int> (i - order.begin());
+			}
+		}
+
+		std::vector<int> new_parents(count);
+		std::vector<math::matrix4> new_locals(count);
+		std::vector<math::matrix4> new_worlds(count);
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			int old_index = order[i];
+			new_parents[i] = parents[old_index] < 0 ? -1 : remap[parents[old_index]];
+			new_locals[i] = locals[old_index];
+			new_worlds[i] = worlds[old_index];
+		}
+
+		parents.swap(new_parents);
+		locals.swap(new_locals);
+		worlds.swap(new_worlds);
+		sorted = true;
+
+		return remap;
+	}
+
+	std::size_t depth_count() const { return sorted ? depth_starts.size() - 1 : 0; }
+	std::size_t depth_begin(std::size_t depth) const { return depth_starts[depth]; }
+	std::size_t depth_end(std::size_t depth) const { return depth_starts[depth + 1]; }
+
+	//Every world matrix in one pass on the calling thread. Only needs parents before children, not a depth sort.
+	void update()
+	{
+		TOCS_TRACE_SCOPE("transform_hierarchy::update");
+		math::batch_propagate_transforms(parents.data(), locals.data(), worlds.data(), 0, size());
+	}
+
+	//Each depth split into jobs of nodes_per_job, one depth after another. Has to be called from a job_system worker after sort_by_depth().
+	void update_parallel(std::size_t nodes_per_job = 4096)
+	{
+		TOCS_TRACE_SCOPE("transform_hierarchy::update_parallel");
+		check(sorted);
+
+		for (std::size_t depth = 0; depth < depth_count(); ++depth)
+		{
+			std::size_t first = depth_begin(depth);
+			threading::job_system::parallel_for(depth_end(depth) - first, nodes_per_job, [this, first](std::size_t begin, std::size_t end)
+			{
+				math::batch_propagate_transforms(parents.data(), locals.data(), worlds.data(), first + begin, first + end);
+			});
+		}
+	}
+
+private:
+	std::vector<std::size_t> depth_starts;
+	bool sorted;
+};
+
+}
+}
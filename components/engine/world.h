@@ -2,6 +2,21 @@
 #include "gametime.h"
 #include "gameobject.h"
 #include "component.h"
+#include "system.h"
+#include "presentation.h"
+#include "spatial_index.h"
+#include "bvh_index.h"
+#include "replay.h"
+#include "replication.h"
+#include "published_state.h"
+#include <core/frame_arena.h>
+#include <threading/trace.h>
+#include <threading/counters.h>
+#include <threading/task.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
 
 namespace tocs {
 namespace engine {
@@ -31,14 +46,45 @@ public:
 };
 
 
+//How the fixed step loop in world::update turns real time into simulation ticks.
+class fixed_step_settings
+{
+public:
+	float tick_length = 1.0f / 60.0f;
+
+	//Catch up cap. If real time gets further ahead than this many ticks the backlog is dropped instead of spiralling.
+	int max_ticks_per_update = 4;
+};
+
 class world
 {
 	game_timer timer;
+	float tick_accumulator;
+	float tick_alpha;
 	std::unique_ptr<game_state> state_history[game_state::num_state_histories];
+	system_scheduler scheduler;
+
+	//Readers pin slots through a const world, the pin counts are the only thing they change.
+	mutable state_publisher<game_state, game_state::num_state_histories> publisher;
+
+	threading::perf_counter_snapshot counter_totals;
+	threading::perf_counter_snapshot last_frame_counters;
+
+	bool deterministic;
 public:
 	game_object_manager game_objects;
+	system_registry systems;
+	fixed_step_settings fixed_step;
+
+#if TOCS_HAS_COROUTINES
+	//Coroutines that co_await this pick up again as jobs once the next frame has been prepared.
+	threading::frame_barrier next_frame;
+#endif
 	
 	world()
+		: tick_accumulator(0)
+		, tick_alpha(0)
+		, deterministic(false)
 	{
 		for (int i = 0; i < game_state::num_state_histories; ++i)
 		{
@@ -46,9 +92,61 @@ public:
 		}
 	}
 
+	//The state systems are writing this frame. Only the simulation should touch it, other threads read the published state instead.
 	game_state &current_state()	{ return state_for_frame(timer.time().frame_number()); }
 	const game_state &current_state() const	{ return state_for_frame(timer.time().frame_number()); }
 
+	typedef state_publisher<game_state, game_state::num_state_histories>::pinned_state pinned_state;
+
+	//The newest frame whose systems have all finished, held until the pin is released. Lock free and safe from any thread, render, network and
+	//telemetry threads read this while the simulation writes the next frame. Empty before the first frame completes.
+	pinned_state pin_latest_state() const
+	{
+		return publisher.pin_latest();
+	}
+
+	//A specific completed frame, empty once it has fallen out of the state history.
+	pinned_state pin_state(int frame) const
+	{
+		return publisher.pin(frame);
+	}
+
+	//Makes a run reproducible from the same inputs, for lockstep peers and replays. Component storages walk in id order so systems, indices and
+	//recorders see components the same way every run, and replays record each frame's checksum. Systems still run in parallel. Their own
+	//parallel work has to go through component_storage::parallel_for_each and parallel_reduce, which split work by id and combine it in order,
+	//and systems that spawn objects have to declare it with spawns().
+	void set_deterministic(bool enabled)
+	{
+		deterministic = enabled;
+		for (auto &state : state_history)
+		{
+			state->component_storage.set_ordered_iteration(enabled);
+		}
+	}
+
+	bool is_deterministic() const { return deterministic; }
+
+	//Checksum of a frame's component state, see all_component_storage::checksum. Peers compare these to catch a desync the frame it happens.
+	//frame has to still be in the state history and not have systems running on it. Has to be called from a job_system worker.
+	std::uint64_t frame_checksum(int frame) const
+	{
+		TOCS_TRACE_SCOPE("frame_checksum");
+		int current = timer.time().frame_number();
+		check(frame <= current && frame > current - game_state::num_state_histories);
+		return state_for_frame(frame).component_storage.checksum();
+	}
+
+	//128 bit hash of a frame's component state, see all_component_storage::state_hash. Only pages of objects whose components were written,
+	//added or removed since the frame's slot was last hashed are read again, so a frame that touched few objects hashes in a fraction of
+	//frame_checksum's time, one that wrote every object costs about the same. The same rules as frame_checksum.
+	core::hash::digest128 state_hash(int frame) const
+	{
+		TOCS_TRACE_SCOPE("state_hash");
+		int current = timer.time().frame_number();
+		check(frame <= current && frame > current - game_state::num_state_histories);
+		return state_for_frame(frame).component_storage.state_hash();
+	}
+
 	game_object_id spawn_object()
 	{
 		//Newly spawned objects enter a temporary pergatory until the end of the current frame.
@@ -63,30 +161,291 @@ public:
 		return handle->get_id();
 	}
 
+	//The reference is for setting the new component up, state_hash won't see writes through it after the frame is next hashed.
 	template <class T>
-	void add_component(game_object_id id)
+	T &add_component(game_object_id id)
 	{
+		return current_state().component_storage.alloc_component<T>(id);
+	}
 
+	//The current game_state's T of id to write, or nullptr if it has none. Marks it for state_hash, see component_storage::find_for_write.
+	template <class T>
+	T *write_component(game_object_id id)
+	{
+		return current_state().component_storage.find_for_write<T>(id);
 	}
 
+	//Applies received diffs to the current game_state's comp_type components, see component_storage::apply_diffs.
+	template <class T>
+	bool apply_diffs(const object_diff *diffs, std::size_t count)
+	{
+		return current_state().component_storage.apply_diffs<T>(diffs, count);
+	}
+
+	//Variable step, game time follows the real clock.
 	void advance_frame()
 	{
+		TOCS_TRACE_SCOPE("advance_frame");
+		end_frame_counters();
 		timer.advance_frame();
+		begin_frame();
+	}
 
+	//Fixed step, game time moves by exactly fixed_step.tick_length.
+	void advance_fixed_frame()
+	{
+		TOCS_TRACE_SCOPE("advance_frame");
+		end_frame_counters();
+		timer.advance_fixed_frame(fixed_step.tick_length);
+		begin_frame();
+	}
+
+	//Runs as many fixed ticks as the real time since the last update covers, up to the catch up cap.
+	//Each tick advances a frame and runs every system. Has to be called from a job_system worker. Returns the number of ticks run.
+	int update()
+	{
+		return update(timer.consume_real_time());
+	}
+
+	int update(float real_dt)
+	{
+		tick_accumulator += real_dt;
+
+		int ticks = 0;
+		while (tick_accumulator >= fixed_step.tick_length && ticks < fixed_step.max_ticks_per_update)
+		{
+			advance_fixed_frame();
+			run_systems();
+
+			tick_accumulator -= fixed_step.tick_length;
+			++ticks;
+		}
+
+		if (tick_accumulator >= fixed_step.tick_length)
+		{
+			//Fell behind by more than the cap, keep only the partial tick so presentation stays smooth.
+			tick_accumulator = std::fmod(tick_accumulator, fixed_step.tick_length);
+		}
+
+		tick_alpha = tick_accumulator / fixed_step.tick_length;
+		return ticks;
+	}
+
+	//How far real time is between the previous tick and the current one, 0 to 1. Used to blend presentation state.
+	float interpolation_alpha() const { return tick_alpha; }
+
+	//Real seconds until update will run another tick.
+	float time_until_next_tick() const { return fixed_step.tick_length - tick_accumulator; }
+
+	//Blends an object's component between the last two game_states at interpolation_alpha, using each value's interpolation_type.
+	//Returns false if the object has no comp_type this frame. Objects spawned this tick have nothing to blend from and get the current values.
+	template <class comp_type>
+	bool interpolate_component(game_object_id id, comp_type &result) const
+	{
+		int frame = timer.time().frame_number();
+
+		const comp_type *to = state_for_frame(frame).component_storage.template find<comp_type>(id);
+		if (!to)
+		{
+			return false;
+		}
+
+		const comp_type *from = state_for_frame(frame - 1).component_storage.template find<comp_type>(id);
+		if (!from)
+		{
+			from = to;
+		}
+
+		comp_type::meta_data.interpolate(*from, *to, tick_alpha, result);
+		return true;
+	}
+
+	//Refills every buffer tracked by out with the last two game_states blended at interpolation_alpha. Has to be called from a job_system worker.
+	void build_presentation(presentation &out) const
+	{
+		int frame = timer.time().frame_number();
+		out.build(state_for_frame(frame - 1).component_storage, state_for_frame(frame).component_storage, tick_alpha);
+	}
+
+	//Refits or rebuilds index from the current game_state's positions, call it once per update. Has to be called from a job_system worker.
+	void update_spatial_index(spatial_index &index) const
+	{
+		index.update(current_state().component_storage);
+	}
+
+	//The same for a bvh_index, which refits the boxes that moved since its last update.
+	void update_bvh_index(bvh_index &index) const
+	{
+		index.update(current_state().component_storage);
+	}
+
+	//Saves the current game_state, objects spawned this frame included. Call it between frames, not while systems run.
+	snapshot_writer write_snapshot() const
+	{
+		TOCS_TRACE_SCOPE("write_snapshot");
 		game_time time = timer.time();
+		const game_state &state = current_state();
+
+		snapshot_writer writer(time.frame_number(), time.total_time(), game_objects.last_id.load());
+		state.component_storage.write_snapshot(writer);
+
+		std::vector<std::uint64_t> objects = live_object_ids();
+		writer.finish(objects.data(), objects.size());
+		return writer;
+	}
+
+	bool save_snapshot(const std::string &path) const
+	{
+		return write_snapshot().save(path);
+	}
+
+	//Replaces every object and component with the snapshot's. Every state history gets the same values so presentation has nothing stale
+	//to blend from. The timer keeps running from where it is, the saved frame number and time are left for the caller to use. Call it between frames.
+	void load_snapshot(const snapshot_view &snapshot)
+	{
+		TOCS_TRACE_SCOPE("load_snapshot");
+		check(snapshot.valid());
+
+		//Every slot gets rewritten, so nothing stays published.
+		publisher.retire_all();
+
+		//Objects spawned this frame haven't reached the manager yet.
 		game_state &state = current_state();
-		game_state &prev_state = state_for_frame(time.frame_number() - 1);
+		for (auto &obj : state.live_objects.object_purgatory)
+		{
+			game_objects.objects.return_item(obj);
+		}
+
+		std::vector<threading::concurrent_pool_handle<game_object>> restored;
+		game_objects.restore(snapshot.objects(), snapshot.object_count(), static_cast<game_object_id> (snapshot.next_object_id()), restored);
+
+		for (int i = 0; i < game_state::num_state_histories; ++i)
+		{
+			state_history[i]->live_objects.live_objects.clear();
+			state_history[i]->live_objects.object_purgatory.clear();
+			state_history[i]->component_storage.read_snapshot(snapshot);
+		}
+		state.live_objects.live_objects = std::move(restored);
+	}
+
+	//Maps the file and copies it into every state history, snapshot_component_view reads one without loading it. Returns false if it can't
+	//be opened or isn't a valid snapshot.
+	bool load_snapshot(const std::string &path)
+	{
+		snapshot_file file;
+		if (!file.open(path) || !file.view().valid())
+		{
+			return false;
+		}
+
+		load_snapshot(file.view());
+		return true;
+	}
 
-		game_objects.move_from_pergatory(prev_state.live_objects.object_purgatory);
+	//Appends the current frame to recorder, call it once per tick after run_systems. Frames that don't follow the last one recorded are
+	//saved as keyframes. In deterministic mode each frame's checksum goes in too, which needs a job_system worker.
+	void record_replay_frame(replay_recorder &recorder) const
+	{
+		TOCS_TRACE_SCOPE("record_replay_frame");
+		game_time time = timer.time();
+		int frame = time.frame_number();
+		std::vector<std::uint64_t> objects = live_object_ids();
 
-		state.prepare_frame(prev_state);
+		if (recorder.needs_keyframe(frame))
+		{
+			recorder.record_keyframe(frame, write_snapshot().get_data(), objects.data(), objects.size());
+		}
+		else
+		{
+			recorder.record_frame(frame, time.total_time(), deterministic ? frame_checksum(frame) : 0, current_state().component_storage, state_for_frame(frame - 1).component_storage, objects.data(), objects.size());
+		}
 	}
 
+	//Sends server's clients the newest completed frame. Reads a pinned state, so it can run on its own worker while the simulation carries on
+	//with the next frame. Has to be called from a job_system worker.
+	void replicate(replication_server &server) const
+	{
+		pinned_state state = pin_latest_state();
+		if (state)
+		{
+			server.update(state->component_storage, state.frame_number());
+		}
+	}
+
+	//Runs every registered system for the current frame. Has to be called from a job_system worker.
+	void run_systems()
+	{
+		TOCS_TRACE_SCOPE("run_systems");
+		scheduler.run_frame(*this, systems);
+	}
+
+	//Hot path counters summed across threads for the last completed frame.
+	const threading::perf_counter_snapshot &frame_counters() const { return last_frame_counters; }
+
 	game_time get_time()
 	{
 		return timer.time();
 	}
 private:
+	void end_frame_counters()
+	{
+		//Everything counted since the last advance belongs to the frame that just finished.
+		threading::perf_counter_snapshot totals = threading::perf_counters::totals();
+		last_frame_counters = totals - counter_totals;
+		counter_totals = totals;
+	}
+
+	//Current objects, spawned this frame included, in id order.
+	std::vector<std::uint64_t> live_object_ids() const
+	{
+		const game_state &state = current_state();
+
+		std::vector<std::uint64_t> objects;
+		objects.reserve(state.live_objects.live_objects.size() + state.live_objects.object_purgatory.size());
+		for (auto &obj : state.live_objects.live_objects)
+		{
+			objects.push_back(obj->get_id());
+		}
+		for (auto &obj : state.live_objects.object_purgatory)
+		{
+			objects.push_back(obj->get_id());
+		}
+		std::sort(objects.begin(), objects.end());
+		return objects;
+	}
+
+	void begin_frame()
+	{
+		game_time time = timer.time();
+		TOCS_TRACE_EVENT(threading::trace_event_type::frame, "frame", static_cast<std::uint32_t> (time.frame_number()));
+		core::frame_arena::begin_frame(time.frame_number());
+
+		game_state &state = current_state();
+		game_state &prev_state = state_for_frame(time.frame_number() - 1);
+
+		{
+			TOCS_TRACE_SCOPE("publish_state");
+			publisher.publish(time.frame_number() - 1, prev_state);
+			publisher.retire(time.frame_number());
+		}
+		state.time = time;
+
+		{
+			TOCS_TRACE_SCOPE("move_from_purgatory");
+			TOCS_COUNT(purgatory_objects, prev_state.live_objects.object_purgatory.size());
+			game_objects.move_from_pergatory(prev_state.live_objects.object_purgatory);
+		}
+
+		{
+			TOCS_TRACE_SCOPE("prepare_frame");
+			state.prepare_frame(prev_state);
+		}
+
+#if TOCS_HAS_COROUTINES
+		next_frame.release();
+#endif
+	}
+
 	game_state &state_for_frame(int framenumber)
 	{
 		return *state_history[framenumber % game_state::num_state_histories];
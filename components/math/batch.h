@@ -0,0 +1,306 @@
+#pragma once
+#include <cstddef>
+#include <cmath>
+#include <core/asserts.h>
+
+#include "simd.h"
+#include "quaternion.h"
+#include "matrix.h"
+
+namespace tocs {
+namespace math {
+
+//Four parallel arrays, one per quaternion component. Batched quaternion kernels work on this layout so each simd lane holds a different quaternion.
+template <class float_type>
+class quaternion_lanes
+{
+public:
+	float_type *x;
+	float_type *y;
+	float_type *z;
+	float_type *w;
+};
+
+namespace detail
+{
+
+//Four quaternions split into component packs, lane i of each pack belongs to the same quaternion.
+class quaternion_pack
+{
+public:
+	simd_pack<float> x, y, z, w;
+
+	static quaternion_pack VECTORCALL load(quaternion_lanes<const float> lanes, std::size_t i)
+	{
+		return quaternion_pack{ simd_pack<float>::load(lanes.x + i), simd_pack<float>::load(lanes.y + i), simd_pack<float>::load(lanes.z + i), simd_pack<float>::load(lanes.w + i) };
+	}
+
+	//From four consecutive xyzw quaternions.
+	static quaternion_pack VECTORCALL load(const quaternion_base<float, simd_enabled> *quaternions)
+	{
+		quaternion_pack result{ quaternions[0].simd, quaternions[1].simd, quaternions[2].simd, quaternions[3].simd };
+		simd_pack<float>::transpose(result.x, result.y, result.z, result.w);
+		return result;
+	}
+
+	void VECTORCALL store(quaternion_lanes<float> lanes, std::size_t i) const
+	{
+		x.store(lanes.x + i);
+		y.store(lanes.y + i);
+		z.store(lanes.z + i);
+		w.store(lanes.w + i);
+	}
+
+	void VECTORCALL store(quaternion_base<float, simd_enabled> *quaternions) const
+	{
+		simd_pack<float> a = x, b = y, c = z, d = w;
+		simd_pack<float>::transpose(a, b, c, d);
+		quaternions[0].simd = a;
+		quaternions[1].simd = b;
+		quaternions[2].simd = c;
+		quaternions[3].simd = d;
+	}
+
+	static simd_pack<float> VECTORCALL dot(const quaternion_pack &a, const quaternion_pack &b)
+	{
+		return a.x.c_mul(b.x).add(a.y.c_mul(b.y)).add(a.z.c_mul(b.z).add(a.w.c_mul(b.w)));
+	}
+
+	static quaternion_pack VECTORCALL slerp(const quaternion_pack &from, const quaternion_pack &to, const slerp_weight_terms &terms)
+	{
+		const simd_pack<float> sign_bit(-0.0f);
+
+		auto dot_product = dot(from, to);
+		auto flip = dot_product.bit_and(sign_bit);
+
+		simd_pack<float> from_weight, to_weight;
+		terms.weights(dot_product.bit_xor(flip), from_weight, to_weight);
+		to_weight = to_weight.bit_xor(flip);
+
+		return quaternion_pack{
+			from.x.c_mul(from_weight).add(to.x.c_mul(to_weight)),
+			from.y.c_mul(from_weight).add(to.y.c_mul(to_weight)),
+			from.z.c_mul(from_weight).add(to.z.c_mul(to_weight)),
+			from.w.c_mul(from_weight).add(to.w.c_mul(to_weight)) };
+	}
+};
+
+}
+
+//result[i] = from[i] * (1 - t) + to[i] * t, the same blend as engine::linear_interp. result may alias from or to.
+inline void batch_lerp(const float *from, const float *to, float t, float *result, std::size_t count)
+{
+	const detail::simd_pack<float> to_weight(t);
+	const detail::simd_pack<float> from_weight(1.0f - t);
+
+	std::size_t i = 0;
+	for (; i + detail::simd_pack<float>::element_count <= count; i += detail::simd_pack<float>::element_count)
+	{
+		auto a = detail::simd_pack<float>::load(from + i);
+		auto b = detail::simd_pack<float>::load(to + i);
+
+		a.c_mul(from_weight).add(b.c_mul(to_weight)).store(result + i);
+	}
+
+	for (; i < count; ++i)
+	{
+		result[i] = from[i] * (1.0f - t) + to[i] * t;
+	}
+}
+
+//Normalized lerp along the shortest arc, to is negated wherever the pair is more than 180 degrees apart.
+//Cheap and good enough for blending between neighbouring frames, the angular error only shows on large steps.
+inline void batch_nlerp(quaternion_lanes<const float> from, quaternion_lanes<const float> to, float t, quaternion_lanes<float> result, std::size_t count)
+{
+	typedef detail::simd_pack<float> pack;
+
+	const pack to_weight(t);
+	const pack from_weight(1.0f - t);
+	const pack sign_bit(-0.0f);
+
+	std::size_t i = 0;
+	for (; i + pack::element_count <= count; i += pack::element_count)
+	{
+		auto fx = pack::load(from.x + i);
+		auto fy = pack::load(from.y + i);
+		auto fz = pack::load(from.z + i);
+		auto fw = pack::load(from.w + i);
+
+		auto tx = pack::load(to.x + i);
+		auto ty = pack::load(to.y + i);
+		auto tz = pack::load(to.z + i);
+		auto tw = pack::load(to.w + i);
+
+		auto dot = fx.c_mul(tx).add(fy.c_mul(ty)).add(fz.c_mul(tz).add(fw.c_mul(tw)));
+		auto flip = dot.bit_and(sign_bit);
+
+		auto rx = fx.c_mul(from_weight).add(tx.bit_xor(flip).c_mul(to_weight));
+		auto ry = fy.c_mul(from_weight).add(ty.bit_xor(flip).c_mul(to_weight));
+		auto rz = fz.c_mul(from_weight).add(tz.bit_xor(flip).c_mul(to_weight));
+		auto rw = fw.c_mul(from_weight).add(tw.bit_xor(flip).c_mul(to_weight));
+
+		auto length = rx.c_mul(rx).add(ry.c_mul(ry)).add(rz.c_mul(rz).add(rw.c_mul(rw))).c_sqrt();
+
+		rx.c_div(length).store(result.x + i);
+		ry.c_div(length).store(result.y + i);
+		rz.c_div(length).store(result.z + i);
+		rw.c_div(length).store(result.w + i);
+	}
+
+	for (; i < count; ++i)
+	{
+		float sign = from.x[i] * to.x[i] + from.y[i] * to.y[i] + from.z[i] * to.z[i] + from.w[i] * to.w[i] < 0 ? -t : t;
+
+		float rx = from.x[i] * (1.0f - t) + to.x[i] * sign;
+		float ry = from.y[i] * (1.0f - t) + to.y[i] * sign;
+		float rz = from.z[i] * (1.0f - t) + to.z[i] * sign;
+		float rw = from.w[i] * (1.0f - t) + to.w[i] * sign;
+
+		float length = std::sqrt(rx * rx + ry * ry + rz * rz + rw * rw);
+
+		result.x[i] = rx / length;
+		result.y[i] = ry / length;
+		result.z[i] = rz / length;
+		result.w[i] = rw / length;
+	}
+}
+
+//Same result as quaternion::slerp for every pair, four per iteration.
+inline void batch_slerp(quaternion_lanes<const float> from, quaternion_lanes<const float> to, float t, quaternion_lanes<float> result, std::size_t count)
+{
+	const detail::slerp_weight_terms weight(t);
+
+	std::size_t i = 0;
+	for (; i + detail::simd_pack<float>::element_count <= count; i += detail::simd_pack<float>::element_count)
+	{
+		detail::quaternion_pack::slerp(detail::quaternion_pack::load(from, i), detail::quaternion_pack::load(to, i), weight).store(result, i);
+	}
+
+	for (; i < count; ++i)
+	{
+		quaternion_base<float, simd_enabled> q = quaternion_base<float, simd_enabled>::slerp(
+			quaternion_base<float, simd_enabled>(from.x[i], from.y[i], from.z[i], from.w[i]),
+			quaternion_base<float, simd_enabled>(to.x[i], to.y[i], to.z[i], to.w[i]), t);
+
+		float lanes[4];
+		q.simd.store(lanes);
+		result.x[i] = lanes[0];
+		result.y[i] = lanes[1];
+		result.z[i] = lanes[2];
+		result.w[i] = lanes[3];
+	}
+}
+
+//Array of quaternions version, transposes four at a time into lanes. result may alias from or to.
+inline void batch_slerp(const quaternion_base<float, simd_enabled> *from, const quaternion_base<float, simd_enabled> *to, float t, quaternion_base<float, simd_enabled> *result, std::size_t count)
+{
+	const detail::slerp_weight_terms weight(t);
+
+	//Two independent packs per iteration keep more multiply-adds in flight.
+	std::size_t i = 0;
+	for (; i + 2 * detail::simd_pack<float>::element_count <= count; i += 2 * detail::simd_pack<float>::element_count)
+	{
+		auto first = detail::quaternion_pack::slerp(detail::quaternion_pack::load(from + i), detail::quaternion_pack::load(to + i), weight);
+		auto second = detail::quaternion_pack::slerp(detail::quaternion_pack::load(from + i + 4), detail::quaternion_pack::load(to + i + 4), weight);
+		first.store(result + i);
+		second.store(result + i + 4);
+	}
+
+	for (; i + detail::simd_pack<float>::element_count <= count; i += detail::simd_pack<float>::element_count)
+	{
+		detail::quaternion_pack::slerp(detail::quaternion_pack::load(from + i), detail::quaternion_pack::load(to + i), weight).store(result + i);
+	}
+
+	for (; i < count; ++i)
+	{
+		result[i] = quaternion_base<float, simd_enabled>::slerp(from[i], to[i], t);
+	}
+}
+
+//quaternion::squad for every set of keys and control points.
+inline void batch_squad(quaternion_lanes<const float> a, quaternion_lanes<const float> b, quaternion_lanes<const float> c, quaternion_lanes<const float> d, float t, quaternion_lanes<float> result, std::size_t count)
+{
+	const detail::slerp_weight_terms weight(t);
+	const detail::slerp_weight_terms inner_weight(2 * t * (1 - t));
+
+	std::size_t i = 0;
+	for (; i + detail::simd_pack<float>::element_count <= count; i += detail::simd_pack<float>::element_count)
+	{
+		auto outer = detail::quaternion_pack::slerp(detail::quaternion_pack::load(a, i), detail::quaternion_pack::load(d, i), weight);
+		auto inner = detail::quaternion_pack::slerp(detail::quaternion_pack::load(b, i), detail::quaternion_pack::load(c, i), weight);
+		detail::quaternion_pack::slerp(outer, inner, inner_weight).store(result, i);
+	}
+
+	for (; i < count; ++i)
+	{
+		typedef quaternion_base<float, simd_enabled> quat;
+
+		quat q = quat::squad(
+			quat(a.x[i], a.y[i], a.z[i], a.w[i]),
+			quat(b.x[i], b.y[i], b.z[i], b.w[i]),
+			quat(c.x[i], c.y[i], c.z[i], c.w[i]),
+			quat(d.x[i], d.y[i], d.z[i], d.w[i]), t);
+
+		float lanes[4];
+		q.simd.store(lanes);
+		result.x[i] = lanes[0];
+		result.y[i] = lanes[1];
+		result.z[i] = lanes[2];
+		result.w[i] = lanes[3];
+	}
+}
+
+//World matrices for nodes [begin, end) of a hierarchy flattened so parents come before their children, world = worlds[parent] * local.
+//Roots have a negative parent and copy their local. Every parent of the range must already be done, so either run the whole array
+//in one call or one depth at a time with the ranges inside a depth split up however you like.
+inline void batch_propagate_transforms(const int *parents, const matrix4 *locals, matrix4 *worlds, std::size_t begin, std::size_t end)
+{
+	typedef detail::simd_pack<float> pack;
+
+	//Siblings sit next to each other, so the parent's broadcasts are only redone when the parent changes.
+	int cached_parent = -1;
+	pack parent_lanes[4][4];
+
+	for (std::size_t i = begin; i < end; ++i)
+	{
+		int parent = parents[i];
+		const matrix4 &local = locals[i];
+
+		if (parent < 0)
+		{
+			worlds[i] = local;
+			continue;
+		}
+
+		check(static_cast<std::size_t> (parent) < i);
+
+		if (parent != cached_parent)
+		{
+			const matrix4 &parent_world = worlds[parent];
+			for (int r = 0; r < 4; ++r)
+			{
+				parent_lanes[r][0] = parent_world.rows[r].simd.swizzle<0, 0, 0, 0>();
+				parent_lanes[r][1] = parent_world.rows[r].simd.swizzle<1, 1, 1, 1>();
+				parent_lanes[r][2] = parent_world.rows[r].simd.swizzle<2, 2, 2, 2>();
+				parent_lanes[r][3] = parent_world.rows[r].simd.swizzle<3, 3, 3, 3>();
+			}
+			cached_parent = parent;
+		}
+
+		pack l0 = local.rows[0].simd;
+		pack l1 = local.rows[1].simd;
+		pack l2 = local.rows[2].simd;
+		pack l3 = local.rows[3].simd;
+
+		matrix4 &world = worlds[i];
+		for (int r = 0; r < 4; ++r)
+		{
+			auto a = parent_lanes[r][0].c_mul(l0).add(parent_lanes[r][1].c_mul(l1));
+			auto b = parent_lanes[r][2].c_mul(l2).add(parent_lanes[r][3].c_mul(l3));
+			world.rows[r].simd = a.add(b);
+		}
+	}
+}
+
+}
+}
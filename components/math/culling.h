@@ -0,0 +1,234 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <core/bits.h>
+
+#include "simd.h"
+#include "matrix.h"
+
+namespace tocs {
+namespace math {
+
+//Bounding spheres as four parallel arrays.
+template <class float_type>
+class sphere_lanes
+{
+public:
+	float_type *x;
+	float_type *y;
+	float_type *z;
+	float_type *radius;
+};
+
+//Boxes as center and half extents, which makes each plane test one dot product plus the box's reach along the plane normal.
+template <class float_type>
+class aabb_lanes
+{
+public:
+	float_type *center_x;
+	float_type *center_y;
+	float_type *center_z;
+	float_type *extent_x;
+	float_type *extent_y;
+	float_type *extent_z;
+};
+
+//Six planes facing inwards in the order left, right, bottom, top, near, far. A point p is inside when dot(normal, p) + distance >= 0 for every plane.
+//Tests are conservative, anything touching the frustum counts as visible and a few boxes just outside a corner do too.
+class frustum
+{
+public:
+	static constexpr int plane_count = 6;
+
+	float normal_x[plane_count];
+	float normal_y[plane_count];
+	float normal_z[plane_count];
+	float distance[plane_count];
+
+	//Gribb and Hartmann, each plane is the w row plus or minus one of the others. Expects the m * v, -w to w clip space that create_frustum builds.
+	//Pass projection * view to get the planes in world space.
+	static frustum from_matrix(const matrix4 &view_projection)
+	{
+		frustum result;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			result.set_plane(axis * 2, view_projection, axis, 1.0f);
+			result.set_plane(axis * 2 + 1, view_projection, axis, -1.0f);
+		}
+		return result;
+	}
+
+	//The batch tests do the same sums in the same order, so these give identical answers and handle the batch tails.
+	bool sphere_visible(float x, float y, float z, float radius) const
+	{
+		for (int p = 0; p < plane_count; ++p)
+		{
+			float reach = normal_x[p] * x + normal_y[p] * y + normal_z[p] * z + distance[p] + radius;
+			if (std::signbit(reach))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool aabb_visible(float center_x, float center_y, float center_z, float extent_x, float extent_y, float extent_z) const
+	{
+		for (int p = 0; p < plane_count; ++p)
+		{
+			float radius = std::abs(normal_x[p]) * extent_x + std::abs(normal_y[p]) * extent_y + std::abs(normal_z[p]) * extent_z;
+			float reach = normal_x[p] * center_x + normal_y[p] * center_y + normal_z[p] * center_z + distance[p] + radius;
+			if (std::signbit(reach))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	void set_plane(int plane, const matrix4 &m, int axis, float sign)
+	{
+		float a = m(3, 0) + sign * m(axis, 0);
+		float b = m(3, 1) + sign * m(axis, 1);
+		float c = m(3, 2) + sign * m(axis, 2);
+		float d = m(3, 3) + sign * m(axis, 3);
+
+		float scale = 1.0f / std::sqrt(a * a + b * b + c * c);
+
+		normal_x[plane] = a * scale;
+		normal_y[plane] = b * scale;
+		normal_z[plane] = c * scale;
+		distance[plane] = d * scale;
+	}
+};
+
+namespace detail
+{
+
+//The planes broadcast into packs once per batch.
+class frustum_packs
+{
+	simd_pack<float> normal_x[frustum::plane_count];
+	simd_pack<float> normal_y[frustum::plane_count];
+	simd_pack<float> normal_z[frustum::plane_count];
+	simd_pack<float> abs_normal_x[frustum::plane_count];
+	simd_pack<float> abs_normal_y[frustum::plane_count];
+	simd_pack<float> abs_normal_z[frustum::plane_count];
+	simd_pack<float> distance[frustum::plane_count];
+public:
+	explicit frustum_packs(const frustum &f)
+	{
+		for (int p = 0; p < frustum::plane_count; ++p)
+		{
+			normal_x[p] = simd_pack<float>(f.normal_x[p]);
+			normal_y[p] = simd_pack<float>(f.normal_y[p]);
+			normal_z[p] = simd_pack<float>(f.normal_z[p]);
+			abs_normal_x[p] = simd_pack<float>(std::abs(f.normal_x[p]));
+			abs_normal_y[p] = simd_pack<float>(std::abs(f.normal_y[p]));
+			abs_normal_z[p] = simd_pack<float>(std::abs(f.normal_z[p]));
+			distance[p] = simd_pack<float>(f.distance[p]);
+		}
+	}
+
+	//Four lane bits, set where the sphere is entirely behind some plane. Every plane's reach is or'ed together, so one negative sign is enough.
+	int VECTORCALL spheres_outside(simd_pack<float> x, simd_pack<float> y, simd_pack<float> z, simd_pack<float> radius) const
+	{
+		simd_pack<float> signs;
+		for (int p = 0; p < frustum::plane_count; ++p)
+		{
+			auto reach = normal_x[p].c_mul(x).add(normal_y[p].c_mul(y)).add(normal_z[p].c_mul(z)).add(distance[p]).add(radius);
+			signs = signs.bit_or(reach);
+		}
+		return signs.sign_mask();
+	}
+
+	int VECTORCALL aabbs_outside(simd_pack<float> center_x, simd_pack<float> center_y, simd_pack<float> center_z, simd_pack<float> extent_x, simd_pack<float> extent_y, simd_pack<float> extent_z) const
+	{
+		simd_pack<float> signs;
+		for (int p = 0; p < frustum::plane_count; ++p)
+		{
+			auto radius = abs_normal_x[p].c_mul(extent_x).add(abs_normal_y[p].c_mul(extent_y)).add(abs_normal_z[p].c_mul(extent_z));
+			auto reach = normal_x[p].c_mul(center_x).add(normal_y[p].c_mul(center_y)).add(normal_z[p].c_mul(center_z)).add(distance[p]).add(radius);
+			signs = signs.bit_or(reach);
+		}
+		return signs.sign_mask();
+	}
+};
+
+//Writes first_index plus the position of every set bit, lowest first, and returns how many.
+inline std::size_t append_set_bits(std::uint64_t bits, std::size_t first_index, std::uint32_t *out)
+{
+	std::size_t written = 0;
+	while (bits)
+	{
+		out[written++] = static_cast<std::uint32_t> (first_index + core::count_trailing_zeros(bits));
+		bits = core::clear_lowest_bit(bits);
+	}
+	return written;
+}
+
+}
+
+//Indices in [begin, end) of the spheres touching the frustum go to visible in ascending order, returns how many. visible needs room for end - begin.
+//Eight per iteration as two independent packs so their plane tests overlap, the visible ones are compacted from the lane mask.
+inline std::size_t cull_spheres(const frustum &f, sphere_lanes<const float> spheres, std::size_t begin, std::size_t end, std::uint32_t *visible)
+{
+	typedef detail::simd_pack<float> pack;
+	const detail::frustum_packs planes(f);
+
+	std::size_t written = 0;
+	std::size_t i = begin;
+	for (; i + 2 * pack::element_count <= end; i += 2 * pack::element_count)
+	{
+		int first = planes.spheres_outside(pack::load(spheres.x + i), pack::load(spheres.y + i), pack::load(spheres.z + i), pack::load(spheres.radius + i));
+		int second = planes.spheres_outside(pack::load(spheres.x + i + 4), pack::load(spheres.y + i + 4), pack::load(spheres.z + i + 4), pack::load(spheres.radius + i + 4));
+
+		written += detail::append_set_bits(~(first | (second << 4)) & 0xFF, i, visible + written);
+	}
+
+	for (; i < end; ++i)
+	{
+		if (f.sphere_visible(spheres.x[i], spheres.y[i], spheres.z[i], spheres.radius[i]))
+		{
+			visible[written++] = static_cast<std::uint32_t> (i);
+		}
+	}
+
+	return written;
+}
+
+//cull_spheres for boxes.
+inline std::size_t cull_aabbs(const frustum &f, aabb_lanes<const float> boxes, std::size_t begin, std::size_t end, std::uint32_t *visible)
+{
+	typedef detail::simd_pack<float> pack;
+	const detail::frustum_packs planes(f);
+
+	std::size_t written = 0;
+	std::size_t i = begin;
+	for (; i + 2 * pack::element_count <= end; i += 2 * pack::element_count)
+	{
+		int first = planes.aabbs_outside(
+			pack::load(boxes.center_x + i), pack::load(boxes.center_y + i), pack::load(boxes.center_z + i),
+			pack::load(boxes.extent_x + i), pack::load(boxes.extent_y + i), pack::load(boxes.extent_z + i));
+		int second = planes.aabbs_outside(
+			pack::load(boxes.center_x + i + 4), pack::load(boxes.center_y + i + 4), pack::load(boxes.center_z + i + 4),
+			pack::load(boxes.extent_x + i + 4), pack::load(boxes.extent_y + i + 4), pack::load(boxes.extent_z + i + 4));
+
+		written += detail::append_set_bits(~(first | (second << 4)) & 0xFF, i, visible + written);
+	}
+
+	for (; i < end; ++i)
+	{
+		if (f.aabb_visible(boxes.center_x[i], boxes.center_y[i], boxes.center_z[i], boxes.extent_x[i], boxes.extent_y[i], boxes.extent_z[i]))
+		{
+			visible[written++] = static_cast<std::uint32_t> (i);
+		}
+	}
+
+	return written;
+}
+
+}
+}
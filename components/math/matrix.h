@@ -4,6 +4,7 @@
 
 #include <cmath>
 #include <limits>
+#include <utility>
 
 namespace tocs {
 namespace math {
@@ -21,70 +22,82 @@ public:
 namespace detail
 {
 	//https://lxjk.github.io/2017/09/03/Fast-4x4-Matrix-Inverse-with-SSE-SIMD-Explained.html#_appendix
+	//2x2 matrices packed row major into one simd_pack.
 
+	//A * B
 	template<class T>
 	inline simd_pack<T> VECTORCALL mat2_mul(simd_pack<T> vec1, simd_pack<T> vec2)
 	{
-		return vec1.c_mul(vec2.swizzle<0, 3, 0, 3>()).add(vec1.swizzle<1, 0, 3, 2>().c_mul(vec2.swizzle<2, 1, 2, 1>()));
+		return vec1.c_mul(vec2.template swizzle<0, 3, 0, 3>()).add(vec1.template swizzle<1, 0, 3, 2>().c_mul(vec2.template swizzle<2, 1, 2, 1>()));
 	}
 
+	//adj(A) * B
 	template<class T>
 	inline simd_pack<T> VECTORCALL mat2_adj_mul(simd_pack<T> vec1, simd_pack<T> vec2)
 	{
-		return vec1.swizzle<3, 3, 0, 0>().c_mul(vec2).add(vec1.swizzle<1, 1, 2, 2>().c_mul(vec2.swizzle<2, 3, 0, 1>()));
+		return vec1.template swizzle<3, 3, 0, 0>().c_mul(vec2).sub(vec1.template swizzle<1, 1, 2, 2>().c_mul(vec2.template swizzle<2, 3, 0, 1>()));
 	}
 
+	//A * adj(B)
 	template<class T>
 	inline simd_pack<T> VECTORCALL mat2_mul_adj(simd_pack<T> vec1, simd_pack<T> vec2)
 	{
-		return vec1.c_mul(vec2.swizzle<3, 0, 3, 0>()).add(vec1.swizzle<1, 0, 3, 2>().c_mul(vec2.swizzle<2, 1, 2, 1>()));
+		return vec1.c_mul(vec2.template swizzle<3, 0, 3, 0>()).sub(vec1.template swizzle<1, 0, 3, 2>().c_mul(vec2.template swizzle<2, 1, 2, 1>()));
 	}
 }
 
+//Rows are stored and vectors are columns, m * v. Translation lives in the w of the first three rows and a parent's matrix goes on the left: world = parent * local.
 template <class T>
 class matrix<T, 4, 4, simd_enabled>
 {
 public:
-	union
-	{
-		vector_base<T, 4> rows[4];
-	};
+	typedef detail::simd_pack<T> pack;
+
+	vector_base<T, 4, simd_enabled> rows[4];
 
 	matrix()
 	{
 	}
 
-	matrix<T, 4, 4> VECTORCALL transposed()
+	template <class U>
+	explicit matrix(const matrix<U, 4, 4, simd_disabled> &copyme)
 	{
-		matrix<T, 4, 4> result;
-		simd_pack<T> t0, t1, t2, t3;
+		for (int r = 0; r < 4; ++r)
+		{
+			rows[r] = vector_base<T, 4, simd_enabled>(T(copyme(r, 0)), T(copyme(r, 1)), T(copyme(r, 2)), T(copyme(r, 3)));
+		}
+	}
 
-		t0 = simd_pack<T>::template raw_shuffle<0x44>(rows[0].simd, rows[1].simd);
-		t1 = simd_pack<T>::template raw_shuffle<0xEE>(rows[0].simd, rows[1].simd);
-		t2 = simd_pack<T>::template raw_shuffle<0x44>(rows[2].simd, rows[3].simd);
-		t3 = simd_pack<T>::template raw_shuffle<0xEE>(rows[2].simd, rows[3].simd);
+	static matrix<T, 4, 4, simd_enabled> identity()
+	{
+		matrix<T, 4, 4, simd_enabled> result;
+		result.rows[0] = vector_base<T, 4, simd_enabled>(1, 0, 0, 0);
+		result.rows[1] = vector_base<T, 4, simd_enabled>(0, 1, 0, 0);
+		result.rows[2] = vector_base<T, 4, simd_enabled>(0, 0, 1, 0);
+		result.rows[3] = vector_base<T, 4, simd_enabled>(0, 0, 0, 1);
+		return result;
+	}
 
-		result.rows[0].simd = simd_pack<T>::template raw_shuffle<0x88>(t0, t1);
-		result.rows[1].simd = simd_pack<T>::template raw_shuffle<0xDD>(t0, t1);
-		result.rows[2].simd = simd_pack<T>::template raw_shuffle<0x88>(t2, t3);
-		result.rows[3].simd = simd_pack<T>::template raw_shuffle<0xDD>(t2, t3);
-	
+	matrix<T, 4, 4, simd_enabled> VECTORCALL transposed() const
+	{
+		matrix<T, 4, 4, simd_enabled> result = *this;
+		pack::transpose(result.rows[0].simd, result.rows[1].simd, result.rows[2].simd, result.rows[3].simd);
 		return result;
 	}
 
-	static matrix<T, 4, 4> create_frustum(float left, float right, float bottom, float top, float near, float far)
+	static matrix<T, 4, 4, simd_enabled> create_frustum(float left, float right, float bottom, float top, float near, float far)
 	{
-		matrix<T, 4, 4> result;
+		matrix<T, 4, 4, simd_enabled> result;
 
-		result.rows[0] = vector_base<T, 4>(2 * near / (right - left), 0, 0, (right + left) / (right - left));
-		result.rows[1] = vector_base<T, 4>(0, 2 * near / (top - bottom), 0, (top + bottom) / (top - bottom));
-		result.rows[2] = vector_base<T, 4>(0, 0, -(far + near) / (far - near), (-2*far*near)/(far-near));
-		result.rows[3] = vector_base<T, 4>(0,0,-1,0);
+		result.rows[0] = vector_base<T, 4, simd_enabled>(2 * near / (right - left), 0, 0, (right + left) / (right - left));
+		result.rows[1] = vector_base<T, 4, simd_enabled>(0, 2 * near / (top - bottom), 0, (top + bottom) / (top - bottom));
+		result.rows[2] = vector_base<T, 4, simd_enabled>(0, 0, -(far + near) / (far - near), (-2*far*near)/(far-near));
+		result.rows[3] = vector_base<T, 4, simd_enabled>(0,0,-1,0);
 
 		return result;
 	}
 
-	static matrix<T, 4, 4> create_projection(float fov, float aspect_ratio, float near, float far)
+	static matrix<T, 4, 4, simd_enabled> create_projection(float fov, float aspect_ratio, float near, float far)
 	{
 		float tangent = std::tan(fov / 2);
 		float height = near * tangent;
@@ -93,123 +106,126 @@ public:
 		return create_frustum(-width, width, -height, height, near, far);
 	}
 
-	matrix<T, 4, 4> inverse() const
+	//General inverse by 2x2 blocks. Singular matrices give infs and nans.
+	matrix<T, 4, 4, simd_enabled> VECTORCALL inverse() const
 	{
-		//Todo check major-ness
 		//https://lxjk.github.io/2017/09/03/Fast-4x4-Matrix-Inverse-with-SSE-SIMD-Explained.html
+		//Inverting is the same for either majorness, the blocks are just transposed.
 
-		auto a = simd_pack<T>::template shuffle<0, 1, 0, 1>(rows[0].simd, row[1].simd);
-		auto b = simd_pack<T>::template shuffle<2, 3, 2, 3>(rows[0].simd, row[1].simd);
-		auto c = simd_pack<T>::template shuffle<0, 1, 0, 1>(rows[2].simd, row[3].simd);
-		auto d = simd_pack<T>::template shuffle<2, 3, 2, 3>(rows[3].simd, row[3].simd);
+		//Sub matrices, m = | a b |
+		//                  | c d |
+		auto a = pack::template shuffle<0, 1, 0, 1>(rows[0].simd, rows[1].simd);
+		auto b = pack::template shuffle<2, 3, 2, 3>(rows[0].simd, rows[1].simd);
+		auto c = pack::template shuffle<0, 1, 0, 1>(rows[2].simd, rows[3].simd);
+		auto d = pack::template shuffle<2, 3, 2, 3>(rows[2].simd, rows[3].simd);
 
-		auto det_a = simd_pack<T>(rows[0].x * rows[1].y - rows[0].y * rows[1].x);
-		auto det_b = simd_pack<T>(rows[0].z * rows[1].w - rows[0].w * rows[1].z);
-		auto det_c = simd_pack<T>(rows[2].x * rows[3].y - rows[2].y * rows[3].x);
-		auto det_d = simd_pack<T>(rows[2].z * rows[3].w - rows[2].w * rows[3].z);
+		//Determinants of all four blocks as (|a|, |b|, |c|, |d|)
+		auto det_sub = pack::template shuffle<0, 2, 0, 2>(rows[0].simd, rows[2].simd).c_mul(pack::template shuffle<1, 3, 1, 3>(rows[1].simd, rows[3].simd))
+			.sub(pack::template shuffle<1, 3, 1, 3>(rows[0].simd, rows[2].simd).c_mul(pack::template shuffle<0, 2, 0, 2>(rows[1].simd, rows[3].simd)));
 
-		auto d_c = detail::mat2_adj_mul(d, c);
+		auto det_a = det_sub.template swizzle<0, 0, 0, 0>();
+		auto det_b = det_sub.template swizzle<1, 1, 1, 1>();
+		auto det_c = det_sub.template swizzle<2, 2, 2, 2>();
+		auto det_d = det_sub.template swizzle<3, 3, 3, 3>();
 
+		auto d_c = detail::mat2_adj_mul(d, c);
 		auto a_b = detail::mat2_adj_mul(a, b);
 
 		auto x = det_d.c_mul(a).sub(detail::mat2_mul(b, d_c));
-
-		auto w = det_c.c_mul(d).sub(detail::mat2_mul(c, a_b));
-
-		auto det_m = det_a.c_mul(det_d);
-
+		auto w = det_a.c_mul(d).sub(detail::mat2_mul(c, a_b));
 		auto y = det_b.c_mul(c).sub(detail::mat2_mul_adj(d, a_b));
-
 		auto z = det_c.c_mul(b).sub(detail::mat2_mul_adj(a, d_c));
 
-		det_m = det_m.add(det_b.c_mul(det_c));
-
-		auto tr = a_b.c_mul(d_c.swizzle<0, 2, 1, 3>());
+		//|m| = |a||d| + |b||c| - tr(adj(a) b adj(d) c)
+		auto tr = a_b.c_mul(d_c.template swizzle<0, 2, 1, 3>());
 		tr = tr.h_add(tr);
 		tr = tr.h_add(tr);
 
-		det_m = det_m.sub(tr);
+		auto det_m = det_a.c_mul(det_d).add(det_b.c_mul(det_c)).sub(tr);
 
-		const static simd_pack<T> adj_sign_mask(1.f, -1.f, -1.f, 1.f);
-
-		auto r_det_m = adj_sign_mask.div(det_m);
+		const static pack adj_sign_mask(1.f, -1.f, -1.f, 1.f);
+		auto r_det_m = adj_sign_mask.c_div(det_m);
 
 		x = x.c_mul(r_det_m);
 		y = y.c_mul(r_det_m);
 		z = z.c_mul(r_det_m);
 		w = w.c_mul(r_det_m);
 
-		matrix<T, 4, 4> result;
-
-		result.rows[0].simd = simd_pack<T>::template shuffle<3, 1, 3, 1>(x, y);
-		result.rows[1].simd = simd_pack<T>::template shuffle<2, 0, 2, 0>(x, y);
-		result.rows[2].simd = simd_pack<T>::template shuffle<3, 1, 3, 1>(z, w);
-		result.rows[3].simd = simd_pack<T>::template shuffle<2, 0, 2, 0>(z, w);
+		//The adjugate shuffle and the block to row shuffle in one.
+		matrix<T, 4, 4, simd_enabled> result;
+		result.rows[0].simd = pack::template shuffle<3, 1, 3, 1>(x, y);
+		result.rows[1].simd = pack::template shuffle<2, 0, 2, 0>(x, y);
+		result.rows[2].simd = pack::template shuffle<3, 1, 3, 1>(z, w);
+		result.rows[3].simd = pack::template shuffle<2, 0, 2, 0>(z, w);
 
 		return result;
 	}
-	
-	matrix<T, 4, 4> transform_inverse() const
-	{
-		//Todo check major-ness
-		//https://lxjk.github.io/2017/09/03/Fast-4x4-Matrix-Inverse-with-SSE-SIMD-Explained.html
-
-		matrix<T, 4, 4> result;
-
-		simd_pack<T> t0 = simd_pack<T>::shuffle<0, 1, 0, 1>(rows[0].simd, row[1].simd);
-		simd_pack<T> t1 = simd_pack<T>::shuffle<2, 3, 2, 3>(rows[0].simd, row[1].simd);
-		result.rows[0].simd = simd_pack<T>::shuffle<0, 2, 0, 3>(t0, rows[2].simd);
-		result.rows[1].simd = simd_pack<T>::shuffle<1, 3, 1, 3>(t0, rows[2].simd);
-		result.rows[2].simd = simd_pack<T>::shuffle<0, 2, 2, 3>(t1, rows[2].simd);
 
+	//Inverse of a rotation, scale and translation with no shear, a lot cheaper than inverse().
+	//The 3x3 part is r * s so its inverse is s^-1 * transpose(r): transpose it and divide each new row by its squared length. Zero scale axes stay zero.
+	matrix<T, 4, 4, simd_enabled> VECTORCALL transform_inverse() const
+	{
+		const static pack one(1);
+		const static pack epsilon(std::numeric_limits<T>::epsilon());
+		const static pack w_only(0, 0, 0, 1);
+
+		//Columns of the 3x3 with w = 0, translation ends up in the fourth.
+		pack c0 = rows[0].simd;
+		pack c1 = rows[1].simd;
+		pack c2 = rows[2].simd;
+		pack translation = w_only;
+		pack::transpose(c0, c1, c2, translation);
+
+		matrix<T, 4, 4, simd_enabled> result;
+		pack *result_rows[3] = { &result.rows[0].simd, &result.rows[1].simd, &result.rows[2].simd };
+		pack columns[3] = { c0, c1, c2 };
+
+		for (int i = 0; i < 3; ++i)
+		{
+			auto size_sq = columns[i].c_mul(columns[i]);
+			size_sq = size_sq.h_add(size_sq);
+			size_sq = size_sq.h_add(size_sq);
 
-		simd_pack<T> sizeSqr;
-		sizeSqr = simd_pack<T>::c_mul(result.rows[0].simd, result.rows[0].simd);
-		sizeSqr = simd_pack<T>::add(sizeSqr, simd_pack<T>::c_mul(result.rows[1].simd, result.rows[1].simd));
-		sizeSqr = simd_pack<T>::add(sizeSqr, simd_pack<T>::c_mul(result.rows[2].simd, result.rows[2].simd));
-
-		const static simd_pack<T> one(1);
-		const static simd_pack<T> epislon(std::numeric_limits<T>::epsilon());
+			//Avoid the divide by zero.
+			auto r_size_sq = pack::blend(one.c_div(size_sq), one, size_sq.c_less(epsilon));
+			auto inverse_row = columns[i].c_mul(r_size_sq);
 
-		//avoid div by zero
-		auto rSizeSqr = simd_pack<T>::blend(simd_pack<T>::c_div(one, sizeSqr), one, simd_pack<T>::c_less(sizeSqr, epislon));
+			//-dot(row, translation) goes in w.
+			auto offset = inverse_row.c_mul(translation);
+			offset = offset.h_add(offset);
+			offset = offset.h_add(offset);
 
-		result.rows[0].simd = simd_pack<T>::c_mul(result.rows[0].simd, rSizeSqr);
-		result.rows[1].simd = simd_pack<T>::c_mul(result.rows[1].simd, rSizeSqr);
-		result.rows[2].simd = simd_pack<T>::c_mul(result.rows[2].simd, rSizeSqr);
+			*result_rows[i] = inverse_row.sub(w_only.c_mul(offset));
+		}
 
-		result.rows[3].simd = simd_pack<T>::c_mul(result.rows[0].simd, simd_pack<T>::swizzle<0, 0, 0, 0>(rows[3].simd));
-		result.rows[3].simd = simd_pack<T>::add(result.rows[3].simd, simd_pack<T>::c_mul(result.rows[1].simd, simd_pack<T>::swizzle<1, 1, 1, 1>(rows[3].simd)));
-		result.rows[3].simd = simd_pack<T>::add(result.rows[3].simd, simd_pack<T>::c_mul(result.rows[2].simd, simd_pack<T>::swizzle<2, 2, 2, 2>(rows[3].simd)));
-		result.rows[3].simd = simd_pack<T>::sub(simd_pack<T>(0,0,0,1), result.rows[3].simd);
+		result.rows[3].simd = w_only;
+		return result;
 	}
 
 	T &operator()(int r, int c)
 	{
-		return rows[r][c];
+		return reinterpret_cast<T *> (&rows[r].simd)[c];
 	}
 
 	const T &operator()(int r, int c) const
 	{
-		return rows[r][c];
+		return reinterpret_cast<const T *> (&rows[r].simd)[c];
 	}
 };
 
 
-
-
 template <class T>
-matrix<T, 4, 4> VECTORCALL operator* (matrix<T, 4, 4> op1, matrix<T, 4, 4> op2)
+matrix<T, 4, 4, simd_enabled> VECTORCALL operator* (const matrix<T, 4, 4, simd_enabled> &op1, const matrix<T, 4, 4, simd_enabled> &op2)
 {
 	//https://stackoverflow.com/questions/18499971/efficient-4x4-matrix-multiplication-c-vs-assembly/18508113#18508113
 
-	matrix<T, 4, 4> result;
+	matrix<T, 4, 4, simd_enabled> result;
 	for (int i = 0; i < 4; ++i)
 	{
-		simd_pack<T> brodcast0 = op1.rows[i].simd.swizzle<0, 0, 0, 0>();
-		simd_pack<T> brodcast1 = op1.rows[i].simd.swizzle<1, 1, 1, 1>();
-		simd_pack<T> brodcast2 = op1.rows[i].simd.swizzle<2, 2, 2, 2>();
-		simd_pack<T> brodcast3 = op1.rows[i].simd.swizzle<3, 3, 3, 3>();
+		detail::simd_pack<T> brodcast0 = op1.rows[i].simd.template swizzle<0, 0, 0, 0>();
+		detail::simd_pack<T> brodcast1 = op1.rows[i].simd.template swizzle<1, 1, 1, 1>();
+		detail::simd_pack<T> brodcast2 = op1.rows[i].simd.template swizzle<2, 2, 2, 2>();
+		detail::simd_pack<T> brodcast3 = op1.rows[i].simd.template swizzle<3, 3, 3, 3>();
 
 		auto a = brodcast0.c_mul(op2.rows[0].simd).add(brodcast1.c_mul(op2.rows[1].simd));
 		auto b = brodcast2.c_mul(op2.rows[2].simd).add(brodcast3.c_mul(op2.rows[3].simd));
@@ -220,19 +236,169 @@ matrix<T, 4, 4> VECTORCALL operator* (matrix<T, 4, 4> op1, matrix<T, 4, 4> op2)
 }
 
 
+//Scalar 4x4 with the same conventions, the reference the simd matrix is checked against. inverse() is Gauss-Jordan with partial pivoting.
 template <class T>
-class matrix<T, 3, 3>
+class matrix<T, 4, 4, simd_disabled>
 {
 public:
-	union
+	T values[4][4];
+
+	matrix()
+	{
+		for (int r = 0; r < 4; ++r)
+		{
+			for (int c = 0; c < 4; ++c)
+			{
+				values[r][c] = 0;
+			}
+		}
+	}
+
+	template <class U>
+	explicit matrix(const matrix<U, 4, 4, simd_enabled> &copyme)
 	{
-		struct
+		for (int r = 0; r < 4; ++r)
 		{
-			vector_base<T, 3> row0;
-			vector_base<T, 3> row1;
-			vector_base<T, 3> row2;
-		};
-	};
+			for (int c = 0; c < 4; ++c)
+			{
+				values[r][c] = T(copyme(r, c));
+			}
+		}
+	}
+
+	static matrix<T, 4, 4, simd_disabled> identity()
+	{
+		matrix<T, 4, 4, simd_disabled> result;
+		for (int i = 0; i < 4; ++i)
+		{
+			result.values[i][i] = 1;
+		}
+		return result;
+	}
+
+	matrix<T, 4, 4, simd_disabled> transposed() const
+	{
+		matrix<T, 4, 4, simd_disabled> result;
+		for (int r = 0; r < 4; ++r)
+		{
+			for (int c = 0; c < 4; ++c)
+			{
+				result.values[c][r] = values[r][c];
+			}
+		}
+		return result;
+	}
+
+	static matrix<T, 4, 4, simd_disabled> create_frustum(T left, T right, T bottom, T top, T near, T far)
+	{
+		matrix<T, 4, 4, simd_disabled> result;
+
+		result.values[0][0] = 2 * near / (right - left);
+		result.values[0][3] = (right + left) / (right - left);
+		result.values[1][1] = 2 * near / (top - bottom);
+		result.values[1][3] = (top + bottom) / (top - bottom);
+		result.values[2][2] = -(far + near) / (far - near);
+		result.values[2][3] = (-2 * far * near) / (far - near);
+		result.values[3][2] = -1;
+
+		return result;
+	}
+
+	static matrix<T, 4, 4, simd_disabled> create_projection(T fov, T aspect_ratio, T near, T far)
+	{
+		T height = near * std::tan(fov / 2);
+		T width = height * aspect_ratio;
+
+		return create_frustum(-width, width, -height, height, near, far);
+	}
+
+	matrix<T, 4, 4, simd_disabled> inverse() const
+	{
+		matrix<T, 4, 4, simd_disabled> work = *this;
+		matrix<T, 4, 4, simd_disabled> result = identity();
+
+		for (int c = 0; c < 4; ++c)
+		{
+			int pivot = c;
+			for (int r = c + 1; r < 4; ++r)
+			{
+				if (std::abs(work.values[r][c]) > std::abs(work.values[pivot][c]))
+				{
+					pivot = r;
+				}
+			}
+
+			for (int k = 0; k < 4; ++k)
+			{
+				std::swap(work.values[c][k], work.values[pivot][k]);
+				std::swap(result.values[c][k], result.values[pivot][k]);
+			}
+
+			T scale = 1 / work.values[c][c];
+			for (int k = 0; k < 4; ++k)
+			{
+				work.values[c][k] *= scale;
+				result.values[c][k] *= scale;
+			}
+
+			for (int r = 0; r < 4; ++r)
+			{
+				if (r != c)
+				{
+					T factor = work.values[r][c];
+					for (int k = 0; k < 4; ++k)
+					{
+						work.values[r][k] -= factor * work.values[c][k];
+						result.values[r][k] -= factor * result.values[c][k];
+					}
+				}
+			}
+		}
+
+		return result;
+	}
+
+	//Any matrix with a bottom row of 0 0 0 1. No shortcut here, the reference shouldn't share the simd version's assumptions.
+	matrix<T, 4, 4, simd_disabled> transform_inverse() const
+	{
+		return inverse();
+	}
+
+	T &operator()(int r, int c)
+	{
+		return values[r][c];
+	}
+
+	const T &operator()(int r, int c) const
+	{
+		return values[r][c];
+	}
+};
+
+template <class T>
+matrix<T, 4, 4, simd_disabled> operator* (const matrix<T, 4, 4, simd_disabled> &op1, const matrix<T, 4, 4, simd_disabled> &op2)
+{
+	matrix<T, 4, 4, simd_disabled> result;
+	for (int r = 0; r < 4; ++r)
+	{
+		for (int c = 0; c < 4; ++c)
+		{
+			T sum = 0;
+			for (int k = 0; k < 4; ++k)
+			{
+				sum += op1.values[r][k] * op2.values[k][c];
+			}
+			result.values[r][c] = sum;
+		}
+	}
+	return result;
+}
+
+template <class T>
+class matrix<T, 3, 3>
+{
+public:
+	vector_base<T, 3> rows[3];
 
 	matrix()
 	{
@@ -243,5 +409,9 @@ public:
 
 using matrix4 = matrix<float, 4, 4, simd_enabled>;
 
+//Scalar references for matrix4.
+using matrix4p = matrix<float, 4, 4, simd_disabled>;
+using matrix4d = matrix<double, 4, 4, simd_disabled>;
+
 }
 }
@@ -1,5 +1,7 @@
 #pragma once
 #include <type_traits>
+#include <cmath>
+#include <limits>
 
 #include "simd.h"
 #include "vector.h"
@@ -13,11 +15,138 @@ namespace detail
 {
 
 template <class T>
-using default_simd_quaternion_toggle = detail::default_simd_vector_toggle<T, 4>;
+using default_simd_quaternion_toggle = typename std::conditional<is_simd_type<T>::value, simd_enabled, simd_disabled>::type;
+
+//Eberly's polynomial slerp, "A Fast and Accurate Algorithm for Computing SLERP".
+//sin(t * a) / sin(a) is expanded as a series in cos(a) - 1 and cut at 12 terms. The last term is scaled by mu, fitted here to minimise the max error over cos(a) in [0, 1], which comes out around 7e-7.
+//Callers flip to the shortest arc first so cos(a) is never negative.
+constexpr int slerp_terms = 12;
+constexpr float slerp_mu = 1.89372247f;
+
+constexpr float slerp_u(int i)
+{
+	return (i == slerp_terms ? slerp_mu : 1.0f) / (i * (2 * i + 1));
+}
+
+constexpr float slerp_v(int i)
+{
+	return (i == slerp_terms ? slerp_mu : 1.0f) * i / (2 * i + 1);
+}
+
+//Indexed from 1 like the series, slot 0 is unused.
+inline const float *slerp_u_table()
+{
+	static constexpr float table[slerp_terms + 1] = { 0, slerp_u(1), slerp_u(2), slerp_u(3), slerp_u(4), slerp_u(5), slerp_u(6), slerp_u(7), slerp_u(8), slerp_u(9), slerp_u(10), slerp_u(11), slerp_u(12) };
+	return table;
+}
+
+inline const float *slerp_v_table()
+{
+	static constexpr float table[slerp_terms + 1] = { 0, slerp_v(1), slerp_v(2), slerp_v(3), slerp_v(4), slerp_v(5), slerp_v(6), slerp_v(7), slerp_v(8), slerp_v(9), slerp_v(10), slerp_v(11), slerp_v(12) };
+	return table;
+}
+
+inline float VECTORCALL multiply(float a, float b)
+{
+	return a * b;
+}
+
+inline simd_pack<float> VECTORCALL multiply(simd_pack<float> a, simd_pack<float> b)
+{
+	return a.c_mul(b);
+}
+
+//a + b * c
+inline float VECTORCALL multiply_add(float a, float b, float c)
+{
+	return a + b * c;
+}
+
+inline simd_pack<float> VECTORCALL multiply_add(simd_pack<float> a, simd_pack<float> b, simd_pack<float> c)
+{
+	return a.add(b.c_mul(c));
+}
+
+//The series as a plain polynomial in cos(a) - 1 for one t, coefficient k is the product of the first k factors of the nested form.
+//Every factor is negative and cos(a) - 1 is never positive, so all the terms add up with the same sign and nothing cancels.
+inline void slerp_coefficients(float t, float *coefficients)
+{
+	const float *u = slerp_u_table();
+	const float *v = slerp_v_table();
+
+	coefficients[0] = 1.0f;
+	for (int i = 1; i <= slerp_terms; ++i)
+	{
+		coefficients[i] = coefficients[i - 1] * (u[i] * (t * t) - v[i]);
+	}
+}
+
+//Estrin's scheme, the dependency chain is 4 multiply-adds deep rather than 12 with Horner's.
+template <class value_type>
+inline value_type VECTORCALL evaluate_slerp_polynomial(const value_type *a, value_type x)
+{
+	static_assert(slerp_terms == 12, "evaluation is unrolled for 12 terms");
+
+	value_type x2 = multiply(x, x);
+	value_type x4 = multiply(x2, x2);
+	value_type x8 = multiply(x4, x4);
+
+	value_type q0 = multiply_add(multiply_add(a[0], a[1], x), multiply_add(a[2], a[3], x), x2);
+	value_type q1 = multiply_add(multiply_add(a[4], a[5], x), multiply_add(a[6], a[7], x), x2);
+	value_type q2 = multiply_add(multiply_add(a[8], a[9], x), multiply_add(a[10], a[11], x), x2);
+
+	return multiply_add(multiply_add(q0, q1, x4), multiply_add(q2, a[12], x4), x8);
+}
+
+//Weights so that from * from_weight + to * to_weight is the slerp, cos_angle is dot(from, to) in [0, 1].
+inline void slerp_weights(float cos_angle, float t, float &from_weight, float &to_weight)
+{
+	float from_coefficients[slerp_terms + 1];
+	float to_coefficients[slerp_terms + 1];
+	slerp_coefficients(1.0f - t, from_coefficients);
+	slerp_coefficients(t, to_coefficients);
+
+	float cos_minus_one = cos_angle - 1.0f;
+	from_weight = (1.0f - t) * evaluate_slerp_polynomial(from_coefficients, cos_minus_one);
+	to_weight = t * evaluate_slerp_polynomial(to_coefficients, cos_minus_one);
+}
+
+//slerp_weights for four quaternions at once sharing one t, with the coefficients worked out once up front.
+class slerp_weight_terms
+{
+	simd_pack<float> from_coefficients[slerp_terms + 1];
+	simd_pack<float> to_coefficients[slerp_terms + 1];
+	simd_pack<float> from_scale;
+	simd_pack<float> to_scale;
+public:
+	explicit slerp_weight_terms(float t)
+		: from_scale(1.0f - t)
+		, to_scale(t)
+	{
+		float from_scalar[slerp_terms + 1];
+		float to_scalar[slerp_terms + 1];
+		slerp_coefficients(1.0f - t, from_scalar);
+		slerp_coefficients(t, to_scalar);
+
+		for (int i = 0; i <= slerp_terms; ++i)
+		{
+			from_coefficients[i] = simd_pack<float>(from_scalar[i]);
+			to_coefficients[i] = simd_pack<float>(to_scalar[i]);
+		}
+	}
+
+	void VECTORCALL weights(simd_pack<float> cos_angle, simd_pack<float> &from_weight, simd_pack<float> &to_weight) const
+	{
+		auto cos_minus_one = cos_angle.sub(simd_pack<float>(1.0f));
+
+		from_weight = from_scale.c_mul(evaluate_slerp_polynomial(from_coefficients, cos_minus_one));
+		to_weight = to_scale.c_mul(evaluate_slerp_polynomial(to_coefficients, cos_minus_one));
+	}
+};
 
 }
 
-template <class T, class simd_toggle = typename detail::default_simd_quaternion_toggle<T>>
+template <class T, class simd_toggle = detail::default_simd_quaternion_toggle<T>>
 class quaternion_base
 {
 
@@ -43,13 +172,22 @@ public:
 	quaternion_base()
 		: simd(0,0,0,1)
 	{}
+
+	quaternion_base(T x, T y, T z, T w)
+		: simd(x, y, z, w)
+	{}
+
+	template <class U>
+	explicit quaternion_base(const quaternion_base<U, simd_disabled> &copyme)
+		: simd(T(copyme.x), T(copyme.y), T(copyme.z), T(copyme.w))
+	{}
 private:
 	quaternion_base(detail::simd_pack<T> simd)
 		: simd(simd)
 	{}
 public:
 
-	vector_base<T,3> VECTORCALL rotate(vector_base<T,3> vec) const
+	vector_base<T, 3, simd_enabled> VECTORCALL rotate(vector_base<T, 3, simd_enabled> vec) const
 	{
 		//https://blog.molecular-matters.com/2013/05/24/a-faster-quaternion-vector-multiplication/
 
@@ -61,31 +199,31 @@ public:
 		{
 			const static detail::simd_pack<T> two(2, 2, 2, 0);
 
-			auto a = simd.swizzle<1, 2, 0, 0>();
-			auto b = vec.simd.swizzle<2, 0, 1, 0>();
+			auto a = simd.template swizzle<1, 2, 0, 0>();
+			auto b = vec.simd.template swizzle<2, 0, 1, 0>();
 
-			auto c = vec.simd.swizzle<1, 2, 0, 0>();
-			auto d = simd.swizzle<2, 0, 1, 0>();
+			auto c = vec.simd.template swizzle<1, 2, 0, 0>();
+			auto d = simd.template swizzle<2, 0, 1, 0>();
 
 			auto ab = a.c_mul(b);
 			auto cd = c.c_mul(d);
 
-			t = two.c_mul(two, ab.sub(cd));
+			t = two.c_mul(ab.sub(cd));
 		}
 
-		vector_base<T, 3> v_prime;
+		vector_base<T, 3, simd_enabled> v_prime;
 
 		{
-			auto qw = detail::simd_pack<T>::swizzle<3, 3, 3, 3>(simd);
-			auto qwt = detail::simd_pack<T>::c_mul(qw, t);
+			auto qw = simd.template swizzle<3, 3, 3, 3>();
+			auto qwt = qw.c_mul(t);
 
 			detail::simd_pack<T> cross;
 			{
-				auto a = simd.swizzle<1, 2, 0, 0>();
-				auto b = t.swizzle<2, 0, 1, 0>();
+				auto a = simd.template swizzle<1, 2, 0, 0>();
+				auto b = t.template swizzle<2, 0, 1, 0>();
 
-				auto c = t.swizzle<1, 2, 0, 0>();
-				auto d = simd.swizzle<2, 0, 1, 0>();
+				auto c = t.template swizzle<1, 2, 0, 0>();
+				auto d = simd.template swizzle<2, 0, 1, 0>();
 
 				auto ab = a.c_mul(b);
 				auto cd = c.c_mul(d);
@@ -108,59 +246,314 @@ public:
 	quaternion_base<T> VECTORCALL inverse() const
 	{
 		auto conj = conjugate();
-		auto mag_sqr = simd.dot<true, true, true, true>(simd);
+		auto mag_sqr = dot_broadcast(simd, simd);
 		
-		return conj.c_div(mag_sqr);
+		return conj.simd.c_div(mag_sqr);
 	}
 
-	quaternion_base<T> VECTORCALL operator*(quaternion_base<T> rhs)
+	quaternion_base<T> VECTORCALL operator*(quaternion_base<T> rhs) const
 	{
 		//X = W * op2.X + X * op2.W + Y * op2.Z - Z * op2.Y;
 		//Y = W * op2.Y + Y * op2.W + Z * op2.X - X * op2.Z;
 		//Z = W * op2.Z + Z * op2.W + X * op2.Y - Y * op2.X;
 		//W = W * op2.W - X * op2.X - Y * op2.Y - Z * op2.Z;
 
-		auto a1 = simd.swizzle<3, 3, 3, 3>();
-		auto a2 = rhs.simd.swizzle<0, 1, 2, 0>();
+		auto a1 = simd.template swizzle<3, 3, 3, 3>();
+		auto a2 = rhs.simd.template swizzle<0, 1, 2, 3>();
 		auto a = a1.c_mul(a2);
 
 		const static detail::simd_pack<T> sign_flipper (1, 1, 1, -1);
 
-		auto b1 = simd.swizzle<0, 1, 2, 0>();
+		auto b1 = simd.template swizzle<0, 1, 2, 0>();
 		b1 = b1.c_mul(sign_flipper);
-		auto b2 = rhs.simd.swizzle<3, 3, 3, 0>();
+		auto b2 = rhs.simd.template swizzle<3, 3, 3, 0>();
 		auto b = b1.c_mul(b2);
 
-		auto c1 = detail::simd_pack<T>::swizzle<1, 2, 0, 1>(simd);
+		auto c1 = simd.template swizzle<1, 2, 0, 1>();
 		c1 = c1.c_mul(sign_flipper);
-		auto c2 = rhs.simd.swizzle<2, 0, 1, 1>();
+		auto c2 = rhs.simd.template swizzle<2, 0, 1, 1>();
 		auto c = c1.c_mul(c2);
 
-		auto d1 = simd.swizzle<2, 0, 1, 2>();
-		auto d2 = rhs.simd.swizzle<1, 2, 0, 2>();
+		auto d1 = simd.template swizzle<2, 0, 1, 2>();
+		auto d2 = rhs.simd.template swizzle<1, 2, 0, 2>();
 		auto d = d1.c_mul(d2);
 
 		return a.add(b.add(c.sub(d)));
 	}
 
+	//Normalized lerp along the shortest arc. math::batch_nlerp is the SoA version.
+	static quaternion_base<T> VECTORCALL nlerp(quaternion_base<T> from, quaternion_base<T> to, T t)
+	{
+		const static detail::simd_pack<T> sign_bit(-0.0f);
+
+		auto products = from.simd.c_mul(to.simd);
+		auto dot = products.h_add(products);
+		dot = dot.h_add(dot);
+
+		auto flipped = to.simd.bit_xor(dot.bit_and(sign_bit));
+		auto blended = from.simd.c_mul(detail::simd_pack<T>(1 - t)).add(flipped.c_mul(detail::simd_pack<T>(t)));
+
+		auto length_sq = blended.c_mul(blended);
+		length_sq = length_sq.h_add(length_sq);
+		length_sq = length_sq.h_add(length_sq);
+
+		return blended.c_div(length_sq.c_sqrt());
+	}
+
+	//Constant angular velocity blend along the shortest arc, uses the polynomial in detail::slerp_weights instead of acos and sin.
+	//math::batch_slerp does the same four at a time.
 	static quaternion_base<T> VECTORCALL slerp(quaternion_base<T> from, quaternion_base<T> to, T t)
 	{
+		const static detail::simd_pack<T> sign_bit(-0.0f);
+
+		auto dot = dot_broadcast(from.simd, to.simd);
+		auto flip = dot.bit_and(sign_bit);
+
+		T from_weight, to_weight;
+		detail::slerp_weights(first_lane(dot.bit_xor(flip)), t, from_weight, to_weight);
 
+		return from.simd.c_mul(detail::simd_pack<T>(from_weight)).add(to.simd.bit_xor(flip).c_mul(detail::simd_pack<T>(to_weight)));
 	}
 
+	//Angles in radians about each axis. Roll about z is applied first, then pitch about x, then yaw about y.
 	static quaternion_base<T> VECTORCALL from_euler(T X, T Y, T Z)
 	{
-
+		T sx = std::sin(X * T(0.5)), cx = std::cos(X * T(0.5));
+		T sy = std::sin(Y * T(0.5)), cy = std::cos(Y * T(0.5));
+		T sz = std::sin(Z * T(0.5)), cz = std::cos(Z * T(0.5));
+
+		return quaternion_base<T>(
+			cy * sx * cz + sy * cx * sz,
+			sy * cx * cz - cy * sx * sz,
+			cy * cx * sz - sy * sx * cz,
+			cy * cx * cz + sy * sx * sz);
 	}
 
+	//Shoemake's spherical quadrangle, a smooth curve from a to d with b and c as inner control points.
+	//For a key sequence q0..qn the segment qi to qi+1 is squad(qi, si, si+1, qi+1, t) with si = squad_control_point(qi-1, qi, qi+1).
 	static quaternion_base<T> VECTORCALL squad(quaternion_base<T> a, quaternion_base<T> b, quaternion_base<T> c, quaternion_base<T> d, T t)
 	{
+		return slerp(slerp(a, d, t), slerp(b, c, t), 2 * t * (1 - t));
+	}
+
+	//Inner control point at current for squad. Goes through log and exp, so it belongs in key setup rather than per sample.
+	static quaternion_base<T> VECTORCALL squad_control_point(quaternion_base<T> previous, quaternion_base<T> current, quaternion_base<T> next)
+	{
+		const static detail::simd_pack<T> sign_bit(-0.0f);
+		const static detail::simd_pack<T> minus_quarter(-0.25f);
+
+		//Keep neighbours on current's hemisphere so the tangent follows the short way round.
+		previous.simd = previous.simd.bit_xor(dot_broadcast(previous.simd, current.simd).bit_and(sign_bit));
+		next.simd = next.simd.bit_xor(dot_broadcast(next.simd, current.simd).bit_and(sign_bit));
+
+		quaternion_base<T> inverse_current = current.conjugate();
+
+		auto tangent = log(inverse_current * next).simd.add(log(inverse_current * previous).simd).c_mul(minus_quarter);
+
+		return current * exp(tangent);
+	}
+
+private:
+	static detail::simd_pack<T> VECTORCALL dot_broadcast(detail::simd_pack<T> a, detail::simd_pack<T> b)
+	{
+		auto products = a.c_mul(b);
+		auto sums = products.h_add(products);
+		return sums.h_add(sums);
+	}
+
+	static T VECTORCALL first_lane(detail::simd_pack<T> pack)
+	{
+		T lanes[4];
+		pack.store(lanes);
+		return lanes[0];
+	}
+
+	//Log of a unit quaternion, the rotation axis scaled by half the angle with w = 0.
+	static quaternion_base<T> VECTORCALL log(quaternion_base<T> q)
+	{
+		T lanes[4];
+		q.simd.store(lanes);
 
+		T sin_angle = std::sqrt(lanes[0] * lanes[0] + lanes[1] * lanes[1] + lanes[2] * lanes[2]);
+		T scale = sin_angle > std::numeric_limits<T>::epsilon() ? std::atan2(sin_angle, lanes[3]) / sin_angle : T(1);
+
+		return quaternion_base<T>(lanes[0] * scale, lanes[1] * scale, lanes[2] * scale, 0);
+	}
+
+	//Exp of a quaternion with w = 0, the inverse of log.
+	static quaternion_base<T> VECTORCALL exp(detail::simd_pack<T> v)
+	{
+		T lanes[4];
+		v.store(lanes);
+
+		T angle = std::sqrt(lanes[0] * lanes[0] + lanes[1] * lanes[1] + lanes[2] * lanes[2]);
+		T scale = angle > std::numeric_limits<T>::epsilon() ? std::sin(angle) / angle : T(1);
+
+		return quaternion_base<T>(lanes[0] * scale, lanes[1] * scale, lanes[2] * scale, std::cos(angle));
 	}
 };
 
 
+//Plain scalar quaternion with the same interface. slerp goes through acos and sin rather than the polynomial so this is the reference the simd path is checked against,
+//and quaternion_base<double> makes a more precise one.
+template <class T>
+class quaternion_base<T, simd_disabled>
+{
+public:
+	static_assert(std::is_floating_point<T>::value, "Quaternions only work with floating point types.");
+
+	T x, y, z, w;
+
+	quaternion_base()
+		: x(0), y(0), z(0), w(1)
+	{}
+
+	quaternion_base(T x, T y, T z, T w)
+		: x(x), y(y), z(z), w(w)
+	{}
+
+	template <class U>
+	explicit quaternion_base(const quaternion_base<U, simd_enabled> &copyme)
+		: x(T(U(copyme.x))), y(T(U(copyme.y))), z(T(U(copyme.z))), w(T(U(copyme.w)))
+	{}
+
+	T dot(const quaternion_base<T, simd_disabled> &rhs) const
+	{
+		return x * rhs.x + y * rhs.y + z * rhs.z + w * rhs.w;
+	}
+
+	vector_base<T, 3, simd_disabled> rotate(const vector_base<T, 3, simd_disabled> &vec) const
+	{
+		//v' = v + 2 * w * cross(q.xyz, v) + 2 * cross(q.xyz, cross(q.xyz, v))
+		vector_base<T, 3, simd_disabled> axis(x, y, z);
+		vector_base<T, 3, simd_disabled> t = axis.cross(vec);
+
+		return vec + t * (2 * w) + axis.cross(t) * T(2);
+	}
+
+	quaternion_base<T, simd_disabled> conjugate() const
+	{
+		return quaternion_base<T, simd_disabled>(-x, -y, -z, w);
+	}
+
+	quaternion_base<T, simd_disabled> inverse() const
+	{
+		T mag_sqr = dot(*this);
+		return quaternion_base<T, simd_disabled>(-x / mag_sqr, -y / mag_sqr, -z / mag_sqr, w / mag_sqr);
+	}
+
+	quaternion_base<T, simd_disabled> operator*(const quaternion_base<T, simd_disabled> &rhs) const
+	{
+		return quaternion_base<T, simd_disabled>(
+			w * rhs.x + x * rhs.w + y * rhs.z - z * rhs.y,
+			w * rhs.y + y * rhs.w + z * rhs.x - x * rhs.z,
+			w * rhs.z + z * rhs.w + x * rhs.y - y * rhs.x,
+			w * rhs.w - x * rhs.x - y * rhs.y - z * rhs.z);
+	}
+
+	static quaternion_base<T, simd_disabled> nlerp(const quaternion_base<T, simd_disabled> &from, const quaternion_base<T, simd_disabled> &to, T t)
+	{
+		T to_weight = from.dot(to) < 0 ? -t : t;
+		return normalized(blend(from, 1 - t, to, to_weight));
+	}
+
+	static quaternion_base<T, simd_disabled> slerp(const quaternion_base<T, simd_disabled> &from, const quaternion_base<T, simd_disabled> &to, T t)
+	{
+		T cos_angle = from.dot(to);
+		T sign = 1;
+		if (cos_angle < 0)
+		{
+			cos_angle = -cos_angle;
+			sign = -1;
+		}
+
+		//Close enough that sin(angle) loses its precision, the arc is a line.
+		if (cos_angle > 1 - std::numeric_limits<T>::epsilon())
+		{
+			return blend(from, 1 - t, to, sign * t);
+		}
+
+		T angle = std::acos(cos_angle);
+		T sin_angle = std::sin(angle);
+
+		return blend(from, std::sin((1 - t) * angle) / sin_angle, to, sign * std::sin(t * angle) / sin_angle);
+	}
+
+	//Same convention as the simd version, roll about z first, then pitch about x, then yaw about y.
+	static quaternion_base<T, simd_disabled> from_euler(T X, T Y, T Z)
+	{
+		quaternion_base<T, simd_disabled> qx(std::sin(X / 2), 0, 0, std::cos(X / 2));
+		quaternion_base<T, simd_disabled> qy(0, std::sin(Y / 2), 0, std::cos(Y / 2));
+		quaternion_base<T, simd_disabled> qz(0, 0, std::sin(Z / 2), std::cos(Z / 2));
+
+		return qy * qx * qz;
+	}
+
+	static quaternion_base<T, simd_disabled> squad(const quaternion_base<T, simd_disabled> &a, const quaternion_base<T, simd_disabled> &b, const quaternion_base<T, simd_disabled> &c, const quaternion_base<T, simd_disabled> &d, T t)
+	{
+		return slerp(slerp(a, d, t), slerp(b, c, t), 2 * t * (1 - t));
+	}
+
+	static quaternion_base<T, simd_disabled> squad_control_point(quaternion_base<T, simd_disabled> previous, const quaternion_base<T, simd_disabled> &current, quaternion_base<T, simd_disabled> next)
+	{
+		if (previous.dot(current) < 0)
+		{
+			previous = scaled(previous, -1);
+		}
+		if (next.dot(current) < 0)
+		{
+			next = scaled(next, -1);
+		}
+
+		quaternion_base<T, simd_disabled> inverse_current = current.conjugate();
+		quaternion_base<T, simd_disabled> a = log(inverse_current * next);
+		quaternion_base<T, simd_disabled> b = log(inverse_current * previous);
+
+		return current * exp(scaled(quaternion_base<T, simd_disabled>(a.x + b.x, a.y + b.y, a.z + b.z, 0), T(-0.25)));
+	}
+
+private:
+	static quaternion_base<T, simd_disabled> blend(const quaternion_base<T, simd_disabled> &a, T a_weight, const quaternion_base<T, simd_disabled> &b, T b_weight)
+	{
+		return quaternion_base<T, simd_disabled>(
+			a.x * a_weight + b.x * b_weight,
+			a.y * a_weight + b.y * b_weight,
+			a.z * a_weight + b.z * b_weight,
+			a.w * a_weight + b.w * b_weight);
+	}
+
+	static quaternion_base<T, simd_disabled> scaled(const quaternion_base<T, simd_disabled> &q, T scale)
+	{
+		return quaternion_base<T, simd_disabled>(q.x * scale, q.y * scale, q.z * scale, q.w * scale);
+	}
+
+	static quaternion_base<T, simd_disabled> normalized(const quaternion_base<T, simd_disabled> &q)
+	{
+		return scaled(q, 1 / std::sqrt(q.dot(q)));
+	}
+
+	static quaternion_base<T, simd_disabled> log(const quaternion_base<T, simd_disabled> &q)
+	{
+		T sin_angle = std::sqrt(q.x * q.x + q.y * q.y + q.z * q.z);
+		T scale = sin_angle > std::numeric_limits<T>::epsilon() ? std::atan2(sin_angle, q.w) / sin_angle : T(1);
+
+		return quaternion_base<T, simd_disabled>(q.x * scale, q.y * scale, q.z * scale, 0);
+	}
+
+	static quaternion_base<T, simd_disabled> exp(const quaternion_base<T, simd_disabled> &q)
+	{
+		T angle = std::sqrt(q.x * q.x + q.y * q.y + q.z * q.z);
+		T scale = angle > std::numeric_limits<T>::epsilon() ? std::sin(angle) / angle : T(1);
+
+		return quaternion_base<T, simd_disabled>(q.x * scale, q.y * scale, q.z * scale, std::cos(angle));
+	}
+};
+
 using quaternion = quaternion_base<float>;
 
+//Scalar quaternions, quaternionp is the float reference for quaternion and quaterniond the double one.
+using quaternionp = quaternion_base<float, simd_disabled>;
+using quaterniond = quaternion_base<double>;
+
 }
 }
\ No newline at end of file
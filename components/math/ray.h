@@ -0,0 +1,105 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+
+#include "simd.h"
+#include "vector.h"
+
+namespace tocs {
+namespace math {
+
+//A ray keeps its reciprocal direction for slab tests. Points along it are origin + t * direction, t from 0 up to whatever limit the query passes.
+class ray
+{
+public:
+	float origin[3];
+	float direction[3];
+	float inverse_direction[3];
+
+	ray()
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			origin[axis] = 0;
+			direction[axis] = 0;
+			inverse_direction[axis] = 0;
+		}
+	}
+
+	ray(const vector3 &from, const vector3 &towards)
+	{
+		float o[3] = { from.x, from.y, from.z };
+		float d[3] = { towards.x, towards.y, towards.z };
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			origin[axis] = o[axis];
+			direction[axis] = d[axis];
+
+			//A zero component is nudged so its reciprocal stays finite, an infinite one makes 0 * inf slabs NaN for boxes touching the origin.
+			float component = std::abs(d[axis]) < 1e-20f ? std::copysign(1e-20f, d[axis]) : d[axis];
+			inverse_direction[axis] = 1.0f / component;
+		}
+	}
+
+	//The segment from to to, t runs 0 to 1.
+	static ray between(const vector3 &from, const vector3 &to)
+	{
+		return ray(from, vector3(to.x - from.x, to.y - from.y, to.z - from.z));
+	}
+
+	//Slab test against a box given by its corners. On a hit within [0, max_t] t is where the ray enters, 0 when it starts inside.
+	//The batch test does the same operations in the same order, so the two agree exactly.
+	bool box_hit(const float *min, const float *max, float max_t, float &t) const
+	{
+		float near_t = 0, far_t = max_t;
+		float nears[3], fars[3];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float t1 = (min[axis] - origin[axis]) * inverse_direction[axis];
+			float t2 = (max[axis] - origin[axis]) * inverse_direction[axis];
+			nears[axis] = t1 < t2 ? t1 : t2;
+			fars[axis] = t1 > t2 ? t1 : t2;
+		}
+
+		near_t = std::max(std::max(std::max(nears[0], nears[1]), nears[2]), near_t);
+		far_t = std::min(std::min(std::min(fars[0], fars[1]), fars[2]), far_t);
+
+		t = near_t;
+		return !(far_t < near_t);
+	}
+};
+
+namespace detail
+{
+
+//The ray broadcast into packs once per query.
+class ray_packs
+{
+	simd_pack<float> origin_x, origin_y, origin_z;
+	simd_pack<float> inverse_x, inverse_y, inverse_z;
+public:
+	explicit ray_packs(const ray &r)
+		: origin_x(r.origin[0]), origin_y(r.origin[1]), origin_z(r.origin[2])
+		, inverse_x(r.inverse_direction[0]), inverse_y(r.inverse_direction[1]), inverse_z(r.inverse_direction[2])
+	{}
+
+	//Four lane bits, set where the ray enters the box within [0, max_t]. The entry distances go to t.
+	int VECTORCALL boxes_hit(simd_pack<float> min_x, simd_pack<float> min_y, simd_pack<float> min_z, simd_pack<float> max_x, simd_pack<float> max_y, simd_pack<float> max_z,
+		simd_pack<float> max_t, simd_pack<float> &t) const
+	{
+		auto t1x = min_x.sub(origin_x).c_mul(inverse_x), t2x = max_x.sub(origin_x).c_mul(inverse_x);
+		auto t1y = min_y.sub(origin_y).c_mul(inverse_y), t2y = max_y.sub(origin_y).c_mul(inverse_y);
+		auto t1z = min_z.sub(origin_z).c_mul(inverse_z), t2z = max_z.sub(origin_z).c_mul(inverse_z);
+
+		auto near_t = t1x.c_min(t2x).c_max(t1y.c_min(t2y)).c_max(t1z.c_min(t2z)).c_max(simd_pack<float>());
+		auto far_t = t1x.c_max(t2x).c_min(t1y.c_max(t2y)).c_min(t1z.c_max(t2z)).c_min(max_t);
+
+		t = near_t;
+		return ~far_t.c_less(near_t).sign_mask() & 0xF;
+	}
+};
+
+}
+
+}
+}
@@ -5,8 +5,17 @@
 #include <smmintrin.h>
 #include <type_traits>
 
-//Todo what about not MSFT?
+//GCC and Clang pass __m128 in registers already, only MSVC needs telling.
+#if defined(_MSC_VER)
 #define VECTORCALL __vectorcall
+#else
+#define VECTORCALL
+#endif
+
+//MSVC emits any intrinsic regardless of /arch, GCC and Clang refuse unless the target has it.
+#if !defined(_MSC_VER) && !defined(__SSE4_1__)
+#error "tocs math needs SSE4.1, build with -msse4.1 or -march set to something newer"
+#endif
 
 namespace tocs {
 namespace math {
@@ -64,6 +73,17 @@ public:
 
 	}
 
+	//Unaligned, for streaming through SoA arrays.
+	inline static simd_pack<float> VECTORCALL load(const float *source)
+	{
+		return simd_pack<float>(_mm_loadu_ps(source));
+	}
+
+	inline void VECTORCALL store(float *dest) const
+	{
+		_mm_storeu_ps(dest, pack);
+	}
+
 	inline simd_pack<float> VECTORCALL add(simd_pack<float> rhs) const
 	{
 		return simd_pack<float>(_mm_add_ps(pack, rhs.pack));
@@ -94,21 +114,65 @@ public:
 		return simd_pack<float>(_mm_cmplt_ps(pack, rhs.pack));
 	}
 
+	inline simd_pack<float> VECTORCALL c_min(simd_pack<float> rhs) const
+	{
+		return simd_pack<float>(_mm_min_ps(pack, rhs.pack));
+	}
+
+	inline simd_pack<float> VECTORCALL c_max(simd_pack<float> rhs) const
+	{
+		return simd_pack<float>(_mm_max_ps(pack, rhs.pack));
+	}
+
+	inline simd_pack<float> VECTORCALL c_sqrt() const
+	{
+		return simd_pack<float>(_mm_sqrt_ps(pack));
+	}
+
+	inline simd_pack<float> VECTORCALL bit_and(simd_pack<float> rhs) const
+	{
+		return simd_pack<float>(_mm_and_ps(pack, rhs.pack));
+	}
+
+	inline simd_pack<float> VECTORCALL bit_xor(simd_pack<float> rhs) const
+	{
+		return simd_pack<float>(_mm_xor_ps(pack, rhs.pack));
+	}
+
+	inline simd_pack<float> VECTORCALL bit_or(simd_pack<float> rhs) const
+	{
+		return simd_pack<float>(_mm_or_ps(pack, rhs.pack));
+	}
+
+	//Sign bit of each lane packed into the low 4 bits, x in bit 0.
+	inline int VECTORCALL sign_mask() const
+	{
+		return _mm_movemask_ps(pack);
+	}
+
 	inline static simd_pack<float> VECTORCALL blend(simd_pack<float> a, simd_pack<float> b, simd_pack<float> mask)
 	{
 		return simd_pack<float>(_mm_blendv_ps(a.pack, b.pack, mask.pack));
 	}
 
+	//Indices are given in lane order, x first. _MM_SHUFFLE takes them highest lane first so they're reversed here.
 	template <int xi, int yi, int zi, int wi>
 	inline simd_pack<float> VECTORCALL swizzle() const
 	{
-		return simd_pack<float>(_mm_shuffle_ps(pack, pack, _MM_SHUFFLE(xi, yi, zi, wi)));
+		return simd_pack<float>(_mm_shuffle_ps(pack, pack, _MM_SHUFFLE(wi, zi, yi, xi)));
 	}
 
+	//x and y come from a, z and w from b.
 	template <int xi, int yi, int zi, int wi>
 	inline static simd_pack<float> VECTORCALL shuffle(simd_pack<float> a, simd_pack<float> b)
 	{
-		return simd_pack<float>(_mm_shuffle_ps(a.pack, b.pack, _MM_SHUFFLE(xi, yi, zi, wi)));
+		return simd_pack<float>(_mm_shuffle_ps(a.pack, b.pack, _MM_SHUFFLE(wi, zi, yi, xi)));
+	}
+
+	//Transposes the 4x4 block held in a, b, c and d. Turns four xyzw values into an x, y, z and w pack and back.
+	inline static void VECTORCALL transpose(simd_pack<float> &a, simd_pack<float> &b, simd_pack<float> &c, simd_pack<float> &d)
+	{
+		_MM_TRANSPOSE4_PS(a.pack, b.pack, c.pack, d.pack);
 	}
 
 	template <unsigned int shufflebytes>
@@ -124,22 +188,18 @@ public:
 		return simd_pack<float>(_mm_insert_ps(pack, _mm_set_ss(v), i * 16));
 	}
 
+	//The swizzle folds away for lane 0.
 	template <int i>
 	inline float VECTORCALL get() const
 	{
-		return _mm_cvtss_f32(swizzle<i, i, i, i>(pack));
-	}
-
-	template<>
-	inline float VECTORCALL get<0>() const
-	{
-		return _mm_cvtss_f32(pack);
+		return _mm_cvtss_f32(swizzle<i, i, i, i>().pack);
 	}
 
+	//Dot product of the flagged lanes, broadcast to every lane.
 	template<bool xf, bool yf, bool zf, bool wf>
 	inline simd_pack<float> VECTORCALL dot(simd_pack<float> rhs) const
 	{
-		return simd_pack<float>(_mm_dp_ps(pack, rhs.pack, xf * 0x11 | yf * 0x22 | zf * 0x33 | wf * 0x44));
+		return simd_pack<float>(_mm_dp_ps(pack, rhs.pack, xf * 0x10 | yf * 0x20 | zf * 0x40 | wf * 0x80 | 0x0F));
 	}
 };
 
@@ -152,12 +212,13 @@ class scalar_simd_vector_accessor
 public:
 	scalar_simd_vector_accessor<T, i> &operator=  (T value)
 	{
-		pack = detail::simd_pack<T>::set<i>(pack, value);
+		pack = pack.template set<i>(value);
+		return *this;
 	}
 
 	operator T() const
 	{
-		return detail::simd_pack<T>::get<i>(pack);
+		return pack.template get<i>();
 	}
 };
 
@@ -1,4 +1,5 @@
 #pragma once
+#include <cmath>
 #include <type_traits>
 #include "simd.h"
 #include "core/type_promotion.h"
@@ -14,7 +15,7 @@ namespace detail
 	{};
 
 	template <class T, int dim>
-	class simd_vector_compatible <T, dim, typename std::enable_if<is_simd_type<T>::value && (dim > 1 && dim < 4)>::type> : public std::true_type
+	class simd_vector_compatible <T, dim, typename std::enable_if<is_simd_type<T>::value && (dim > 1 && dim <= 4)>::type> : public std::true_type
 	{};
 
 	template <class T, int dim, class type_override = void>
@@ -35,19 +36,15 @@ namespace detail
 	};
 
 	template <class T, int dim>
-	class default_simd_vector_toggle<T, dim, typename enable_if_simd_vector<T, dim>>
+	class default_simd_vector_toggle<T, dim, typename enable_if_simd_vector<T, dim>::type>
 	{
 	public:
 		typedef simd_enabled type;
 	};
 }
 
-template <class T, int dim, class Enable = simd_disabled>
-class vector_base
-{
-	T values[dim];
-public:
-};
+template <class T, int dim, class Enable = typename detail::default_simd_vector_toggle<T, dim>::type>
+class vector_base;
 
 //SIMD Specializations
 
@@ -89,11 +86,11 @@ public:
 	{}
 
 	template<class U>
-	vector_base(vector_base<U, 4> copyme)
-		: simd(copyme.x, copyme.y, copyme.z, copyme.w)
+	explicit vector_base(const vector_base<U, 4, simd_disabled> &copyme)
+		: simd(T(copyme.x), T(copyme.y), T(copyme.z), T(copyme.w))
 	{}
-private:
-	vector_base(detail::simd_pack<T> pack)
+
+	explicit vector_base(detail::simd_pack<T> pack)
 		: simd(pack)
 	{}
 };
@@ -120,31 +117,31 @@ public:
 	{}
 
 	template<class U>
-	vector_base(vector_base<U, 3> copyme)
-		: simd(copyme.x, copyme.y, copyme.z, 0)
+	explicit vector_base(const vector_base<U, 3, simd_disabled> &copyme)
+		: simd(T(copyme.x), T(copyme.y), T(copyme.z), 0)
+	{}
+
+	explicit vector_base(detail::simd_pack<T> pack)
+		: simd(pack)
 	{}
 
 	vector_base<T, 3, simd_enabled> VECTORCALL cross(vector_base<T, 3, simd_enabled> rhs) const
 	{
-		detail::simd_pack<T> a = simd.swizzle<1, 2, 0, 0>();
-		detail::simd_pack<T> b = rhs.simd.swizzle<2, 0, 1, 0>();
+		detail::simd_pack<T> a = simd.template swizzle<1, 2, 0, 0>();
+		detail::simd_pack<T> b = rhs.simd.template swizzle<2, 0, 1, 0>();
 
-		detail::simd_pack<T> c = rhs.simd.swizzle<1, 2, 0, 0>();
-		detail::simd_pack<T> d = simd.swizzle<2, 0, 1, 0>();
+		detail::simd_pack<T> c = rhs.simd.template swizzle<1, 2, 0, 0>();
+		detail::simd_pack<T> d = simd.template swizzle<2, 0, 1, 0>();
 
 		detail::simd_pack<T> ab = a.c_mul(b);
 		detail::simd_pack<T> cd = c.c_mul(d);
 
-		return ab.sub(cd);
+		return vector_base<T, 3, simd_enabled>(ab.sub(cd));
 	}
 
 	static vector_base<T, 3, simd_enabled> forward;
 	static vector_base<T, 3, simd_enabled> up;
 	static vector_base<T, 3, simd_enabled> left;
-private:
-	vector_base(detail::simd_pack<T> pack)
-		: simd(pack)
-	{}
 };
 
 template <class T>
@@ -175,12 +172,11 @@ public:
 	{}
 
 	template<class U>
-	vector_base(vector_base<U, 2> copyme)
-		: simd(copyme.x, copyme.y, 0, 0)
+	explicit vector_base(const vector_base<U, 2, simd_disabled> &copyme)
+		: simd(T(copyme.x), T(copyme.y), 0, 0)
 	{}
 
-private:
-	vector_base(detail::simd_pack<T> pack)
+	explicit vector_base(detail::simd_pack<T> pack)
 		: simd(pack)
 	{}
 };
@@ -190,13 +186,13 @@ private:
 template <class T, int dim>
 vector_base<T, dim, simd_enabled> VECTORCALL operator+ (vector_base<T, dim, simd_enabled> a, vector_base<T, dim, simd_enabled> b)
 {
-	return vector_base<float, dim>(a.add(b));
+	return vector_base<T, dim, simd_enabled>(a.simd.add(b.simd));
 }
 
 template <class T, int dim>
 vector_base<T, dim, simd_enabled> VECTORCALL operator- (vector_base<T, dim, simd_enabled> a, vector_base<T, dim, simd_enabled> b)
 {
-	return vector_base<T, dim>(a.sub(b));
+	return vector_base<T, dim, simd_enabled>(a.simd.sub(b.simd));
 }
 
 //SIMD - Scalar Operators
@@ -207,7 +203,7 @@ vector_base<T, dim, simd_enabled> VECTORCALL operator- (vector_base<T, dim, simd
 template <class T, class U, int dim>
 vector_base<typename type_promotion<T, U>::type, dim, typename detail::enable_if_simd_vector<typename type_promotion<T, U>::type, dim, simd_enabled>::type> VECTORCALL operator* (vector_base<T, dim, simd_enabled> a, U b)
 {
-	typedef type_promotion<T, U>::type result_kernel_type;
+	typedef typename type_promotion<T, U>::type result_kernel_type;
 	typedef vector_base<result_kernel_type, dim, simd_enabled> result_type;
 
 	result_type v = a;
@@ -218,7 +214,7 @@ vector_base<typename type_promotion<T, U>::type, dim, typename detail::enable_if
 template <class T, class U, int dim>
 vector_base<typename type_promotion<T, U>::type, dim, typename detail::enable_if_simd_vector<typename type_promotion<T, U>::type, dim, simd_enabled>::type> VECTORCALL operator/ (vector_base<T, dim, simd_enabled> a, U b)
 {
-	typedef type_promotion<T, U>::type result_kernel_type;
+	typedef typename type_promotion<T, U>::type result_kernel_type;
 	typedef vector_base<result_kernel_type, dim, simd_enabled> result_type;
 
 	result_type v = a;
@@ -233,17 +229,17 @@ namespace detail {
 template <class T, int dim>
 T VECTORCALL vector_shared_simd_funcs<T, dim>::dot(vector_base<T, dim, simd_enabled> rhs) const
 {
-	const vector_base<T, dim, simd_enabled> &this_vec = reinterpret_cast<const vector_base<T, dim, simd_enabled> &> (*this);
+	const vector_base<T, dim, simd_enabled> &this_vec = static_cast<const vector_base<T, dim, simd_enabled> &> (*this);
 
-	auto dotresult = this_vec.simd.dot<(dim >= 1), (dim >= 2), (dim >= 3), (dim >= 4)>(rhs.simd);
+	auto dotresult = this_vec.simd.template dot<(dim >= 1), (dim >= 2), (dim >= 3), (dim >= 4)>(rhs.simd);
 
-	return dotresult.get<0>();
+	return dotresult.template get<0>();
 }
 
 template <class T, int dim>
 T VECTORCALL vector_shared_simd_funcs<T, dim>::length_sq() const
 {
-	const vector_base<T, dim, simd_enabled> &this_vec = reinterpret_cast<const vector_base<T, dim, simd_enabled> &> (*this);
+	const vector_base<T, dim, simd_enabled> &this_vec = static_cast<const vector_base<T, dim, simd_enabled> &> (*this);
 
 	return dot(this_vec);
 }
@@ -257,11 +253,181 @@ typename to_real<T>::type VECTORCALL vector_shared_simd_funcs<T, dim>::length()
 template <class T, int dim>
 vector_base<typename to_real<T>::type, dim, simd_enabled> VECTORCALL vector_shared_simd_funcs<T, dim>::normalized() const
 {
-	const vector_base<T, dim, simd_enabled> &this_vec = reinterpret_cast<const vector_base<T, dim, simd_enabled> &> (*this);
+	const vector_base<T, dim, simd_enabled> &this_vec = static_cast<const vector_base<T, dim, simd_enabled> &> (*this);
+
+	return vector_base<typename to_real<T>::type, dim, simd_enabled>(this_vec) / length();
+}
 
-	return vector_base<to_real<T>::type, dim>(this_vec) / length();
 }
 
+//Scalar Specializations
+
+//Plain members and plain arithmetic, for types without a simd_pack and as the reference the simd versions are checked against by MathCheck.
+//Converting from a simd vector is explicit since it goes through memory.
+
+namespace detail
+{
+
+template <class T, int dim>
+class vector_shared_scalar_funcs
+{
+	const vector_base<T, dim, simd_disabled> &self() const
+	{
+		return static_cast<const vector_base<T, dim, simd_disabled> &> (*this);
+	}
+public:
+	T dot(const vector_base<T, dim, simd_disabled> &rhs) const
+	{
+		T result = 0;
+		for (int i = 0; i < dim; ++i)
+		{
+			result += self()[i] * rhs[i];
+		}
+		return result;
+	}
+
+	T length_sq() const
+	{
+		return dot(self());
+	}
+
+	typename to_real<T>::type length() const
+	{
+		return std::sqrt(static_cast<typename to_real<T>::type> (length_sq()));
+	}
+
+	vector_base<typename to_real<T>::type, dim, simd_disabled> normalized() const
+	{
+		typedef typename to_real<T>::type real;
+
+		vector_base<real, dim, simd_disabled> result;
+		real scale = real(1) / length();
+		for (int i = 0; i < dim; ++i)
+		{
+			result[i] = static_cast<real> (self()[i]) * scale;
+		}
+		return result;
+	}
+};
+
+}
+
+template <class T>
+class vector_base<T, 4, simd_disabled> : public detail::vector_shared_scalar_funcs<T, 4>
+{
+public:
+	T x, y, z, w;
+
+	vector_base()
+		: x(0), y(0), z(0), w(0)
+	{}
+
+	vector_base(T x, T y, T z, T w)
+		: x(x), y(y), z(z), w(w)
+	{}
+
+	template<class U>
+	explicit vector_base(vector_base<U, 4, simd_enabled> copyme)
+		: x(T(U(copyme.x))), y(T(U(copyme.y))), z(T(U(copyme.z))), w(T(U(copyme.w)))
+	{}
+
+	T &operator[](int i) { return (&x)[i]; }
+	const T &operator[](int i) const { return (&x)[i]; }
+};
+
+template <class T>
+class vector_base<T, 3, simd_disabled> : public detail::vector_shared_scalar_funcs<T, 3>
+{
+public:
+	T x, y, z;
+
+	vector_base()
+		: x(0), y(0), z(0)
+	{}
+
+	vector_base(T x, T y, T z)
+		: x(x), y(y), z(z)
+	{}
+
+	template<class U>
+	explicit vector_base(vector_base<U, 3, simd_enabled> copyme)
+		: x(T(U(copyme.x))), y(T(U(copyme.y))), z(T(U(copyme.z)))
+	{}
+
+	T &operator[](int i) { return (&x)[i]; }
+	const T &operator[](int i) const { return (&x)[i]; }
+
+	vector_base<T, 3, simd_disabled> cross(const vector_base<T, 3, simd_disabled> &rhs) const
+	{
+		return vector_base<T, 3, simd_disabled>(y * rhs.z - z * rhs.y, z * rhs.x - x * rhs.z, x * rhs.y - y * rhs.x);
+	}
+};
+
+template <class T>
+class vector_base<T, 2, simd_disabled> : public detail::vector_shared_scalar_funcs<T, 2>
+{
+public:
+	T x, y;
+
+	vector_base()
+		: x(0), y(0)
+	{}
+
+	vector_base(T x, T y)
+		: x(x), y(y)
+	{}
+
+	template<class U>
+	explicit vector_base(vector_base<U, 2, simd_enabled> copyme)
+		: x(T(U(copyme.x))), y(T(U(copyme.y)))
+	{}
+
+	T &operator[](int i) { return (&x)[i]; }
+	const T &operator[](int i) const { return (&x)[i]; }
+};
+
+//Scalar Operators
+
+template <class T, int dim>
+vector_base<T, dim, simd_disabled> operator+ (vector_base<T, dim, simd_disabled> a, const vector_base<T, dim, simd_disabled> &b)
+{
+	for (int i = 0; i < dim; ++i)
+	{
+		a[i] += b[i];
+	}
+	return a;
+}
+
+template <class T, int dim>
+vector_base<T, dim, simd_disabled> operator- (vector_base<T, dim, simd_disabled> a, const vector_base<T, dim, simd_disabled> &b)
+{
+	for (int i = 0; i < dim; ++i)
+	{
+		a[i] -= b[i];
+	}
+	return a;
+}
+
+template <class T, class U, int dim>
+vector_base<typename type_promotion<T, U>::type, dim, simd_disabled> operator* (const vector_base<T, dim, simd_disabled> &a, U b)
+{
+	vector_base<typename type_promotion<T, U>::type, dim, simd_disabled> result;
+	for (int i = 0; i < dim; ++i)
+	{
+		result[i] = a[i] * b;
+	}
+	return result;
+}
+
+template <class T, class U, int dim>
+vector_base<typename type_promotion<T, U>::type, dim, simd_disabled> operator/ (const vector_base<T, dim, simd_disabled> &a, U b)
+{
+	vector_base<typename type_promotion<T, U>::type, dim, simd_disabled> result;
+	for (int i = 0; i < dim; ++i)
+	{
+		result[i] = a[i] / b;
+	}
+	return result;
 }
 
 //Simd enabled 4 float vector.
@@ -273,17 +439,22 @@ using vector3 = vector_base<float, 3, simd_enabled>;
 //Simd enabled 2 float vector.
 using vector2 = vector_base<float, 2, simd_enabled>;
 
+//Scalar vectors, the same interface with plain members.
+using vector4p = vector_base<float, 4, simd_disabled>;
+using vector3p = vector_base<float, 3, simd_disabled>;
+using vector2p = vector_base<float, 2, simd_disabled>;
+
+using vector4d = vector_base<double, 4>;
+using vector3d = vector_base<double, 3>;
+using vector2d = vector_base<double, 2>;
+
 //using vector4i = vector_base<int, 4>;
 //using vector3i = vector_base<int, 3>;
 //using vector2i = vector_base<int, 2>;
 
-//using vector4p = vector_base<float, 4, simd_disabled>;
-//using vector3p = vector_base<float, 3, simd_disabled>;
-//using vector2p = vector_base<float, 2, simd_disabled>;
-
 //using vector4ip = vector_base<int, 4, simd_disabled>;
 //using vector3ip = vector_base<int, 3, simd_disabled>;
 //using vector2ip = vector_base<int, 2, simd_disabled>;
 
 }
-}
\ No newline at end of file
+}
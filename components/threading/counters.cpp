@@ -0,0 +1,78 @@
+#include "counters.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace tocs {
+namespace threading {
+
+namespace {
+
+class counter_registry
+{
+public:
+	std::mutex mutex;
+	std::vector<std::unique_ptr<perf_counters::thread_block>> blocks;
+};
+
+counter_registry &registry()
+{
+	static counter_registry instance;
+	return instance;
+}
+
+}
+
+const char *perf_counter_snapshot::name(perf_counter counter)
+{
+	switch (counter)
+	{
+	case perf_counter::work_queue_pops: return "work_queue_pops";
+	case perf_counter::steals: return "steals";
+	case perf_counter::failed_steals: return "failed_steals";
+	case perf_counter::pool_try_get_retries: return "pool_try_get_retries";
+	case perf_counter::pool_page_allocations: return "pool_page_allocations";
+	case perf_counter::pool_yield_spins: return "pool_yield_spins";
+	case perf_counter::component_lock_waits: return "component_lock_waits";
+	case perf_counter::purgatory_objects: return "purgatory_objects";
+	case perf_counter::published_state_waits: return "published_state_waits";
+	case perf_counter::state_hash_pages: return "state_hash_pages";
+	}
+	return "unknown";
+}
+
+perf_counters::thread_block &perf_counters::this_thread_block()
+{
+	static thread_local thread_block *block = nullptr;
+
+	if (!block)
+	{
+		counter_registry &r = registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		r.blocks.emplace_back(new thread_block());
+		block = r.blocks.back().get();
+	}
+
+	return *block;
+}
+
+perf_counter_snapshot perf_counters::totals()
+{
+	perf_counter_snapshot result;
+
+	counter_registry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+
+	for (auto &block : r.blocks)
+	{
+		for (int i = 0; i < perf_counter_count; ++i)
+		{
+			result.values[i] += block->values[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	return result;
+}
+
+}
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+//Compile the counters out with TOCS_PERF_COUNTERS=0.
+#ifndef TOCS_PERF_COUNTERS
+#define TOCS_PERF_COUNTERS 1
+#endif
+
+namespace tocs {
+namespace threading {
+
+enum class perf_counter
+{
+	work_queue_pops,		//Jobs a worker took from its own queues.
+	steals,				//Successful steals, batch pulls count once.
+	failed_steals,			//pull_job calls that found nothing to steal at some priority.
+	pool_try_get_retries,		//concurrent_free_list::try_get loops caused by contention.
+	pool_page_allocations,		//New node pages from concurrent_pool_storage::fetch_new_node.
+	pool_yield_spins,		//fetch_new_node yields while another thread allocates a page.
+	component_lock_waits,		//component_mapping lock acquisitions that had to block.
+	purgatory_objects,		//Objects moved out of purgatory at the start of a frame.
+	published_state_waits,		//Yields while a frame's state slot was still pinned by a reader.
+	state_hash_pages,		//Component pages state_hash had to rehash because their contents changed.
+};
+
+static constexpr int perf_counter_count = 10;
+
+class perf_counter_snapshot
+{
+public:
+	std::uint64_t values[perf_counter_count];
+
+	perf_counter_snapshot()
+		: values{}
+	{}
+
+	std::uint64_t operator[](perf_counter counter) const { return values[static_cast<int> (counter)]; }
+
+	perf_counter_snapshot operator-(const perf_counter_snapshot &rhs) const
+	{
+		perf_counter_snapshot result;
+		for (int i = 0; i < perf_counter_count; ++i)
+		{
+			result.values[i] = values[i] - rhs.values[i];
+		}
+		return result;
+	}
+
+	static const char *name(perf_counter counter);
+};
+
+//Per thread counters that are only ever written by their own thread, so bumping one is a plain load and store.
+//totals() sums every thread's block, threads that have exited keep their counts.
+class perf_counters
+{
+public:
+	class thread_block
+	{
+	public:
+		std::atomic<std::uint64_t> values[perf_counter_count];
+
+		thread_block()
+		{
+			for (auto &value : values)
+			{
+				value.store(0, std::memory_order_relaxed);
+			}
+		}
+	};
+private:
+	static thread_block &this_thread_block();
+public:
+	static void add(perf_counter counter, std::uint64_t amount = 1)
+	{
+		std::atomic<std::uint64_t> &value = this_thread_block().values[static_cast<int> (counter)];
+		value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	static perf_counter_snapshot totals();
+};
+
+}
+}
+
+#if TOCS_PERF_COUNTERS
+#define TOCS_COUNT(counter, amount) ::tocs::threading::perf_counters::add(::tocs::threading::perf_counter::counter, amount)
+#else
+#define TOCS_COUNT(counter, amount) ((void)0)
+#endif
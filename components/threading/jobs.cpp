@@ -8,10 +8,11 @@ static thread_local job* thread_job;
 
 void job::run()
 {
-	check(thread_job == nullptr);
+	//Jobs can nest when a job waits and helps run other work, so restore whatever was running before.
+	job *previous_job = thread_job;
 	thread_job = this;
 	job_func();
-	thread_job = nullptr;
+	thread_job = previous_job;
 	if (parent)
 	{
 		--parent->remaining_subjobs;
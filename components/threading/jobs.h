@@ -2,6 +2,7 @@
 #include <vector>
 #include <thread>
 #include <atomic>
+#include <functional>
 #include "cacheline.h"
 #include "pool.h"
 
@@ -10,9 +11,20 @@ namespace threading {
 
 //https://manu343726.github.io/2017/03/13/lock-free-job-stealing-task-system-with-modern-c.html
 
+//Each worker has a queue per priority and always drains higher priorities first, including when stealing.
+enum class job_priority
+{
+	critical,	//On the frame's critical path, e.g. systems.
+	normal,
+	background,	//Long running work like asset decompression. Doesn't start while the job system has background work paused.
+};
+
+static constexpr int job_priority_count = 3;
+
 class job
 {
 	job *parent;
+	job_priority priority;
 	std::atomic<int> remaining_subjobs;
 	std::function<void()> job_func;
 
@@ -20,17 +32,23 @@ class job
 
 	cache_line_padding padding;
 public:
+	friend class worker;
+	friend class job_system;
 
 	job()
 		: parent(nullptr)
+		, priority(job_priority::normal)
 	{}
 
 	template<class Func>
-	job(Func &&func)
+	job(Func &&func, job_priority priority = job_priority::normal)
 		: parent(nullptr)
+		, priority(priority)
 		, job_func(std::forward<Func>(func))
 	{}
 
+	job_priority get_priority() const { return priority; }
+
 	void run();
 
 	static job *this_job();
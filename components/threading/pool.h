@@ -2,7 +2,9 @@
 #include <atomic>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include "core/asserts.h"
+#include "counters.h"
 namespace tocs {
 namespace threading {
 
@@ -96,6 +98,7 @@ namespace detail {
 
 				if ((refs & REFS_MASK) == 0 || !head_ptr->refs.compare_exchange_strong(refs, refs + 1, std::memory_order_acquire, std::memory_order_relaxed))
 				{
+					TOCS_COUNT(pool_try_get_retries, 1);
 					head_ptr = head.load(std::memory_order_acquire);
 					continue;
 				}
@@ -110,7 +113,7 @@ namespace detail {
 					// Yay, got the node. This means it was on the list, which means
 					// shouldBeOnFreeList must be false no matter the refcount (because
 					// nobody else knows it's been taken off yet, it can't have been put back on).
-					assert((head.load()->refs.load(std::memory_order_relaxed) & SHOULD_BE_ON_FREELIST) == 0);
+					assert((head_ptr->refs.load(std::memory_order_relaxed) & SHOULD_BE_ON_FREELIST) == 0);
 
 					// Decrease refcount twice, once for our ref, and once for the list's ref
 					head_ptr->refs.fetch_add(-2, std::memory_order_relaxed);
@@ -120,6 +123,7 @@ namespace detail {
 
 				// OK, the head must have changed on us, but we still need to decrease the refcount we
 				// increased
+				TOCS_COUNT(pool_try_get_retries, 1);
 				refs = prevHead->refs.fetch_add(-1, std::memory_order_acq_rel);
 				if (refs == SHOULD_BE_ON_FREELIST + 1)
 				{
@@ -196,6 +200,7 @@ namespace detail {
 				{
 					//We got the last node in the page so we alloc a new one for the next fetch.
 					node_page *new_page = new node_page();
+					TOCS_COUNT(pool_page_allocations, 1);
 
 					node_type* result_node = &tail_page->nodes[node_slot];
 
@@ -208,6 +213,7 @@ namespace detail {
 				else if (node_slot >= node_page::max_node_count)
 				{
 					//We're past the end of the last page, but we're not the first thread to get to it. Now we have to wait :/
+					TOCS_COUNT(pool_yield_spins, 1);
 					std::this_thread::yield();
 				}
 				else
@@ -315,7 +321,7 @@ public:
 	void return_item(concurrent_pool_handle<T> handle)
 	{
 		item_behaviour.on_return(&handle.node->item(), handle.node->constructed);
-		add_node(handle.node);
+		free_list.add_node(handle.node);
 	}
 };
 
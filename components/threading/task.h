@@ -0,0 +1,565 @@
+#pragma once
+
+//Coroutine jobs need C++20 coroutines, without them this header is empty.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define TOCS_HAS_COROUTINES 1
+
+#include <coroutine>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "worker.h"
+#include "core/asserts.h"
+
+namespace tocs {
+namespace threading {
+
+//Coroutine frames come from per thread free lists bucketed by size so suspending and resuming across frames doesn't hit the heap.
+//A frame freed on another thread just joins that thread's list.
+class coroutine_frame_pool
+{
+	static constexpr std::size_t bucket_size = 64;
+	static constexpr std::size_t bucket_count = 16;
+	static constexpr std::size_t max_cached_per_bucket = 256;
+
+	class free_block
+	{
+	public:
+		free_block *next;
+	};
+
+	class thread_cache
+	{
+	public:
+		free_block *buckets[bucket_count] = {};
+		std::size_t counts[bucket_count] = {};
+
+		~thread_cache()
+		{
+			for (std::size_t b = 0; b < bucket_count; ++b)
+			{
+				while (buckets[b])
+				{
+					free_block *next = buckets[b]->next;
+					::operator delete(buckets[b]);
+					buckets[b] = next;
+				}
+			}
+		}
+	};
+
+	static thread_cache &this_thread_cache()
+	{
+		static thread_local thread_cache cache;
+		return cache;
+	}
+
+	static std::size_t bucket_for(std::size_t size)
+	{
+		return (size + bucket_size - 1) / bucket_size - 1;
+	}
+public:
+	static void *allocate(std::size_t size)
+	{
+		std::size_t bucket = bucket_for(size);
+		if (bucket >= bucket_count)
+		{
+			return ::operator new(size);
+		}
+
+		thread_cache &cache = this_thread_cache();
+		if (free_block *block = cache.buckets[bucket])
+		{
+			cache.buckets[bucket] = block->next;
+			--cache.counts[bucket];
+			return block;
+		}
+
+		return ::operator new((bucket + 1) * bucket_size);
+	}
+
+	static void deallocate(void *memory, std::size_t size)
+	{
+		std::size_t bucket = bucket_for(size);
+		thread_cache &cache = this_thread_cache();
+
+		if (bucket >= bucket_count || cache.counts[bucket] >= max_cached_per_bucket)
+		{
+			::operator delete(memory);
+			return;
+		}
+
+		free_block *block = static_cast<free_block *> (memory);
+		block->next = cache.buckets[bucket];
+		cache.buckets[bucket] = block;
+		++cache.counts[bucket];
+	}
+};
+
+template <class T = void>
+class task;
+
+namespace detail {
+
+class task_promise_base
+{
+public:
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+
+	class final_awaiter
+	{
+	public:
+		bool await_ready() const noexcept { return false; }
+
+		template <class Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> finished) noexcept
+		{
+			//Hand straight back to whoever awaited us without growing the stack.
+			std::coroutine_handle<> next = finished.promise().continuation;
+			return next ? next : std::noop_coroutine();
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	final_awaiter final_suspend() const noexcept { return {}; }
+
+	void unhandled_exception() { exception = std::current_exception(); }
+
+	static void *operator new(std::size_t size) { return coroutine_frame_pool::allocate(size); }
+	static void operator delete(void *memory, std::size_t size) { coroutine_frame_pool::deallocate(memory, size); }
+};
+
+template <class T>
+class task_promise : public task_promise_base
+{
+	std::optional<T> value;
+public:
+	task<T> get_return_object();
+
+	template <class U>
+	void return_value(U &&result)
+	{
+		value.emplace(std::forward<U>(result));
+	}
+
+	T result()
+	{
+		if (exception)
+		{
+			std::rethrow_exception(exception);
+		}
+		return std::move(*value);
+	}
+};
+
+template <>
+class task_promise<void> : public task_promise_base
+{
+public:
+	task<void> get_return_object();
+
+	void return_void() {}
+
+	void result()
+	{
+		if (exception)
+		{
+			std::rethrow_exception(exception);
+		}
+	}
+};
+
+//Fire and forget coroutine used by spawn(), it frees its own frame when it finishes.
+class detached_task
+{
+public:
+	class promise_type
+	{
+	public:
+		detached_task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() const noexcept { return {}; }
+		std::suspend_never final_suspend() const noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+
+		static void *operator new(std::size_t size) { return coroutine_frame_pool::allocate(size); }
+		static void operator delete(void *memory, std::size_t size) { coroutine_frame_pool::deallocate(memory, size); }
+	};
+};
+
+}
+
+//Lazily started coroutine. Awaiting it runs it on the awaiting thread and resumes the awaiter when it completes.
+//Use schedule(), job awaits, job_group, frame_barrier and completion_event inside it to hop between workers without blocking a thread.
+template <class T>
+class task
+{
+public:
+	typedef detail::task_promise<T> promise_type;
+private:
+	std::coroutine_handle<promise_type> handle;
+public:
+	task()
+		: handle(nullptr)
+	{}
+
+	explicit task(std::coroutine_handle<promise_type> handle)
+		: handle(handle)
+	{}
+
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	task(task &&moveme) noexcept
+		: handle(std::exchange(moveme.handle, nullptr))
+	{}
+
+	task &operator=(task &&moveme) noexcept
+	{
+		if (this != &moveme)
+		{
+			if (handle)
+			{
+				handle.destroy();
+			}
+			handle = std::exchange(moveme.handle, nullptr);
+		}
+		return *this;
+	}
+
+	~task()
+	{
+		if (handle)
+		{
+			handle.destroy();
+		}
+	}
+
+	bool done() const { return !handle || handle.done(); }
+
+	//The task has to hold a coroutine, awaiting a default constructed or moved from task has no result to resume with.
+	auto operator co_await() && noexcept
+	{
+		check(handle);
+
+		class awaiter
+		{
+		public:
+			std::coroutine_handle<promise_type> child;
+
+			bool await_ready() const noexcept { return child.done(); }
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+			{
+				child.promise().continuation = awaiting;
+				return child;
+			}
+
+			T await_resume()
+			{
+				return child.promise().result();
+			}
+		};
+
+		return awaiter{ handle };
+	}
+};
+
+namespace detail {
+
+template <class T>
+task<T> task_promise<T>::get_return_object()
+{
+	return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object()
+{
+	return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+inline detached_task run_detached(task<void> t)
+{
+	co_await std::move(t);
+}
+
+}
+
+//Starts a task running as a job on the calling worker's job system. It owns itself and is freed once it finishes.
+inline void spawn(task<void> t, job_priority priority = job_priority::normal)
+{
+	job_system::queue_job([t = std::make_shared<task<void>>(std::move(t))]() mutable
+	{
+		detail::run_detached(std::move(*t));
+	}, priority);
+}
+
+//co_await schedule() suspends and resumes as a fresh job, letting other workers pick the coroutine up.
+class schedule_awaiter
+{
+	job_priority priority;
+public:
+	explicit schedule_awaiter(job_priority priority)
+		: priority(priority)
+	{}
+
+	bool await_ready() const noexcept { return false; }
+
+	void await_suspend(std::coroutine_handle<> awaiting)
+	{
+		job_system::queue_job([awaiting]() { awaiting.resume(); }, priority);
+	}
+
+	void await_resume() const noexcept {}
+};
+
+inline schedule_awaiter schedule(job_priority priority = job_priority::normal)
+{
+	return schedule_awaiter(priority);
+}
+
+//co_await run_job(func) runs func as its own job and resumes with its result on whichever worker ran it.
+template <class Func>
+class job_awaiter
+{
+	typedef std::invoke_result_t<Func &> result_type;
+	typedef std::conditional_t<std::is_void<result_type>::value, char, std::optional<result_type>> storage_type;
+
+	Func func;
+	job_priority priority;
+	storage_type result;
+public:
+	job_awaiter(Func func, job_priority priority)
+		: func(std::move(func))
+		, priority(priority)
+	{}
+
+	bool await_ready() const noexcept { return false; }
+
+	void await_suspend(std::coroutine_handle<> awaiting)
+	{
+		job_system::queue_job([this, awaiting]()
+		{
+			if constexpr (std::is_void<result_type>::value)
+			{
+				func();
+			}
+			else
+			{
+				result.emplace(func());
+			}
+			awaiting.resume();
+		}, priority);
+	}
+
+	result_type await_resume()
+	{
+		if constexpr (!std::is_void<result_type>::value)
+		{
+			return std::move(*result);
+		}
+	}
+};
+
+template <class Func>
+job_awaiter<std::decay_t<Func>> run_job(Func &&func, job_priority priority = job_priority::normal)
+{
+	return job_awaiter<std::decay_t<Func>>(std::forward<Func>(func), priority);
+}
+
+//Fans out child jobs and lets one coroutine co_await all of them. Only one wait per group.
+class job_group
+{
+	std::atomic<int> remaining;
+	std::coroutine_handle<> waiter;
+
+	void finish_one()
+	{
+		if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			waiter.resume();
+		}
+	}
+public:
+	job_group()
+		: remaining(1)
+	{}
+
+	job_group(const job_group &) = delete;
+	job_group &operator=(const job_group &) = delete;
+
+	template <class Func>
+	void run(Func &&func, job_priority priority = job_priority::normal)
+	{
+		remaining.fetch_add(1, std::memory_order_relaxed);
+		job_system::queue_job([this, func = std::forward<Func>(func)]() mutable
+		{
+			func();
+			finish_one();
+		}, priority);
+	}
+
+	auto operator co_await() noexcept
+	{
+		class awaiter
+		{
+		public:
+			job_group *group;
+
+			bool await_ready() const noexcept { return false; }
+
+			bool await_suspend(std::coroutine_handle<> awaiting) noexcept
+			{
+				//The group starts at one so children can't resume us before we're suspended, dropping it here either suspends
+				//or, if every child already finished, carries straight on.
+				group->waiter = awaiting;
+				return group->remaining.fetch_sub(1, std::memory_order_acq_rel) != 1;
+			}
+
+			void await_resume() const noexcept {}
+		};
+
+		return awaiter{ this };
+	}
+};
+
+//Coroutines that co_await this are parked until release(), which the world calls when a frame advances.
+//Gameplay code that waits a frame doesn't need to hold a worker or keep a state machine.
+class frame_barrier
+{
+	std::mutex mutex;
+	std::vector<std::coroutine_handle<>> waiting;
+
+	//The system the waiting coroutines were suspended on, so release() can queue them from threads that aren't workers.
+	job_system *system = nullptr;
+public:
+	frame_barrier() {}
+
+	frame_barrier(const frame_barrier &) = delete;
+	frame_barrier &operator=(const frame_barrier &) = delete;
+
+	auto operator co_await() noexcept
+	{
+		class awaiter
+		{
+		public:
+			frame_barrier *barrier;
+
+			bool await_ready() const noexcept { return false; }
+
+			void await_suspend(std::coroutine_handle<> awaiting)
+			{
+				worker *current = worker::this_worker();
+				check(current != nullptr);
+
+				std::lock_guard<std::mutex> lock(barrier->mutex);
+				barrier->system = &current->get_system();
+				barrier->waiting.push_back(awaiting);
+			}
+
+			void await_resume() const noexcept {}
+		};
+
+		return awaiter{ this };
+	}
+
+	//Queues every waiting coroutine as a job. Safe from any thread, off a worker they're queued as external jobs.
+	void release(job_priority priority = job_priority::normal)
+	{
+		std::vector<std::coroutine_handle<>> released;
+		job_system *released_system;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			released.swap(waiting);
+			released_system = system;
+		}
+
+		bool on_worker = worker::this_worker() != nullptr;
+		for (std::coroutine_handle<> handle : released)
+		{
+			if (on_worker)
+			{
+				job_system::queue_job([handle]() { handle.resume(); }, priority);
+			}
+			else
+			{
+				released_system->queue_job_external([handle]() { handle.resume(); }, priority);
+			}
+		}
+	}
+
+	std::size_t waiting_count()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return waiting.size();
+	}
+};
+
+//One shot event for I/O style completions. set() can come from any thread, the waiting coroutine is resumed on a worker.
+class completion_event
+{
+	//nullptr while pending, set_marker once set, otherwise the address of the waiting coroutine.
+	std::atomic<void *> state;
+	job_system *system;
+
+	static void *set_marker() { return reinterpret_cast<void *> (std::uintptr_t(1)); }
+public:
+	completion_event()
+		: state(nullptr)
+		, system(nullptr)
+	{}
+
+	completion_event(const completion_event &) = delete;
+	completion_event &operator=(const completion_event &) = delete;
+
+	bool is_set() const { return state.load(std::memory_order_acquire) == set_marker(); }
+
+	void set()
+	{
+		void *previous = state.exchange(set_marker(), std::memory_order_acq_rel);
+		if (previous && previous != set_marker())
+		{
+			std::coroutine_handle<> waiter = std::coroutine_handle<>::from_address(previous);
+			system->queue_job_external([waiter]() { waiter.resume(); });
+		}
+	}
+
+	auto operator co_await() noexcept
+	{
+		class awaiter
+		{
+		public:
+			completion_event *event;
+
+			bool await_ready() const noexcept { return event->is_set(); }
+
+			bool await_suspend(std::coroutine_handle<> awaiting) noexcept
+			{
+				event->system = &worker::this_worker()->get_system();
+				void *expected = nullptr;
+				return event->state.compare_exchange_strong(expected, awaiting.address(), std::memory_order_acq_rel);
+			}
+
+			void await_resume() const noexcept {}
+		};
+
+		return awaiter{ this };
+	}
+};
+
+}
+}
+
+#else
+#define TOCS_HAS_COROUTINES 0
+#endif
@@ -0,0 +1,105 @@
+#include "thread_config.h"
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace tocs {
+namespace threading {
+
+std::vector<int> job_system_config::select_cpus(const cpu_topology &topology) const
+{
+	std::vector<cpu_topology::logical_cpu> usable;
+	std::vector<int> used_cores;
+
+	for (const cpu_topology::logical_cpu &cpu : topology.cpus)
+	{
+		if (!cpus.empty() && std::find(cpus.begin(), cpus.end(), cpu.id) == cpus.end())
+		{
+			continue;
+		}
+
+		if (std::find(reserved_cpus.begin(), reserved_cpus.end(), cpu.id) != reserved_cpus.end())
+		{
+			continue;
+		}
+
+		if (avoid_smt_siblings)
+		{
+			if (std::find(used_cores.begin(), used_cores.end(), cpu.core) != used_cores.end())
+			{
+				continue;
+			}
+			used_cores.push_back(cpu.core);
+		}
+
+		usable.push_back(cpu);
+	}
+
+	std::stable_sort(usable.begin(), usable.end(), [](const cpu_topology::logical_cpu &a, const cpu_topology::logical_cpu &b)
+	{
+		if (a.numa_node != b.numa_node)
+		{
+			return a.numa_node < b.numa_node;
+		}
+		return a.cache_group < b.cache_group;
+	});
+
+	std::vector<int> result;
+	for (const cpu_topology::logical_cpu &cpu : usable)
+	{
+		result.push_back(cpu.id);
+	}
+	return result;
+}
+
+#if defined(_WIN32)
+
+bool pin_current_thread(int cpu)
+{
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = static_cast<WORD> (cpu / 64);
+	affinity.Mask = KAFFINITY(1) << (cpu % 64);
+	return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+}
+
+void set_current_thread_name(const std::string &name)
+{
+	std::wstring wide(name.begin(), name.end());
+	SetThreadDescription(GetCurrentThread(), wide.c_str());
+}
+
+#elif defined(__linux__)
+
+bool pin_current_thread(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+void set_current_thread_name(const std::string &name)
+{
+	pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+}
+
+#else
+
+bool pin_current_thread(int)
+{
+	return false;
+}
+
+void set_current_thread_name(const std::string &)
+{
+}
+
+#endif
+
+}
+}
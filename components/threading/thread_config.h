@@ -0,0 +1,72 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+#include "topology.h"
+
+namespace tocs {
+namespace threading {
+
+//How job_system threads are laid out on the machine.
+//Pinning matters when several simulation processes share a host, unpinned workers migrate and frame times jitter.
+class job_system_config
+{
+public:
+	//0 means one worker per usable cpu.
+	std::size_t worker_count;
+
+	//Cpus workers may run on. Empty means every online cpu.
+	std::vector<int> cpus;
+
+	//Cpus that are never used, e.g. left for the OS, network interrupts or another process.
+	std::vector<int> reserved_cpus;
+
+	//Only use one logical cpu per physical core.
+	bool avoid_smt_siblings;
+
+	//Set thread affinity when worker threads start.
+	bool pin_threads;
+
+	//Worker 0 runs on the thread that builds the job system, only pin it if this is set.
+	bool pin_calling_thread;
+
+	//Threads get named prefix + worker index. Linux truncates names to 15 characters.
+	std::string thread_name_prefix;
+
+	//Capacity of each worker's per priority queue. Jobs queued past it go through the shared external list, which is slower but never full.
+	int queue_size;
+
+	job_system_config()
+		: worker_count(0)
+		, avoid_smt_siblings(false)
+		, pin_threads(false)
+		, pin_calling_thread(false)
+		, thread_name_prefix("tocs_worker")
+		, queue_size(100)
+	{}
+
+	//Fills cpus from a bitmask, bit n allows cpu n.
+	job_system_config &set_cpu_mask(std::uint64_t mask)
+	{
+		cpus.clear();
+		for (int cpu = 0; cpu < 64; ++cpu)
+		{
+			if (mask & (std::uint64_t(1) << cpu))
+			{
+				cpus.push_back(cpu);
+			}
+		}
+		return *this;
+	}
+
+	//The cpus workers get assigned to in order, grouped by numa node and cache so neighbouring workers share an L3.
+	std::vector<int> select_cpus(const cpu_topology &topology) const;
+};
+
+//Pins the calling thread to one logical cpu. Returns false if the OS refused.
+bool pin_current_thread(int cpu);
+
+void set_current_thread_name(const std::string &name);
+
+}
+}
@@ -0,0 +1,212 @@
+#include "topology.h"
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <utility>
+#include <cstdlib>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+namespace tocs {
+namespace threading {
+
+cpu_topology cpu_topology::uniform(int count)
+{
+	cpu_topology result;
+	for (int i = 0; i < count; ++i)
+	{
+		result.cpus.push_back(logical_cpu{ i, i, 0, 0 });
+	}
+	return result;
+}
+
+const cpu_topology::logical_cpu *cpu_topology::find_cpu(int id) const
+{
+	for (const logical_cpu &cpu : cpus)
+	{
+		if (cpu.id == id)
+		{
+			return &cpu;
+		}
+	}
+	return nullptr;
+}
+
+std::vector<int> cpu_topology::parse_cpu_list(const std::string &list)
+{
+	std::vector<int> result;
+	std::stringstream stream(list);
+	std::string range;
+
+	while (std::getline(stream, range, ','))
+	{
+		if (range.empty() || range[0] == '\n')
+		{
+			continue;
+		}
+
+		std::size_t dash = range.find('-');
+		int first = std::atoi(range.c_str());
+		int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+
+		for (int cpu = first; cpu <= last; ++cpu)
+		{
+			result.push_back(cpu);
+		}
+	}
+
+	return result;
+}
+
+#if defined(_WIN32)
+
+cpu_topology cpu_topology::detect()
+{
+	DWORD length = 0;
+	GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+
+	std::vector<unsigned char> buffer(length);
+	auto *info = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *> (buffer.data());
+	if (length == 0 || !GetLogicalProcessorInformationEx(RelationAll, info, &length))
+	{
+		return uniform(static_cast<int> (std::thread::hardware_concurrency()));
+	}
+
+	std::map<int, logical_cpu> found;
+	int core_index = 0;
+	int cache_index = 0;
+
+	auto for_each_cpu = [](const GROUP_AFFINITY &affinity, auto &&func)
+	{
+		for (int bit = 0; bit < static_cast<int> (sizeof(KAFFINITY) * 8); ++bit)
+		{
+			if (affinity.Mask & (KAFFINITY(1) << bit))
+			{
+				func(affinity.Group * 64 + bit);
+			}
+		}
+	};
+
+	for (DWORD offset = 0; offset < length;)
+	{
+		auto *entry = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *> (buffer.data() + offset);
+
+		switch (entry->Relationship)
+		{
+		case RelationProcessorCore:
+			for (WORD g = 0; g < entry->Processor.GroupCount; ++g)
+			{
+				for_each_cpu(entry->Processor.GroupMask[g], [&](int id)
+				{
+					found[id].id = id;
+					found[id].core = core_index;
+				});
+			}
+			++core_index;
+			break;
+		case RelationCache:
+			if (entry->Cache.Level == 3)
+			{
+				for_each_cpu(entry->Cache.GroupMask, [&](int id) { found[id].cache_group = cache_index; });
+				++cache_index;
+			}
+			break;
+		case RelationNumaNode:
+			for_each_cpu(entry->NumaNode.GroupMask, [&](int id) { found[id].numa_node = static_cast<int> (entry->NumaNode.NodeNumber); });
+			break;
+		default:
+			break;
+		}
+
+		offset += entry->Size;
+	}
+
+	cpu_topology result;
+	for (auto &pair : found)
+	{
+		result.cpus.push_back(pair.second);
+	}
+	return result;
+}
+
+#else
+
+static bool read_file(const std::string &path, std::string &contents)
+{
+	std::ifstream file(path);
+	if (!file)
+	{
+		return false;
+	}
+	std::getline(file, contents);
+	return true;
+}
+
+cpu_topology cpu_topology::detect()
+{
+	std::string online;
+	if (!read_file("/sys/devices/system/cpu/online", online))
+	{
+		return uniform(static_cast<int> (std::thread::hardware_concurrency()));
+	}
+
+	cpu_topology result;
+	std::map<std::pair<int, int>, int> core_ids;
+	std::map<int, int> cpu_to_node;
+
+	for (int node = 0;; ++node)
+	{
+		std::string node_cpus;
+		if (!read_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", node_cpus))
+		{
+			break;
+		}
+		for (int cpu : parse_cpu_list(node_cpus))
+		{
+			cpu_to_node[cpu] = node;
+		}
+	}
+
+	for (int id : parse_cpu_list(online))
+	{
+		std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(id);
+		std::string value;
+
+		int package = read_file(base + "/topology/physical_package_id", value) ? std::atoi(value.c_str()) : 0;
+		int core = read_file(base + "/topology/core_id", value) ? std::atoi(value.c_str()) : id;
+
+		//Cache groups are named after the lowest cpu sharing the L3, that's unique without needing cache ids.
+		int cache_group = package;
+		if (read_file(base + "/cache/index3/shared_cpu_list", value))
+		{
+			std::vector<int> sharing = parse_cpu_list(value);
+			if (!sharing.empty())
+			{
+				cache_group = sharing.front();
+			}
+		}
+
+		auto core_key = std::make_pair(package, core);
+		auto existing = core_ids.find(core_key);
+		int core_index = existing == core_ids.end() ? static_cast<int> (core_ids.size()) : existing->second;
+		core_ids.emplace(core_key, core_index);
+
+		auto node = cpu_to_node.find(id);
+		result.cpus.push_back(logical_cpu{ id, core_index, cache_group, node == cpu_to_node.end() ? 0 : node->second });
+	}
+
+	if (result.cpus.empty())
+	{
+		return uniform(static_cast<int> (std::thread::hardware_concurrency()));
+	}
+
+	return result;
+}
+
+#endif
+
+}
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <vector>
+#include <string>
+
+namespace tocs {
+namespace threading {
+
+//Which logical cpus share a core, a last level cache and a numa node.
+//Used to keep work stealing local, on chiplet parts a steal across L3 groups costs several times a local one.
+class cpu_topology
+{
+public:
+	class logical_cpu
+	{
+	public:
+		int id;
+		int core;
+		int cache_group;
+		int numa_node;
+	};
+
+	std::vector<logical_cpu> cpus;
+
+	//Reads the topology from the OS. If that fails every cpu gets its own core and they all share one cache group and node.
+	static cpu_topology detect();
+
+	//Flat topology with count cpus, for tests and platforms we can't query.
+	static cpu_topology uniform(int count);
+
+	const logical_cpu *find_cpu(int id) const;
+
+	//Parses linux cpulist strings like "0-3,8-11".
+	static std::vector<int> parse_cpu_list(const std::string &list);
+};
+
+}
+}
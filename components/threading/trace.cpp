@@ -0,0 +1,205 @@
+#include "trace.h"
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+namespace tocs {
+namespace threading {
+
+namespace {
+
+class trace_registry
+{
+public:
+	std::mutex mutex;
+	std::vector<std::unique_ptr<trace_buffer>> buffers;
+	//Per buffer index of the first event to export, moved forward by tracer::clear.
+	std::vector<std::uint64_t> export_starts;
+	//Never shrinks, set elements keep their address through rehashes.
+	std::unordered_set<std::string> interned_names;
+};
+
+trace_registry &registry()
+{
+	static trace_registry instance;
+	return instance;
+}
+
+void write_escaped(std::FILE *file, const char *text)
+{
+	for (const char *c = text; *c; ++c)
+	{
+		if (*c == '"' || *c == '\\')
+		{
+			std::fputc('\\', file);
+		}
+		if (static_cast<unsigned char> (*c) >= 0x20)
+		{
+			std::fputc(*c, file);
+		}
+	}
+}
+
+}
+
+std::atomic<bool> &tracer::enabled_flag()
+{
+	static std::atomic<bool> enabled(false);
+	return enabled;
+}
+
+void tracer::set_enabled(bool enable)
+{
+	enabled_flag().store(enable, std::memory_order_relaxed);
+}
+
+std::uint64_t tracer::now_ns()
+{
+	return static_cast<std::uint64_t> (std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+const char *tracer::intern(const std::string &name)
+{
+	trace_registry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	return r.interned_names.insert(name).first->c_str();
+}
+
+//Buffers are only made once a thread records something, names given before that wait here.
+static thread_local trace_buffer *thread_buffer = nullptr;
+static thread_local std::string pending_thread_name;
+
+trace_buffer &tracer::this_thread_buffer()
+{
+	if (!thread_buffer)
+	{
+		trace_registry &r = registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+
+		int index = static_cast<int> (r.buffers.size());
+		r.buffers.emplace_back(new trace_buffer(index));
+		r.export_starts.push_back(0);
+		thread_buffer = r.buffers.back().get();
+		thread_buffer->thread_name = pending_thread_name.empty() ? "thread " + std::to_string(index) : pending_thread_name;
+	}
+
+	return *thread_buffer;
+}
+
+void tracer::name_this_thread(const std::string &name)
+{
+	if (!thread_buffer)
+	{
+		pending_thread_name = name;
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(registry().mutex);
+	thread_buffer->thread_name = name;
+}
+
+void tracer::clear()
+{
+	trace_registry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+
+	for (std::size_t i = 0; i < r.buffers.size(); ++i)
+	{
+		r.export_starts[i] = r.buffers[i]->head.load(std::memory_order_acquire);
+	}
+}
+
+bool tracer::write_chrome_trace(const std::string &path)
+{
+	std::FILE *file = std::fopen(path.c_str(), "w");
+	if (!file)
+	{
+		return false;
+	}
+
+	trace_registry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+
+	std::vector<trace_event> events;
+	bool first = true;
+
+	std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", file);
+
+	for (std::size_t b = 0; b < r.buffers.size(); ++b)
+	{
+		trace_buffer &buffer = *r.buffers[b];
+
+		std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"", first ? "" : ",\n", buffer.thread_index);
+		write_escaped(file, buffer.thread_name.c_str());
+		std::fputs("\"}}", file);
+		first = false;
+
+		std::uint64_t head = buffer.head.load(std::memory_order_acquire);
+		std::uint64_t start = head > trace_buffer::capacity ? head - trace_buffer::capacity : 0;
+		if (start < r.export_starts[b])
+		{
+			start = r.export_starts[b];
+		}
+
+		events.clear();
+		for (std::uint64_t i = start; i < head; ++i)
+		{
+			events.push_back(buffer.events[i & (trace_buffer::capacity - 1)]);
+		}
+
+		//Anything the owning thread lapped while we were copying is garbage, including the slot it may be writing right now.
+		std::uint64_t head_after = buffer.head.load(std::memory_order_acquire);
+		std::uint64_t first_valid = head_after >= trace_buffer::capacity ? head_after - trace_buffer::capacity + 1 : 0;
+
+		for (std::uint64_t i = start; i < head; ++i)
+		{
+			if (i < first_valid)
+			{
+				continue;
+			}
+
+			const trace_event &e = events[i - start];
+			const char *phase = "i";
+			const char *name = e.name ? e.name : "";
+
+			switch (e.type)
+			{
+			case trace_event_type::job_begin: phase = "B"; break;
+			case trace_event_type::job_end: phase = "E"; break;
+			case trace_event_type::idle_begin: phase = "B"; name = "idle"; break;
+			case trace_event_type::idle_end: phase = "E"; name = "idle"; break;
+			case trace_event_type::phase_begin: phase = "B"; break;
+			case trace_event_type::phase_end: phase = "E"; break;
+			case trace_event_type::steal: phase = "i"; name = "steal"; break;
+			case trace_event_type::frame: phase = "i"; name = "frame"; break;
+			}
+
+			std::fprintf(file, ",\n{\"name\":\"");
+			write_escaped(file, name);
+			std::fprintf(file, "\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":0,\"tid\":%d", phase, e.timestamp_ns / 1000.0, buffer.thread_index);
+
+			if (e.type == trace_event_type::frame)
+			{
+				std::fprintf(file, ",\"s\":\"g\",\"args\":{\"frame\":%u}", e.arg);
+			}
+			else if (e.type == trace_event_type::steal)
+			{
+				std::fprintf(file, ",\"s\":\"t\",\"args\":{\"victim\":%u}", e.arg);
+			}
+			else if (e.type == trace_event_type::job_begin)
+			{
+				std::fprintf(file, ",\"args\":{\"priority\":%u}", e.arg);
+			}
+
+			std::fputs("}", file);
+		}
+	}
+
+	std::fputs("\n]}\n", file);
+	return std::fclose(file) == 0;
+}
+
+}
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+//Compile tracing out entirely with TOCS_TRACING=0. When compiled in, every trace point costs one relaxed load and a branch while disabled.
+#ifndef TOCS_TRACING
+#define TOCS_TRACING 1
+#endif
+
+namespace tocs {
+namespace threading {
+
+enum class trace_event_type : std::uint8_t
+{
+	job_begin,
+	job_end,
+	steal,		//arg is the victim worker index.
+	idle_begin,
+	idle_end,
+	phase_begin,	//Named span on a thread, e.g. parts of world::advance_frame.
+	phase_end,
+	frame,		//Instant marker, arg is the frame number.
+};
+
+class trace_event
+{
+public:
+	std::uint64_t timestamp_ns;
+	const char *name;
+	std::uint32_t arg;
+	trace_event_type type;
+};
+
+//Single producer ring of events owned by one thread. When it fills up the oldest events get overwritten.
+class trace_buffer
+{
+public:
+	static constexpr std::uint32_t capacity = 1 << 16;
+
+	std::unique_ptr<trace_event[]> events;
+	std::atomic<std::uint64_t> head;
+	std::string thread_name;
+	int thread_index;
+
+	trace_buffer(int thread_index)
+		: events(new trace_event[capacity])
+		, head(0)
+		, thread_index(thread_index)
+	{}
+
+	void push(const trace_event &e)
+	{
+		std::uint64_t h = head.load(std::memory_order_relaxed);
+		events[h & (capacity - 1)] = e;
+		head.store(h + 1, std::memory_order_release);
+	}
+};
+
+//Per thread event recording for the job system and the frame loop, exported as chrome trace json which chrome://tracing and ui.perfetto.dev both load.
+//Names are stored as pointers, they need to outlive the export, string literals are the usual choice.
+class tracer
+{
+	static std::atomic<bool> &enabled_flag();
+	static trace_buffer &this_thread_buffer();
+public:
+	static bool enabled()
+	{
+		return enabled_flag().load(std::memory_order_relaxed);
+	}
+
+	static void set_enabled(bool enable);
+
+	static std::uint64_t now_ns();
+
+	static void record(trace_event_type type, const char *name, std::uint32_t arg = 0)
+	{
+		this_thread_buffer().push(trace_event{ now_ns(), name, arg, type });
+	}
+
+	static void name_this_thread(const std::string &name);
+
+	//Copy of name that lives as long as the process, for names built at runtime. The same name always returns the same pointer.
+	static const char *intern(const std::string &name);
+
+	//Drops everything recorded so far.
+	static void clear();
+
+	//Writes whatever is still in the rings. Safe to call while threads are recording, events overwritten mid copy are dropped.
+	static bool write_chrome_trace(const std::string &path);
+};
+
+//Records a phase_begin/phase_end pair around a scope.
+class trace_scope
+{
+	const char *name;
+	bool active;
+public:
+	explicit trace_scope(const char *name)
+		: name(name)
+		, active(TOCS_TRACING && tracer::enabled())
+	{
+		if (active)
+		{
+			tracer::record(trace_event_type::phase_begin, name);
+		}
+	}
+
+	~trace_scope()
+	{
+		if (active)
+		{
+			tracer::record(trace_event_type::phase_end, name);
+		}
+	}
+
+	trace_scope(const trace_scope &) = delete;
+	trace_scope &operator=(const trace_scope &) = delete;
+};
+
+}
+}
+
+#if TOCS_TRACING
+#define TOCS_TRACE_CONCAT_INNER(a, b) a##b
+#define TOCS_TRACE_CONCAT(a, b) TOCS_TRACE_CONCAT_INNER(a, b)
+#define TOCS_TRACE_EVENT(type, name, arg) do { if (::tocs::threading::tracer::enabled()) ::tocs::threading::tracer::record(type, name, arg); } while (0)
+#define TOCS_TRACE_SCOPE(name) ::tocs::threading::trace_scope TOCS_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#else
+#define TOCS_TRACE_EVENT(type, name, arg) ((void)0)
+#define TOCS_TRACE_SCOPE(name) ((void)0)
+#endif
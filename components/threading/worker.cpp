@@ -1,72 +1,320 @@
 #include "worker.h"
 #include <thread>
+#include <algorithm>
+#include <string>
 
 namespace tocs {
 namespace threading {
 
-worker::~worker()
+void worker::return_queued_jobs()
 {
 	job *junk_job = nullptr;
-	while (job_queue.pop(junk_job))
-	{ }
+	for (auto &job_queue : job_queues)
+	{
+		while (job_queue.pop(junk_job))
+		{
+			system->job_pool.return_item(junk_job->pool_handle);
+		}
+	}
+}
+
+//How many victims to probe in each tier before moving further out. Remote probes are expensive even when they fail.
+static constexpr std::size_t max_steal_attempts[worker::steal_tier_count] = { 64, 4, 2 };
+
+//Cap on how many extra jobs get pulled over in one steal.
+static constexpr int max_steal_batch = 8;
+
+bool worker::steal_from(detail::work_queue<job*> &victim_queue, int lane, job *&result)
+{
+	if (!victim_queue.steal(result))
+	{
+		return false;
+	}
+
+	//Take up to half of what's left so we don't have to come straight back, stealing one at a time keeps each take safe against the owner.
+	auto &own_queue = job_queues[lane];
+	int space = static_cast<int> (own_queue.get_max_work()) - own_queue.size_estimate() - 1;
+	int extra = std::min(std::min(victim_queue.size_estimate() / 2, max_steal_batch), space);
+
+	for (int i = 0; i < extra; ++i)
+	{
+		job *batch_job = nullptr;
+		if (!victim_queue.steal(batch_job))
+		{
+			break;
+		}
+		if (!own_queue.push(batch_job))
+		{
+			system->push_external(batch_job);
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool worker::try_steal(int lane, job *&result)
+{
+	for (int tier = 0; tier < steal_tier_count; ++tier)
+	{
+		const std::vector<int> &tier_victims = victims[tier];
+		if (tier_victims.empty())
+		{
+			continue;
+		}
+
+		std::uint32_t size = static_cast<std::uint32_t> (tier_victims.size());
+		std::uint32_t start = worker_chooser.next_below(size);
+		std::size_t attempts = std::min<std::size_t>(size, max_steal_attempts[tier]);
+
+		for (std::size_t attempt = 0; attempt < attempts; ++attempt)
+		{
+			worker &victim = system->workers[tier_victims[(start + attempt) % size]];
+			if (steal_from(victim.job_queues[lane], lane, result))
+			{
+				TOCS_TRACE_EVENT(trace_event_type::steal, "steal", static_cast<std::uint32_t> (tier_victims[(start + attempt) % size]));
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+//Counts a background job as running before one leaves its lane, so once pause_background() returns and background_jobs_running() reads 0
+//no background job can start. Fails when paused, pull_job skips the background lane then.
+bool worker::begin_background_pull()
+{
+	++system->background_running;
+	if (system->background_paused.load())
+	{
+		--system->background_running;
+		return false;
+	}
+	return true;
 }
 
 job *worker::pull_job()
 {
 	job *job_to_run = nullptr;
-	if (!job_queue.pop(job_to_run))
+	const int background_lane = static_cast<int> (job_priority::background);
+
+	//Local work first, priorities in order. Only once there's none is it worth paying for steals, which fail on every victim when the
+	//system is mostly idle.
+	for (int lane = 0; lane < job_priority_count; ++lane)
+	{
+		if (lane == background_lane && !begin_background_pull())
+		{
+			break;
+		}
+
+		if (job_queues[lane].pop(job_to_run))
+		{
+			TOCS_COUNT(work_queue_pops, 1);
+			return job_to_run;
+		}
+
+		if (system->external_counts[lane].load(std::memory_order_relaxed) > 0)
+		{
+			job_to_run = system->take_external_job(lane);
+			if (job_to_run)
+			{
+				return job_to_run;
+			}
+		}
+
+		if (lane == background_lane)
+		{
+			--system->background_running;
+		}
+	}
+
+	for (int lane = 0; lane < job_priority_count; ++lane)
 	{
-		int worker = system->worker_choosing_range(worker_chooser);
-		auto &steal_queue = system->workers[worker].job_queue;
-		if (&steal_queue == &job_queue)
+		if (lane == background_lane && !begin_background_pull())
+		{
+			break;
+		}
+
+		if (try_steal(lane, job_to_run))
 		{
-			std::this_thread::yield();
-			return nullptr;
+			TOCS_COUNT(steals, 1);
+			return job_to_run;
 		}
 
-		//Attempt a steal.
-		if (!steal_queue.steal(job_to_run))
+		TOCS_COUNT(failed_steals, 1);
+		if (lane == background_lane)
 		{
-			std::this_thread::yield();
-			return nullptr;
+			--system->background_running;
 		}
 	}
 
-	return job_to_run;
+	std::this_thread::yield();
+	return nullptr;
 }
 
 static thread_local worker *thread_worker = nullptr;
 worker* worker::this_worker() { return thread_worker; }
 
-void worker::run()
+void worker::bind_to_this_thread()
 {
 	thread_worker = this;
-	while (running)
+}
+
+void worker::execute(job *j)
+{
+	//pull_job already counted background jobs as running.
+	bool background = j->get_priority() == job_priority::background;
+
+	TOCS_TRACE_EVENT(trace_event_type::job_begin, "job", static_cast<std::uint32_t> (j->get_priority()));
+	j->run();
+	TOCS_TRACE_EVENT(trace_event_type::job_end, "job", 0);
+	system->job_pool.return_item(j->pool_handle);
+
+	if (background)
 	{
-		job *j = pull_job();
-		if (j)
-		{
-			j->run();
-		}
+		--system->background_running;
 	}
 }
 
+void worker::run()
+{
+	thread_worker = this;
+	run_until([this]()
+	{
+		return !running;
+	});
+}
+
+
+static job_system_config config_with_count(std::size_t worker_count)
+{
+	job_system_config config;
+	config.worker_count = worker_count;
+	return config;
+}
 
 job_system::job_system(std::size_t worker_count /* = std::thread::hardware_concurrency() */)
-	: worker_choosing_range(0, worker_count)
+	: job_system(config_with_count(worker_count))
+{
+}
+
+job_system::job_system(const job_system_config &config)
+	: topology(cpu_topology::detect())
+	, background_paused(false)
+	, background_running(0)
 {
+	for (auto &count : external_counts)
+	{
+		count.store(0, std::memory_order_relaxed);
+	}
+
+	std::vector<int> usable_cpus = config.select_cpus(topology);
+	if (usable_cpus.empty())
+	{
+		//Config filtered out everything, run unpinned on whatever the OS gives us.
+		for (const cpu_topology::logical_cpu &cpu : topology.cpus)
+		{
+			usable_cpus.push_back(cpu.id);
+		}
+	}
+
+	std::size_t worker_count = config.worker_count ? config.worker_count : usable_cpus.size();
+	if (worker_count == 0)
+	{
+		worker_count = 1;
+	}
+
 	workers.reserve(worker_count);
 	threads.reserve(worker_count - 1);
 
+	//All the workers have to exist before any thread starts, otherwise a thread could try to steal from a half built worker.
 	for (unsigned int i = 0; i < worker_count; ++i)
 	{
-		workers.emplace_back(*this, 100);
-		if (i != 0)
+		workers.emplace_back(*this, config.queue_size, (i + 1) * 0x9E3779B9u);
+		worker_cpus.push_back(usable_cpus[i % usable_cpus.size()]);
+	}
+
+	build_steal_tiers();
+
+	bool pin_threads = config.pin_threads;
+	for (unsigned int i = 1; i < worker_count; ++i)
+	{
+		threads.emplace_back([w = &workers[i], cpu = worker_cpus[i], pin_threads, name = config.thread_name_prefix + std::to_string(i)]()
+		{
+			if (pin_threads)
+			{
+				pin_current_thread(cpu);
+			}
+			set_current_thread_name(name);
+			tracer::name_this_thread(name);
+			w->run();
+		});
+	}
+
+	//Worker 0 is the thread that made the job system, it runs jobs when it waits.
+	if (config.pin_threads && config.pin_calling_thread)
+	{
+		pin_current_thread(worker_cpus[0]);
+	}
+	workers[0].bind_to_this_thread();
+	tracer::name_this_thread(config.thread_name_prefix + "0");
+}
+
+job *job_system::take_external_job(int lane)
+{
+	std::lock_guard<std::mutex> lock(external_mutex);
+	if (external_jobs[lane].empty())
+	{
+		return nullptr;
+	}
+
+	job *result = external_jobs[lane].front();
+	external_jobs[lane].pop_front();
+	--external_counts[lane];
+	return result;
+}
+
+void job_system::push_external(job *j)
+{
+	int lane = static_cast<int> (j->get_priority());
+
+	std::lock_guard<std::mutex> lock(external_mutex);
+	external_jobs[lane].push_back(j);
+	++external_counts[lane];
+}
+
+void job_system::build_steal_tiers()
+{
+	for (std::size_t i = 0; i < workers.size(); ++i)
+	{
+		const cpu_topology::logical_cpu *self = topology.find_cpu(worker_cpus[i]);
+
+		for (auto &tier : workers[i].victims)
 		{
-			threads.emplace_back([w = &workers[i]]()
+			tier.clear();
+		}
+
+		for (std::size_t j = 0; j < workers.size(); ++j)
+		{
+			if (i == j)
+			{
+				continue;
+			}
+
+			const cpu_topology::logical_cpu *other = topology.find_cpu(worker_cpus[j]);
+
+			int tier = 2;
+			if (self && other && self->cache_group == other->cache_group && self->numa_node == other->numa_node)
 			{
-				w->run();
-			});
+				tier = 0;
+			}
+			else if (self && other && self->numa_node == other->numa_node)
+			{
+				tier = 1;
+			}
+
+			workers[i].victims[tier].push_back(static_cast<int> (j));
 		}
 	}
 }
@@ -83,6 +331,20 @@ job_system::~job_system()
 	{
 		thread.join();
 	}
+
+	//Jobs that never ran go back to the pool like finished ones.
+	for (worker &w : workers)
+	{
+		w.return_queued_jobs();
+	}
+	for (auto &lane : external_jobs)
+	{
+		for (job *j : lane)
+		{
+			job_pool.return_item(j->pool_handle);
+		}
+		lane.clear();
+	}
 }
 
 }
@@ -2,8 +2,15 @@
 #include "workqueue.h"
 #include "jobs.h"
 #include "pool.h"
-#include <random>
+#include "topology.h"
+#include "thread_config.h"
+#include "trace.h"
+#include "core/xorshift.h"
+#include <array>
+#include <deque>
+#include <mutex>
 #include <type_traits>
+#include <vector>
 
 namespace tocs {
 namespace threading {
@@ -12,36 +19,73 @@ class job_system;
 
 class worker
 {
-	detail::work_queue<job*> job_queue;
+public:
+	//Other workers are grouped by how far away they are: same L3, same numa node, then everything else.
+	static constexpr int steal_tier_count = 3;
+private:
+	std::array<detail::work_queue<job*>, job_priority_count> job_queues;
 	job_system *system;
-	std::mt19937 worker_chooser;
-	bool running;
+	std::array<std::vector<int>, steal_tier_count> victims;
+	core::xorshift_random worker_chooser;
+	std::atomic<bool> running;
 	cache_line_padding padding;
 
 	job *pull_job();
+	bool try_steal(int lane, job *&result);
+	bool steal_from(detail::work_queue<job*> &victim_queue, int lane, job *&result);
+	bool begin_background_pull();
+	void execute(job *j);
 public:
-	worker(job_system &system, int maxwork)
-		: system(&system)
-		, job_queue(maxwork)
+	friend class job_system;
+
+	worker(job_system &system, int maxwork, std::uint32_t seed)
+		: job_queues{ { detail::work_queue<job*>(maxwork), detail::work_queue<job*>(maxwork), detail::work_queue<job*>(maxwork) } }
+		, system(&system)
+		, worker_chooser(seed)
 		, running(true)
 	{
 	}
 
-	~worker();
+	//Queued jobs are returned by job_system's destructor, the job pool is gone by the time workers are destroyed.
+	void return_queued_jobs();
 
 	worker(const worker &copyme) = delete;
 	worker &operator=(const worker &copyme) = delete;
 	
-	worker(worker &&moveme) = default;
-	worker &operator=(worker &&moveme) = default;
+	worker(worker &&moveme) noexcept
+		: job_queues(std::move(moveme.job_queues))
+		, system(moveme.system)
+		, victims(std::move(moveme.victims))
+		, worker_chooser(moveme.worker_chooser)
+		, running(moveme.running.load())
+	{}
+
+	worker &operator=(worker &&moveme) noexcept
+	{
+		job_queues = std::move(moveme.job_queues);
+		system = moveme.system;
+		victims = std::move(moveme.victims);
+		worker_chooser = moveme.worker_chooser;
+		running = moveme.running.load();
+		return *this;
+	}
 
 	void run();
 	void stop_work() { running = false; }
 
+	//Runs jobs on this worker until done returns true. Lets a thread waiting on work help out instead of blocking.
+	template <class Pred>
+	void run_until(Pred &&done);
+
+	//Makes this the worker for the calling thread. Used for worker 0 which runs on the thread that owns the job_system.
+	void bind_to_this_thread();
+
 	static worker* this_worker();
 
+	job_system &get_system() const { return *system; }
+
 	template <class Func>
-	threading::concurrent_pool_handle<job> queue_job(Func &&func);
+	threading::concurrent_pool_handle<job> queue_job(Func &&func, job_priority priority = job_priority::normal);
 };
 
 static_assert(std::is_move_constructible<worker>::value, "Workers have to be move constructable");
@@ -51,35 +95,179 @@ static_assert(std::is_move_assignable<worker>::value, "Workers have to be move a
 class job_system
 {
 	std::vector<worker> workers;
-	std::uniform_int_distribution<int> worker_choosing_range;
+	std::vector<int> worker_cpus;
+	cpu_topology topology;
 	std::vector<std::thread> threads;
 	concurrent_pool<job> job_pool;
+
+	std::atomic<bool> background_paused;
+	std::atomic<int> background_running;
+
+	//Jobs queued from threads that aren't workers, e.g. I/O completion callbacks, and jobs that didn't fit a worker's queue. One first in
+	//first out list per priority, workers take them in the same lane order as their own queues.
+	std::mutex external_mutex;
+	std::array<std::deque<job*>, job_priority_count> external_jobs;
+	std::array<std::atomic<int>, job_priority_count> external_counts;
+
+	void build_steal_tiers();
+	job *take_external_job(int lane);
+	void push_external(job *j);
 public:
 	friend class worker;
 
 	job_system(std::size_t worker_count = std::thread::hardware_concurrency());
+	explicit job_system(const job_system_config &config);
 	~job_system();
 
-	job_system(const job_system &) = default;
-	job_system &operator=(const job_system &) = default;
+	//Workers hold a pointer back to the system so it can't be copied or moved.
+	job_system(const job_system &) = delete;
+	job_system &operator=(const job_system &) = delete;
+
+	job_system(job_system &&) = delete;
+	job_system &operator=(job_system &&) = delete;
 
-	job_system(job_system &&) = default;
-	job_system &operator=(job_system &&) = default;
+	std::size_t worker_count() const { return workers.size(); }
 
+	//The logical cpu each worker is assigned to, whether or not it's pinned.
+	int worker_cpu(std::size_t index) const { return worker_cpus[index]; }
+
+	//The returned handle is only valid until the job finishes, after that it goes back to the pool.
+	template <class Func>
+	static threading::concurrent_pool_handle<job> queue_job(Func &&func, job_priority priority = job_priority::normal)
+	{
+		return worker::this_worker()->queue_job(std::forward<Func>(func), priority);
+	}
+
+	//Safe from any thread, workers pick these up after their own queue of the same priority. Slower than queue_job so keep it for threads
+	//outside the system.
 	template <class Func>
-	static threading::concurrent_pool_handle<job> queue_job(Func &&func)
+	void queue_job_external(Func &&func, job_priority priority = job_priority::normal)
 	{
-		return worker::this_worker()->queue_job(std::forward<Func>(func));
+		auto new_job = job_pool.get_item(std::forward<Func>(func), priority);
+		new_job->pool_handle = new_job;
+		push_external(&*new_job);
+	}
+
+	//Stops workers from starting new background jobs, e.g. across a frame barrier. Background jobs already running carry on,
+	//long running ones should check is_background_paused() and split their work up.
+	void pause_background() { background_paused = true; }
+	void resume_background() { background_paused = false; }
+	bool is_background_paused() const { return background_paused; }
+
+	//Background jobs counted from before a worker takes one off its lane, so after pause_background() a 0 here stays 0 until resume.
+	int background_jobs_running() const { return background_running; }
+
+	template <class Pred>
+	static void wait_until(Pred &&done)
+	{
+		worker::this_worker()->run_until(std::forward<Pred>(done));
+	}
+
+	//Splits [0, count) into ranges of at most grain and runs func(begin, end) for each, returns once all are done. One job per worker claims ranges
+	//until none are left, so any number of ranges fits in the fixed size queues. Has to be called from a worker, which runs jobs while it waits.
+	template <class Func>
+	static void parallel_for(std::size_t count, std::size_t grain, Func &&func, job_priority priority = job_priority::critical)
+	{
+		std::size_t chunk_count = (count + grain - 1) / grain;
+		if (chunk_count <= 1)
+		{
+			if (count > 0)
+			{
+				func(std::size_t(0), count);
+			}
+			return;
+		}
+
+		std::size_t job_count = worker::this_worker()->get_system().worker_count();
+		job_count = job_count < chunk_count ? job_count : chunk_count;
+
+		std::atomic<std::size_t> next_chunk(0);
+		std::atomic<std::size_t> remaining(job_count);
+
+		for (std::size_t j = 0; j < job_count; ++j)
+		{
+			queue_job([&func, &next_chunk, &remaining, count, grain, chunk_count]()
+			{
+				for (std::size_t chunk = next_chunk.fetch_add(1, std::memory_order_relaxed); chunk < chunk_count; chunk = next_chunk.fetch_add(1, std::memory_order_relaxed))
+				{
+					std::size_t begin = chunk * grain;
+					std::size_t end = begin + grain < count ? begin + grain : count;
+					func(begin, end);
+				}
+				remaining.fetch_sub(1, std::memory_order_release);
+			}, priority);
+		}
+
+		wait_until([&remaining]()
+		{
+			return remaining.load(std::memory_order_acquire) == 0;
+		});
+	}
+
+	//Folds map(begin, end) over the same ranges parallel_for uses, then combines the results in range order starting from identity. The ranges
+	//depend only on count and grain and the combine order never depends on which worker finished first, so floating point sums come out
+	//bit identical run to run and on any number of workers.
+	template <class T, class MapFunc, class CombineFunc>
+	static T parallel_reduce(std::size_t count, std::size_t grain, T identity, MapFunc &&map, CombineFunc &&combine, job_priority priority = job_priority::critical)
+	{
+		std::size_t chunk_count = (count + grain - 1) / grain;
+		std::vector<T> partials(chunk_count, identity);
+
+		parallel_for(count, grain, [&partials, &map, grain](std::size_t begin, std::size_t end)
+		{
+			partials[begin / grain] = map(begin, end);
+		}, priority);
+
+		T result = identity;
+		for (const T &partial : partials)
+		{
+			result = combine(result, partial);
+		}
+		return result;
 	}
 };
 
 template <class Func>
-threading::concurrent_pool_handle<job> worker::queue_job(Func &&func)
+threading::concurrent_pool_handle<job> worker::queue_job(Func &&func, job_priority priority)
 {
-	auto new_job = system->job_pool.get_item(std::forward<Func>(func));
-	job_queue.push(new_job);
+	auto new_job = system->job_pool.get_item(std::forward<Func>(func), priority);
+	new_job->pool_handle = new_job;
+	if (!job_queues[static_cast<int> (priority)].push(&*new_job))
+	{
+		//Full, e.g. a frame with more ready systems than queue_size. Other workers pick it up from the external list instead.
+		system->push_external(&*new_job);
+	}
 	return new_job;
 }
 
+template <class Pred>
+void worker::run_until(Pred &&done)
+{
+	bool idle = false;
+	while (!done())
+	{
+		job *j = pull_job();
+		if (j)
+		{
+			if (idle)
+			{
+				TOCS_TRACE_EVENT(trace_event_type::idle_end, "idle", 0);
+				idle = false;
+			}
+			execute(j);
+		}
+		else if (!idle)
+		{
+			TOCS_TRACE_EVENT(trace_event_type::idle_begin, "idle", 0);
+			idle = true;
+		}
+	}
+
+	if (idle)
+	{
+		TOCS_TRACE_EVENT(trace_event_type::idle_end, "idle", 0);
+	}
+}
+
 }
 }
\ No newline at end of file
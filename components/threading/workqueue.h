@@ -2,6 +2,8 @@
 #include <atomic>
 #include <vector>
 #include <memory>
+#include <cstdint>
+#include "core/asserts.h"
 
 namespace tocs {
 namespace threading {
@@ -14,8 +16,10 @@ class work_queue
 {
 	std::size_t max_work;
 	std::unique_ptr<std::atomic<T>[]> work_array;
-	std::atomic<int> top;
-	std::atomic<int> bottom;
+	//Only ever grow, a slot is index % max_work. 64 bit so they can't wrap in a process's lifetime, signed since pop briefly moves bottom
+	//below top on an empty queue.
+	std::atomic<std::int64_t> top;
+	std::atomic<std::int64_t> bottom;
 public:
 
 	//static_assert(std::atomic<T>::is_always_lock_free, "work queues only work on lock free types");
@@ -23,6 +27,8 @@ public:
 	work_queue(std::size_t max_work)
 		: max_work(max_work)
 		, work_array(new std::atomic<T> [max_work])
+		, top(0)
+		, bottom(0)
 	{
 	}
 
@@ -48,33 +54,44 @@ public:
 
 	std::size_t get_max_work() const { return max_work; }
 
-	void push(const T &item)
+	//Racy snapshot of how many items are queued, good enough to decide how much to steal.
+	int size_estimate() const
 	{
-		int b = bottom;
-		work_array[b] = item;
+		std::int64_t b = bottom.load(std::memory_order_relaxed);
+		std::int64_t t = top.load(std::memory_order_relaxed);
+		return b > t ? static_cast<int> (b - t) : 0;
+	}
+
+	//Only the owner pushes. Returns false without queueing anything if the queue is full.
+	bool push(const T &item)
+	{
+		std::int64_t b = bottom;
+		if (b - top >= static_cast<std::int64_t> (max_work))
+		{
+			return false;
+		}
+		work_array[b % max_work] = item;
 		bottom = b + 1;
+		return true;
 	}
 
 	bool pop(T &result)
 	{
-		int b = bottom - 1;
+		std::int64_t b = bottom - 1;
 		bottom = b;
 		
-		int t = top;
+		std::int64_t t = top;
 		if (t <= b)
 		{
 		
-			result = work_array[b];
+			result = work_array[b % max_work];
 			if (t != b)
 			{
 				return true;
 			}
 		
-			bool success = true;
-			if (top.compare_exchange_strong(t, t + 1))
-			{
-				success = false;
-			}
+			//Last item in the queue, race the thieves for it.
+			bool success = top.compare_exchange_strong(t, t + 1);
 		
 			bottom = t + 1;
 			return success;
@@ -88,16 +105,12 @@ public:
 
 	bool steal(T &result)
 	{
-		int t = top;
-		int b = bottom;
+		std::int64_t t = top;
+		std::int64_t b = bottom;
 		if (t < b)
 		{
-			result = work_array[t];
-			if (top.compare_exchange_strong(t, t+1))
-			{
-				return false;
-			}
-			return true;
+			result = work_array[t % max_work];
+			return top.compare_exchange_strong(t, t + 1);
 		}
 		return false;
 	}